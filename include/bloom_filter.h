@@ -0,0 +1,20 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Bloom filter over keys, about 1% false positives at 10 bits per key.
+
+typedef struct {
+  uint8_t *bits;
+  uint64_t no_bits;
+} BloomFilter;
+
+BloomFilter create_bloom_filter(uint64_t no_keys);
+BloomFilter bloom_filter_from_data(uint8_t *bits, uint64_t no_bits);
+uint64_t bloom_filter_size(const BloomFilter *bloom_filter);
+void bloom_filter_add(BloomFilter *bloom_filter, const char *key,
+                      uint32_t key_length);
+bool bloom_filter_may_contain(const BloomFilter *bloom_filter,
+                              const char *key, uint32_t key_length);
+void destroy_bloom_filter(BloomFilter *bloom_filter);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "engine.h"
+#include "snapshot.h"
+
+// B+tree keeping records sorted by key in leaf pages linked to their right
+// sibling, so ranges are answered with a descent and a walk along the leaves.
+// Nodes are not locked individually, the header page lock already makes a
+// writer exclusive for the whole time the database is open.
+extern const EngineOperations btree_engine;
+
+// Walks the leaves in key order from the first key not smaller than from, or
+// from the smallest key when from is NULL. The record returned by next points
+// into the cursor and is only valid until the following call. A cursor opened
+// on a snapshot reads the nodes as the snapshot sees them.
+typedef struct {
+  Database *database;
+  Snapshot *snapshot;
+  uint8_t *node;
+  uint64_t page_id;
+  uint32_t offset;
+  SafeBuffer record_buffer;
+} BTreeCursor;
+
+void btree_cursor_open(Database *database, BTreeCursor *cursor,
+                       const char *from, uint32_t from_length,
+                       enum FileErrorStatus *error);
+// From the smallest key of the tree rooted at root_page when the snapshot was
+// opened.
+void btree_snapshot_cursor_open(Database *database, Snapshot *snapshot,
+                                uint64_t root_page, BTreeCursor *cursor,
+                                enum FileErrorStatus *error);
+bool btree_cursor_next(BTreeCursor *cursor, Record *record,
+                       enum FileErrorStatus *error);
+void btree_cursor_close(BTreeCursor *cursor);
@@ -6,3 +6,8 @@ uint64_t read_data_from_buffer(const uint8_t *buffer, uint32_t offset,
                                 uint32_t size);
 void write_data_to_buffer(uint8_t *buffer, uint32_t offset, uint32_t size,
                           uint64_t data);
+// LEB128 varints, seven bits per byte, the high bit set on all but the last.
+uint64_t read_varint_from_buffer(const uint8_t *buffer, uint32_t *offset);
+uint32_t write_varint_to_buffer(uint8_t *buffer, uint32_t offset,
+                                uint64_t data);
+uint32_t varint_size(uint64_t data);
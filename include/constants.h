@@ -1,11 +1,22 @@
 #pragma once
 
-#define PAGE_NO_BITS (12)
-#define PAGE_SIZE (4096)
-#define DATA_PAGE_SIZE (4096)
-#define HEADER_PAGE_SIZE (4096)
-#define DATABASE_VERSION (3834052067ULL)
+// A database chooses its page size when it is created, a power of two from 4
+// to 64 KiB, and records it in its header page. The header fields fit in the
+// smallest page.
+#define MIN_PAGE_SIZE (4096)
+#define MAX_PAGE_SIZE (65536)
+#define HEADER_PAGE_SIZE (MIN_PAGE_SIZE)
+// Files created before the page size field was added have 4 KiB pages.
+#define DEFAULT_PAGE_SIZE (4096)
+// Files created before XXH3 bucket hashing keep XXH64 with modulo reduction.
+#define DATABASE_VERSION_XXH64 (3834052067ULL)
+#define DATABASE_VERSION_XXH3 (3834052068ULL)
+// Files created before compact records keep writing fixed records.
+#define DATABASE_VERSION_COMPACT_RECORDS (3834052069ULL)
+#define DATABASE_VERSION (DATABASE_VERSION_COMPACT_RECORDS)
 #define MAX_STRING_LENGTH (100)
+// Values longer than a record holds are kept in overflow pages.
+#define MAX_VALUE_LENGTH ((uint64_t)1 << 24)
 #define RECORD_SIZE_ESTIMATE (MAX_STRING_LENGTH + MAX_STRING_LENGTH + 38)
 #define MAX_NO_ELEMENTS ((uint64_t)1 << 55)
 #define BYTE_SIZE (8)
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "engine.h"
+
+// Bucketized cuckoo layout: every key lives in one of two candidate data
+// pages, so a lookup never reads more than two pages.
+extern const EngineOperations cuckoo_engine;
@@ -2,24 +2,78 @@
 
 #include "buffer_manager.h"
 #include "constants.h"
+#include "error.h"
+#include "page_codec.h"
 #include "record.h"
 #include <stdbool.h>
 
+// A compressed data page holds this many times the bytes of its slot.
+#define COMPRESSED_PAGE_RATIO (4)
+
 typedef struct {
   SafeBuffer *safe_buffer;
 } DataPage;
 
+// Where the data pages of a file are kept, page page_id in the slot of the
+// same id, slot_size bytes at page_id * slot_size. Without a codec a page is
+// its slot. With one, a page of COMPRESSED_PAGE_RATIO slots is kept
+// compressed in its slot, so that a read of a slot brings more records as
+// long as they compress.
+typedef struct {
+  int fd;
+  uint64_t slot_size;
+  uint64_t page_size;
+  PageCodec codec;
+} DataPageFile;
+
+// Called for every record of a page with the record's offset inside the page.
+// The record is only valid for the duration of the call.
+typedef void (*DataPageEntryCallback)(const Record *record, uint32_t offset,
+                                      void *arguments);
+
 DataPage create_data_page(SafeBuffer *safe_buffer);
 size_t data_page_free_space(const DataPage *data_page);
 size_t data_page_no_entries(const DataPage *data_page);
 bool data_page_is_free_page(const DataPage *data_page);
+size_t data_page_used_space(const DataPage *data_page);
+// Keys sharing a prefix with the first key put into a page are stored without
+// it, so a record may take less room than its length.
+size_t data_page_entry_size(const DataPage *data_page, const Record *record);
+size_t data_page_stored_entry_size(const DataPage *data_page,
+                                   uint32_t offset);
 bool data_page_find_entry(const DataPage *data_page, const char *key,
-                          Record *record);
+                          uint32_t key_length, Record *record);
+bool data_page_entry_at(const DataPage *data_page, uint32_t offset,
+                        const char *key, uint32_t key_length, Record *record);
+bool data_page_next_entry(const DataPage *data_page, uint32_t *offset,
+                          SafeBuffer *view, Record *record);
+void data_page_for_each_entry(const DataPage *data_page,
+                              DataPageEntryCallback callback, void *arguments);
 bool data_page_delete_entry(DataPage *data_page, const char *key,
-                            Record *record);
+                            uint32_t key_length, Record *record);
 bool data_page_insert_entry(DataPage *data_page, const Record *record,
                             uint64_t hash);
 uint64_t data_page_hash(const DataPage *data_page);
 DataPage data_page_from_data(SafeBuffer *safe_buffer, uint64_t page_id);
 const uint8_t *data_page_buffer(DataPage *data_page);
 void destroy_data_page(DataPage *data_page);
+
+DataPageFile data_page_file(int fd, uint64_t slot_size, PageCodec codec);
+// Whether the record goes into the page, which then still fits its slot.
+bool data_page_has_room(const DataPageFile *file, const DataPage *data_page,
+                        const Record *record);
+// The buffers hold page_size bytes.
+void read_data_page(const DataPageFile *file, uint64_t page_id,
+                    SafeBuffer *safe_buffer, enum FileErrorStatus *error);
+void locked_read_data_page(const DataPageFile *file, uint64_t page_id,
+                           SafeBuffer *safe_buffer,
+                           enum FileErrorStatus *error);
+void write_data_page(const DataPageFile *file, SafeBuffer *safe_buffer,
+                     uint64_t page_id, enum FileErrorStatus *error);
+// For the pages read or written in bulk, slot holds slot_size bytes and page
+// page_size. Both return false for a page that does not fit its slot or a
+// corrupt slot.
+bool encode_data_page(const DataPageFile *file, const uint8_t *page,
+                      uint8_t *slot);
+bool decode_data_page(const DataPageFile *file, const uint8_t *slot,
+                      uint8_t *page);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "buffer_manager.h"
+#include "engine.h"
+#include "error.h"
+#include "record.h"
+#include "snapshot.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Sequential walk over a range of data pages of the hash engines, reading
+// several pages per pread and skipping the free pages. A cursor owns its
+// buffers, so cursors over disjoint ranges may run on separate threads. A
+// cursor given a snapshot after it is opened reads the pages as the snapshot
+// sees them. Compressed pages are expanded one at a time into expanded.
+
+typedef struct {
+  DataPageFile file;
+  Snapshot *snapshot;
+  uint64_t page_id;
+  uint64_t to_page;
+  uint8_t *buffer;
+  uint8_t *expanded;
+  uint64_t no_buffered;
+  uint64_t index;
+  uint32_t offset;
+  SafeBuffer page;
+  SafeBuffer view;
+  uint8_t record[RECORD_SIZE_ESTIMATE];
+} DataPageCursor;
+
+// Walks the pages in [from_page, to_page), clamped to the data pages.
+void data_page_cursor_open(DataPageCursor *cursor, const Database *database,
+                           uint64_t from_page, uint64_t to_page,
+                           enum FileErrorStatus *error);
+// The record points into the cursor and is only valid until the following
+// call.
+bool data_page_cursor_next(DataPageCursor *cursor, Record *record,
+                           enum FileErrorStatus *error);
+void data_page_cursor_close(DataPageCursor *cursor);
+
+// Splits the data pages into one contiguous range per thread, one per core
+// when no_threads is 0. The callback is called from the worker threads
+// concurrently and in no particular order.
+void parallel_scan_data_pages(Database *database, uint64_t no_threads,
+                              ScanCallback callback, void *arguments,
+                              enum FileErrorStatus *error);
@@ -1,14 +1,228 @@
 #pragma once
 #include "file_utilities.h"
+#include "header_page.h"
+#include "keydir.h"
+#include "overflow.h"
+#include "reaper.h"
 #include "record.h"
+#include "time_index.h"
+#include "value_cache.h"
+#include "write_batch.h"
+#include <pthread.h>
 
-int open_database(char *path, bool with_write_lock,
-                  enum FileErrorStatus *error);
-void create_database(char *path, uint64_t no_elements,
+typedef struct engine_operations EngineOperations;
+
+// An open database. The header page stays locked, read or write, until the
+// database is closed, so the cached header fields remain valid. The API calls
+// take the recursive mutex, shared with the reaper thread when one runs,
+// except on a sharded database where the shards take their own. The data
+// pages are read and written through data_pages, larger than page_size once
+// compressed.
+typedef struct {
+  int fd;
+  char *path;
+  bool writable;
+  uint64_t no_pages;
+  uint64_t page_size;
+  DataPageFile data_pages;
+  uint64_t version;
+  EngineType engine;
+  uint64_t root_page;
+  uint64_t first_segment;
+  uint64_t last_segment;
+  uint64_t no_shards;
+  KeyDir *keydir;
+  OverflowFile *overflow;
+  TimeIndex *time_index;
+  ValueCache *value_cache;
+  Reaper *reaper;
+  pthread_mutex_t mutex;
+  // bumped by every write, snapshots record the value they were opened at
+  uint64_t commit_sequence;
+  struct snapshot_registry *snapshots;
+  const EngineOperations *operations;
+  void *state;
+} Database;
+
+typedef void (*ScanCallback)(const Record *record, void *arguments);
+
+// Called once for every key of a multi-get with the position of the key in the
+// batch, record is NULL when the key is not found.
+typedef void (*MultiGetCallback)(uint64_t index, const Record *record,
+                                 void *arguments);
+
+// Makes the record to store for a key from its current record, NULL when the
+// key is missing. updated stays valid until the update returns. Returns false
+// to leave the key as it is.
+typedef bool (*UpdateCallback)(const Record *current, Record *updated,
+                               void *arguments, enum FileErrorStatus *error);
+
+typedef struct {
+  uint64_t no_pages;
+  uint64_t no_used_pages;
+  uint64_t no_records;
+  uint64_t used_bytes;
+  uint64_t free_bytes;
+} EngineStats;
+
+typedef struct {
+  uint64_t no_moved_records;
+  uint64_t no_expired_records;
+  uint64_t no_written_pages;
+  uint64_t no_freed_pages;
+} VacuumStats;
+
+// Storage engine, selected by the engine field of the header page. create
+// formats the pages after the header and sets the header fields of the
+// database. open and close may be NULL for engines without state of their own,
+// mget and write_batch for engines handling a batch key by key, scan_range
+// for engines without key order and vacuum for engines with nothing to
+// reorganize, get, put and del for the sharded engine which hands single keys
+// to its shards, update for engines updating a key with a get and a put.
+// put and update store the record as given, values too long for a record
+// are already moved to the overflow pages. Keys are byte strings of the given
+// length and may hold any byte, NUL included. open_view, scan_view and
+// close_view are NULL for the engines writing their pages in place, whose
+// snapshots keep the images of the pages changed.
+struct engine_operations {
+  const char *name;
+  bool stores_data_pages;
+  void (*create)(Database *database, uint64_t no_elements,
+                 enum FileErrorStatus *error);
+  void (*open)(Database *database, enum FileErrorStatus *error);
+  bool (*get)(Database *database, const char *key, uint32_t key_length,
+              Record *record, enum FileErrorStatus *error);
+  void (*mget)(Database *database, const char **keys,
+               const uint32_t *key_lengths, uint64_t no_keys,
+               MultiGetCallback callback, void *arguments,
+               enum FileErrorStatus *error);
+  void (*put)(Database *database, const Record *record,
+              enum FileErrorStatus *error);
+  bool (*del)(Database *database, const char *key, uint32_t key_length,
+              Record *record, enum FileErrorStatus *error);
+  // Finds the record of the key once and stores the one the callback makes
+  // of it, expired or not. Returns whether the key was written.
+  bool (*update)(Database *database, const char *key, uint32_t key_length,
+                 UpdateCallback callback, void *arguments,
+                 enum FileErrorStatus *error);
+  void (*write_batch)(Database *database, const WriteBatch *write_batch,
+                      enum FileErrorStatus *error);
+  void (*scan)(Database *database, ScanCallback callback, void *arguments,
+               enum FileErrorStatus *error);
+  void (*scan_range)(Database *database, const char *from,
+                     uint32_t from_length, const char *to, uint32_t to_length,
+                     ScanCallback callback, void *arguments,
                      enum FileErrorStatus *error);
-bool query_element(int fd, const char *key, Record *record,
-                   enum FileErrorStatus *error);
-void insert_element(int fd, const char *key, const char *value,
+  void (*stats)(Database *database, EngineStats *stats,
+                enum FileErrorStatus *error);
+  // Reorganizes the pages of the next stretch of the file from *page_id on,
+  // 0 at the start, and moves *page_id past them. Returns false once the
+  // whole file was visited.
+  bool (*vacuum)(Database *database, uint64_t *page_id, VacuumStats *stats,
+                 enum FileErrorStatus *error);
+  // A view holds the records as of its opening, taken under the database
+  // lock, and is scanned without it. Expired records are skipped.
+  void *(*open_view)(Database *database, enum FileErrorStatus *error);
+  void (*scan_view)(Database *database, void *view, ScanCallback callback,
+                    void *arguments, enum FileErrorStatus *error);
+  void (*close_view)(Database *database, void *view);
+  void (*close)(Database *database, enum FileErrorStatus *error);
+};
+
+Database *open_database(char *path, bool with_write_lock,
+                        enum FileErrorStatus *error);
+void close_database(Database *database, enum FileErrorStatus *error);
+// page_size is a power of two from MIN_PAGE_SIZE to MAX_PAGE_SIZE, the shards
+// of a sharded database all have it and page_codec. Only the engines storing
+// data pages compress them, in pages of up to MAX_PAGE_SIZE.
+void create_database(char *path, uint64_t no_elements, EngineType engine,
+                     uint64_t page_size, PageCodec page_codec,
+                     enum FileErrorStatus *error);
+void create_sharded_database(char *path, uint64_t no_elements,
+                             EngineType engine, uint64_t no_shards,
+                             uint64_t page_size, PageCodec page_codec,
+                             enum FileErrorStatus *error);
+void database_attach_keydir(Database *database, enum FileErrorStatus *error);
+// Keeps the records of up to capacity recently read keys in memory, answered
+// without the database lock or any read of the file. Attached before the
+// database is shared between threads, like the key directory. The reaper, the
+// time index and the cache of a sharded database are those of its shards,
+// which are all opened.
+void database_attach_value_cache(Database *database, uint64_t capacity,
+                                 enum FileErrorStatus *error);
+// Removes the expired records from a thread of its own until the database is
+// closed, the records of the compact format may be set to expire.
+void database_start_reaper(Database *database, enum FileErrorStatus *error);
+// Indexes the records by the time they were last written, kept up to date by
+// every later write, also by the processes opening the database after.
+void database_create_time_index(Database *database,
+                                enum FileErrorStatus *error);
+const char *database_engine_name(const Database *database);
+RecordFormat database_record_format(const Database *database);
+bool query_element(Database *database, const char *key, uint32_t key_length,
+                   Record *record, enum FileErrorStatus *error);
+void query_elements(Database *database, const char **keys,
+                    const uint32_t *key_lengths, uint64_t no_keys,
+                    MultiGetCallback callback, void *arguments,
                     enum FileErrorStatus *error);
-bool delete_element(int fd, const char *key, Record *record,
+void insert_element(Database *database, const char *key, uint32_t key_length,
+                    const char *value, uint64_t value_length,
                     enum FileErrorStatus *error);
+// The record expires ttl_seconds from now, 0 for never. Expired records are
+// left out of lookups and scans and removed when read or reaped.
+void insert_element_with_ttl(Database *database, const char *key,
+                             uint32_t key_length, const char *value,
+                             uint64_t value_length, uint64_t ttl_seconds,
+                             enum FileErrorStatus *error);
+// Atomic read-modify-write of one key, the value keeps the expiry of the key.
+// incr reads a missing key as 0 and append as empty.
+int64_t increment_element(Database *database, const char *key,
+                          uint32_t key_length, int64_t delta,
+                          enum FileErrorStatus *error);
+uint64_t append_element(Database *database, const char *key,
+                        uint32_t key_length, const char *suffix,
+                        uint64_t suffix_length, enum FileErrorStatus *error);
+bool compare_and_set_element(Database *database, const char *key,
+                             uint32_t key_length, const char *expected,
+                             uint64_t expected_length, const char *value,
+                             uint64_t value_length,
+                             enum FileErrorStatus *error);
+// Values are returned NUL terminated in a buffer owned by the caller, also for
+// the records kept in overflow pages.
+char *read_record_value(const Database *database, const Record *record,
+                        uint64_t *length, enum FileErrorStatus *error);
+bool query_value(Database *database, const char *key, uint32_t key_length,
+                 char **value, uint64_t *length, enum FileErrorStatus *error);
+bool delete_element(Database *database, const char *key, uint32_t key_length,
+                    Record *record, enum FileErrorStatus *error);
+void commit_write_batch(Database *database, const WriteBatch *write_batch,
+                        enum FileErrorStatus *error);
+void scan_elements(Database *database, ScanCallback callback, void *arguments,
+                   enum FileErrorStatus *error);
+void parallel_scan_elements(Database *database, uint64_t no_threads,
+                            ScanCallback callback, void *arguments,
+                            enum FileErrorStatus *error);
+// The records last written at or after since, the most recent first.
+void scan_changed_since(Database *database, const Timestamp *since,
+                        ScanCallback callback, void *arguments,
+                        enum FileErrorStatus *error);
+void scan_range_elements(Database *database, const char *from,
+                         uint32_t from_length, const char *to,
+                         uint32_t to_length, ScanCallback callback,
+                         void *arguments, enum FileErrorStatus *error);
+void database_stats(Database *database, EngineStats *stats,
+                    enum FileErrorStatus *error);
+// Reorganizes the file one stretch of pages at a time, the database lock being
+// taken for each stretch so that the other threads go on in between, then
+// rewrites the time index without the entries of older writes.
+void vacuum_database(Database *database, VacuumStats *stats,
+                     enum FileErrorStatus *error);
+void database_write_header(Database *database, enum FileErrorStatus *error);
+
+// Shared by the engines keeping their records in hashed data pages
+void create_data_pages(Database *database, uint64_t no_elements,
+                       enum FileErrorStatus *error);
+void scan_data_pages(Database *database, ScanCallback callback,
+                     void *arguments, enum FileErrorStatus *error);
+void data_pages_stats(Database *database, EngineStats *stats,
+                      enum FileErrorStatus *error);
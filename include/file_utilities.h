@@ -7,12 +7,13 @@
 #include <stdbool.h>
 #include <stdio.h>
 
-int create_database_file(char *path, uint64_t no_elements,
-                         enum FileErrorStatus *error);
+int create_database_file(char *path, enum FileErrorStatus *error);
 
-int open_database_file(char *path, bool with_write_lock,
+// page_size is read from the header page.
+int open_database_file(char *path, bool with_write_lock, uint64_t *page_size,
                        enum FileErrorStatus *error);
 
+// The capacity of the buffer is the page size.
 void read_page_into_buffer(int file, uint64_t page_id, SafeBuffer *safe_buffer,
                            enum FileErrorStatus *error);
 
@@ -27,6 +28,9 @@ void unlock_page(int file, uint64_t page_id, enum FileErrorStatus *error);
 
 void close_database_file(int fd, enum FileErrorStatus *error);
 
+// Makes a file created or renamed under the directory of path durable.
+bool sync_parent_directory(const char *path);
+
 void locked_read_page_into_buffer(int file, uint64_t page_id,
                                   SafeBuffer *safe_buffer,
                                   enum FileErrorStatus *error);
@@ -2,16 +2,45 @@
 
 #include "buffer_manager.h"
 #include "constants.h"
+#include "page_codec.h"
 #include <stdbool.h>
 
 typedef struct {
   SafeBuffer *safe_buffer;
 } HeaderPage;
 
-HeaderPage create_header_page(SafeBuffer *safe_buffer, uint64_t no_pages);
+// Layout of the data pages, files created before the field existed read as
+// linear probing since the reserved area is zeroed.
+typedef enum {
+  ENGINE_LINEAR_PROBING = 0,
+  ENGINE_CUCKOO,
+  ENGINE_BTREE,
+  ENGINE_LOG,
+  ENGINE_LSM,
+  ENGINE_SHARDED,
+  ENGINE_LENGTH
+} EngineType;
+
+HeaderPage create_header_page(SafeBuffer *safe_buffer, uint64_t no_pages,
+                              EngineType engine);
 HeaderPage open_header_page(SafeBuffer *safe_buffer);
 uint64_t header_page_id(const HeaderPage *header_page);
 uint64_t header_no_pages(const HeaderPage *header_page);
+void header_set_no_pages(HeaderPage *header_page, uint64_t no_pages);
 uint64_t header_version(const HeaderPage *header_page);
+EngineType header_engine(const HeaderPage *header_page);
+uint64_t header_root_page(const HeaderPage *header_page);
+void header_set_root_page(HeaderPage *header_page, uint64_t root_page);
+uint64_t header_first_segment(const HeaderPage *header_page);
+void header_set_first_segment(HeaderPage *header_page, uint64_t first_segment);
+uint64_t header_last_segment(const HeaderPage *header_page);
+void header_set_last_segment(HeaderPage *header_page, uint64_t last_segment);
+uint64_t header_no_shards(const HeaderPage *header_page);
+void header_set_no_shards(HeaderPage *header_page, uint64_t no_shards);
+// Set by create_header_page to the capacity of its buffer, the page size of
+// the database.
+uint64_t header_page_size(const HeaderPage *header_page);
+PageCodec header_page_codec(const HeaderPage *header_page);
+void header_set_page_codec(HeaderPage *header_page, PageCodec page_codec);
 const uint8_t *header_page_buffer(HeaderPage *header_page);
 void destroy_header_page(HeaderPage *header_page);
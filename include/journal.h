@@ -0,0 +1,26 @@
+#pragma once
+
+#include "error.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Redo journal of the pages one commit writes, kept in <path>.journal next
+// to the database file. The page images are synced to the journal before any
+// of them is written in place, so a commit cut short by a crash is completed
+// the next time the database is opened, and one not fully journaled was never
+// started.
+
+typedef struct {
+  uint64_t page_id;
+  const uint8_t *page;
+} JournalPage;
+
+// Writes the pages to fd through the journal, the caller holds their write
+// locks.
+void journal_commit_pages(const char *path, int fd, uint64_t page_size,
+                          const JournalPage *pages, uint64_t no_pages,
+                          enum FileErrorStatus *error);
+// A reader holding the header read lock upgrades it to replay the journal
+// and goes back to the read lock after.
+void journal_recover(const char *path, int fd, uint64_t page_size,
+                     bool with_write_lock, enum FileErrorStatus *error);
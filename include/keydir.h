@@ -0,0 +1,43 @@
+#pragma once
+
+#include "data_page.h"
+#include "error.h"
+#include "record.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// In-memory key directory (Bitcask style) mapping a key to the page and
+// in-page offset of its record. Entries keep the key, so keys sharing a hash
+// get an entry each. Only meaningful while the process owning it is the only
+// writer of the database.
+
+typedef struct {
+  uint64_t key_hash;
+  uint64_t page_id;
+  uint32_t slot;
+  uint32_t key_length;
+  char key[MAX_STRING_LENGTH];
+} KeyDirEntry;
+
+typedef struct {
+  KeyDirEntry *entries;
+  uint8_t *occupied;
+  uint64_t capacity;
+  uint64_t no_entries;
+} KeyDir;
+
+KeyDir *create_keydir(void);
+KeyDir *build_keydir(const DataPageFile *file, uint64_t no_pages,
+                     enum FileErrorStatus *error);
+bool keydir_lookup(const KeyDir *keydir, const char *key, uint32_t key_length,
+                   KeyDirEntry *entry);
+bool keydir_index_page(KeyDir *keydir, uint64_t page_id,
+                       const DataPage *data_page);
+bool keydir_set(KeyDir *keydir, const char *key, uint32_t key_length,
+                uint64_t page_id, uint32_t slot);
+void keydir_remove(KeyDir *keydir, const char *key, uint32_t key_length);
+bool keydir_query_element(const DataPageFile *file, const KeyDir *keydir,
+                          const char *key, uint32_t key_length, Record *record,
+                          bool *resolved, enum FileErrorStatus *error);
+uint64_t keydir_no_entries(const KeyDir *keydir);
+void destroy_keydir(KeyDir *keydir);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "engine.h"
+
+// Static hash file probing consecutive data pages from the home page of a
+// key, the original layout of the database.
+extern const EngineOperations linear_probing_engine;
+
+typedef struct linear_probing_loader LinearProbingLoader;
+
+// Fills the data pages of a new database with records given in order of their
+// home page, written a chunk of pages at a time. Every data page is written,
+// the file is expected to hold nothing yet past the header page.
+LinearProbingLoader *create_linear_probing_loader(Database *database,
+                                                  enum FileErrorStatus *error);
+// The records of a call may come in any order, but are homed at or after the
+// home pages of the records of the calls before.
+void linear_probing_loader_add(LinearProbingLoader *loader,
+                               const Record *records, uint64_t no_records,
+                               enum FileErrorStatus *error);
+// Writes the pages left, the loader is freed.
+void linear_probing_loader_finish(LinearProbingLoader *loader,
+                                  enum FileErrorStatus *error);
+void destroy_linear_probing_loader(LinearProbingLoader *loader);
+uint64_t linear_probing_home(const Database *database, const char *key,
+                             uint32_t key_length);
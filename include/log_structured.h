@@ -0,0 +1,9 @@
+#pragma once
+
+#include "engine.h"
+
+// Bitcask style log: every write is appended to the active segment file next
+// to the database file, an in-memory index built at open maps every key to
+// its latest entry, and a background merger rewrites the sealed segments
+// keeping only the live entries.
+extern const EngineOperations log_engine;
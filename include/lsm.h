@@ -0,0 +1,10 @@
+#pragma once
+
+#include "engine.h"
+
+// LSM tree: writes go to a write-ahead log and a skiplist memtable, which is
+// flushed to an immutable sorted run once full or once the log outgrows it.
+// Runs are organised in levels merged by a background compaction thread,
+// level 0 holding the flushed runs and every deeper level a single run ten
+// times larger than the one above.
+extern const EngineOperations lsm_engine;
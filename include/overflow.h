@@ -0,0 +1,37 @@
+#pragma once
+
+#include "error.h"
+#include "record.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Chains of pages holding the values too long for a record, in a file next to
+// the database file (<path>.overflow). A value is written in full before the
+// record pointing to it, and every page carries the chain id of its value, so
+// a reader racing with the writer notices a page freed and reused meanwhile.
+
+// Overflow pages have the page size of their database.
+typedef struct {
+  int fd;
+  uint64_t page_size;
+} OverflowFile;
+
+// <path>.overflow
+void overflow_file_path(char *buffer, const char *path);
+// NULL without an error when the file does not exist and create is false.
+OverflowFile *open_overflow_file(const char *path, uint64_t page_size,
+                                 bool writable, bool create,
+                                 enum FileErrorStatus *error);
+uint64_t overflow_no_used_pages(const OverflowFile *overflow_file,
+                                enum FileErrorStatus *error);
+void overflow_write_value(OverflowFile *overflow_file, const char *value,
+                          uint64_t length, OverflowReference *reference,
+                          enum FileErrorStatus *error);
+// The value is returned NUL terminated in a buffer owned by the caller.
+char *overflow_read_value(const OverflowFile *overflow_file,
+                          const OverflowReference *reference,
+                          enum FileErrorStatus *error);
+void overflow_free_value(OverflowFile *overflow_file,
+                         const OverflowReference *reference,
+                         enum FileErrorStatus *error);
+void close_overflow_file(OverflowFile *overflow_file);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "engine.h"
+#include "error.h"
+#include "write_batch.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Pages touched by a write batch, read once, changed in memory and written
+// back once, their write locks taken in page order. Pages written together go
+// through the journal, a crash leaves all of them or none, and a batch that
+// fails before the write leaves the file untouched.
+
+typedef struct {
+  uint64_t page_id;
+  bool dirty;
+  SafeBuffer safe_buffer;
+  uint8_t buffer[];
+} CachedPage;
+
+// Pages sorted by page id.
+typedef struct {
+  CachedPage **pages;
+  uint64_t no_pages;
+} PageCache;
+
+// The page as cached, read from the file the first time.
+CachedPage *cached_page(Database *database, PageCache *page_cache,
+                        uint64_t page_id, enum FileErrorStatus *error);
+// A zeroed page past the end of the file, marked dirty.
+CachedPage *new_cached_page(Database *database, PageCache *page_cache,
+                            uint64_t page_id, enum FileErrorStatus *error);
+// The header page, locked as long as the database is open, may be among them.
+void write_cached_pages(Database *database, PageCache *page_cache,
+                        enum FileErrorStatus *error);
+// Points the key directory at the records of the data pages written.
+void index_cached_pages(Database *database, const PageCache *page_cache,
+                        const WriteBatch *write_batch,
+                        enum FileErrorStatus *error);
+void destroy_page_cache(PageCache *page_cache);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Codec of the data pages, recorded in the header page. Files created before
+// the field existed read as uncompressed since the reserved area is zeroed.
+typedef enum {
+  PAGE_CODEC_NONE = 0,
+  PAGE_CODEC_LZ,
+  PAGE_CODEC_LENGTH
+} PageCodec;
+
+// The most bytes length bytes may take once compressed.
+uint32_t page_codec_bound(PageCodec codec, uint32_t length);
+// Returns the compressed length, 0 when the output does not fit capacity.
+uint32_t page_codec_compress(PageCodec codec, const uint8_t *input,
+                             uint32_t length, uint8_t *output,
+                             uint32_t capacity);
+// Returns false when the input is corrupt or does not decompress to exactly
+// length bytes.
+bool page_codec_decompress(PageCodec codec, const uint8_t *input,
+                           uint32_t input_length, uint8_t *output,
+                           uint32_t length);
@@ -1,5 +1,6 @@
 #pragma once
 #include "error.h"
+#include "header_page.h"
 #include <inttypes.h>
 
 typedef enum {
@@ -8,20 +9,78 @@ typedef enum {
   COMMAND_INSERT,
   COMMAND_TIMESTAMP,
   COMMAND_DELETE,
+  COMMAND_STATS,
+  COMMAND_SCAN,
+  COMMAND_MGET,
+  COMMAND_INCREMENT,
+  COMMAND_APPEND,
+  COMMAND_COMPARE_AND_SET,
+  COMMAND_CHANGED_SINCE,
+  COMMAND_VACUUM,
+  COMMAND_REBUILD,
+  COMMAND_BATCH,
   COMMAND_LENGTH
 } Command;
 
+// Operations of the lines a batch reads from its input
+typedef enum {
+  BATCH_GET = 0,
+  BATCH_SET,
+  BATCH_DELETE,
+  BATCH_STATS,
+  BATCH_SCAN,
+  BATCH_SLEEP,
+  BATCH_BEGIN,
+  BATCH_COMMIT,
+  BATCH_ABORT,
+  BATCH_SNAPSHOT,
+  BATCH_SNAPSHOT_SCAN,
+  BATCH_LENGTH
+} BatchOperation;
+
 typedef struct {
   const char *key;
   const char *value;
+  const char *expected;
+  const char *end_key;
   const char *path;
+  const char *destination;
+  const char **keys;
+  uint64_t no_keys;
   uint64_t no_elements;
+  EngineType engine;
+  uint64_t no_shards;
+  bool time_index;
+  uint64_t page_size;
+  PageCodec page_codec;
+  uint64_t ttl;
+  int64_t delta;
+  uint64_t since;
+  double load_factor;
+  bool keydir;
+  bool reaper;
+  // 0 without a value cache
+  uint64_t cache_capacity;
   Command command;
 } ParsedValues;
 
+typedef struct {
+  const char *key;
+  const char *value;
+  uint64_t ttl;
+  // 0 for a scan on the calling thread
+  uint64_t no_threads;
+  uint64_t seconds;
+  BatchOperation operation;
+} BatchLine;
+
 Command parse_command(const char *command, enum FileErrorStatus *error);
 
 ParsedValues parse_values(Command command, int argc, char **argv,
                           enum FileErrorStatus *error);
 
+// The words of the line are separated by spaces, the key and value of a
+// batch line then cannot hold any. The line is split in place.
+BatchLine parse_batch_line(char *line, enum FileErrorStatus *error);
+
 
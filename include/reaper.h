@@ -0,0 +1,22 @@
+#pragma once
+
+#include "error.h"
+#include "record.h"
+#include <inttypes.h>
+
+// Hashed timing wheel of the keys set to expire, advanced by a thread of its
+// own that hands every key past its expiry to the callback. The callback runs
+// on that thread and must check the key is still expired, a key written again
+// keeps its old wheel entry.
+
+typedef void (*ReapCallback)(const char *key, uint32_t key_length,
+                             void *arguments);
+
+typedef struct reaper Reaper;
+
+Reaper *create_reaper(ReapCallback callback, void *arguments,
+                      enum FileErrorStatus *error);
+void reaper_schedule(Reaper *reaper, const char *key, uint32_t key_length,
+                     const Timestamp *expiry, enum FileErrorStatus *error);
+// Stops the thread, the keys not reaped yet are dropped.
+void destroy_reaper(Reaper *reaper);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "error.h"
+#include <inttypes.h>
+
+// Offline rebuild of a database into a new linear probing file sized for the
+// records it holds. The source stays read locked, so unchanged, while the new
+// file is written next to the destination and renamed in place once synced.
+
+#define DEFAULT_LOAD_FACTOR (0.75)
+
+typedef struct {
+  uint64_t no_records;
+  uint64_t no_pages;
+} RebuildStats;
+
+// load_factor in (0, 1] is the share of the data page space the records take.
+// The destination must not exist, the overflow values and the time index of
+// the source are carried over.
+void rebuild_database(char *source_path, char *destination_path,
+                      double load_factor, RebuildStats *stats,
+                      enum FileErrorStatus *error);
@@ -13,19 +13,60 @@ typedef struct {
   uint64_t nanoseconds;
 } Timestamp;
 
+// Encoding of the records written, records of both formats are read. Fixed
+// records keep full-width timestamps, compact ones varint lengths and
+// timestamps.
+typedef enum { RECORD_FORMAT_FIXED = 0, RECORD_FORMAT_COMPACT } RecordFormat;
+
+// Location of a value kept in the overflow pages of a database.
+typedef struct {
+  uint64_t length;
+  uint64_t first_page;
+  uint64_t chain_id;
+} OverflowReference;
+
 const Record record_from_buffer(SafeBuffer *safe_buffer);
-Record record_from_data(SafeBuffer *safe_buffer, const char *key,
-                        const char *value);
+// Keys and values are passed with their length and may hold NUL bytes.
+Record record_from_data(SafeBuffer *safe_buffer, RecordFormat format,
+                        const char *key, uint32_t key_length,
+                        const char *value, uint32_t value_length);
+Record record_from_overflow(SafeBuffer *safe_buffer, RecordFormat format,
+                            const char *key, uint32_t key_length,
+                            const OverflowReference *reference);
+bool record_fits_inline(RecordFormat format, uint32_t key_length,
+                        uint64_t value_length);
+bool record_has_overflow(const Record *record);
+OverflowReference record_overflow_reference(const Record *record);
+Record record_copy_into(SafeBuffer *safe_buffer, const Record *record);
 const char *record_key(const Record *record);
+uint32_t record_key_length(const Record *record);
+bool record_has_key(const Record *record, const char *key,
+                    uint32_t key_length);
 const char *record_value(const Record *record);
+uint32_t record_value_length(const Record *record);
 Timestamp record_first_timestamp(const Record *record);
 Timestamp record_last_timestamp(const Record *record);
-void record_update_data(Record *record, const char *value,
+void record_update_data(Record *record, const char *value, uint32_t length,
                         const Timestamp *timestamp);
 uint32_t get_record_length(const Record *record);
 const uint8_t *record_get_buffer(const Record *record);
 void destroy_record(Record *record);
 Record record_clone(Record *record);
 void record_set_first_timestamp(Record *record, Timestamp timestamp);
+void record_set_expiry(Record *record, const Timestamp *expiry);
+bool record_expiry(const Record *record, Timestamp *expiry);
+bool record_has_expired(const Record *record);
+int compare_keys(const char *key, uint32_t key_length, const char *other_key,
+                 uint32_t other_key_length);
+// Records kept in a data page may leave out the first shared bytes of their
+// key. The encoding returns the length written into entry, 0 when the record
+// is not compact or the entry would not be shorter.
+uint32_t record_encode_shared_prefix(const Record *record, uint32_t shared,
+                                     uint8_t *entry);
+bool record_entry_has_shared_prefix(const uint8_t *entry);
+const char *record_entry_key_suffix(const uint8_t *entry, uint32_t *shared,
+                                    uint32_t *suffix_length);
+Record record_expand_shared_prefix(SafeBuffer *safe_buffer,
+                                   const uint8_t *entry, const char *prefix);
 void format_timestamp_into_date(const Timestamp *timestamp, char *date_buffer,
                                 size_t len_date_buffer);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "engine.h"
+
+// Database split into shard files, each a complete database of its own with
+// its header lock, descriptor, overflow file and engine. The database file
+// itself only holds the header page listing the number of shards, its writers
+// keep a read lock on it. Keys are routed by the high bits of their hash, a
+// single key operation is handed to its shard without taking any lock of the
+// sharded database, operations spanning several shards run on one thread per
+// shard.
+
+#define MAX_SHARDS (64)
+
+extern const EngineOperations sharded_engine;
+
+// <path>.shard<shard>
+void sharded_shard_path(char *buffer, const char *path, uint64_t shard);
+// The shard of the key, opened by the first operation routed to it.
+Database *sharded_key_shard(const Database *database, const char *key,
+                            uint32_t key_length, enum FileErrorStatus *error);
+Database *sharded_shard(const Database *database, uint64_t shard,
+                        enum FileErrorStatus *error);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "buffer_manager.h"
+#include "record.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Memtable of the LSM engine, records kept sorted by key. A delete is stored
+// as a tombstone so it keeps hiding the older versions in the sorted runs.
+
+typedef struct skiplist_node SkipListNode;
+
+typedef struct {
+  SkipListNode *head;
+  uint32_t height;
+  uint64_t no_entries;
+  uint64_t size;
+  uint64_t random_state;
+} SkipList;
+
+SkipList *create_skiplist(void);
+bool skiplist_put(SkipList *skiplist, const Record *record, bool tombstone);
+const SkipListNode *skiplist_find(const SkipList *skiplist, const char *key,
+                                  uint32_t key_length);
+const SkipListNode *skiplist_seek(const SkipList *skiplist, const char *from,
+                                  uint32_t from_length);
+const SkipListNode *skiplist_next(const SkipListNode *node);
+Record skiplist_node_record(const SkipListNode *node, SafeBuffer *view);
+bool skiplist_node_is_tombstone(const SkipListNode *node);
+uint64_t skiplist_size(const SkipList *skiplist);
+void destroy_skiplist(SkipList *skiplist);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "engine.h"
+#include "error.h"
+#include "overflow.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Consistent read-only view of a database as of the commit it was opened at.
+// With the linear, cuckoo and btree engines a writer keeps the image of a
+// page the first time it changes it while snapshots are open, and a snapshot
+// scan reads the kept image instead of the page. The scan takes the database
+// lock for one chunk of pages at a time only, so writers go on while it runs.
+// The lsm engine copies its memtable when the snapshot opens and keeps the
+// sorted runs of the moment open, compacted or not, until it closes. The log
+// engine copies the locations of the live entries and keeps a descriptor of
+// every segment, merged away or not. Both scan without any lock. A sharded
+// database opens a snapshot of every shard with all the shards locked.
+// Snapshots are closed before their database.
+
+typedef struct snapshot Snapshot;
+
+Snapshot *open_snapshot(Database *database, enum FileErrorStatus *error);
+uint64_t snapshot_sequence(const Snapshot *snapshot);
+// Expired records are skipped, the records of overflow values stay readable
+// with read_record_value while the snapshot is open.
+void snapshot_scan(Snapshot *snapshot, ScanCallback callback, void *arguments,
+                   enum FileErrorStatus *error);
+void close_snapshot(Snapshot *snapshot);
+
+// Writers call these under the database lock. A page is kept before it is
+// written in place, and the overflow pages of a value replaced are freed by
+// the last snapshot closing instead of now; false when no snapshot is open.
+void snapshot_preserve_page(const Database *database, uint64_t page_id,
+                            enum FileErrorStatus *error);
+bool snapshot_defer_overflow_free(Database *database,
+                                  const OverflowReference *reference,
+                                  enum FileErrorStatus *error);
+// Reads no_pages data pages from page_id as the snapshot sees them, the
+// pages are not expanded.
+void snapshot_read_pages(Snapshot *snapshot, uint64_t page_id,
+                         uint64_t no_pages, uint8_t *buffer,
+                         enum FileErrorStatus *error);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "bloom_filter.h"
+#include "buffer_manager.h"
+#include "constants.h"
+#include "error.h"
+#include "record.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Immutable file of entries sorted by key, written once by a memtable flush
+// or a compaction. The block index and the Bloom filter are kept in memory
+// while the run is open, so a lookup reads at most one block.
+
+// Runs are files of their own, their blocks do not follow the page size of
+// the database.
+#define RUN_BLOCK_SIZE (4096)
+
+typedef enum { RUN_ENTRY_PUT = 1, RUN_ENTRY_DELETE } RunEntryType;
+
+typedef struct {
+  uint64_t id;
+  int fd;
+  uint64_t no_blocks;
+  uint64_t no_entries;
+  char (*first_keys)[MAX_STRING_LENGTH + 1];
+  uint32_t *first_key_lengths;
+  char last_key[MAX_STRING_LENGTH + 1];
+  uint32_t last_key_length;
+  BloomFilter bloom_filter;
+  // snapshots reading the run, a compaction dropping the run leaves closing
+  // it to the last of them
+  uint64_t no_readers;
+  bool dropped;
+} SortedRun;
+
+typedef struct sorted_run_writer SortedRunWriter;
+
+// The record returned by next points into the cursor and is only valid until
+// the following call.
+typedef struct {
+  const SortedRun *run;
+  uint8_t *block;
+  uint64_t block_id;
+  uint32_t offset;
+  SafeBuffer view;
+} SortedRunCursor;
+
+SortedRunWriter *create_sorted_run_writer(const char *path,
+                                          uint64_t no_entries,
+                                          enum FileErrorStatus *error);
+void sorted_run_writer_add(SortedRunWriter *writer, RunEntryType type,
+                           const Record *record, enum FileErrorStatus *error);
+uint64_t sorted_run_writer_no_entries(const SortedRunWriter *writer);
+SortedRun *sorted_run_writer_finish(SortedRunWriter *writer, uint64_t id,
+                                    enum FileErrorStatus *error);
+void destroy_sorted_run_writer(SortedRunWriter *writer);
+
+SortedRun *open_sorted_run(const char *path, uint64_t id,
+                           enum FileErrorStatus *error);
+uint64_t sorted_run_size(const SortedRun *run);
+bool sorted_run_get(const SortedRun *run, const char *key,
+                    uint32_t key_length, uint8_t *block, RunEntryType *type,
+                    Record *record, SafeBuffer *view,
+                    enum FileErrorStatus *error);
+void close_sorted_run(SortedRun *run);
+
+void sorted_run_cursor_open(SortedRunCursor *cursor, const SortedRun *run,
+                            const char *from, uint32_t from_length,
+                            enum FileErrorStatus *error);
+bool sorted_run_cursor_next(SortedRunCursor *cursor, RunEntryType *type,
+                            Record *record, enum FileErrorStatus *error);
+void sorted_run_cursor_close(SortedRunCursor *cursor);
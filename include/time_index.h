@@ -0,0 +1,46 @@
+#pragma once
+
+#include "error.h"
+#include "record.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Keys in the order they were last written, in a file next to the database
+// file (<path>.mtime). Every write appends its key with the time of the
+// write, so the file is sorted by time and the keys written since a given
+// time are found with a binary search. A key written again or deleted keeps
+// its older entries, readers check them against the record, until the index
+// is rewritten from the records.
+
+typedef struct {
+  int fd;
+  uint64_t no_entries;
+  uint64_t last_nanoseconds;
+} TimeIndex;
+
+typedef void (*TimeIndexCallback)(const char *key, uint32_t key_length,
+                                  const Timestamp *timestamp, void *arguments);
+
+// NULL without an error when the file does not exist and create is false.
+TimeIndex *open_time_index(const char *path, bool writable, bool create,
+                           enum FileErrorStatus *error);
+// An empty index in <path>.mtime.new, filled with time_index_add and put in
+// place of the index with replace_time_index.
+TimeIndex *create_time_index_replacement(const char *path,
+                                         enum FileErrorStatus *error);
+// Syncs the replacement and renames it over the index, a crash leaves one or
+// the other. time_index then uses the replacement, which is freed, and on
+// failure stays as it was.
+void replace_time_index(TimeIndex *time_index, TimeIndex *replacement,
+                        const char *path, enum FileErrorStatus *error);
+// A time earlier than the last entry is stored as the time of that entry,
+// which keeps the file sorted when the clock goes back.
+void time_index_add(TimeIndex *time_index, const char *key,
+                    uint32_t key_length, const Timestamp *timestamp,
+                    enum FileErrorStatus *error);
+// Calls the callback for every entry written at or after since, oldest first.
+void time_index_find_since(const TimeIndex *time_index,
+                           const Timestamp *since, TimeIndexCallback callback,
+                           void *arguments, enum FileErrorStatus *error);
+uint64_t time_index_no_entries(const TimeIndex *time_index);
+void close_time_index(TimeIndex *time_index);
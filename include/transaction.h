@@ -0,0 +1,31 @@
+#pragma once
+
+#include "engine.h"
+#include "error.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Reads and writes of several keys applied as one. A transaction holds the
+// lock of its database from begin to commit or abort, and the process holds
+// the header write lock of the file, so what it reads stays current until it
+// commits. Writes are buffered in a write batch and reads see them. The
+// page engines commit the batch through the journal and the log and lsm
+// engines as one log entry, all of it or none.
+
+typedef struct transaction Transaction;
+
+Transaction *begin_transaction(Database *database,
+                               enum FileErrorStatus *error);
+// Values are returned NUL terminated in a buffer owned by the caller.
+bool transaction_get(Transaction *transaction, const char *key,
+                     uint32_t key_length, char **value, uint64_t *length,
+                     enum FileErrorStatus *error);
+// Fails for a key and value not fitting a write batch entry.
+bool transaction_put(Transaction *transaction, const char *key,
+                     uint32_t key_length, const char *value,
+                     uint32_t value_length);
+bool transaction_delete(Transaction *transaction, const char *key,
+                        uint32_t key_length);
+// Both end the transaction and free it.
+void commit_transaction(Transaction *transaction, enum FileErrorStatus *error);
+void abort_transaction(Transaction *transaction);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "error.h"
+#include "record.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Bounded cache of the records of hot keys, split into shards of their own
+// lock picked by the hash of the key, and evicting with CLOCK: a hit sets the
+// reference bit of an entry, and the hand clears the bits it passes until it
+// finds an entry to evict. The owner drops the key of every write from it.
+
+typedef struct value_cache ValueCache;
+
+ValueCache *create_value_cache(uint64_t capacity,
+                               enum FileErrorStatus *error);
+// The record returned is a copy the caller destroys.
+bool value_cache_get(ValueCache *value_cache, const char *key,
+                     uint32_t key_length, Record *record);
+void value_cache_put(ValueCache *value_cache, const Record *record);
+void value_cache_invalidate(ValueCache *value_cache, const char *key,
+                            uint32_t key_length);
+void destroy_value_cache(ValueCache *value_cache);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "constants.h"
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Puts and deletes committed together with commit_write_batch, applied in the
+// order they were added.
+
+typedef enum { WRITE_BATCH_PUT = 1, WRITE_BATCH_DELETE } WriteBatchType;
+
+typedef struct {
+  WriteBatchType type;
+  uint32_t key_length;
+  uint32_t value_length;
+  char key[MAX_STRING_LENGTH + 1];
+  char value[MAX_STRING_LENGTH + 1];
+} WriteBatchEntry;
+
+typedef struct {
+  WriteBatchEntry *entries;
+  uint64_t no_entries;
+  uint64_t capacity;
+} WriteBatch;
+
+WriteBatch *create_write_batch(void);
+// put fails for a key and value not fitting a record, batches do not write
+// overflow pages.
+bool write_batch_put(WriteBatch *write_batch, const char *key,
+                     uint32_t key_length, const char *value,
+                     uint32_t value_length);
+bool write_batch_delete(WriteBatch *write_batch, const char *key,
+                        uint32_t key_length);
+uint64_t write_batch_no_entries(const WriteBatch *write_batch);
+const WriteBatchEntry *write_batch_entry(const WriteBatch *write_batch,
+                                         uint64_t index);
+void clear_write_batch(WriteBatch *write_batch);
+void destroy_write_batch(WriteBatch *write_batch);
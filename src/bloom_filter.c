@@ -0,0 +1,83 @@
+#include "../include/bloom_filter.h"
+#include "../include/constants.h"
+#include "../include/xxhash.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BITS_PER_KEY (10)
+#define NO_PROBES (7)
+#define MIN_BITS (64)
+
+static void probe_hashes(const char *key, uint32_t key_length,
+                         uint64_t *first, uint64_t *second);
+
+// API implementation
+
+// bits is NULL when the allocation failed.
+BloomFilter create_bloom_filter(uint64_t no_keys) {
+  uint64_t no_bits = no_keys * BITS_PER_KEY;
+  no_bits = no_bits < MIN_BITS ? MIN_BITS : no_bits;
+  no_bits = (no_bits + BYTE_SIZE - 1) / BYTE_SIZE * BYTE_SIZE;
+
+  BloomFilter bloom_filter = {.bits = calloc(no_bits / BYTE_SIZE, 1),
+                              .no_bits = no_bits};
+  if (NULL == bloom_filter.bits) {
+    fprintf(stderr, "cannot allocate bloom filter.\n");
+  }
+  return bloom_filter;
+}
+
+BloomFilter bloom_filter_from_data(uint8_t *bits, uint64_t no_bits) {
+  return (BloomFilter){.bits = bits, .no_bits = no_bits};
+}
+
+uint64_t bloom_filter_size(const BloomFilter *bloom_filter) {
+  assert(bloom_filter);
+  return bloom_filter->no_bits / BYTE_SIZE;
+}
+
+void bloom_filter_add(BloomFilter *bloom_filter, const char *key,
+                      uint32_t key_length) {
+  assert(bloom_filter);
+  assert(key);
+
+  uint64_t first, second;
+  probe_hashes(key, key_length, &first, &second);
+  for (uint32_t i = 0; i < NO_PROBES; ++i) {
+    uint64_t bit = (first + i * second) % bloom_filter->no_bits;
+    bloom_filter->bits[bit / BYTE_SIZE] |= 1 << (bit % BYTE_SIZE);
+  }
+}
+
+bool bloom_filter_may_contain(const BloomFilter *bloom_filter,
+                              const char *key, uint32_t key_length) {
+  assert(bloom_filter);
+  assert(key);
+
+  uint64_t first, second;
+  probe_hashes(key, key_length, &first, &second);
+  for (uint32_t i = 0; i < NO_PROBES; ++i) {
+    uint64_t bit = (first + i * second) % bloom_filter->no_bits;
+    if (0 == (bloom_filter->bits[bit / BYTE_SIZE] & (1 << (bit % BYTE_SIZE)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void destroy_bloom_filter(BloomFilter *bloom_filter) {
+  free(bloom_filter->bits);
+  bloom_filter->bits = NULL;
+}
+
+// Local implementation
+
+// Double hashing, the probes are derived from the two halves of one hash.
+static void probe_hashes(const char *key, uint32_t key_length,
+                         uint64_t *first, uint64_t *second) {
+  uint64_t hash = XXH3_64bits(key, key_length);
+  *first = hash & 0xFFFFFFFF;
+  *second = (hash >> 32) | 1;
+}
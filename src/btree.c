@@ -0,0 +1,905 @@
+#include "../include/btree.h"
+#include "../include/buffer_manager.h"
+#include "../include/buffer_utilities.h"
+#include "../include/engine.h"
+#include "../include/file_utilities.h"
+#include "../include/header_page.h"
+#include "../include/page_cache.h"
+#include "../include/record.h"
+#include "../include/snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// node type (1 byte) | no_entries (4 bytes) | used space (4 bytes) | next leaf
+// (8 bytes) | leftmost child (8 bytes) | entries (page size - 25 bytes)
+//
+// The used space of a full 64 KiB node does not fit 2 bytes, nodes are created
+// wide, flagged in their type, with 4 byte counts. The nodes of files created
+// before, all of 4 KiB, keep 2 byte counts and pass their layout on to the
+// nodes split from them.
+//
+// Leaf entries are records sorted by key. Inner entries are key length (1
+// byte) | key (key length + 1 bytes) | child (8 bytes), the child holding the
+// keys not smaller than the entry key and smaller than the next one. The
+// leftmost child holds the keys smaller than the first entry key.
+
+#define NODE_TYPE_SIZE (1)
+#define NODE_TYPE_OFFSET (0)
+#define NODE_WIDE (0x80)
+
+#define NARROW_COUNT_SIZE (2)
+#define WIDE_COUNT_SIZE (4)
+#define NO_ENTRIES_OFFSET (NODE_TYPE_OFFSET + NODE_TYPE_SIZE)
+
+#define NEXT_LEAF_SIZE (8)
+#define LEFTMOST_CHILD_SIZE (8)
+
+#define KEY_LENGTH_SIZE (1)
+#define STRING_TERMINATOR_SIZE (1)
+#define CHILD_SIZE (8)
+#define MAX_INNER_ENTRY_SIZE                                                   \
+  (KEY_LENGTH_SIZE + MAX_STRING_LENGTH + STRING_TERMINATOR_SIZE + CHILD_SIZE)
+
+#define ROOT_PAGE (1)
+#define MAX_DEPTH (32)
+
+typedef enum { NODE_LEAF = 1, NODE_INNER } NodeType;
+
+// Where the nodes are read and written: the file, or the pages cached by a
+// write batch, written together once the whole batch is applied. The pages
+// from no_file_pages on are appended by the batch.
+typedef struct {
+  Database *database;
+  PageCache *page_cache;
+  uint64_t no_file_pages;
+} NodeStore;
+
+static void btree_create(Database *database, uint64_t no_elements,
+                         enum FileErrorStatus *error);
+static bool btree_get(Database *database, const char *key,
+                      uint32_t key_length, Record *record,
+                      enum FileErrorStatus *error);
+static void btree_put(Database *database, const Record *new_record,
+                      enum FileErrorStatus *error);
+static bool btree_delete(Database *database, const char *key,
+                         uint32_t key_length, Record *record,
+                         enum FileErrorStatus *error);
+static void btree_write_batch(Database *database, const WriteBatch *write_batch,
+                              enum FileErrorStatus *error);
+static void btree_scan(Database *database, ScanCallback callback,
+                       void *arguments, enum FileErrorStatus *error);
+static void btree_scan_range(Database *database, const char *from,
+                             uint32_t from_length, const char *to,
+                             uint32_t to_length, ScanCallback callback,
+                             void *arguments, enum FileErrorStatus *error);
+static void btree_stats(Database *database, EngineStats *stats,
+                        enum FileErrorStatus *error);
+static void insert_record(NodeStore *store, const Record *new_record,
+                          enum FileErrorStatus *error);
+static bool remove_record(NodeStore *store, const char *key,
+                          uint32_t key_length, Record *record,
+                          enum FileErrorStatus *error);
+static uint64_t descend(NodeStore *store, const char *key, uint32_t key_length,
+                        uint8_t *node, uint64_t *path, uint32_t *depth,
+                        enum FileErrorStatus *error);
+static void load_node(NodeStore *store, uint64_t page_id, uint8_t *node,
+                      enum FileErrorStatus *error);
+static void store_node(NodeStore *store, uint64_t page_id, uint8_t *node,
+                       enum FileErrorStatus *error);
+static CachedPage *store_page(NodeStore *store, uint64_t page_id,
+                              enum FileErrorStatus *error);
+static void read_cursor_node(BTreeCursor *cursor, uint64_t page_id,
+                             enum FileErrorStatus *error);
+static void read_node(const Database *database, uint64_t page_id,
+                      uint8_t *node, enum FileErrorStatus *error);
+static void write_node(const Database *database, uint64_t page_id,
+                       uint8_t *node, enum FileErrorStatus *error);
+static void init_node(uint8_t *node, uint64_t page_size, NodeType type,
+                      bool wide);
+static NodeType node_type(const uint8_t *node);
+static bool node_wide(const uint8_t *node);
+static uint32_t count_size(const uint8_t *node);
+static uint32_t used_offset(const uint8_t *node);
+static uint32_t next_leaf_offset(const uint8_t *node);
+static uint32_t leftmost_child_offset(const uint8_t *node);
+static uint32_t entries_offset(const uint8_t *node);
+static uint32_t node_no_entries(const uint8_t *node);
+static uint32_t node_used(const uint8_t *node);
+static uint64_t node_next_leaf(const uint8_t *node);
+static uint64_t node_leftmost_child(const uint8_t *node);
+static void update_no_entries(uint8_t *node, uint32_t no_entries);
+static void update_used(uint8_t *node, uint32_t used);
+static void update_next_leaf(uint8_t *node, uint64_t page_id);
+static void update_leftmost_child(uint8_t *node, uint64_t page_id);
+static Record record_at(const uint8_t *entry, SafeBuffer *view);
+static uint32_t entry_length(NodeType type, const uint8_t *entry);
+static int compare_entry_key(NodeType type, const uint8_t *entry,
+                             const char *key, uint32_t key_length);
+static uint64_t entry_child(const uint8_t *entry);
+static uint32_t make_inner_entry(uint8_t *entry, const char *key,
+                                 uint32_t key_length, uint64_t child);
+static uint64_t find_child(const uint8_t *node, const char *key,
+                           uint32_t key_length);
+static uint32_t leaf_position(const uint8_t *node, const char *key,
+                              uint32_t key_length, bool *found);
+static uint32_t inner_position(const uint8_t *node, const char *key,
+                               uint32_t key_length);
+static bool insert_entry(uint8_t *node, uint64_t page_size, uint32_t position,
+                         const uint8_t *entry, uint32_t length);
+static void remove_entry(uint8_t *node, uint32_t position);
+static void split_node(uint8_t *node, uint8_t *right, uint8_t *entries,
+                       uint64_t page_size, uint32_t position,
+                       const uint8_t *entry, uint32_t length, char *separator,
+                       uint32_t *separator_length);
+
+// API implementation
+
+const EngineOperations btree_engine = {.name = "btree",
+                                       .stores_data_pages = false,
+                                       .create = btree_create,
+                                       .open = NULL,
+                                       .get = btree_get,
+                                       .mget = NULL,
+                                       .put = btree_put,
+                                       .del = btree_delete,
+                                       .update = NULL,
+                                       .write_batch = btree_write_batch,
+                                       .scan = btree_scan,
+                                       .scan_range = btree_scan_range,
+                                       .stats = btree_stats,
+                                       .vacuum = NULL,
+                                       .open_view = NULL,
+                                       .scan_view = NULL,
+                                       .close_view = NULL,
+                                       .close = NULL};
+
+void btree_cursor_open(Database *database, BTreeCursor *cursor,
+                       const char *from, uint32_t from_length,
+                       enum FileErrorStatus *error) {
+  *error = success;
+  memset(cursor, 0, sizeof(BTreeCursor));
+  cursor->database = database;
+
+  cursor->node = malloc(database->page_size);
+  if (NULL == cursor->node) {
+    fprintf(stderr, "cannot allocate btree node.\n");
+    *error = failure;
+    return;
+  }
+
+  NodeStore store = {.database = database};
+  cursor->page_id =
+      descend(&store, from, from_length, cursor->node, NULL, NULL, error);
+  if (failure == *error) {
+    btree_cursor_close(cursor);
+    return;
+  }
+
+  bool _found;
+  cursor->offset = leaf_position(cursor->node, from, from_length, &_found);
+}
+
+void btree_snapshot_cursor_open(Database *database, Snapshot *snapshot,
+                                uint64_t root_page, BTreeCursor *cursor,
+                                enum FileErrorStatus *error) {
+  *error = success;
+  memset(cursor, 0, sizeof(BTreeCursor));
+  cursor->database = database;
+  cursor->snapshot = snapshot;
+
+  cursor->node = malloc(database->page_size);
+  if (NULL == cursor->node) {
+    fprintf(stderr, "cannot allocate btree node.\n");
+    *error = failure;
+    return;
+  }
+
+  cursor->page_id = root_page;
+  for (uint32_t level = 0; level < MAX_DEPTH; ++level) {
+    read_cursor_node(cursor, cursor->page_id, error);
+    if (failure == *error) {
+      btree_cursor_close(cursor);
+      return;
+    }
+    if (NODE_LEAF == node_type(cursor->node)) {
+      cursor->offset = entries_offset(cursor->node);
+      return;
+    }
+    cursor->page_id = node_leftmost_child(cursor->node);
+  }
+
+  fprintf(stderr, "btree is corrupted, maximum depth exceeded.\n");
+  *error = failure;
+  btree_cursor_close(cursor);
+}
+
+bool btree_cursor_next(BTreeCursor *cursor, Record *record,
+                       enum FileErrorStatus *error) {
+  *error = success;
+
+  while (cursor->offset >= node_used(cursor->node)) {
+    uint64_t next_leaf = node_next_leaf(cursor->node);
+    if (0 == next_leaf) {
+      return false;
+    }
+
+    read_cursor_node(cursor, next_leaf, error);
+    if (failure == *error) {
+      return false;
+    }
+    cursor->page_id = next_leaf;
+    cursor->offset = entries_offset(cursor->node);
+  }
+
+  *record = record_at(cursor->node + cursor->offset, &cursor->record_buffer);
+  cursor->offset += get_record_length(record);
+  return true;
+}
+
+void btree_cursor_close(BTreeCursor *cursor) {
+  free(cursor->node);
+  cursor->node = NULL;
+}
+
+// Local implementation
+
+static void btree_create(Database *database, uint64_t no_elements,
+                         enum FileErrorStatus *error) {
+  *error = success;
+  uint8_t *node = malloc(database->page_size);
+  if (NULL == node) {
+    fprintf(stderr, "cannot allocate btree node.\n");
+    *error = failure;
+    return;
+  }
+
+  init_node(node, database->page_size, NODE_LEAF, true);
+  write_node(database, ROOT_PAGE, node, error);
+  free(node);
+
+  database->root_page = ROOT_PAGE;
+  database->no_pages = ROOT_PAGE + 1;
+}
+
+static bool btree_get(Database *database, const char *key,
+                      uint32_t key_length, Record *record,
+                      enum FileErrorStatus *error) {
+  bool found = false;
+  uint8_t *node = malloc(database->page_size);
+  if (NULL == node) {
+    fprintf(stderr, "cannot allocate btree node.\n");
+    *error = failure;
+    return false;
+  }
+
+  NodeStore store = {.database = database};
+  descend(&store, key, key_length, node, NULL, NULL, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  uint32_t position = leaf_position(node, key, key_length, &found);
+  if (found) {
+    SafeBuffer view;
+    Record local_record = record_at(node + position, &view);
+    *record = record_clone(&local_record);
+  }
+
+cleanup_0:
+  free(node);
+  return found;
+}
+
+static void btree_put(Database *database, const Record *new_record,
+                      enum FileErrorStatus *error) {
+  uint64_t no_pages = database->no_pages;
+  NodeStore store = {.database = database};
+  insert_record(&store, new_record, error);
+  if (success == *error && no_pages != database->no_pages) {
+    database_write_header(database, error);
+  }
+}
+
+static bool btree_delete(Database *database, const char *key,
+                         uint32_t key_length, Record *record,
+                         enum FileErrorStatus *error) {
+  NodeStore store = {.database = database};
+  return remove_record(&store, key, key_length, record, error);
+}
+
+// Every entry is applied to the cached nodes, each read at most once, then
+// the changed and the new nodes are written back together, with the header
+// page when the tree grew.
+static void btree_write_batch(Database *database, const WriteBatch *write_batch,
+                              enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t no_pages = database->no_pages;
+  uint64_t root_page = database->root_page;
+  PageCache page_cache = {.pages = NULL, .no_pages = 0};
+  NodeStore store = {.database = database,
+                     .page_cache = &page_cache,
+                     .no_file_pages = no_pages};
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    if (WRITE_BATCH_PUT == entry->type) {
+      Record record = record_from_data(
+          record_safe_buffer, database_record_format(database), entry->key,
+          entry->key_length, entry->value, entry->value_length);
+      insert_record(&store, &record, error);
+    } else {
+      Record record;
+      if (remove_record(&store, entry->key, entry->key_length, &record,
+                        error)) {
+        destroy_record(&record);
+      }
+    }
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+  }
+
+  if (no_pages != database->no_pages) {
+    CachedPage *page = cached_page(database, &page_cache, 0, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+    HeaderPage header_page = open_header_page(&page->safe_buffer);
+    header_set_no_pages(&header_page, database->no_pages);
+    header_set_root_page(&header_page, database->root_page);
+    page->dirty = true;
+  }
+  write_cached_pages(database, &page_cache, error);
+
+cleanup_1:
+  free_record_buffer(record_safe_buffer);
+cleanup_0:
+  if (failure == *error) {
+    database->no_pages = no_pages;
+    database->root_page = root_page;
+  }
+  destroy_page_cache(&page_cache);
+}
+
+static void btree_scan(Database *database, ScanCallback callback,
+                       void *arguments, enum FileErrorStatus *error) {
+  btree_scan_range(database, NULL, 0, NULL, 0, callback, arguments, error);
+}
+
+// One descent to the leaf holding from, then only the leaves overlapping the
+// range are read.
+static void btree_scan_range(Database *database, const char *from,
+                             uint32_t from_length, const char *to,
+                             uint32_t to_length, ScanCallback callback,
+                             void *arguments, enum FileErrorStatus *error) {
+  BTreeCursor cursor;
+  btree_cursor_open(database, &cursor, from, from_length, error);
+  if (failure == *error) {
+    return;
+  }
+
+  Record record;
+  while (btree_cursor_next(&cursor, &record, error)) {
+    if (NULL != to && compare_keys(record_key(&record),
+                                   record_key_length(&record), to,
+                                   to_length) > 0) {
+      break;
+    }
+    callback(&record, arguments);
+  }
+
+  btree_cursor_close(&cursor);
+}
+
+static void btree_stats(Database *database, EngineStats *stats,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  uint8_t *node = malloc(database->page_size);
+  if (NULL == node) {
+    fprintf(stderr, "cannot allocate btree node.\n");
+    *error = failure;
+    return;
+  }
+
+  stats->no_pages = database->no_pages;
+  for (uint64_t page_id = 1; page_id < database->no_pages; ++page_id) {
+    read_node(database, page_id, node, error);
+    if (failure == *error) {
+      break;
+    }
+
+    uint32_t used = node_used(node);
+    stats->free_bytes += database->page_size - used;
+    if (0 == node_no_entries(node)) {
+      continue;
+    }
+
+    ++stats->no_used_pages;
+    if (NODE_LEAF == node_type(node)) {
+      stats->no_records += node_no_entries(node);
+      stats->used_bytes += used - entries_offset(node);
+    }
+  }
+
+  free(node);
+}
+
+// A full node is split in two around the middle byte and the first key of the
+// right half is inserted in the parent, up to a new root when the old one
+// splits. New nodes are appended to the file.
+static void insert_record(NodeStore *store, const Record *new_record,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  Database *database = store->database;
+  const char *key = record_key(new_record);
+  uint32_t key_length = record_key_length(new_record);
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  Record record = record_copy_into(record_safe_buffer, new_record);
+
+  uint64_t page_size = database->page_size;
+  uint8_t *node = malloc(page_size);
+  uint8_t *right = malloc(page_size);
+  uint8_t *entries = malloc(2 * page_size);
+  if (NULL == node || NULL == right || NULL == entries) {
+    fprintf(stderr, "cannot allocate btree node.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  uint64_t path[MAX_DEPTH];
+  uint32_t depth = 0;
+  uint64_t page_id = descend(store, key, key_length, node, path, &depth, error);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
+
+  bool found;
+  uint32_t position = leaf_position(node, key, key_length, &found);
+  if (found) {
+    SafeBuffer view;
+    Record old_record = record_at(node + position, &view);
+    record_set_first_timestamp(&record, record_first_timestamp(&old_record));
+    remove_entry(node, position);
+  }
+
+  uint8_t separator_entry[MAX_INNER_ENTRY_SIZE];
+  const uint8_t *entry = record_get_buffer(&record);
+  uint32_t length = get_record_length(&record);
+  while (!insert_entry(node, page_size, position, entry, length)) {
+    char separator[MAX_STRING_LENGTH + 1];
+    uint32_t separator_length;
+    uint64_t right_page_id = database->no_pages++;
+    split_node(node, right, entries, page_size, position, entry, length,
+               separator, &separator_length);
+    if (NODE_LEAF == node_type(node)) {
+      update_next_leaf(right, node_next_leaf(node));
+      update_next_leaf(node, right_page_id);
+    }
+
+    store_node(store, right_page_id, right, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+    store_node(store, page_id, node, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+
+    entry = separator_entry;
+    length = make_inner_entry(separator_entry, separator, separator_length,
+                              right_page_id);
+    if (0 == depth) {
+      init_node(node, page_size, NODE_INNER, node_wide(node));
+      update_leftmost_child(node, page_id);
+      page_id = database->no_pages++;
+      database->root_page = page_id;
+      position = entries_offset(node);
+      continue;
+    }
+
+    page_id = path[--depth];
+    load_node(store, page_id, node, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+    position = inner_position(node, separator, separator_length);
+  }
+
+  store_node(store, page_id, node, error);
+
+cleanup_1:
+  free(node);
+  free(right);
+  free(entries);
+  free_record_buffer(record_safe_buffer);
+cleanup_0:
+  return;
+}
+
+// Nodes are not merged when they run empty, the emptied leaves stay in the
+// sibling chain and are skipped by the cursor.
+static bool remove_record(NodeStore *store, const char *key,
+                          uint32_t key_length, Record *record,
+                          enum FileErrorStatus *error) {
+  bool found = false;
+  uint8_t *node = malloc(store->database->page_size);
+  if (NULL == node) {
+    fprintf(stderr, "cannot allocate btree node.\n");
+    *error = failure;
+    return false;
+  }
+
+  uint64_t page_id = descend(store, key, key_length, node, NULL, NULL, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  uint32_t position = leaf_position(node, key, key_length, &found);
+  if (!found) {
+    goto cleanup_0;
+  }
+
+  SafeBuffer view;
+  Record local_record = record_at(node + position, &view);
+  *record = record_clone(&local_record);
+  remove_entry(node, position);
+  store_node(store, page_id, node, error);
+  if (failure == *error) {
+    destroy_record(record);
+    found = false;
+  }
+
+cleanup_0:
+  free(node);
+  return found;
+}
+
+// Reads the nodes from the root to the leaf that holds key, the leftmost leaf
+// when key is NULL. The inner nodes passed are recorded in path when given.
+static uint64_t descend(NodeStore *store, const char *key, uint32_t key_length,
+                        uint8_t *node, uint64_t *path, uint32_t *depth,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t page_id = store->database->root_page;
+
+  for (uint32_t level = 0; level < MAX_DEPTH; ++level) {
+    load_node(store, page_id, node, error);
+    if (failure == *error) {
+      return page_id;
+    }
+
+    if (NODE_LEAF == node_type(node)) {
+      return page_id;
+    }
+
+    if (NULL != path) {
+      path[(*depth)++] = page_id;
+    }
+    page_id = find_child(node, key, key_length);
+  }
+
+  fprintf(stderr, "btree is corrupted, maximum depth exceeded.\n");
+  *error = failure;
+  return page_id;
+}
+
+static void load_node(NodeStore *store, uint64_t page_id, uint8_t *node,
+                      enum FileErrorStatus *error) {
+  if (NULL == store->page_cache) {
+    read_node(store->database, page_id, node, error);
+    return;
+  }
+
+  CachedPage *page = store_page(store, page_id, error);
+  if (NULL != page) {
+    memcpy(node, page->buffer, store->database->page_size);
+  }
+}
+
+static void store_node(NodeStore *store, uint64_t page_id, uint8_t *node,
+                       enum FileErrorStatus *error) {
+  if (NULL == store->page_cache) {
+    snapshot_preserve_page(store->database, page_id, error);
+    if (success == *error) {
+      write_node(store->database, page_id, node, error);
+    }
+    return;
+  }
+
+  CachedPage *page = store_page(store, page_id, error);
+  if (NULL != page) {
+    memcpy(page->buffer, node, store->database->page_size);
+    page->dirty = true;
+  }
+}
+
+// The nodes appended by the batch are not in the file yet.
+static CachedPage *store_page(NodeStore *store, uint64_t page_id,
+                              enum FileErrorStatus *error) {
+  if (page_id < store->no_file_pages) {
+    return cached_page(store->database, store->page_cache, page_id, error);
+  }
+  return new_cached_page(store->database, store->page_cache, page_id, error);
+}
+
+static void read_cursor_node(BTreeCursor *cursor, uint64_t page_id,
+                             enum FileErrorStatus *error) {
+  if (NULL != cursor->snapshot) {
+    snapshot_read_pages(cursor->snapshot, page_id, 1, cursor->node, error);
+  } else {
+    read_node(cursor->database, page_id, cursor->node, error);
+  }
+}
+
+static void read_node(const Database *database, uint64_t page_id,
+                      uint8_t *node, enum FileErrorStatus *error) {
+  SafeBuffer safe_buffer = {
+      .buffer = node, .length = 0, .capacity = database->page_size};
+  read_page_into_buffer(database->fd, page_id, &safe_buffer, error);
+}
+
+static void write_node(const Database *database, uint64_t page_id,
+                       uint8_t *node, enum FileErrorStatus *error) {
+  SafeBuffer safe_buffer = {.buffer = node,
+                            .length = database->page_size,
+                            .capacity = database->page_size};
+  write_page_to_file(database->fd, &safe_buffer, page_id, false, error);
+}
+
+static void init_node(uint8_t *node, uint64_t page_size, NodeType type,
+                      bool wide) {
+  memset(node, 0, page_size);
+  write_data_to_buffer(node, NODE_TYPE_OFFSET, NODE_TYPE_SIZE,
+                       wide ? type | NODE_WIDE : type);
+  update_used(node, entries_offset(node));
+}
+
+static NodeType node_type(const uint8_t *node) {
+  return (NodeType)(node[NODE_TYPE_OFFSET] & ~NODE_WIDE);
+}
+
+static bool node_wide(const uint8_t *node) {
+  return 0 != (node[NODE_TYPE_OFFSET] & NODE_WIDE);
+}
+
+static uint32_t count_size(const uint8_t *node) {
+  return node_wide(node) ? WIDE_COUNT_SIZE : NARROW_COUNT_SIZE;
+}
+
+static uint32_t used_offset(const uint8_t *node) {
+  return NO_ENTRIES_OFFSET + count_size(node);
+}
+
+static uint32_t next_leaf_offset(const uint8_t *node) {
+  return used_offset(node) + count_size(node);
+}
+
+static uint32_t leftmost_child_offset(const uint8_t *node) {
+  return next_leaf_offset(node) + NEXT_LEAF_SIZE;
+}
+
+static uint32_t entries_offset(const uint8_t *node) {
+  return leftmost_child_offset(node) + LEFTMOST_CHILD_SIZE;
+}
+
+static uint32_t node_no_entries(const uint8_t *node) {
+  return (uint32_t)read_data_from_buffer(node, NO_ENTRIES_OFFSET,
+                                         count_size(node));
+}
+
+static uint32_t node_used(const uint8_t *node) {
+  return (uint32_t)read_data_from_buffer(node, used_offset(node),
+                                         count_size(node));
+}
+
+static uint64_t node_next_leaf(const uint8_t *node) {
+  return read_data_from_buffer(node, next_leaf_offset(node), NEXT_LEAF_SIZE);
+}
+
+static uint64_t node_leftmost_child(const uint8_t *node) {
+  return read_data_from_buffer(node, leftmost_child_offset(node),
+                               LEFTMOST_CHILD_SIZE);
+}
+
+static void update_no_entries(uint8_t *node, uint32_t no_entries) {
+  write_data_to_buffer(node, NO_ENTRIES_OFFSET, count_size(node), no_entries);
+}
+
+static void update_used(uint8_t *node, uint32_t used) {
+  write_data_to_buffer(node, used_offset(node), count_size(node), used);
+}
+
+static void update_next_leaf(uint8_t *node, uint64_t page_id) {
+  write_data_to_buffer(node, next_leaf_offset(node), NEXT_LEAF_SIZE, page_id);
+}
+
+static void update_leftmost_child(uint8_t *node, uint64_t page_id) {
+  write_data_to_buffer(node, leftmost_child_offset(node), LEFTMOST_CHILD_SIZE,
+                       page_id);
+}
+
+static Record record_at(const uint8_t *entry, SafeBuffer *view) {
+  *view = (SafeBuffer){
+      .buffer = (uint8_t *)entry, .length = entry[0], .capacity = entry[0]};
+  return record_from_buffer(view);
+}
+
+static uint32_t entry_length(NodeType type, const uint8_t *entry) {
+  if (NODE_LEAF == type) {
+    SafeBuffer view;
+    Record record = record_at(entry, &view);
+    return get_record_length(&record);
+  }
+  return KEY_LENGTH_SIZE + entry[0] + STRING_TERMINATOR_SIZE + CHILD_SIZE;
+}
+
+static int compare_entry_key(NodeType type, const uint8_t *entry,
+                             const char *key, uint32_t key_length) {
+  if (NODE_LEAF == type) {
+    SafeBuffer view;
+    Record record = record_at(entry, &view);
+    return compare_keys(record_key(&record), record_key_length(&record), key,
+                        key_length);
+  }
+  return compare_keys((const char *)entry + KEY_LENGTH_SIZE, entry[0], key,
+                      key_length);
+}
+
+static uint64_t entry_child(const uint8_t *entry) {
+  return read_data_from_buffer(
+      entry, KEY_LENGTH_SIZE + entry[0] + STRING_TERMINATOR_SIZE, CHILD_SIZE);
+}
+
+static uint32_t make_inner_entry(uint8_t *entry, const char *key,
+                                 uint32_t key_length, uint64_t child) {
+  entry[0] = key_length;
+  memcpy(entry + KEY_LENGTH_SIZE, key, key_length);
+  entry[KEY_LENGTH_SIZE + key_length] = '\0';
+  write_data_to_buffer(entry,
+                       KEY_LENGTH_SIZE + key_length + STRING_TERMINATOR_SIZE,
+                       CHILD_SIZE, child);
+  return KEY_LENGTH_SIZE + key_length + STRING_TERMINATOR_SIZE + CHILD_SIZE;
+}
+
+static uint64_t find_child(const uint8_t *node, const char *key,
+                           uint32_t key_length) {
+  uint64_t child = node_leftmost_child(node);
+  if (NULL == key) {
+    return child;
+  }
+
+  uint32_t used = node_used(node);
+  for (uint32_t offset = entries_offset(node); offset < used;
+       offset += entry_length(NODE_INNER, node + offset)) {
+    if (compare_entry_key(NODE_INNER, node + offset, key, key_length) > 0) {
+      break;
+    }
+    child = entry_child(node + offset);
+  }
+  return child;
+}
+
+// Offset of the first record whose key is not smaller than key.
+static uint32_t leaf_position(const uint8_t *node, const char *key,
+                              uint32_t key_length, bool *found) {
+  *found = false;
+  uint32_t used = node_used(node);
+  if (NULL == key) {
+    return entries_offset(node);
+  }
+
+  uint32_t offset = entries_offset(node);
+  for (; offset < used; offset += entry_length(NODE_LEAF, node + offset)) {
+    int cmp = compare_entry_key(NODE_LEAF, node + offset, key, key_length);
+    if (cmp >= 0) {
+      *found = 0 == cmp;
+      break;
+    }
+  }
+  return offset;
+}
+
+// Offset of the first inner entry whose key is greater than key.
+static uint32_t inner_position(const uint8_t *node, const char *key,
+                               uint32_t key_length) {
+  uint32_t used = node_used(node);
+  uint32_t offset = entries_offset(node);
+  for (; offset < used; offset += entry_length(NODE_INNER, node + offset)) {
+    if (compare_entry_key(NODE_INNER, node + offset, key, key_length) > 0) {
+      break;
+    }
+  }
+  return offset;
+}
+
+static bool insert_entry(uint8_t *node, uint64_t page_size, uint32_t position,
+                         const uint8_t *entry, uint32_t length) {
+  uint32_t used = node_used(node);
+  if (used + length > page_size) {
+    return false;
+  }
+
+  memmove(node + position + length, node + position, used - position);
+  memcpy(node + position, entry, length);
+  update_used(node, used + length);
+  update_no_entries(node, node_no_entries(node) + 1);
+  return true;
+}
+
+static void remove_entry(uint8_t *node, uint32_t position) {
+  uint32_t used = node_used(node);
+  uint32_t length = entry_length(node_type(node), node + position);
+
+  memmove(node + position, node + position + length,
+          used - position - length);
+  memset(node + used - length, 0, length);
+  update_used(node, used - length);
+  update_no_entries(node, node_no_entries(node) - 1);
+}
+
+// Splits the entries of node plus the one to insert at position by bytes. A
+// leaf keeps the separator as first entry of the right node, an inner node
+// moves it up and its child becomes the leftmost child of the right node.
+// entries holds two pages.
+static void split_node(uint8_t *node, uint8_t *right, uint8_t *entries,
+                       uint64_t page_size, uint32_t position,
+                       const uint8_t *entry, uint32_t length, char *separator,
+                       uint32_t *separator_length) {
+  NodeType type = node_type(node);
+  uint32_t offset = entries_offset(node);
+  uint32_t used = node_used(node);
+  uint32_t no_entries = node_no_entries(node) + 1;
+  uint32_t total = used - offset + length;
+
+  uint32_t before = position - offset;
+  memcpy(entries, node + offset, before);
+  memcpy(entries + before, entry, length);
+  memcpy(entries + before + length, node + position, used - position);
+
+  uint32_t split = 0;
+  uint32_t no_left_entries = 0;
+  while (split < total / 2) {
+    split += entry_length(type, entries + split);
+    ++no_left_entries;
+  }
+  const uint8_t *separator_entry = entries + split;
+  if (NODE_LEAF == type) {
+    SafeBuffer view;
+    Record record = record_at(separator_entry, &view);
+    *separator_length = record_key_length(&record);
+    memcpy(separator, record_key(&record), *separator_length);
+  } else {
+    *separator_length = separator_entry[0];
+    memcpy(separator, separator_entry + KEY_LENGTH_SIZE, *separator_length);
+  }
+
+  init_node(right, page_size, type, node_wide(node));
+  uint32_t right_start = split;
+  uint32_t no_right_entries = no_entries - no_left_entries;
+  if (NODE_INNER == type) {
+    update_leftmost_child(right, entry_child(entries + split));
+    right_start += entry_length(type, entries + split);
+    --no_right_entries;
+  }
+  memcpy(right + offset, entries + right_start, total - right_start);
+  update_used(right, offset + total - right_start);
+  update_no_entries(right, no_right_entries);
+
+  memcpy(node + offset, entries, split);
+  memset(node + offset + split, 0, page_size - offset - split);
+  update_used(node, offset + split);
+  update_no_entries(node, no_left_entries);
+}
@@ -8,7 +8,7 @@
 #define POOL_SIZE 4
 
 typedef struct page_pool_entry {
-  uint8_t buffer[PAGE_SIZE];
+  uint8_t buffer[MAX_PAGE_SIZE];
   SafeBuffer safe_buffer;
   bool allocated;
 } PagePoolEntry;
@@ -19,8 +19,9 @@ typedef struct record_pool_entry {
   bool allocated;
 } RecordPoolEntry;
 
-static PagePoolEntry page_pool[POOL_SIZE];
-static RecordPoolEntry record_pool[POOL_SIZE];
+// Every thread has pools of its own, so engines may run on worker threads.
+static _Thread_local PagePoolEntry page_pool[POOL_SIZE];
+static _Thread_local RecordPoolEntry record_pool[POOL_SIZE];
 
 void set_buffer_length(SafeBuffer *safe_buffer, size_t length) {
   assert(safe_buffer);
@@ -43,12 +44,15 @@ uint8_t *get_buffer(SafeBuffer *safe_buffer) {
   return safe_buffer->buffer;
 }
 
-SafeBuffer *allocate_page_buffer(void) {
+// The capacity of the buffer is the page size, which page reads and writes go
+// by.
+SafeBuffer *allocate_page_buffer(size_t page_size) {
+  assert(page_size <= MAX_PAGE_SIZE);
   for (uint32_t i = 0; i < POOL_SIZE; ++i) {
     PagePoolEntry *pool_entry = page_pool + i;
     if (false == pool_entry->allocated) {
       SafeBuffer *safe_buffer = &pool_entry->safe_buffer;
-      safe_buffer->capacity = PAGE_SIZE;
+      safe_buffer->capacity = page_size;
       safe_buffer->buffer = pool_entry->buffer;
       pool_entry->allocated = true;
       return safe_buffer;
@@ -1,6 +1,10 @@
 #include "../include/buffer_utilities.h"
 #include "../include/constants.h"
 
+#define VARINT_BITS (7)
+#define VARINT_MASK (0x7F)
+#define VARINT_CONTINUATION (0x80)
+
 uint64_t read_data_from_buffer(const uint8_t *buffer, uint32_t offset,
                                 uint32_t size) {
   uint64_t return_value = 0;
@@ -17,3 +21,37 @@ void write_data_to_buffer(uint8_t *buffer, uint32_t offset, uint32_t size,
     data = data >> BYTE_SIZE;
   }
 }
+
+// offset is moved past the varint.
+uint64_t read_varint_from_buffer(const uint8_t *buffer, uint32_t *offset) {
+  uint64_t return_value = 0;
+  for (uint32_t shift = 0; shift < 64; shift += VARINT_BITS) {
+    uint8_t byte = buffer[(*offset)++];
+    return_value |= (uint64_t)(byte & VARINT_MASK) << shift;
+    if (0 == (byte & VARINT_CONTINUATION)) {
+      break;
+    }
+  }
+  return return_value;
+}
+
+// Returns the number of bytes written.
+uint32_t write_varint_to_buffer(uint8_t *buffer, uint32_t offset,
+                                uint64_t data) {
+  uint32_t size = 0;
+  while (data > VARINT_MASK) {
+    buffer[offset + size++] = (data & VARINT_MASK) | VARINT_CONTINUATION;
+    data = data >> VARINT_BITS;
+  }
+  buffer[offset + size++] = data;
+  return size;
+}
+
+uint32_t varint_size(uint64_t data) {
+  uint32_t size = 1;
+  while (data > VARINT_MASK) {
+    data = data >> VARINT_BITS;
+    ++size;
+  }
+  return size;
+}
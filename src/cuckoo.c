@@ -0,0 +1,591 @@
+#include "../include/cuckoo.h"
+#include "../include/buffer_manager.h"
+#include "../include/data_page.h"
+#include "../include/engine.h"
+#include "../include/file_utilities.h"
+#include "../include/keydir.h"
+#include "../include/page_cache.h"
+#include "../include/record.h"
+#include "../include/snapshot.h"
+#include "../include/xxhash.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FIRST_SEED (0x9E3779B97F4A7C15ULL)
+#define SECOND_SEED (0xC2B2AE3D27D4EB4FULL)
+#define MAX_KICKS (32)
+#define MAX_PATH_PAGES (MAX_KICKS + 2)
+
+// Pages touched by an insert are modified in memory and only written once the
+// whole kick sequence succeeded, so a failed insert leaves the file untouched.
+typedef struct {
+  CachedPage *pages[MAX_PATH_PAGES];
+  uint64_t length;
+} KickPath;
+
+// Where the pages of a write come from: the kick path of a single write,
+// locked as it grows, or the pages cached by a write batch.
+typedef struct {
+  Database *database;
+  KickPath *path;
+  PageCache *page_cache;
+} PageSource;
+
+typedef struct {
+  const DataPage *data_page;
+  uint32_t needed_space;
+  size_t free_space;
+  uint64_t random_state;
+  uint64_t no_candidates;
+  char key[MAX_STRING_LENGTH + 1];
+  uint32_t key_length;
+} VictimChoice;
+
+static bool cuckoo_get(Database *database, const char *key,
+                       uint32_t key_length, Record *record,
+                       enum FileErrorStatus *error);
+static void cuckoo_put(Database *database, const Record *new_record,
+                       enum FileErrorStatus *error);
+static bool cuckoo_delete(Database *database, const char *key,
+                          uint32_t key_length, Record *record,
+                          enum FileErrorStatus *error);
+static bool cuckoo_update(Database *database, const char *key,
+                          uint32_t key_length, UpdateCallback callback,
+                          void *arguments, enum FileErrorStatus *error);
+static void cuckoo_write_batch(Database *database,
+                               const WriteBatch *write_batch,
+                               enum FileErrorStatus *error);
+static void place_record(PageSource *source, const Record *new_record,
+                         enum FileErrorStatus *error);
+static bool remove_record(PageSource *source, const char *key,
+                          uint32_t key_length, Record *record,
+                          enum FileErrorStatus *error);
+static CachedPage *source_page(PageSource *source, uint64_t page_id,
+                               enum FileErrorStatus *error);
+static void candidate_pages(const char *key, uint32_t key_length,
+                            uint64_t no_pages, uint64_t pages[2]);
+static uint64_t alternate_page(const char *key, uint32_t key_length,
+                               uint64_t no_pages, uint64_t page_id);
+static CachedPage *load_path_page(const Database *database, KickPath *path,
+                                  uint64_t page_id,
+                                  enum FileErrorStatus *error);
+static void release_path(int fd, KickPath *path, enum FileErrorStatus *error);
+static void write_path(const Database *database, KickPath *path,
+                       enum FileErrorStatus *error);
+static bool choose_victim(const DataPage *data_page, uint32_t needed_space,
+                          uint64_t *random_state, char *key,
+                          uint32_t *key_length);
+static void consider_victim(const Record *record, uint32_t offset,
+                            void *arguments);
+static uint64_t next_random(uint64_t *random_state);
+
+// API implementation
+
+const EngineOperations cuckoo_engine = {.name = "cuckoo",
+                                        .stores_data_pages = true,
+                                        .create = create_data_pages,
+                                        .open = NULL,
+                                        .get = cuckoo_get,
+                                        .mget = NULL,
+                                        .put = cuckoo_put,
+                                        .del = cuckoo_delete,
+                                        .update = cuckoo_update,
+                                        .write_batch = cuckoo_write_batch,
+                                        .scan = scan_data_pages,
+                                        .scan_range = NULL,
+                                        .stats = data_pages_stats,
+                                        .vacuum = NULL,
+                                        .open_view = NULL,
+                                        .scan_view = NULL,
+                                        .close_view = NULL,
+                                        .close = NULL};
+
+// Local implementation
+
+static bool cuckoo_get(Database *database, const char *key,
+                       uint32_t key_length, Record *record,
+                       enum FileErrorStatus *error) {
+  *error = success;
+  bool return_value = false;
+  int fd = database->fd;
+  uint64_t no_pages = database->no_pages;
+
+  uint64_t pages[2];
+  candidate_pages(key, key_length, no_pages, pages);
+
+  // Both reads are issued up front so the second candidate is already in
+  // flight while the first one is searched.
+  for (uint32_t i = 0; i < 2; ++i) {
+    posix_fadvise(fd, pages[i] * database->page_size, database->page_size,
+                  POSIX_FADV_WILLNEED);
+  }
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (uint32_t i = 0; i < 2 && !return_value; ++i) {
+    if (1 == i && pages[0] == pages[1]) {
+      break;
+    }
+
+    read_lock_page(fd, pages[i], error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+
+    read_data_page(&database->data_pages, pages[i], safe_buffer, error);
+    if (failure == *error) {
+      unlock_page(fd, pages[i], error);
+      *error = failure;
+      goto cleanup_1;
+    }
+
+    DataPage data_page = create_data_page(safe_buffer);
+    return_value = data_page_find_entry(&data_page, key, key_length, record);
+
+    unlock_page(fd, pages[i], error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+  }
+
+cleanup_1:
+  free_page_buffer(safe_buffer);
+cleanup_0:
+  return return_value;
+}
+
+static void cuckoo_put(Database *database, const Record *new_record,
+                       enum FileErrorStatus *error) {
+  KickPath path = {.length = 0};
+  PageSource source = {.database = database, .path = &path};
+
+  place_record(&source, new_record, error);
+  if (success == *error) {
+    write_path(database, &path, error);
+  }
+  release_path(database->fd, &path, error);
+}
+
+static bool cuckoo_delete(Database *database, const char *key,
+                          uint32_t key_length, Record *record,
+                          enum FileErrorStatus *error) {
+  KickPath path = {.length = 0};
+  PageSource source = {.database = database, .path = &path};
+
+  bool found = remove_record(&source, key, key_length, record, error);
+  if (found && success == *error) {
+    if (NULL != database->keydir) {
+      keydir_remove(database->keydir, key, key_length);
+    }
+    write_path(database, &path, error);
+  }
+  release_path(database->fd, &path, error);
+  return found;
+}
+
+// The candidate page holding the key is rewritten in place when the new record
+// fits there once the current one is gone. Otherwise, and for a missing key,
+// the record is put as usual, kicking other records if need be.
+static bool cuckoo_update(Database *database, const char *key,
+                          uint32_t key_length, UpdateCallback callback,
+                          void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  bool updated = false;
+  int fd = database->fd;
+
+  KickPath path = {.length = 0};
+
+  uint64_t pages[2];
+  candidate_pages(key, key_length, database->no_pages, pages);
+
+  Record current;
+  CachedPage *path_page = NULL;
+  for (uint32_t i = 0; i < 2 && NULL == path_page; ++i) {
+    CachedPage *candidate =
+        load_path_page(database, &path, pages[i], error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+    DataPage data_page = create_data_page(&candidate->safe_buffer);
+    if (data_page_delete_entry(&data_page, key, key_length, &current)) {
+      path_page = candidate;
+    }
+  }
+
+  Record record;
+  updated = callback(NULL != path_page ? &current : NULL, &record, arguments,
+                     error);
+  if (NULL != path_page) {
+    destroy_record(&current);
+  }
+  if (!updated || failure == *error) {
+    goto cleanup_0;
+  }
+
+  if (NULL != path_page) {
+    DataPage data_page = create_data_page(&path_page->safe_buffer);
+    if (data_page_has_room(&database->data_pages, &data_page, &record)) {
+      data_page_insert_entry(&data_page, &record, path_page->page_id);
+      path_page->dirty = true;
+      write_path(database, &path, error);
+      goto cleanup_0;
+    }
+  }
+
+  release_path(fd, &path, error);
+  if (success == *error) {
+    cuckoo_put(database, &record, error);
+  }
+  return updated;
+
+cleanup_0:
+  release_path(fd, &path, error);
+  return updated;
+}
+
+// Every entry is applied in memory to the pages it touches, kicks included,
+// each page being read at most once, then the modified pages are written back
+// together.
+static void cuckoo_write_batch(Database *database,
+                               const WriteBatch *write_batch,
+                               enum FileErrorStatus *error) {
+  *error = success;
+  PageCache page_cache = {.pages = NULL, .no_pages = 0};
+  PageSource source = {.database = database, .page_cache = &page_cache};
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  for (uint64_t i = 0; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    if (WRITE_BATCH_PUT == entry->type) {
+      Record record = record_from_data(
+          record_safe_buffer, database_record_format(database), entry->key,
+          entry->key_length, entry->value, entry->value_length);
+      place_record(&source, &record, error);
+    } else {
+      Record record;
+      if (remove_record(&source, entry->key, entry->key_length, &record,
+                        error)) {
+        destroy_record(&record);
+      }
+    }
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+  write_cached_pages(database, &page_cache, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  index_cached_pages(database, &page_cache, write_batch, error);
+
+cleanup_0:
+  free_record_buffer(record_safe_buffer);
+  destroy_page_cache(&page_cache);
+}
+
+// Replaces the previous version of the key, wherever it lives, and kicks
+// records to their other candidate page until every one has room. The pages
+// are only changed in memory.
+static void place_record(PageSource *source, const Record *new_record,
+                         enum FileErrorStatus *error) {
+  *error = success;
+  const char *key = record_key(new_record);
+  uint32_t key_length = record_key_length(new_record);
+  uint64_t no_pages = source->database->no_pages;
+  const DataPageFile *data_pages = &source->database->data_pages;
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  // the image of a page is kept while its victim is tried, a compressed page
+  // may still not fit its slot with the pending record in place of the victim
+  uint8_t *image = malloc(data_pages->page_size);
+  if (NULL == image) {
+    fprintf(stderr, "cannot allocate page for insertion path.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  Record record = record_copy_into(record_safe_buffer, new_record);
+
+  uint64_t pages[2];
+  candidate_pages(key, key_length, no_pages, pages);
+
+  CachedPage *candidate_cached_pages[2];
+  DataPage candidates[2];
+  for (uint32_t i = 0; i < 2; ++i) {
+    candidate_cached_pages[i] = source_page(source, pages[i], error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+    candidates[i] = create_data_page(&candidate_cached_pages[i]->safe_buffer);
+  }
+
+  // An update keeps the creation time of the previous version.
+  for (uint32_t i = 0; i < 2; ++i) {
+    Record deleted_record;
+    if (data_page_delete_entry(candidates + i, key, key_length,
+                               &deleted_record)) {
+      candidate_cached_pages[i]->dirty = true;
+      record_set_first_timestamp(&record,
+                                 record_first_timestamp(&deleted_record));
+      destroy_record(&deleted_record);
+      break;
+    }
+  }
+
+  uint64_t page_id = data_page_free_space(candidates + 1) >
+                             data_page_free_space(candidates)
+                         ? pages[1]
+                         : pages[0];
+  uint64_t random_state = XXH3_64bits(key, key_length);
+
+  Record pending = record;
+  bool pending_is_victim = false;
+  bool placed = false;
+  for (uint32_t kicks = 0; kicks <= MAX_KICKS && !placed; ++kicks) {
+    CachedPage *page = source_page(source, page_id, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    uint32_t record_length = data_page_entry_size(&data_page, &pending);
+    if (data_page_has_room(data_pages, &data_page, &pending)) {
+      data_page_insert_entry(&data_page, &pending, page_id);
+      page->dirty = true;
+      placed = true;
+      break;
+    }
+
+    char victim_key[MAX_STRING_LENGTH + 1];
+    uint32_t victim_key_length;
+    if (kicks == MAX_KICKS ||
+        !choose_victim(&data_page, record_length, &random_state, victim_key,
+                       &victim_key_length)) {
+      break;
+    }
+
+    Record victim;
+    memcpy(image, page->buffer, data_pages->page_size);
+    data_page_delete_entry(&data_page, victim_key, victim_key_length, &victim);
+    if (!data_page_has_room(data_pages, &data_page, &pending)) {
+      memcpy(page->buffer, image, data_pages->page_size);
+      destroy_record(&victim);
+      continue;
+    }
+    data_page_insert_entry(&data_page, &pending, page_id);
+    page->dirty = true;
+    if (pending_is_victim) {
+      destroy_record(&pending);
+    }
+    pending = victim;
+    pending_is_victim = true;
+    page_id = alternate_page(victim_key, victim_key_length, no_pages, page_id);
+  }
+
+  if (!placed) {
+    fprintf(stderr, "no room left for the element, database is full.\n");
+    *error = failure;
+  }
+
+cleanup_1:
+  if (pending_is_victim) {
+    destroy_record(&pending);
+  }
+cleanup_0:
+  free(image);
+  free_record_buffer(record_safe_buffer);
+}
+
+static bool remove_record(PageSource *source, const char *key,
+                          uint32_t key_length, Record *record,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  bool found = false;
+
+  uint64_t pages[2];
+  candidate_pages(key, key_length, source->database->no_pages, pages);
+
+  for (uint32_t i = 0; i < 2 && !found; ++i) {
+    CachedPage *page = source_page(source, pages[i], error);
+    if (failure == *error) {
+      return false;
+    }
+
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    found = data_page_delete_entry(&data_page, key, key_length, record);
+    page->dirty |= found;
+  }
+  return found;
+}
+
+static CachedPage *source_page(PageSource *source, uint64_t page_id,
+                               enum FileErrorStatus *error) {
+  if (NULL != source->page_cache) {
+    return cached_page(source->database, source->page_cache, page_id, error);
+  }
+  return load_path_page(source->database, source->path, page_id, error);
+}
+
+static void candidate_pages(const char *key, uint32_t key_length,
+                            uint64_t no_pages, uint64_t pages[2]) {
+  uint64_t no_data_pages = no_pages - 1;
+  uint64_t seeds[2] = {FIRST_SEED, SECOND_SEED};
+  for (uint32_t i = 0; i < 2; ++i) {
+    XXH64_hash_t hash = XXH3_64bits_withSeed(key, key_length, seeds[i]);
+    pages[i] =
+        (uint64_t)(((unsigned __int128)hash * no_data_pages) >> 64) + 1;
+  }
+}
+
+static uint64_t alternate_page(const char *key, uint32_t key_length,
+                               uint64_t no_pages, uint64_t page_id) {
+  uint64_t pages[2];
+  candidate_pages(key, key_length, no_pages, pages);
+  return pages[0] == page_id ? pages[1] : pages[0];
+}
+
+// Pages are write locked the first time they join the path and stay locked
+// until the path is released.
+static CachedPage *load_path_page(const Database *database, KickPath *path,
+                                  uint64_t page_id,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+
+  for (uint64_t i = 0; i < path->length; ++i) {
+    if (path->pages[i]->page_id == page_id) {
+      return path->pages[i];
+    }
+  }
+
+  if (MAX_PATH_PAGES == path->length) {
+    *error = failure;
+    return NULL;
+  }
+
+  int fd = database->fd;
+  uint64_t page_size = database->data_pages.page_size;
+  CachedPage *page = malloc(sizeof(CachedPage) + page_size);
+  if (NULL == page) {
+    fprintf(stderr, "cannot allocate page for insertion path.\n");
+    *error = failure;
+    return NULL;
+  }
+  page->page_id = page_id;
+  page->dirty = false;
+  page->safe_buffer = (SafeBuffer){
+      .buffer = page->buffer, .length = 0, .capacity = page_size};
+
+  write_lock_page(fd, page_id, error);
+  if (failure == *error) {
+    free(page);
+    return NULL;
+  }
+  path->pages[path->length++] = page;
+
+  read_data_page(&database->data_pages, page_id, &page->safe_buffer, error);
+  if (failure == *error) {
+    return NULL;
+  }
+
+  return page;
+}
+
+static void release_path(int fd, KickPath *path, enum FileErrorStatus *error) {
+  enum FileErrorStatus unlock_error = success;
+  for (uint64_t i = 0; i < path->length; ++i) {
+    unlock_page(fd, path->pages[i]->page_id, &unlock_error);
+    free(path->pages[i]);
+    if (failure == unlock_error) {
+      *error = failure;
+    }
+  }
+  path->length = 0;
+}
+
+static void write_path(const Database *database, KickPath *path,
+                       enum FileErrorStatus *error) {
+  for (uint64_t i = 0; i < path->length; ++i) {
+    CachedPage *page = path->pages[i];
+    if (!page->dirty) {
+      continue;
+    }
+
+    snapshot_preserve_page(database, page->page_id, error);
+    if (failure == *error) {
+      return;
+    }
+    write_data_page(&database->data_pages, &page->safe_buffer, page->page_id,
+                    error);
+    if (failure == *error) {
+      return;
+    }
+
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    if (NULL != database->keydir &&
+        !keydir_index_page(database->keydir, page->page_id, &data_page)) {
+      *error = failure;
+      return;
+    }
+  }
+}
+
+// Picks, uniformly at random, a record whose eviction makes room for the
+// pending one.
+static bool choose_victim(const DataPage *data_page, uint32_t needed_space,
+                          uint64_t *random_state, char *key,
+                          uint32_t *key_length) {
+  VictimChoice choice = {.data_page = data_page,
+                         .needed_space = needed_space,
+                         .free_space = data_page_free_space(data_page),
+                         .random_state = *random_state,
+                         .no_candidates = 0};
+  data_page_for_each_entry(data_page, consider_victim, &choice);
+  *random_state = choice.random_state;
+  if (0 == choice.no_candidates) {
+    return false;
+  }
+  memcpy(key, choice.key, choice.key_length);
+  *key_length = choice.key_length;
+  return true;
+}
+
+static void consider_victim(const Record *record, uint32_t offset,
+                            void *arguments) {
+  VictimChoice *choice = arguments;
+  size_t stored_size = data_page_stored_entry_size(choice->data_page, offset);
+  if (choice->free_space + stored_size <= choice->needed_space) {
+    return;
+  }
+
+  ++choice->no_candidates;
+  if (0 == next_random(&choice->random_state) % choice->no_candidates) {
+    choice->key_length = record_key_length(record);
+    memcpy(choice->key, record_key(record), choice->key_length);
+  }
+}
+
+static uint64_t next_random(uint64_t *random_state) {
+  uint64_t x = *random_state ? *random_state : FIRST_SEED;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *random_state = x;
+  return x;
+}
@@ -1,14 +1,30 @@
 #include "../include/data_page.h"
 #include "../include/buffer_manager.h"
 #include "../include/buffer_utilities.h"
+#include "../include/file_utilities.h"
 #include "../include/record.h"
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // hash (8 bytes) | free_page (1 byte) | no_entries (2 bytes) | free space (2
-// bytes) | data (4083 bytes)
+// bytes) | data (page size - 13 bytes)
+//
+// A page is as large as the capacity of its buffer, the free space of an
+// empty 64 KiB page still fits 2 bytes.
+//
+// The data of a page of compact records starts with an anchor, the key of the
+// record that first went into the empty page: length (1 byte) | ANCHOR_FLAG (1
+// byte) | key. Compact records store their key relative to it, leaving out the
+// bytes they share with the anchor. The second byte of a record is never
+// ANCHOR_FLAG. The anchor stays when its record is deleted and only goes with
+// the last record of the page.
+//
+// The slot of a compressed page keeps the header of the page, then compressed
+// length (2 bytes) | the used data of the page, compressed. The free space of
+// the header gives the length of the data once expanded.
 
 #define BYTE_SIZE (8)
 
@@ -26,27 +42,57 @@
 
 #define DATA_OFFSET (FREE_SPACE_OFFSET + FREE_SPACE_SIZE)
 
+#define ANCHOR_FLAG (0x40)
+#define ANCHOR_KEY_OFFSET (2)
+
+#define COMPRESSED_LENGTH_SIZE (2)
+#define COMPRESSED_LENGTH_OFFSET (DATA_OFFSET)
+#define COMPRESSED_DATA_OFFSET                                                 \
+  (COMPRESSED_LENGTH_OFFSET + COMPRESSED_LENGTH_SIZE)
+
+// Left free in a slot when a record goes into its page, the page may compress
+// a few bytes worse once records around it are deleted.
+#define SLOT_RESERVE (64)
+
 static void assert_data_page(const DataPage *data_page);
+static uint32_t page_size(const DataPage *data_page);
 static uint32_t free_spot(const DataPage *data_page);
 static void update_no_entries(DataPage *data_page, size_t no_entries);
 static void update_is_free_page(DataPage *data_page, bool is_free);
 static void update_free_space(DataPage *data_page, size_t free_space);
 static void update_hash(DataPage *data_page, uint64_t hash);
+static bool page_anchor(const DataPage *data_page, const char **key,
+                        uint32_t *key_length);
+static uint32_t first_entry(const DataPage *data_page);
+static uint32_t common_prefix_length(const char *key, uint32_t key_length,
+                                     const char *other_key,
+                                     uint32_t other_key_length);
+static bool entry_has_key(const uint8_t *entry, const char *key,
+                          uint32_t key_length, uint32_t shared_with_anchor);
+static Record read_entry(const DataPage *data_page, uint32_t offset,
+                         uint8_t *expanded, SafeBuffer *safe_buffer);
+static uint32_t encode_entry(const DataPage *data_page, const Record *record,
+                             uint8_t *entry, uint32_t *anchor_length);
+static bool compress_page(const DataPageFile *file, const uint8_t *page,
+                          uint8_t *slot, uint32_t reserve);
+static void read_slot(const DataPageFile *file, uint64_t page_id,
+                      bool locked, SafeBuffer *safe_buffer,
+                      enum FileErrorStatus *error);
 
 DataPage data_page_from_data(SafeBuffer *safe_buffer, uint64_t page_id) {
   assert(safe_buffer);
-  set_buffer_length(safe_buffer, DATA_PAGE_SIZE);
+  set_buffer_length(safe_buffer, get_buffer_capacity(safe_buffer));
   uint8_t *buffer = get_buffer(safe_buffer);
   memset(buffer, 0, get_buffer_capacity(safe_buffer));
   DataPage data_page = {.safe_buffer = safe_buffer};
   update_is_free_page(&data_page, true);
-  update_free_space(&data_page, DATA_PAGE_SIZE - DATA_OFFSET);
+  update_free_space(&data_page, page_size(&data_page) - DATA_OFFSET);
   update_hash(&data_page, page_id);
   return data_page;
 }
 
 DataPage create_data_page(SafeBuffer *safe_buffer) {
-  assert(get_buffer_capacity(safe_buffer) >= DATA_PAGE_SIZE);
+  assert(get_buffer_capacity(safe_buffer) >= MIN_PAGE_SIZE);
   return (DataPage){.safe_buffer = safe_buffer};
 }
 
@@ -76,19 +122,50 @@ uint64_t data_page_hash(const DataPage *data_page) {
   return (uint64_t)read_data_from_buffer(buffer, HASH_OFFSET, HASH_SIZE);
 }
 
+size_t data_page_used_space(const DataPage *data_page) {
+  return page_size(data_page) - DATA_OFFSET - data_page_free_space(data_page);
+}
+
+// Bytes the record takes once inserted, counting the anchor it brings to an
+// empty page.
+size_t data_page_entry_size(const DataPage *data_page, const Record *record) {
+  assert_data_page(data_page);
+  assert(record);
+  uint8_t entry[RECORD_SIZE_ESTIMATE];
+  uint32_t anchor_length;
+  uint32_t entry_length =
+      encode_entry(data_page, record, entry, &anchor_length);
+  return anchor_length + entry_length;
+}
+
+size_t data_page_stored_entry_size(const DataPage *data_page,
+                                   uint32_t offset) {
+  assert_data_page(data_page);
+  const uint8_t *buffer = get_buffer(data_page->safe_buffer);
+  return buffer[offset];
+}
+
 static bool find_entry(const DataPage *data_page, const char *key,
-                       Record *record, uint32_t *index) {
-  uint32_t data_offset = DATA_OFFSET;
+                       uint32_t key_length, Record *record, uint32_t *index) {
+  uint32_t data_offset = first_entry(data_page);
   uint8_t *buffer = get_buffer(data_page->safe_buffer);
 
-  while (data_offset < DATA_PAGE_SIZE && buffer[data_offset] != 0) {
-    SafeBuffer safe_buffer = (SafeBuffer){.buffer = buffer + data_offset,
-                                          .length = buffer[data_offset],
-                                          .capacity = buffer[data_offset]};
-    Record local_record = record_from_buffer(&safe_buffer);
-    const char *local_key = record_key(&local_record);
-    int cmp = strncmp(local_key, key, MAX_STRING_LENGTH);
-    if (0 == cmp) {
+  // Computed once, a record stored relative to the anchor then matches on its
+  // shared length and suffix alone.
+  const char *anchor_key = NULL;
+  uint32_t anchor_key_length = 0;
+  page_anchor(data_page, &anchor_key, &anchor_key_length);
+  uint32_t shared_with_anchor =
+      common_prefix_length(key, key_length, anchor_key, anchor_key_length);
+
+  uint32_t size = page_size(data_page);
+  while (data_offset < size && buffer[data_offset] != 0) {
+    if (entry_has_key(buffer + data_offset, key, key_length,
+                      shared_with_anchor)) {
+      uint8_t expanded[RECORD_SIZE_ESTIMATE];
+      SafeBuffer safe_buffer;
+      Record local_record =
+          read_entry(data_page, data_offset, expanded, &safe_buffer);
       *record = record_clone(&local_record);
       *index = data_offset;
       return true;
@@ -100,21 +177,91 @@ static bool find_entry(const DataPage *data_page, const char *key,
 }
 
 bool data_page_find_entry(const DataPage *data_page, const char *key,
-                          Record *record) {
+                          uint32_t key_length, Record *record) {
   assert_data_page(data_page);
   assert(key);
   uint32_t _index;
 
-  return find_entry(data_page, key, record, &_index);
+  return find_entry(data_page, key, key_length, record, &_index);
+}
+
+bool data_page_entry_at(const DataPage *data_page, uint32_t offset,
+                        const char *key, uint32_t key_length, Record *record) {
+  assert_data_page(data_page);
+  assert(key);
+
+  uint8_t *buffer = get_buffer(data_page->safe_buffer);
+  if (offset < first_entry(data_page) || offset >= free_spot(data_page) ||
+      buffer[offset] == 0) {
+    return false;
+  }
+
+  const char *anchor_key = NULL;
+  uint32_t anchor_key_length = 0;
+  page_anchor(data_page, &anchor_key, &anchor_key_length);
+  if (!entry_has_key(buffer + offset, key, key_length,
+                     common_prefix_length(key, key_length, anchor_key,
+                                          anchor_key_length))) {
+    return false;
+  }
+
+  uint8_t expanded[RECORD_SIZE_ESTIMATE];
+  SafeBuffer safe_buffer;
+  Record local_record = read_entry(data_page, offset, expanded, &safe_buffer);
+  *record = record_clone(&local_record);
+  return true;
+}
+
+// Record at offset, 0 for the first one, copied into view, which holds
+// RECORD_SIZE_ESTIMATE bytes, and offset moved to the following record.
+bool data_page_next_entry(const DataPage *data_page, uint32_t *offset,
+                          SafeBuffer *view, Record *record) {
+  assert_data_page(data_page);
+  assert(offset);
+  assert(get_buffer_capacity(view) >= RECORD_SIZE_ESTIMATE);
+
+  uint8_t *buffer = get_buffer(data_page->safe_buffer);
+  uint32_t first = first_entry(data_page);
+  *offset = *offset < first ? first : *offset;
+  if (*offset >= page_size(data_page) || buffer[*offset] == 0) {
+    return false;
+  }
+
+  uint8_t expanded[RECORD_SIZE_ESTIMATE];
+  SafeBuffer safe_buffer;
+  Record local_record = read_entry(data_page, *offset, expanded, &safe_buffer);
+  *record = record_copy_into(view, &local_record);
+  *offset += buffer[*offset];
+  return true;
+}
+
+void data_page_for_each_entry(const DataPage *data_page,
+                              DataPageEntryCallback callback,
+                              void *arguments) {
+  assert_data_page(data_page);
+  assert(callback);
+
+  uint32_t data_offset = first_entry(data_page);
+  uint8_t *buffer = get_buffer(data_page->safe_buffer);
+
+  uint32_t size = page_size(data_page);
+  while (data_offset < size && buffer[data_offset] != 0) {
+    uint8_t expanded[RECORD_SIZE_ESTIMATE];
+    SafeBuffer safe_buffer;
+    Record local_record =
+        read_entry(data_page, data_offset, expanded, &safe_buffer);
+    callback(&local_record, data_offset, arguments);
+    data_offset += buffer[data_offset];
+  }
 }
 
 bool data_page_delete_entry(DataPage *data_page, const char *key,
-                            Record *record) {
+                            uint32_t key_length, Record *record) {
   assert_data_page(data_page);
   assert(key);
 
   uint32_t index;
-  bool found_entry = find_entry(data_page, key, record, &index);
+  bool found_entry = find_entry(data_page, key, key_length, record, &index);
   uint8_t *buffer = get_buffer(data_page->safe_buffer);
   if (found_entry) {
     uint32_t first_free_spot = free_spot(data_page);
@@ -129,6 +276,10 @@ bool data_page_delete_entry(DataPage *data_page, const char *key,
     update_free_space(data_page, free_space + record_length);
     uint32_t new_first_free_spot = free_spot(data_page);
     memset(buffer + new_first_free_spot, 0, record_length);
+    if (1 == no_entries) {
+      memset(buffer + DATA_OFFSET, 0, page_size(data_page) - DATA_OFFSET);
+      update_free_space(data_page, page_size(data_page) - DATA_OFFSET);
+    }
     return true;
   }
   return false;
@@ -141,12 +292,22 @@ bool data_page_insert_entry(DataPage *data_page, const Record *record,
 
   uint8_t *buffer = get_buffer(data_page->safe_buffer);
   size_t free_space = data_page_free_space(data_page);
-  uint32_t record_length = get_record_length(record);
+  uint8_t entry[RECORD_SIZE_ESTIMATE];
+  uint32_t anchor_length;
+  uint32_t entry_length =
+      encode_entry(data_page, record, entry, &anchor_length);
+  uint32_t record_length = anchor_length + entry_length;
   if (record_length > free_space) {
     return false;
   }
-  uint32_t first_free_spot = free_spot(data_page);
-  memcpy(buffer + first_free_spot, record_get_buffer(record), record_length);
+  if (0 != anchor_length) {
+    buffer[DATA_OFFSET] = anchor_length;
+    buffer[DATA_OFFSET + 1] = ANCHOR_FLAG;
+    memcpy(buffer + DATA_OFFSET + ANCHOR_KEY_OFFSET, record_key(record),
+           anchor_length - ANCHOR_KEY_OFFSET);
+  }
+  uint32_t first_free_spot = free_spot(data_page) + anchor_length;
+  memcpy(buffer + first_free_spot, entry, entry_length);
   size_t no_entries = data_page_no_entries(data_page);
   update_no_entries(data_page, no_entries + 1);
   if (1 == no_entries) {
@@ -168,6 +329,128 @@ const uint8_t *data_page_buffer(DataPage *data_page) {
   return buffer;
 }
 
+DataPageFile data_page_file(int fd, uint64_t slot_size, PageCodec codec) {
+  uint64_t page_size = slot_size;
+  if (PAGE_CODEC_NONE != codec) {
+    page_size *= COMPRESSED_PAGE_RATIO;
+  }
+  return (DataPageFile){.fd = fd,
+                        .slot_size = slot_size,
+                        .page_size = page_size,
+                        .codec = codec};
+}
+
+// Records that cannot take more than the slot once compressed are let in
+// without compressing the page.
+bool data_page_has_room(const DataPageFile *file, const DataPage *data_page,
+                        const Record *record) {
+  assert_data_page(data_page);
+  assert(record);
+
+  size_t entry_size = data_page_entry_size(data_page, record);
+  if (entry_size >= data_page_free_space(data_page)) {
+    return false;
+  }
+  if (PAGE_CODEC_NONE == file->codec) {
+    return true;
+  }
+  uint32_t capacity = file->slot_size - COMPRESSED_DATA_OFFSET - SLOT_RESERVE;
+  uint32_t length = data_page_used_space(data_page) + entry_size;
+  if (page_codec_bound(file->codec, length) <= capacity) {
+    return true;
+  }
+
+  uint8_t *copy = malloc(file->page_size + file->slot_size);
+  if (NULL == copy) {
+    fprintf(stderr, "cannot allocate page.\n");
+    return false;
+  }
+  memcpy(copy, get_buffer(data_page->safe_buffer), file->page_size);
+  SafeBuffer safe_buffer = {.buffer = copy,
+                            .length = file->page_size,
+                            .capacity = file->page_size};
+  DataPage trial = {.safe_buffer = &safe_buffer};
+  data_page_insert_entry(&trial, record, data_page_hash(data_page));
+  bool fits =
+      compress_page(file, copy, copy + file->page_size, SLOT_RESERVE);
+  free(copy);
+  return fits;
+}
+
+void read_data_page(const DataPageFile *file, uint64_t page_id,
+                    SafeBuffer *safe_buffer, enum FileErrorStatus *error) {
+  read_slot(file, page_id, false, safe_buffer, error);
+}
+
+void locked_read_data_page(const DataPageFile *file, uint64_t page_id,
+                           SafeBuffer *safe_buffer,
+                           enum FileErrorStatus *error) {
+  read_slot(file, page_id, true, safe_buffer, error);
+}
+
+void write_data_page(const DataPageFile *file, SafeBuffer *safe_buffer,
+                     uint64_t page_id, enum FileErrorStatus *error) {
+  *error = success;
+  assert(get_buffer_capacity(safe_buffer) == file->page_size);
+
+  if (PAGE_CODEC_NONE == file->codec) {
+    write_page_to_file(file->fd, safe_buffer, page_id, false, error);
+    return;
+  }
+
+  uint8_t *slot = malloc(file->slot_size);
+  if (NULL == slot) {
+    fprintf(stderr, "cannot allocate page.\n");
+    *error = failure;
+    return;
+  }
+  if (encode_data_page(file, get_buffer(safe_buffer), slot)) {
+    SafeBuffer slot_buffer = {.buffer = slot,
+                              .length = file->slot_size,
+                              .capacity = file->slot_size};
+    write_page_to_file(file->fd, &slot_buffer, page_id, false, error);
+  } else {
+    *error = failure;
+  }
+  free(slot);
+}
+
+bool encode_data_page(const DataPageFile *file, const uint8_t *page,
+                      uint8_t *slot) {
+  if (!compress_page(file, page, slot, 0)) {
+    fprintf(stderr, "data page does not fit its slot.\n");
+    return false;
+  }
+  return true;
+}
+
+bool decode_data_page(const DataPageFile *file, const uint8_t *slot,
+                      uint8_t *page) {
+  if (PAGE_CODEC_NONE == file->codec) {
+    memcpy(page, slot, file->page_size);
+    return true;
+  }
+
+  uint32_t free_space =
+      read_data_from_buffer(slot, FREE_SPACE_OFFSET, FREE_SPACE_SIZE);
+  uint32_t compressed_length = read_data_from_buffer(
+      slot, COMPRESSED_LENGTH_OFFSET, COMPRESSED_LENGTH_SIZE);
+  if (free_space > file->page_size - DATA_OFFSET ||
+      compressed_length > file->slot_size - COMPRESSED_DATA_OFFSET) {
+    fprintf(stderr, "corrupt compressed page.\n");
+    return false;
+  }
+  uint32_t length = file->page_size - DATA_OFFSET - free_space;
+  if (!page_codec_decompress(file->codec, slot + COMPRESSED_DATA_OFFSET,
+                             compressed_length, page + DATA_OFFSET, length)) {
+    fprintf(stderr, "corrupt compressed page.\n");
+    return false;
+  }
+  memcpy(page, slot, DATA_OFFSET);
+  memset(page + DATA_OFFSET + length, 0, free_space);
+  return true;
+}
+
 static void assert_data_page(const DataPage *data_page) {
   assert(data_page);
   assert(data_page->safe_buffer);
@@ -176,7 +459,11 @@ static void assert_data_page(const DataPage *data_page) {
 static uint32_t free_spot(const DataPage *data_page) {
   size_t free_space = data_page_free_space(data_page);
   assert(free_space > 0);
-  return (DATA_PAGE_SIZE - free_space);
+  return (page_size(data_page) - free_space);
+}
+
+static uint32_t page_size(const DataPage *data_page) {
+  return (uint32_t)get_buffer_capacity(data_page->safe_buffer);
 }
 
 static void update_no_entries(DataPage *data_page, size_t no_entries) {
@@ -198,3 +485,162 @@ static void update_hash(DataPage *data_page, uint64_t hash) {
   uint8_t *buffer = get_buffer(data_page->safe_buffer);
   write_data_to_buffer(buffer, HASH_OFFSET, HASH_SIZE, hash);
 }
+
+static bool page_anchor(const DataPage *data_page, const char **key,
+                        uint32_t *key_length) {
+  uint8_t *buffer = get_buffer(data_page->safe_buffer);
+  if (0 == buffer[DATA_OFFSET] || ANCHOR_FLAG != buffer[DATA_OFFSET + 1]) {
+    return false;
+  }
+  *key = (const char *)buffer + DATA_OFFSET + ANCHOR_KEY_OFFSET;
+  *key_length = buffer[DATA_OFFSET] - ANCHOR_KEY_OFFSET;
+  return true;
+}
+
+static uint32_t first_entry(const DataPage *data_page) {
+  const uint8_t *buffer = get_buffer(data_page->safe_buffer);
+  const char *key;
+  uint32_t key_length;
+  return page_anchor(data_page, &key, &key_length)
+             ? DATA_OFFSET + buffer[DATA_OFFSET]
+             : DATA_OFFSET;
+}
+
+static uint32_t common_prefix_length(const char *key, uint32_t key_length,
+                                     const char *other_key,
+                                     uint32_t other_key_length) {
+  uint32_t length =
+      key_length < other_key_length ? key_length : other_key_length;
+  uint32_t shared = 0;
+  while (shared < length && key[shared] == other_key[shared]) {
+    ++shared;
+  }
+  return shared;
+}
+
+// Compares the stored form, without expanding records kept relative to the
+// anchor. shared_with_anchor is the length of the prefix key shares with it.
+static bool entry_has_key(const uint8_t *entry, const char *key,
+                          uint32_t key_length, uint32_t shared_with_anchor) {
+  if (!record_entry_has_shared_prefix(entry)) {
+    SafeBuffer safe_buffer = (SafeBuffer){
+        .buffer = (uint8_t *)entry, .length = entry[0], .capacity = entry[0]};
+    Record record = record_from_buffer(&safe_buffer);
+    return record_has_key(&record, key, key_length);
+  }
+
+  uint32_t shared, suffix_length;
+  const char *suffix = record_entry_key_suffix(entry, &shared, &suffix_length);
+  return shared + suffix_length == key_length && shared <= shared_with_anchor &&
+         0 == memcmp(key + shared, suffix, suffix_length);
+}
+
+// Views the record at offset in place, or expands it into expanded when it is
+// stored relative to the anchor.
+static Record read_entry(const DataPage *data_page, uint32_t offset,
+                         uint8_t *expanded, SafeBuffer *safe_buffer) {
+  uint8_t *buffer = get_buffer(data_page->safe_buffer);
+  const char *anchor_key;
+  uint32_t anchor_key_length;
+  if (record_entry_has_shared_prefix(buffer + offset) &&
+      page_anchor(data_page, &anchor_key, &anchor_key_length)) {
+    *safe_buffer = (SafeBuffer){.buffer = expanded,
+                                .length = 0,
+                                .capacity = RECORD_SIZE_ESTIMATE};
+    return record_expand_shared_prefix(safe_buffer, buffer + offset,
+                                       anchor_key);
+  }
+
+  *safe_buffer = (SafeBuffer){.buffer = buffer + offset,
+                              .length = buffer[offset],
+                              .capacity = buffer[offset]};
+  return record_from_buffer(safe_buffer);
+}
+
+// entry receives the record as stored in the page, anchor_length the length
+// of the anchor the record brings to an empty page, 0 if none.
+static uint32_t encode_entry(const DataPage *data_page, const Record *record,
+                             uint8_t *entry, uint32_t *anchor_length) {
+  *anchor_length = 0;
+  const char *key = record_key(record);
+  uint32_t key_length = record_key_length(record);
+  const char *anchor_key;
+  uint32_t anchor_key_length;
+  uint32_t entry_length = 0;
+  if (0 == data_page_no_entries(data_page)) {
+    entry_length = record_encode_shared_prefix(record, key_length, entry);
+    *anchor_length = 0 != entry_length ? ANCHOR_KEY_OFFSET + key_length : 0;
+  } else if (page_anchor(data_page, &anchor_key, &anchor_key_length)) {
+    uint32_t shared = common_prefix_length(key, key_length, anchor_key,
+                                           anchor_key_length);
+    entry_length = record_encode_shared_prefix(record, shared, entry);
+  }
+
+  if (0 == entry_length) {
+    entry_length = get_record_length(record);
+    memcpy(entry, record_get_buffer(record), entry_length);
+  }
+  return entry_length;
+}
+
+// reserve bytes of the slot are left unused.
+static bool compress_page(const DataPageFile *file, const uint8_t *page,
+                          uint8_t *slot, uint32_t reserve) {
+  if (PAGE_CODEC_NONE == file->codec) {
+    memcpy(slot, page, file->slot_size);
+    return true;
+  }
+
+  uint32_t free_space =
+      read_data_from_buffer(page, FREE_SPACE_OFFSET, FREE_SPACE_SIZE);
+  uint32_t length = file->page_size - DATA_OFFSET - free_space;
+  uint32_t compressed_length = page_codec_compress(
+      file->codec, page + DATA_OFFSET, length, slot + COMPRESSED_DATA_OFFSET,
+      file->slot_size - COMPRESSED_DATA_OFFSET - reserve);
+  if (0 == compressed_length) {
+    return false;
+  }
+
+  memcpy(slot, page, DATA_OFFSET);
+  write_data_to_buffer(slot, COMPRESSED_LENGTH_OFFSET, COMPRESSED_LENGTH_SIZE,
+                       compressed_length);
+  uint32_t end = COMPRESSED_DATA_OFFSET + compressed_length;
+  memset(slot + end, 0, file->slot_size - end);
+  return true;
+}
+
+static void read_slot(const DataPageFile *file, uint64_t page_id,
+                      bool locked, SafeBuffer *safe_buffer,
+                      enum FileErrorStatus *error) {
+  *error = success;
+  assert(get_buffer_capacity(safe_buffer) == file->page_size);
+
+  if (PAGE_CODEC_NONE == file->codec) {
+    if (locked) {
+      locked_read_page_into_buffer(file->fd, page_id, safe_buffer, error);
+    } else {
+      read_page_into_buffer(file->fd, page_id, safe_buffer, error);
+    }
+    return;
+  }
+
+  uint8_t *slot = malloc(file->slot_size);
+  if (NULL == slot) {
+    fprintf(stderr, "cannot allocate page.\n");
+    *error = failure;
+    return;
+  }
+  SafeBuffer slot_buffer = {
+      .buffer = slot, .length = 0, .capacity = file->slot_size};
+  if (locked) {
+    locked_read_page_into_buffer(file->fd, page_id, &slot_buffer, error);
+  } else {
+    read_page_into_buffer(file->fd, page_id, &slot_buffer, error);
+  }
+  if (success == *error &&
+      !decode_data_page(file, slot, get_buffer(safe_buffer))) {
+    *error = failure;
+  }
+  set_buffer_length(safe_buffer, file->page_size);
+  free(slot);
+}
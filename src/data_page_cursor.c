@@ -0,0 +1,200 @@
+#include "../include/data_page_cursor.h"
+#include "../include/data_page.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Pages read per pread, large enough to stream the file.
+#define CURSOR_CHUNK_PAGES (64)
+#define MAX_SCAN_THREADS (64)
+
+typedef struct {
+  const Database *database;
+  uint64_t from_page;
+  uint64_t to_page;
+  ScanCallback callback;
+  void *arguments;
+  bool failed;
+} ScanTask;
+
+static bool read_chunk(DataPageCursor *cursor, enum FileErrorStatus *error);
+static void *scan_range_of_pages(void *arguments);
+
+// API implementation
+
+void data_page_cursor_open(DataPageCursor *cursor, const Database *database,
+                           uint64_t from_page, uint64_t to_page,
+                           enum FileErrorStatus *error) {
+  *error = success;
+
+  from_page = from_page < 1 ? 1 : from_page;
+  to_page = to_page > database->no_pages ? database->no_pages : to_page;
+  const DataPageFile *file = &database->data_pages;
+  uint64_t expanded_size =
+      PAGE_CODEC_NONE == file->codec ? 0 : file->page_size;
+  *cursor = (DataPageCursor){
+      .file = *file,
+      .snapshot = NULL,
+      .page_id = from_page,
+      .to_page = to_page,
+      .buffer = malloc(CURSOR_CHUNK_PAGES * file->slot_size + expanded_size),
+      .no_buffered = 0,
+      .index = 0,
+      .offset = 0};
+  if (NULL == cursor->buffer) {
+    fprintf(stderr, "cannot allocate cursor buffer.\n");
+    *error = failure;
+    return;
+  }
+  cursor->expanded = cursor->buffer + CURSOR_CHUNK_PAGES * file->slot_size;
+}
+
+bool data_page_cursor_next(DataPageCursor *cursor, Record *record,
+                           enum FileErrorStatus *error) {
+  *error = success;
+
+  while (true) {
+    if (cursor->index == cursor->no_buffered && !read_chunk(cursor, error)) {
+      return false;
+    }
+
+    uint64_t slot_size = cursor->file.slot_size;
+    uint8_t *slot = cursor->buffer + cursor->index * slot_size;
+    cursor->page = (SafeBuffer){
+        .buffer = slot, .length = slot_size, .capacity = slot_size};
+    cursor->view = (SafeBuffer){.buffer = cursor->record,
+                                .length = 0,
+                                .capacity = RECORD_SIZE_ESTIMATE};
+    DataPage data_page = create_data_page(&cursor->page);
+    bool is_free_page = data_page_is_free_page(&data_page);
+    // a page is expanded when its first record is read
+    if (!is_free_page && PAGE_CODEC_NONE != cursor->file.codec) {
+      if (0 == cursor->offset &&
+          !decode_data_page(&cursor->file, slot, cursor->expanded)) {
+        *error = failure;
+        return false;
+      }
+      cursor->page = (SafeBuffer){.buffer = cursor->expanded,
+                                  .length = cursor->file.page_size,
+                                  .capacity = cursor->file.page_size};
+    }
+    if (!is_free_page &&
+        data_page_next_entry(&data_page, &cursor->offset, &cursor->view,
+                             record)) {
+      return true;
+    }
+
+    ++cursor->index;
+    cursor->offset = 0;
+  }
+}
+
+void data_page_cursor_close(DataPageCursor *cursor) {
+  free(cursor->buffer);
+  cursor->buffer = NULL;
+}
+
+void parallel_scan_data_pages(Database *database, uint64_t no_threads,
+                              ScanCallback callback, void *arguments,
+                              enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t no_data_pages = database->no_pages - 1;
+  if (0 == no_threads) {
+    long no_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    no_threads = no_cores < 1 ? 1 : (uint64_t)no_cores;
+  }
+  no_threads = no_threads > MAX_SCAN_THREADS ? MAX_SCAN_THREADS : no_threads;
+  no_threads = no_threads > no_data_pages ? no_data_pages : no_threads;
+  no_threads = no_threads == 0 ? 1 : no_threads;
+
+  uint64_t slot_size = database->data_pages.slot_size;
+  posix_fadvise(database->fd, slot_size, no_data_pages * slot_size,
+                POSIX_FADV_SEQUENTIAL);
+
+  ScanTask tasks[MAX_SCAN_THREADS];
+  pthread_t threads[MAX_SCAN_THREADS];
+  bool started[MAX_SCAN_THREADS] = {false};
+  uint64_t pages_per_thread = (no_data_pages + no_threads - 1) / no_threads;
+  for (uint64_t i = 0; i < no_threads; ++i) {
+    uint64_t from_page = 1 + i * pages_per_thread;
+    tasks[i] = (ScanTask){.database = database,
+                          .from_page = from_page,
+                          .to_page = from_page + pages_per_thread,
+                          .callback = callback,
+                          .arguments = arguments,
+                          .failed = false};
+    started[i] =
+        0 == pthread_create(threads + i, NULL, scan_range_of_pages, tasks + i);
+    if (!started[i]) {
+      scan_range_of_pages(tasks + i);
+    }
+  }
+
+  for (uint64_t i = 0; i < no_threads; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    if (tasks[i].failed) {
+      *error = failure;
+    }
+  }
+}
+
+// Local implementation
+
+static bool read_chunk(DataPageCursor *cursor, enum FileErrorStatus *error) {
+  cursor->page_id += cursor->no_buffered;
+  cursor->index = 0;
+  cursor->no_buffered = 0;
+  if (cursor->page_id >= cursor->to_page) {
+    return false;
+  }
+
+  uint64_t no_pages = cursor->to_page - cursor->page_id;
+  no_pages = no_pages > CURSOR_CHUNK_PAGES ? CURSOR_CHUNK_PAGES : no_pages;
+  if (NULL != cursor->snapshot) {
+    snapshot_read_pages(cursor->snapshot, cursor->page_id, no_pages,
+                        cursor->buffer, error);
+    if (failure == *error) {
+      return false;
+    }
+  } else {
+    uint64_t slot_size = cursor->file.slot_size;
+    ssize_t bytes_read =
+        pread(cursor->file.fd, cursor->buffer, no_pages * slot_size,
+              cursor->page_id * slot_size);
+    if (bytes_read != (ssize_t)(no_pages * slot_size)) {
+      fprintf(stderr, "failed to read pages while scanning.\n");
+      *error = failure;
+      return false;
+    }
+  }
+
+  cursor->no_buffered = no_pages;
+  return true;
+}
+
+static void *scan_range_of_pages(void *arguments) {
+  ScanTask *task = arguments;
+
+  enum FileErrorStatus error;
+  DataPageCursor cursor;
+  data_page_cursor_open(&cursor, task->database, task->from_page,
+                        task->to_page, &error);
+  if (failure == error) {
+    task->failed = true;
+    return NULL;
+  }
+
+  Record record;
+  while (data_page_cursor_next(&cursor, &record, &error)) {
+    task->callback(&record, task->arguments);
+  }
+  task->failed = failure == error;
+
+  data_page_cursor_close(&cursor);
+  return NULL;
+}
@@ -1,374 +1,1984 @@
 #include "../include/engine.h"
+#include "../include/btree.h"
 #include "../include/buffer_manager.h"
+#include "../include/cuckoo.h"
 #include "../include/data_page.h"
+#include "../include/data_page_cursor.h"
 #include "../include/file_utilities.h"
 #include "../include/header_page.h"
+#include "../include/journal.h"
+#include "../include/keydir.h"
+#include "../include/linear_probing.h"
+#include "../include/log_structured.h"
+#include "../include/lsm.h"
+#include "../include/overflow.h"
+#include "../include/reaper.h"
 #include "../include/record.h"
+#include "../include/sharded.h"
+#include "../include/snapshot.h"
 #include "../include/xxhash.h"
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-typedef enum { FOUND, NOT_FOUND, WILL_NOT_FIND } PredicateResult;
+// Keeps the expiry within the seven bytes record.c reserves for it.
+#define MAX_TTL_SECONDS (1ULL << 32)
+// Sign, digits and NUL of an int64_t
+#define MAX_INTEGER_LENGTH (21)
 
-typedef PredicateResult (*DatabasePredicate)(const DataPage *data_page,
-                                             uint64_t index,
-                                             const void *inner_arguments,
-                                             enum FileErrorStatus *error);
 typedef struct {
-  DatabasePredicate predicate;
-  void *inner_arguments;
-} DatabasePredicateClosure;
+  ScanCallback callback;
+  void *arguments;
+} ExpiryFilter;
 
 typedef struct {
-  uint32_t record_length;
-} SpaceEnough;
+  MultiGetCallback callback;
+  void *arguments;
+} MultiGetExpiryFilter;
 
 typedef struct {
+  Reaper *reaper;
+  bool failed;
+} ScheduleArguments;
+
+// Makes the new value of a key from its current one, found false for a
+// missing key. *new_value stays owned by the update. Returns false to leave
+// the key as it is.
+typedef bool (*ValueUpdate)(const char *value, uint64_t length, bool found,
+                            const char **new_value, uint64_t *new_length,
+                            void *arguments, enum FileErrorStatus *error);
+
+// State of an update handed to the engine, record is the one stored.
+typedef struct {
+  Database *database;
   const char *key;
-} KeyMatch;
+  uint32_t key_length;
+  ValueUpdate update;
+  void *arguments;
+  SafeBuffer *record_safe_buffer;
+  Record record;
+  Timestamp expiry;
+  bool expires;
+  bool overflow;
+  OverflowReference reference;
+  bool replaces_overflow;
+  OverflowReference old_reference;
+} RecordUpdate;
+
+typedef struct {
+  int64_t delta;
+  int64_t result;
+  char digits[MAX_INTEGER_LENGTH];
+} Increment;
+
+typedef struct {
+  const char *suffix;
+  uint64_t suffix_length;
+  char *value;
+  uint64_t length;
+} Append;
 
-static uint64_t hash(const char *key, size_t no_data_pages);
+typedef struct {
+  const char *expected;
+  uint64_t expected_length;
+  const char *value;
+  uint64_t value_length;
+} CompareAndSet;
 
-static bool find_element(int fd, DatabasePredicateClosure *closure,
-                         uint64_t no_pages, uint64_t from_index,
-                         uint64_t *index, enum FileErrorStatus *error);
+typedef struct {
+  Timestamp since;
+  ScanCallback callback;
+  void *arguments;
+} ChangedFilter;
 
-static PredicateResult is_key_match(const DataPage *data_page, uint64_t index,
-                                    const void *inner_arguments,
-                                    enum FileErrorStatus *error);
+typedef struct {
+  Timestamp timestamp;
+  uint32_t key_length;
+  char key[MAX_STRING_LENGTH];
+} IndexedKey;
 
-static PredicateResult is_space_enough(const DataPage *data_page,
-                                       uint64_t index,
-                                       const void *inner_arguments,
-                                       enum FileErrorStatus *error);
+// Keys collected from the time index, or from the records when it is built.
+typedef struct {
+  IndexedKey *keys;
+  uint64_t no_keys;
+  uint64_t capacity;
+  bool failed;
+} IndexedKeys;
 
-static uint64_t no_pages(int fd, enum FileErrorStatus *error);
+typedef struct {
+  const char *from;
+  uint32_t from_length;
+  const char *to;
+  uint32_t to_length;
+  ScanCallback callback;
+  void *arguments;
+} RangeFilter;
+
+// Order based on enum
+static const EngineOperations *engines[ENGINE_LENGTH] = {
+    &linear_probing_engine, &cuckoo_engine, &btree_engine, &log_engine,
+    &lsm_engine,           &sharded_engine};
+
+static void read_header_fields(Database *database, enum FileErrorStatus *error);
+static void create_database_file_with_shards(char *path, uint64_t no_elements,
+                                             EngineType engine,
+                                             uint64_t no_shards,
+                                             uint64_t page_size,
+                                             PageCodec page_codec,
+                                             enum FileErrorStatus *error);
+static void filter_range(const Record *record, void *arguments);
+static void filter_changed(const Record *record, void *arguments);
+static IndexedKey *append_indexed_key(IndexedKeys *indexed_keys,
+                                      const char *key, uint32_t key_length);
+static void collect_changed_key(const char *key, uint32_t key_length,
+                                const Timestamp *timestamp, void *arguments);
+static void collect_record_key(const Record *record, void *arguments);
+static void collect_indexed_keys(Database *database,
+                                 IndexedKeys *indexed_keys,
+                                 enum FileErrorStatus *error);
+static void add_indexed_keys(TimeIndex *time_index,
+                             const IndexedKeys *indexed_keys,
+                             enum FileErrorStatus *error);
+static void compact_time_index(Database *database,
+                               enum FileErrorStatus *error);
+static void collect_changed_keys(Database *database, const Timestamp *since,
+                                 IndexedKeys *indexed_keys,
+                                 enum FileErrorStatus *error);
+static int compare_indexed_keys(const void *first, const void *second);
+static bool is_new_key(uint64_t *slots, uint64_t no_slots,
+                       const IndexedKeys *indexed_keys, uint64_t index);
+static bool timestamp_before(const Timestamp *first, const Timestamp *second);
+static void skip_expired(const Record *record, void *arguments);
+static void skip_expired_value(uint64_t index, const Record *record,
+                               void *arguments);
+static void schedule_expiry(const Record *record, void *arguments);
+static void reap_key(const char *key, uint32_t key_length, void *arguments);
+static void lock_database(Database *database);
+static void unlock_database(Database *database);
+static bool cached_element(Database *database, const char *key,
+                           uint32_t key_length, Record *record);
+static bool lookup_element(Database *database, const char *key,
+                           uint32_t key_length, Record *record,
+                           enum FileErrorStatus *error);
+static bool remove_element(Database *database, const char *key,
+                           uint32_t key_length, Record *record,
+                           enum FileErrorStatus *error);
+static void put_element(Database *database, const char *key,
+                        uint32_t key_length, const char *value,
+                        uint64_t value_length, const Timestamp *expiry,
+                        enum FileErrorStatus *error);
+static bool check_put(const Database *database, uint32_t key_length,
+                      uint64_t value_length, const Timestamp *expiry,
+                      enum FileErrorStatus *error);
+static Record make_record(Database *database, SafeBuffer *record_safe_buffer,
+                          const char *key, uint32_t key_length,
+                          const char *value, uint64_t value_length,
+                          const Timestamp *expiry, bool *overflow,
+                          OverflowReference *reference,
+                          enum FileErrorStatus *error);
+static void record_written(Database *database, const Record *record,
+                           const Timestamp *expiry,
+                           const OverflowReference *replaced,
+                           enum FileErrorStatus *error);
+static bool update_element(Database *database, const char *key,
+                           uint32_t key_length, ValueUpdate update,
+                           void *arguments, enum FileErrorStatus *error);
+static bool update_record(const Record *current, Record *updated,
+                          void *arguments, enum FileErrorStatus *error);
+static bool read_for_update(Database *database, const char *key,
+                            uint32_t key_length, char **value,
+                            uint64_t *length, Timestamp *expiry,
+                            bool *expires, enum FileErrorStatus *error);
+static bool increment_value(const char *value, uint64_t length, bool found,
+                            const char **new_value, uint64_t *new_length,
+                            void *arguments, enum FileErrorStatus *error);
+static bool append_value(const char *value, uint64_t length, bool found,
+                         const char **new_value, uint64_t *new_length,
+                         void *arguments, enum FileErrorStatus *error);
+static bool compare_and_set_value(const char *value, uint64_t length,
+                                  bool found, const char **new_value,
+                                  uint64_t *new_length, void *arguments,
+                                  enum FileErrorStatus *error);
+static bool parse_integer(const char *value, uint64_t length,
+                          int64_t *integer);
+static Timestamp current_time(void);
+static Timestamp expiry_after(uint64_t ttl_seconds);
+static void uncache_batch(Database *database, const WriteBatch *write_batch);
+static void index_batch(Database *database, const WriteBatch *write_batch,
+                        enum FileErrorStatus *error);
+static void release_overflow_value(Database *database,
+                                   const OverflowReference *reference,
+                                   enum FileErrorStatus *error);
+static bool overflow_in_use(const Database *database,
+                            enum FileErrorStatus *error);
+static uint64_t collect_replaced_values(Database *database,
+                                        const WriteBatch *write_batch,
+                                        OverflowReference *references,
+                                        enum FileErrorStatus *error);
 
 // API Implementation
-int open_database(char *path, bool with_write_lock,
-                  enum FileErrorStatus *error) {
+Database *open_database(char *path, bool with_write_lock,
+                        enum FileErrorStatus *error) {
   *error = success;
-  int fd = open_database_file(path, with_write_lock, error);
-  if (failure == *error) {
+
+  Database *database = calloc(1, sizeof(Database));
+  if (NULL == database) {
+    fprintf(stderr, "cannot allocate database.\n");
     *error = failure;
-    return -1;
+    goto cleanup_0;
   }
-  return fd;
-}
 
-void create_database(char *path, uint64_t no_elements,
-                     enum FileErrorStatus *error) {
-  create_database_file(path, no_elements, error);
-}
+  pthread_mutexattr_t mutex_attributes;
+  pthread_mutexattr_init(&mutex_attributes);
+  pthread_mutexattr_settype(&mutex_attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&database->mutex, &mutex_attributes);
+  pthread_mutexattr_destroy(&mutex_attributes);
 
-bool query_element(int fd, const char *key, Record *record,
-                   enum FileErrorStatus *error) {
-  *error = success;
-  bool return_value = false;
+  database->path = strdup(path);
+  if (NULL == database->path) {
+    fprintf(stderr, "cannot allocate database.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
 
-  uint64_t number_pages = no_pages(fd, error);
+  database->writable = with_write_lock;
+  database->fd =
+      open_database_file(path, with_write_lock, &database->page_size, error);
   if (failure == *error) {
-    goto cleanup_0;
+    goto cleanup_1;
   }
 
-  uint64_t index = hash(key, number_pages - 1);
-  KeyMatch key_match = {.key = key};
-  DatabasePredicateClosure closure = {.predicate = is_key_match,
-                                      .inner_arguments = &key_match};
-  bool found = find_element(fd, &closure, number_pages, index, &index, error);
-
+  // a batch cut short by a crash is completed before anything is read
+  journal_recover(path, database->fd, database->page_size, with_write_lock,
+                  error);
   if (failure == *error) {
-    goto cleanup_0;
+    goto cleanup_2;
   }
 
-  if (!found) {
-    goto cleanup_1;
+  read_header_fields(database, error);
+  if (failure == *error) {
+    goto cleanup_2;
   }
 
-  SafeBuffer *safe_buffer = allocate_page_buffer();
-  if (NULL == safe_buffer) {
+  if (database->engine >= ENGINE_LENGTH) {
+    fprintf(stderr, "unknown database engine.\n");
     *error = failure;
     goto cleanup_2;
   }
 
-  read_page_into_buffer(fd, index, safe_buffer, error);
+  database->overflow = open_overflow_file(path, database->page_size,
+                                          with_write_lock, false, error);
   if (failure == *error) {
     goto cleanup_2;
   }
+  database->time_index = open_time_index(path, with_write_lock, false, error);
+  if (failure == *error) {
+    goto cleanup_3;
+  }
+
+  database->operations = engines[database->engine];
+  if (NULL != database->operations->open) {
+    database->operations->open(database, error);
+    if (failure == *error) {
+      goto cleanup_4;
+    }
+  }
 
-  DataPage data_page = create_data_page(safe_buffer);
-  data_page_find_entry(&data_page, key, record);
-  return_value = true;
+  return database;
 
+cleanup_4:
+  close_time_index(database->time_index);
+cleanup_3:
+  close_overflow_file(database->overflow);
 cleanup_2:
-  free_page_buffer(safe_buffer);
+  close_database_file(database->fd, error);
+  *error = failure;
 cleanup_1:
-  unlock_page(fd, index, error);
+  pthread_mutex_destroy(&database->mutex);
+  free(database->path);
+  free(database);
 cleanup_0:
-  return return_value;
+  return NULL;
 }
 
-void insert_element(int fd, const char *key, const char *value,
-                    enum FileErrorStatus *error) {
+void close_database(Database *database, enum FileErrorStatus *error) {
   *error = success;
+  enum FileErrorStatus close_error = success;
 
-  uint64_t number_pages = no_pages(fd, error);
-  if (failure == *error) {
-    goto cleanup_0;
+  // first, the reaper thread may be waiting for the database
+  destroy_reaper(database->reaper);
+  if (NULL != database->operations->close) {
+    database->operations->close(database, &close_error);
   }
-
-  SafeBuffer *record_safe_buffer = allocate_record_buffer();
-  if (NULL == record_safe_buffer) {
+  destroy_keydir(database->keydir);
+  destroy_value_cache(database->value_cache);
+  close_overflow_file(database->overflow);
+  close_time_index(database->time_index);
+  close_database_file(database->fd, error);
+  pthread_mutex_destroy(&database->mutex);
+  free(database->path);
+  free(database);
+
+  if (failure == close_error) {
     *error = failure;
-    goto cleanup_0;
   }
+}
+
+void create_database(char *path, uint64_t no_elements, EngineType engine,
+                     uint64_t page_size, PageCodec page_codec,
+                     enum FileErrorStatus *error) {
+  create_database_file_with_shards(path, no_elements, engine, 0, page_size,
+                                   page_codec, error);
+}
 
-  Record record = record_from_data(record_safe_buffer, key, value);
+// The database file is created first, so an existing database is never
+// overwritten, then one database of the given engine per shard.
+void create_sharded_database(char *path, uint64_t no_elements,
+                             EngineType engine, uint64_t no_shards,
+                             uint64_t page_size, PageCodec page_codec,
+                             enum FileErrorStatus *error) {
+  *error = success;
+  assert(ENGINE_SHARDED != engine);
+
+  if (0 == no_shards || no_shards > MAX_SHARDS) {
+    fprintf(stderr, "invalid number of shards.\n");
+    *error = failure;
+    return;
+  }
 
-  uint64_t original_index = hash(key, number_pages - 1);
-  SpaceEnough space_enough = {.record_length = get_record_length(&record)};
-  DatabasePredicateClosure closure = {.predicate = is_space_enough,
-                                      .inner_arguments = &space_enough};
-  uint64_t new_index = original_index;
-  bool found = find_element(fd, &closure, number_pages, original_index,
-                            &new_index, error);
+  create_database_file_with_shards(path, no_elements, ENGINE_SHARDED,
+                                   no_shards, page_size, PAGE_CODEC_NONE,
+                                   error);
   if (failure == *error) {
-    goto cleanup_1;
+    return;
   }
 
-  if (!found) {
-    goto cleanup_2;
+  char shard_path[PATH_MAX];
+  uint64_t no_created = 0;
+  uint64_t no_shard_elements = (no_elements + no_shards - 1) / no_shards;
+  for (; no_created < no_shards; ++no_created) {
+    sharded_shard_path(shard_path, path, no_created);
+    create_database(shard_path, no_shard_elements, engine, page_size,
+                    page_codec, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
   }
+  return;
 
-  SafeBuffer *safe_buffer = allocate_page_buffer();
-  if (NULL == safe_buffer) {
-    *error = failure;
-    goto cleanup_2;
+cleanup_0:
+  for (uint64_t i = 0; i < no_created; ++i) {
+    sharded_shard_path(shard_path, path, i);
+    unlink(shard_path);
   }
+  unlink(path);
+}
 
-  unlock_page(fd, new_index, error);
+void database_attach_keydir(Database *database, enum FileErrorStatus *error) {
+  *error = success;
 
-  Record deleted_record;
-  bool deleted = delete_element(fd, key, &deleted_record, error);
-  if (failure == *error) {
-    goto cleanup_3;
+  if (!database->operations->stores_data_pages) {
+    fprintf(stderr, "key directory is not supported by the %s engine.\n",
+            database->operations->name);
+    *error = failure;
+    return;
   }
 
-  read_page_into_buffer(fd, new_index, safe_buffer, error);
-  if (failure == *error) {
-    goto cleanup_3;
+  if (NULL == database->keydir) {
+    database->keydir =
+        build_keydir(&database->data_pages, database->no_pages, error);
   }
+}
+
+void database_attach_value_cache(Database *database, uint64_t capacity,
+                                 enum FileErrorStatus *error) {
+  *error = success;
 
-  Timestamp first_timestamp;
-  if (deleted) {
-    first_timestamp = record_first_timestamp(&deleted_record);
-    record_set_first_timestamp(&record, first_timestamp);
-    destroy_record(&deleted_record);
+  if (0 == capacity) {
+    fprintf(stderr, "invalid value cache capacity.\n");
+    *error = failure;
+    return;
   }
 
-  DataPage data_page = create_data_page(safe_buffer);
-  data_page_insert_entry(&data_page, &record, original_index);
-  write_page_to_file(fd, safe_buffer, new_index, false, error);
+  if (ENGINE_SHARDED == database->engine) {
+    uint64_t shard_capacity =
+        (capacity + database->no_shards - 1) / database->no_shards;
+    for (uint64_t i = 0; i < database->no_shards && success == *error; ++i) {
+      Database *shard = sharded_shard(database, i, error);
+      if (NULL != shard) {
+        database_attach_value_cache(shard, shard_capacity, error);
+      }
+    }
+    return;
+  }
 
-cleanup_3:
-  free_page_buffer(safe_buffer);
-cleanup_2:
-  unlock_page(fd, new_index, error);
-cleanup_1:
-  free_page_buffer(record_safe_buffer);
-cleanup_0:
-  return;
+  if (NULL == database->value_cache) {
+    database->value_cache = create_value_cache(capacity, error);
+  }
 }
 
-bool delete_element(int fd, const char *key, Record *record,
-                    enum FileErrorStatus *error) {
+// Schedules the records already set to expire, the reaper thread then takes
+// the lock of the database for every key it reaps.
+void database_start_reaper(Database *database, enum FileErrorStatus *error) {
   *error = success;
-  bool return_value = false;
 
-  uint64_t number_pages = no_pages(fd, error);
-  if (failure == *error) {
-    goto cleanup_0;
+  if (!database->writable) {
+    fprintf(stderr, "the reaper needs a writable database.\n");
+    *error = failure;
+    return;
+  }
+  if (ENGINE_SHARDED == database->engine) {
+    for (uint64_t i = 0; i < database->no_shards && success == *error; ++i) {
+      Database *shard = sharded_shard(database, i, error);
+      if (NULL != shard) {
+        database_start_reaper(shard, error);
+      }
+    }
+    return;
+  }
+  if (NULL != database->reaper) {
+    return;
   }
 
-  uint64_t index = hash(key, number_pages - 1);
-  KeyMatch key_match = {.key = key};
-  DatabasePredicateClosure closure = {.predicate = is_key_match,
-                                      .inner_arguments = &key_match};
-  bool found = find_element(fd, &closure, number_pages, index, &index, error);
-
+  lock_database(database);
+  database->reaper = create_reaper(reap_key, database, error);
   if (failure == *error) {
     goto cleanup_0;
   }
 
-  if (!found) {
-    goto cleanup_1;
+  ScheduleArguments arguments = {.reaper = database->reaper, .failed = false};
+  database->operations->scan(database, schedule_expiry, &arguments, error);
+  if (failure == *error || arguments.failed) {
+    destroy_reaper(database->reaper);
+    database->reaper = NULL;
+    *error = failure;
   }
 
-  SafeBuffer *safe_buffer = allocate_page_buffer();
-  if (NULL == safe_buffer) {
+cleanup_0:
+  unlock_database(database);
+}
+
+// The entries of the records already stored are written in the order of their
+// last write.
+void database_create_time_index(Database *database,
+                                enum FileErrorStatus *error) {
+  *error = success;
+
+  if (!database->writable) {
+    fprintf(stderr, "the time index needs a writable database.\n");
     *error = failure;
-    goto cleanup_1;
+    return;
+  }
+  if (ENGINE_SHARDED == database->engine) {
+    for (uint64_t i = 0; i < database->no_shards && success == *error; ++i) {
+      Database *shard = sharded_shard(database, i, error);
+      if (NULL != shard) {
+        database_create_time_index(shard, error);
+      }
+    }
+    return;
+  }
+  if (NULL != database->time_index) {
+    return;
   }
 
-  read_page_into_buffer(fd, index, safe_buffer, error);
+  lock_database(database);
+  IndexedKeys indexed_keys = {
+      .keys = NULL, .no_keys = 0, .capacity = 0, .failed = false};
+  collect_indexed_keys(database, &indexed_keys, error);
   if (failure == *error) {
-    goto cleanup_2;
+    goto cleanup_0;
   }
 
-  DataPage data_page = create_data_page(safe_buffer);
-  return_value = data_page_delete_entry(&data_page, key, record);
+  database->time_index = open_time_index(database->path, true, true, error);
+  if (success == *error) {
+    add_indexed_keys(database->time_index, &indexed_keys, error);
+  }
 
-  if (return_value) {
-    write_lock_page(fd, index, error);
-    if (failure == *error) {
-      goto cleanup_2;
+cleanup_0:
+  free(indexed_keys.keys);
+  unlock_database(database);
+}
+
+const char *database_engine_name(const Database *database) {
+  return database->operations->name;
+}
+
+// Older files keep the fixed records their readers expect.
+RecordFormat database_record_format(const Database *database) {
+  return DATABASE_VERSION_XXH64 == database->version ||
+                 DATABASE_VERSION_XXH3 == database->version
+             ? RECORD_FORMAT_FIXED
+             : RECORD_FORMAT_COMPACT;
+}
+
+// An expired record is not returned, and removed when the database is
+// writable.
+bool query_element(Database *database, const char *key, uint32_t key_length,
+                   Record *record, enum FileErrorStatus *error) {
+  *error = success;
+  if (ENGINE_SHARDED == database->engine) {
+    Database *shard = sharded_key_shard(database, key, key_length, error);
+    return NULL != shard &&
+           query_element(shard, key, key_length, record, error);
+  }
+
+  if (cached_element(database, key, key_length, record)) {
+    return true;
+  }
+
+  lock_database(database);
+  bool found = lookup_element(database, key, key_length, record, error);
+  if (found && record_has_expired(record)) {
+    destroy_record(record);
+    found = false;
+    Record expired;
+    if (database->writable &&
+        remove_element(database, key, key_length, &expired, error)) {
+      destroy_record(&expired);
     }
+  }
+  // filled under the lock, a write of the key cannot come in between
+  if (found && NULL != database->value_cache) {
+    value_cache_put(database->value_cache, record);
+  }
+  unlock_database(database);
+  return found;
+}
+
+// Engines without a batched lookup, and databases with a key directory which
+// already resolve a key with one read, answer the batch key by key.
+void query_elements(Database *database, const char **keys,
+                    const uint32_t *key_lengths, uint64_t no_keys,
+                    MultiGetCallback callback, void *arguments,
+                    enum FileErrorStatus *error) {
+  *error = success;
+
+  lock_database(database);
+  if (NULL != database->operations->mget && NULL == database->keydir) {
+    MultiGetExpiryFilter filter = {.callback = callback,
+                                   .arguments = arguments};
+    database->operations->mget(database, keys, key_lengths, no_keys,
+                               skip_expired_value, &filter, error);
+    goto cleanup_0;
+  }
 
-    write_page_to_file(fd, safe_buffer, index, false, error);
+  for (uint64_t i = 0; i < no_keys; ++i) {
+    Record record;
+    bool found =
+        query_element(database, keys[i], key_lengths[i], &record, error);
     if (failure == *error) {
-      goto cleanup_2;
+      goto cleanup_0;
+    }
+    callback(i, found ? &record : NULL, arguments);
+    if (found) {
+      destroy_record(&record);
     }
   }
 
-cleanup_2:
-  free_page_buffer(safe_buffer);
-cleanup_1:
-  unlock_page(fd, index, error);
 cleanup_0:
-  return return_value;
+  unlock_database(database);
 }
 
-static uint64_t hash(const char *key, size_t no_data_pages) {
-  size_t length = strnlen(key, 100);
-  XXH64_hash_t hash = XXH64(key, length, 0);
-  return (hash % no_data_pages) + 1;
+void insert_element(Database *database, const char *key, uint32_t key_length,
+                    const char *value, uint64_t value_length,
+                    enum FileErrorStatus *error) {
+  insert_element_with_ttl(database, key, key_length, value, value_length, 0,
+                          error);
 }
 
-PredicateResult is_key_match(const DataPage *data_page, uint64_t index,
-                             const void *inner_arguments,
+void insert_element_with_ttl(Database *database, const char *key,
+                             uint32_t key_length, const char *value,
+                             uint64_t value_length, uint64_t ttl_seconds,
                              enum FileErrorStatus *error) {
   *error = success;
-  const KeyMatch *typed_inner_arguments = inner_arguments;
+  if (ENGINE_SHARDED == database->engine) {
+    Database *shard = sharded_key_shard(database, key, key_length, error);
+    if (NULL != shard) {
+      insert_element_with_ttl(shard, key, key_length, value, value_length,
+                              ttl_seconds, error);
+    }
+    return;
+  }
 
-  bool is_free_page = data_page_is_free_page(data_page);
-  if (is_free_page) {
-    return WILL_NOT_FIND;
+  if (ttl_seconds > MAX_TTL_SECONDS) {
+    fprintf(stderr, "ttl is too long.\n");
+    *error = failure;
+    return;
   }
+  Timestamp expiry = expiry_after(ttl_seconds);
 
-  Record record;
-  uint64_t original_hash = data_page_hash(data_page);
-  if (original_hash == index) {
-    bool found =
-        data_page_find_entry(data_page, typed_inner_arguments->key, &record);
+  lock_database(database);
+  put_element(database, key, key_length, value, value_length,
+              0 != ttl_seconds ? &expiry : NULL, error);
+  unlock_database(database);
+}
 
-    if (found) {
-      destroy_record(&record);
-    }
+// The read-modify-write operations below hold the lock of the database from
+// the read to the write, and a writer holds the header write lock against
+// other processes, so no update lands in between. The expiry of the key is
+// kept.
+
+int64_t increment_element(Database *database, const char *key,
+                          uint32_t key_length, int64_t delta,
+                          enum FileErrorStatus *error) {
+  if (ENGINE_SHARDED == database->engine) {
+    Database *shard = sharded_key_shard(database, key, key_length, error);
+    return NULL != shard
+               ? increment_element(shard, key, key_length, delta, error)
+               : 0;
+  }
 
-    return found ? FOUND : NOT_FOUND;
+  Increment increment = {.delta = delta, .result = 0};
+  bool written = update_element(database, key, key_length, increment_value,
+                                &increment, error);
+  return written ? increment.result : 0;
+}
+
+// Returns the length of the new value.
+uint64_t append_element(Database *database, const char *key,
+                        uint32_t key_length, const char *suffix,
+                        uint64_t suffix_length, enum FileErrorStatus *error) {
+  if (ENGINE_SHARDED == database->engine) {
+    Database *shard = sharded_key_shard(database, key, key_length, error);
+    return NULL != shard ? append_element(shard, key, key_length, suffix,
+                                          suffix_length, error)
+                         : 0;
   }
 
-  return NOT_FOUND;
+  Append append = {.suffix = suffix,
+                   .suffix_length = suffix_length,
+                   .value = NULL,
+                   .length = 0};
+  bool written =
+      update_element(database, key, key_length, append_value, &append, error);
+  free(append.value);
+  return written ? append.length : 0;
 }
 
-PredicateResult is_space_enough(const DataPage *data_page, uint64_t index,
-                                const void *inner_arguments,
-                                enum FileErrorStatus *error) {
+// Writes value only when the key holds expected, a missing key never does.
+// Returns whether the value was written.
+bool compare_and_set_element(Database *database, const char *key,
+                             uint32_t key_length, const char *expected,
+                             uint64_t expected_length, const char *value,
+                             uint64_t value_length,
+                             enum FileErrorStatus *error) {
+  if (ENGINE_SHARDED == database->engine) {
+    Database *shard = sharded_key_shard(database, key, key_length, error);
+    return NULL != shard &&
+           compare_and_set_element(shard, key, key_length, expected,
+                                   expected_length, value, value_length,
+                                   error);
+  }
+
+  CompareAndSet compare_and_set = {.expected = expected,
+                                   .expected_length = expected_length,
+                                   .value = value,
+                                   .value_length = value_length};
+  return update_element(database, key, key_length, compare_and_set_value,
+                        &compare_and_set, error);
+}
+
+char *read_record_value(const Database *database, const Record *record,
+                        uint64_t *length, enum FileErrorStatus *error) {
   *error = success;
-  const SpaceEnough *typed_inner_arguments = inner_arguments;
+  if (ENGINE_SHARDED == database->engine && record_has_overflow(record)) {
+    const Database *shard = sharded_key_shard(
+        database, record_key(record), record_key_length(record), error);
+    return NULL != shard ? read_record_value(shard, record, length, error)
+                         : NULL;
+  }
+
+  if (!record_has_overflow(record)) {
+    *length = record_value_length(record);
+    char *copy = malloc(*length + 1);
+    if (NULL == copy) {
+      fprintf(stderr, "cannot allocate value.\n");
+      *error = failure;
+      return NULL;
+    }
+    memcpy(copy, record_value(record), *length);
+    copy[*length] = '\0';
+    return copy;
+  }
 
-  size_t length = data_page_no_entries(data_page);
-  if (0 == length) {
-    return FOUND;
+  if (NULL == database->overflow) {
+    fprintf(stderr, "overflow file is missing.\n");
+    *error = failure;
+    return NULL;
   }
 
-  uint64_t original_hash = data_page_hash(data_page);
-  size_t free_space = data_page_free_space(data_page);
-  return original_hash == index &&
-                 typed_inner_arguments->record_length < free_space
-             ? FOUND
-             : NOT_FOUND;
+  OverflowReference reference = record_overflow_reference(record);
+  *length = reference.length;
+  return overflow_read_value(database->overflow, &reference, error);
 }
 
-// A read lock is kept on the found page if found
-static bool find_element(int fd, DatabasePredicateClosure *closure,
-                         uint64_t no_pages, uint64_t from_index,
-                         uint64_t *index, enum FileErrorStatus *error) {
+// The lock is kept while reading the overflow pages, the reaper could free
+// them otherwise.
+bool query_value(Database *database, const char *key, uint32_t key_length,
+                 char **value, uint64_t *length, enum FileErrorStatus *error) {
   *error = success;
+  if (ENGINE_SHARDED == database->engine) {
+    Database *shard = sharded_key_shard(database, key, key_length, error);
+    return NULL != shard &&
+           query_value(shard, key, key_length, value, length, error);
+  }
+
   bool return_value = false;
 
-  SafeBuffer *safe_buffer = allocate_page_buffer();
-  if (NULL == safe_buffer) {
+  Record record;
+  if (cached_element(database, key, key_length, &record)) {
+    if (!record_has_overflow(&record)) {
+      *value = read_record_value(database, &record, length, error);
+      destroy_record(&record);
+      return success == *error;
+    }
+    destroy_record(&record);
+  }
+
+  lock_database(database);
+  bool found = query_element(database, key, key_length, &record, error);
+  if (failure == *error || !found) {
+    goto cleanup_0;
+  }
+
+  *value = read_record_value(database, &record, length, error);
+  destroy_record(&record);
+  return_value = success == *error;
+
+cleanup_0:
+  unlock_database(database);
+  return return_value;
+}
+
+// The record returned keeps its overflow reference, the pages it points to
+// are already freed. An expired record is removed and reported as not found.
+bool delete_element(Database *database, const char *key, uint32_t key_length,
+                    Record *record, enum FileErrorStatus *error) {
+  if (ENGINE_SHARDED == database->engine) {
+    Database *shard = sharded_key_shard(database, key, key_length, error);
+    return NULL != shard &&
+           delete_element(shard, key, key_length, record, error);
+  }
+
+  lock_database(database);
+  bool found = remove_element(database, key, key_length, record, error);
+  if (found && record_has_expired(record)) {
+    destroy_record(record);
+    found = false;
+  }
+  unlock_database(database);
+  return found;
+}
+
+// Every engine applies a batch atomically. The overflow pages of the values
+// it replaces are freed once it is written, a crash in between only leaks
+// them.
+void commit_write_batch(Database *database, const WriteBatch *write_batch,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t no_entries = write_batch_no_entries(write_batch);
+  if (0 == no_entries) {
+    return;
+  }
+  if (ENGINE_SHARDED == database->engine) {
+    database->operations->write_batch(database, write_batch, error);
+    return;
+  }
+
+  lock_database(database);
+  OverflowReference *replaced = malloc(no_entries * sizeof(OverflowReference));
+  if (NULL == replaced) {
+    fprintf(stderr, "cannot allocate write batch.\n");
     *error = failure;
     goto cleanup_0;
   }
+  uint64_t no_replaced =
+      collect_replaced_values(database, write_batch, replaced, error);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
 
-  uint64_t count = 0;
-  uint64_t i = from_index;
+  database->operations->write_batch(database, write_batch, error);
+  uncache_batch(database, write_batch);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
+  ++database->commit_sequence;
+  for (uint64_t i = 0; i < no_replaced && success == *error; ++i) {
+    release_overflow_value(database, replaced + i, error);
+  }
+  if (success == *error) {
+    index_batch(database, write_batch, error);
+  }
 
-  while (count != no_pages - 1) {
+cleanup_1:
+  free(replaced);
+cleanup_0:
+  unlock_database(database);
+}
 
-    read_lock_page(fd, i, error);
-    if (failure == *error) {
-      goto cleanup_1;
-    };
+// Expired records are skipped by every scan.
+void scan_elements(Database *database, ScanCallback callback, void *arguments,
+                   enum FileErrorStatus *error) {
+  ExpiryFilter filter = {.callback = callback, .arguments = arguments};
+  lock_database(database);
+  database->operations->scan(database, skip_expired, &filter, error);
+  unlock_database(database);
+}
 
-    read_page_into_buffer(fd, i, safe_buffer, error);
-    if (failure == *error) {
-      goto cleanup_2;
-    };
+// Engines without data pages fall back to their sequential scan, the
+// callback must be thread-safe either way. The lock of the database is not
+// taken, the callback may then read values from the worker threads.
+void parallel_scan_elements(Database *database, uint64_t no_threads,
+                            ScanCallback callback, void *arguments,
+                            enum FileErrorStatus *error) {
+  ExpiryFilter filter = {.callback = callback, .arguments = arguments};
+  if (database->operations->stores_data_pages) {
+    parallel_scan_data_pages(database, no_threads, skip_expired, &filter,
+                             error);
+    return;
+  }
+  database->operations->scan(database, skip_expired, &filter, error);
+}
 
-    DataPage data_page = create_data_page(safe_buffer);
-    PredicateResult found =
-        closure->predicate(&data_page, i, closure->inner_arguments, error);
-    if (failure == *error) {
-      goto cleanup_2;
-    }
+// With a time index only the entries written since are read, without one the
+// records are scanned, and the keys of the shards are merged. Every key found
+// is looked up and answered once, at its most recent write.
+void scan_changed_since(Database *database, const Timestamp *since,
+                        ScanCallback callback, void *arguments,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  lock_database(database);
 
-    if (FOUND == found) {
-      *index = i;
-      return_value = true;
-      goto cleanup_1;
-    }
+  IndexedKeys indexed_keys = {
+      .keys = NULL, .no_keys = 0, .capacity = 0, .failed = false};
+  collect_changed_keys(database, since, &indexed_keys, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  // the entries of the time index are already in the order of the writes
+  if (NULL == database->time_index && 0 != indexed_keys.no_keys) {
+    qsort(indexed_keys.keys, indexed_keys.no_keys, sizeof(IndexedKey),
+          compare_indexed_keys);
+  }
 
-    if (WILL_NOT_FIND == found) {
-      goto cleanup_2;
-    }
+  uint64_t no_slots = 2 * indexed_keys.no_keys + 1;
+  uint64_t *slots = calloc(no_slots, sizeof(uint64_t));
+  if (NULL == slots) {
+    fprintf(stderr, "cannot allocate changed keys.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
 
-    unlock_page(fd, i, error);
+  for (uint64_t i = indexed_keys.no_keys; i > 0; --i) {
+    if (!is_new_key(slots, no_slots, &indexed_keys, i - 1)) {
+      continue;
+    }
+    IndexedKey *indexed_key = indexed_keys.keys + i - 1;
+    Record record;
+    bool found = query_element(database, indexed_key->key,
+                               indexed_key->key_length, &record, error);
     if (failure == *error) {
       goto cleanup_1;
-    };
-
-    i = (i == no_pages - 1) ? 1 : (i + 1) % no_pages;
-    ++count;
+    }
+    if (!found) {
+      continue;
+    }
+    Timestamp last = record_last_timestamp(&record);
+    if (!timestamp_before(&last, since)) {
+      callback(&record, arguments);
+    }
+    destroy_record(&record);
   }
 
-cleanup_2:
-  unlock_page(fd, i, error);
 cleanup_1:
-  free_page_buffer(safe_buffer);
+  free(slots);
 cleanup_0:
-  return return_value;
+  free(indexed_keys.keys);
+  unlock_database(database);
 }
 
-static uint64_t no_pages(int fd, enum FileErrorStatus *error) {
-  SafeBuffer *safe_buffer = allocate_page_buffer();
-  if (NULL == safe_buffer) {
-    *error = failure;
-    return 0;
+// Engines without key order answer ranges with a filtered full scan, the
+// records are then not returned in key order.
+void scan_range_elements(Database *database, const char *from,
+                         uint32_t from_length, const char *to,
+                         uint32_t to_length, ScanCallback callback,
+                         void *arguments, enum FileErrorStatus *error) {
+  ExpiryFilter expiry_filter = {.callback = callback, .arguments = arguments};
+  lock_database(database);
+  if (NULL != database->operations->scan_range) {
+    database->operations->scan_range(database, from, from_length, to,
+                                     to_length, skip_expired, &expiry_filter,
+                                     error);
+    goto cleanup_0;
   }
 
-  read_page_into_buffer(fd, 0, safe_buffer, error);
-  if (failure == *error) {
-    free_page_buffer(safe_buffer);
-    return 0;
-  }
+  RangeFilter filter = {.from = from,
+                        .from_length = from_length,
+                        .to = to,
+                        .to_length = to_length,
+                        .callback = skip_expired,
+                        .arguments = &expiry_filter};
+  database->operations->scan(database, filter_range, &filter, error);
 
-  HeaderPage header_page = open_header_page(safe_buffer);
-  uint64_t no_pages = header_no_pages(&header_page);
+cleanup_0:
+  unlock_database(database);
+}
 
-  free_page_buffer(safe_buffer);
-  return no_pages;
+void database_stats(Database *database, EngineStats *stats,
+                    enum FileErrorStatus *error) {
+  memset(stats, 0, sizeof(EngineStats));
+  lock_database(database);
+  database->operations->stats(database, stats, error);
+  unlock_database(database);
+}
+
+void vacuum_database(Database *database, VacuumStats *stats,
+                     enum FileErrorStatus *error) {
+  *error = success;
+  memset(stats, 0, sizeof(VacuumStats));
+
+  if (!database->writable) {
+    fprintf(stderr, "vacuum needs a writable database.\n");
+    *error = failure;
+    return;
+  }
+  if (NULL != database->operations->vacuum) {
+    uint64_t page_id = 0;
+    bool more = true;
+    while (more && success == *error) {
+      lock_database(database);
+      more = database->operations->vacuum(database, &page_id, stats, error);
+      unlock_database(database);
+    }
+  }
+  if (success == *error) {
+    compact_time_index(database, error);
+  }
+}
+
+// Writes the fields an engine may change back to the header page.
+void database_write_header(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+
+  SafeBuffer *safe_buffer = allocate_page_buffer(database->page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  read_page_into_buffer(database->fd, 0, safe_buffer, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  HeaderPage header_page = open_header_page(safe_buffer);
+  header_set_no_pages(&header_page, database->no_pages);
+  header_set_root_page(&header_page, database->root_page);
+  header_set_first_segment(&header_page, database->first_segment);
+  header_set_last_segment(&header_page, database->last_segment);
+  write_page_to_file(database->fd, safe_buffer, 0, false, error);
+
+cleanup_0:
+  free_page_buffer(safe_buffer);
+}
+
+// Sized for two pages per page worth of estimated records, so the probe
+// sequences stay short. Compressed pages are counted as two slots of records,
+// a file then still holds records of the estimated size that do not compress.
+void create_data_pages(Database *database, uint64_t no_elements,
+                       enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t page_size = database->page_size;
+  if (PAGE_CODEC_NONE != database->data_pages.codec) {
+    page_size *= 2;
+  }
+  uint64_t no_data_pages =
+      ((no_elements * RECORD_SIZE_ESTIMATE - page_size + 1) / page_size) << 1;
+  if (no_elements * RECORD_SIZE_ESTIMATE < 2 * page_size) {
+    no_data_pages = 2;
+  }
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  for (uint64_t page_id = 1; page_id <= no_data_pages; ++page_id) {
+    data_page_from_data(safe_buffer, page_id);
+    write_data_page(&database->data_pages, safe_buffer, page_id, error);
+    if (failure == *error) {
+      break;
+    }
+  }
+
+  database->no_pages = no_data_pages + 1;
+  database->root_page = 0;
+  free_page_buffer(safe_buffer);
+}
+
+void scan_data_pages(Database *database, ScanCallback callback,
+                     void *arguments, enum FileErrorStatus *error) {
+  DataPageCursor cursor;
+  data_page_cursor_open(&cursor, database, 1, database->no_pages, error);
+  if (failure == *error) {
+    return;
+  }
+
+  Record record;
+  while (data_page_cursor_next(&cursor, &record, error)) {
+    callback(&record, arguments);
+  }
+  data_page_cursor_close(&cursor);
+}
+
+void data_pages_stats(Database *database, EngineStats *stats,
+                      enum FileErrorStatus *error) {
+  *error = success;
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  stats->no_pages = database->no_pages;
+  for (uint64_t page_id = 1; page_id < database->no_pages; ++page_id) {
+    read_data_page(&database->data_pages, page_id, safe_buffer, error);
+    if (failure == *error) {
+      break;
+    }
+
+    DataPage data_page = create_data_page(safe_buffer);
+    stats->free_bytes += data_page_free_space(&data_page);
+    if (0 != data_page_no_entries(&data_page)) {
+      ++stats->no_used_pages;
+      stats->no_records += data_page_no_entries(&data_page);
+      stats->used_bytes += data_page_used_space(&data_page);
+    }
+  }
+
+  free_page_buffer(safe_buffer);
+}
+
+// Local implementation
+
+static void read_header_fields(Database *database,
+                               enum FileErrorStatus *error) {
+  SafeBuffer *safe_buffer = allocate_page_buffer(database->page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  read_page_into_buffer(database->fd, 0, safe_buffer, error);
+  if (failure == *error) {
+    free_page_buffer(safe_buffer);
+    return;
+  }
+
+  HeaderPage header_page = open_header_page(safe_buffer);
+  database->no_pages = header_no_pages(&header_page);
+  database->version = header_version(&header_page);
+  database->engine = header_engine(&header_page);
+  database->root_page = header_root_page(&header_page);
+  database->first_segment = header_first_segment(&header_page);
+  database->last_segment = header_last_segment(&header_page);
+  database->no_shards = header_no_shards(&header_page);
+  database->data_pages = data_page_file(database->fd, database->page_size,
+                                        header_page_codec(&header_page));
+  if (database->data_pages.codec >= PAGE_CODEC_LENGTH ||
+      database->data_pages.page_size > MAX_PAGE_SIZE) {
+    fprintf(stderr, "unknown page codec.\n");
+    *error = failure;
+  }
+
+  free_page_buffer(safe_buffer);
+}
+
+static void create_database_file_with_shards(char *path, uint64_t no_elements,
+                                             EngineType engine,
+                                             uint64_t no_shards,
+                                             uint64_t page_size,
+                                             PageCodec page_codec,
+                                             enum FileErrorStatus *error) {
+  *error = success;
+  assert(no_elements < MAX_NO_ELEMENTS);
+
+  if (page_size < MIN_PAGE_SIZE || page_size > MAX_PAGE_SIZE ||
+      0 != (page_size & (page_size - 1))) {
+    fprintf(stderr, "invalid page size.\n");
+    *error = failure;
+    return;
+  }
+  if (PAGE_CODEC_NONE != page_codec && !engines[engine]->stores_data_pages) {
+    fprintf(stderr, "compression is not supported by the %s engine.\n",
+            engines[engine]->name);
+    *error = failure;
+    return;
+  }
+  if (PAGE_CODEC_NONE != page_codec &&
+      page_size * COMPRESSED_PAGE_RATIO > MAX_PAGE_SIZE) {
+    fprintf(stderr, "page size too large for compression.\n");
+    *error = failure;
+    return;
+  }
+
+  Database database = {.path = path,
+                       .page_size = page_size,
+                       .writable = true,
+                       .version = DATABASE_VERSION,
+                       .engine = engine,
+                       .no_shards = no_shards,
+                       .operations = engines[engine]};
+  database.fd = create_database_file(path, error);
+  if (failure == *error) {
+    return;
+  }
+  database.data_pages = data_page_file(database.fd, page_size, page_codec);
+
+  database.operations->create(&database, no_elements, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  SafeBuffer *safe_buffer = allocate_page_buffer(page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  HeaderPage header_page =
+      create_header_page(safe_buffer, database.no_pages, engine);
+  header_set_root_page(&header_page, database.root_page);
+  header_set_first_segment(&header_page, database.first_segment);
+  header_set_last_segment(&header_page, database.last_segment);
+  header_set_no_shards(&header_page, database.no_shards);
+  header_set_page_codec(&header_page, page_codec);
+  write_page_to_file(database.fd, safe_buffer, 0, false, error);
+  free_page_buffer(safe_buffer);
+
+cleanup_0:
+  if (failure == *error) {
+    close_database_file(database.fd, error);
+    *error = failure;
+    return;
+  }
+  close_database_file(database.fd, error);
+}
+
+static void filter_range(const Record *record, void *arguments) {
+  RangeFilter *filter = arguments;
+  const char *key = record_key(record);
+  uint32_t key_length = record_key_length(record);
+  if (compare_keys(key, key_length, filter->from, filter->from_length) >= 0 &&
+      compare_keys(key, key_length, filter->to, filter->to_length) <= 0) {
+    filter->callback(record, filter->arguments);
+  }
+}
+
+static void filter_changed(const Record *record, void *arguments) {
+  ChangedFilter *filter = arguments;
+  Timestamp last = record_last_timestamp(record);
+  if (!timestamp_before(&last, &filter->since)) {
+    filter->callback(record, filter->arguments);
+  }
+}
+
+static IndexedKey *append_indexed_key(IndexedKeys *indexed_keys,
+                                      const char *key, uint32_t key_length) {
+  if (indexed_keys->no_keys == indexed_keys->capacity) {
+    uint64_t capacity =
+        0 == indexed_keys->capacity ? 64 : 2 * indexed_keys->capacity;
+    IndexedKey *keys =
+        realloc(indexed_keys->keys, capacity * sizeof(IndexedKey));
+    if (NULL == keys) {
+      fprintf(stderr, "cannot allocate indexed keys.\n");
+      indexed_keys->failed = true;
+      return NULL;
+    }
+    indexed_keys->keys = keys;
+    indexed_keys->capacity = capacity;
+  }
+
+  IndexedKey *indexed_key = indexed_keys->keys + indexed_keys->no_keys++;
+  indexed_key->key_length = key_length;
+  memcpy(indexed_key->key, key, key_length);
+  return indexed_key;
+}
+
+static void collect_changed_key(const char *key, uint32_t key_length,
+                                const Timestamp *timestamp, void *arguments) {
+  IndexedKey *indexed_key = append_indexed_key(arguments, key, key_length);
+  if (NULL != indexed_key) {
+    indexed_key->timestamp = *timestamp;
+  }
+}
+
+static void collect_record_key(const Record *record, void *arguments) {
+  IndexedKey *indexed_key = append_indexed_key(
+      arguments, record_key(record), record_key_length(record));
+  if (NULL != indexed_key) {
+    indexed_key->timestamp = record_last_timestamp(record);
+  }
+}
+
+// The keys of the records stored, in the order of their last write.
+static void collect_indexed_keys(Database *database,
+                                 IndexedKeys *indexed_keys,
+                                 enum FileErrorStatus *error) {
+  *error = success;
+  database->operations->scan(database, collect_record_key, indexed_keys,
+                             error);
+  if (failure == *error || indexed_keys->failed) {
+    *error = failure;
+    return;
+  }
+  if (0 != indexed_keys->no_keys) {
+    qsort(indexed_keys->keys, indexed_keys->no_keys, sizeof(IndexedKey),
+          compare_indexed_keys);
+  }
+}
+
+static void add_indexed_keys(TimeIndex *time_index,
+                             const IndexedKeys *indexed_keys,
+                             enum FileErrorStatus *error) {
+  *error = success;
+  for (uint64_t i = 0; success == *error && i < indexed_keys->no_keys; ++i) {
+    const IndexedKey *indexed_key = indexed_keys->keys + i;
+    time_index_add(time_index, indexed_key->key, indexed_key->key_length,
+                   &indexed_key->timestamp, error);
+  }
+}
+
+// Rewrites the time index with one entry per record, dropping the entries of
+// the keys written again or deleted since.
+static void compact_time_index(Database *database,
+                               enum FileErrorStatus *error) {
+  *error = success;
+  if (NULL == database->time_index) {
+    return;
+  }
+
+  lock_database(database);
+  IndexedKeys indexed_keys = {
+      .keys = NULL, .no_keys = 0, .capacity = 0, .failed = false};
+  collect_indexed_keys(database, &indexed_keys, error);
+  if (failure == *error ||
+      indexed_keys.no_keys == time_index_no_entries(database->time_index)) {
+    goto cleanup_0;
+  }
+
+  TimeIndex *replacement =
+      create_time_index_replacement(database->path, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  add_indexed_keys(replacement, &indexed_keys, error);
+  if (failure == *error) {
+    close_time_index(replacement);
+    goto cleanup_0;
+  }
+  replace_time_index(database->time_index, replacement, database->path,
+                     error);
+
+cleanup_0:
+  free(indexed_keys.keys);
+  unlock_database(database);
+}
+
+// The keys written at or after since with the time of the write, from the
+// time index or from the records, of every shard of a sharded database.
+static void collect_changed_keys(Database *database, const Timestamp *since,
+                                 IndexedKeys *indexed_keys,
+                                 enum FileErrorStatus *error) {
+  *error = success;
+
+  if (ENGINE_SHARDED == database->engine) {
+    for (uint64_t i = 0; i < database->no_shards && success == *error; ++i) {
+      Database *shard = sharded_shard(database, i, error);
+      if (NULL != shard) {
+        collect_changed_keys(shard, since, indexed_keys, error);
+      }
+    }
+    return;
+  }
+
+  lock_database(database);
+  if (NULL != database->time_index) {
+    time_index_find_since(database->time_index, since, collect_changed_key,
+                          indexed_keys, error);
+  } else {
+    ChangedFilter filter = {.since = *since,
+                            .callback = collect_record_key,
+                            .arguments = indexed_keys};
+    scan_elements(database, filter_changed, &filter, error);
+  }
+  if (indexed_keys->failed) {
+    *error = failure;
+  }
+  unlock_database(database);
+}
+
+static int compare_indexed_keys(const void *first, const void *second) {
+  const IndexedKey *first_key = first;
+  const IndexedKey *second_key = second;
+  if (timestamp_before(&first_key->timestamp, &second_key->timestamp)) {
+    return -1;
+  }
+  return timestamp_before(&second_key->timestamp, &first_key->timestamp);
+}
+
+static bool timestamp_before(const Timestamp *first, const Timestamp *second) {
+  return first->seconds < second->seconds ||
+         (first->seconds == second->seconds &&
+          first->nanoseconds < second->nanoseconds);
+}
+
+// Open addressing over the positions of the keys, a slot holds the position
+// plus one.
+static bool is_new_key(uint64_t *slots, uint64_t no_slots,
+                       const IndexedKeys *indexed_keys, uint64_t index) {
+  const IndexedKey *indexed_key = indexed_keys->keys + index;
+  uint64_t slot =
+      XXH3_64bits(indexed_key->key, indexed_key->key_length) % no_slots;
+  while (0 != slots[slot]) {
+    const IndexedKey *other = indexed_keys->keys + slots[slot] - 1;
+    if (other->key_length == indexed_key->key_length &&
+        0 == memcmp(other->key, indexed_key->key, indexed_key->key_length)) {
+      return false;
+    }
+    slot = (slot + 1) % no_slots;
+  }
+  slots[slot] = index + 1;
+  return true;
+}
+
+static void skip_expired(const Record *record, void *arguments) {
+  ExpiryFilter *filter = arguments;
+  if (!record_has_expired(record)) {
+    filter->callback(record, filter->arguments);
+  }
+}
+
+static void skip_expired_value(uint64_t index, const Record *record,
+                               void *arguments) {
+  MultiGetExpiryFilter *filter = arguments;
+  bool expired = NULL != record && record_has_expired(record);
+  filter->callback(index, expired ? NULL : record, filter->arguments);
+}
+
+static void schedule_expiry(const Record *record, void *arguments) {
+  ScheduleArguments *typed_arguments = arguments;
+  Timestamp expiry;
+  if (typed_arguments->failed || !record_expiry(record, &expiry)) {
+    return;
+  }
+
+  enum FileErrorStatus error;
+  reaper_schedule(typed_arguments->reaper, record_key(record),
+                  record_key_length(record), &expiry, &error);
+  typed_arguments->failed = failure == error;
+}
+
+// Runs on the reaper thread. query_element removes the record if it is still
+// expired, a key written again since is left alone.
+static void reap_key(const char *key, uint32_t key_length, void *arguments) {
+  Database *database = arguments;
+  enum FileErrorStatus error;
+  Record record;
+  if (query_element(database, key, key_length, &record, &error)) {
+    destroy_record(&record);
+  }
+}
+
+// A sharded database keeps nothing of its own to guard, its shards are locked
+// by the calls made on them.
+static void lock_database(Database *database) {
+  if (ENGINE_SHARDED != database->engine) {
+    pthread_mutex_lock(&database->mutex);
+  }
+}
+
+static void unlock_database(Database *database) {
+  if (ENGINE_SHARDED != database->engine) {
+    pthread_mutex_unlock(&database->mutex);
+  }
+}
+
+// Answered without the lock of the database, an expired record is left to
+// the locked path which removes it.
+static bool cached_element(Database *database, const char *key,
+                           uint32_t key_length, Record *record) {
+  if (NULL == database->value_cache ||
+      !value_cache_get(database->value_cache, key, key_length, record)) {
+    return false;
+  }
+  if (record_has_expired(record)) {
+    destroy_record(record);
+    return false;
+  }
+  return true;
+}
+
+static bool lookup_element(Database *database, const char *key,
+                           uint32_t key_length, Record *record,
+                           enum FileErrorStatus *error) {
+  *error = success;
+
+  if (NULL != database->keydir) {
+    bool resolved;
+    bool found =
+        keydir_query_element(&database->data_pages, database->keydir, key,
+                             key_length, record, &resolved, error);
+    if (failure == *error || resolved) {
+      return found;
+    }
+  }
+
+  return database->operations->get(database, key, key_length, record, error);
+}
+
+static bool remove_element(Database *database, const char *key,
+                           uint32_t key_length, Record *record,
+                           enum FileErrorStatus *error) {
+  bool found =
+      database->operations->del(database, key, key_length, record, error);
+  database->commit_sequence += found;
+  if (NULL != database->value_cache) {
+    value_cache_invalidate(database->value_cache, key, key_length);
+  }
+  if (failure == *error || !found || !record_has_overflow(record) ||
+      NULL == database->overflow) {
+    return found;
+  }
+
+  OverflowReference reference = record_overflow_reference(record);
+  release_overflow_value(database, &reference, error);
+  return found;
+}
+
+// Open snapshots may still read the value, its pages are then freed once the
+// last of them closes.
+static void release_overflow_value(Database *database,
+                                   const OverflowReference *reference,
+                                   enum FileErrorStatus *error) {
+  if (!snapshot_defer_overflow_free(database, reference, error)) {
+    overflow_free_value(database->overflow, reference, error);
+  }
+}
+
+// A value too long for a record is written to overflow pages before its
+// record, the pages of the value replaced are freed once the record is
+// stored. The overflow file is only created by the first such value.
+static void put_element(Database *database, const char *key,
+                        uint32_t key_length, const char *value,
+                        uint64_t value_length, const Timestamp *expiry,
+                        enum FileErrorStatus *error) {
+  *error = success;
+
+  if (!check_put(database, key_length, value_length, expiry, error)) {
+    return;
+  }
+
+  bool replaces_overflow = false;
+  OverflowReference old_reference;
+  if (overflow_in_use(database, error)) {
+    Record old_record;
+    if (query_element(database, key, key_length, &old_record, error)) {
+      replaces_overflow = record_has_overflow(&old_record);
+      if (replaces_overflow) {
+        old_reference = record_overflow_reference(&old_record);
+      }
+      destroy_record(&old_record);
+    }
+  }
+  if (failure == *error) {
+    return;
+  }
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  bool overflow;
+  OverflowReference reference;
+  Record record =
+      make_record(database, record_safe_buffer, key, key_length, value,
+                  value_length, expiry, &overflow, &reference, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  database->operations->put(database, &record, error);
+  if (NULL != database->value_cache) {
+    value_cache_invalidate(database->value_cache, key, key_length);
+  }
+  if (failure == *error) {
+    if (overflow) {
+      enum FileErrorStatus free_error;
+      overflow_free_value(database->overflow, &reference, &free_error);
+    }
+    goto cleanup_0;
+  }
+  record_written(database, &record, expiry,
+                 replaces_overflow ? &old_reference : NULL, error);
+
+cleanup_0:
+  free_record_buffer(record_safe_buffer);
+}
+
+static bool check_put(const Database *database, uint32_t key_length,
+                      uint64_t value_length, const Timestamp *expiry,
+                      enum FileErrorStatus *error) {
+  *error = success;
+
+  if (key_length > MAX_STRING_LENGTH) {
+    fprintf(stderr, "key is too long.\n");
+    *error = failure;
+    return false;
+  }
+  if (value_length > MAX_VALUE_LENGTH) {
+    fprintf(stderr, "value is too long.\n");
+    *error = failure;
+    return false;
+  }
+  if (NULL != expiry &&
+      RECORD_FORMAT_COMPACT != database_record_format(database)) {
+    fprintf(stderr, "expiry is not supported by this database version.\n");
+    *error = failure;
+    return false;
+  }
+  return true;
+}
+
+// A value not fitting inline is written to the overflow pages, *overflow
+// then tells the caller to free them if the record is not stored.
+static Record make_record(Database *database, SafeBuffer *record_safe_buffer,
+                          const char *key, uint32_t key_length,
+                          const char *value, uint64_t value_length,
+                          const Timestamp *expiry, bool *overflow,
+                          OverflowReference *reference,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  *overflow = false;
+
+  RecordFormat format = database_record_format(database);
+  Record record;
+  if (record_fits_inline(format, key_length, value_length)) {
+    record = record_from_data(record_safe_buffer, format, key, key_length,
+                              value, value_length);
+  } else {
+    if (NULL == database->overflow) {
+      database->overflow = open_overflow_file(
+          database->path, database->page_size, true, true, error);
+      if (failure == *error) {
+        return record;
+      }
+    }
+    overflow_write_value(database->overflow, value, value_length, reference,
+                         error);
+    if (failure == *error) {
+      return record;
+    }
+    *overflow = true;
+    record = record_from_overflow(record_safe_buffer, format, key, key_length,
+                                  reference);
+  }
+  if (NULL != expiry) {
+    record_set_expiry(&record, expiry);
+  }
+  return record;
+}
+
+// Bookkeeping of a record stored in place of the one holding replaced, NULL
+// when that one had no overflow value.
+static void record_written(Database *database, const Record *record,
+                           const Timestamp *expiry,
+                           const OverflowReference *replaced,
+                           enum FileErrorStatus *error) {
+  *error = success;
+  const char *key = record_key(record);
+  uint32_t key_length = record_key_length(record);
+  ++database->commit_sequence;
+
+  if (NULL != replaced) {
+    release_overflow_value(database, replaced, error);
+  }
+  if (success == *error && NULL != database->time_index) {
+    Timestamp last = record_last_timestamp(record);
+    time_index_add(database->time_index, key, key_length, &last, error);
+  }
+
+  // a key the reaper misses is still dropped when it is next read
+  if (NULL != database->reaper && NULL != expiry) {
+    enum FileErrorStatus schedule_error;
+    reaper_schedule(database->reaper, key, key_length, expiry,
+                    &schedule_error);
+  }
+}
+
+// With an update operation of the engine the key is found once and the new
+// record stored where it was, otherwise it is read and then put.
+static bool update_element(Database *database, const char *key,
+                           uint32_t key_length, ValueUpdate update,
+                           void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  bool written = false;
+
+  if (key_length > MAX_STRING_LENGTH) {
+    fprintf(stderr, "key is too long.\n");
+    *error = failure;
+    return false;
+  }
+
+  lock_database(database);
+  if (NULL == database->operations->update) {
+    char *value;
+    uint64_t length;
+    Timestamp expiry;
+    bool expires;
+    bool found = read_for_update(database, key, key_length, &value, &length,
+                                 &expiry, &expires, error);
+    const char *new_value;
+    uint64_t new_length;
+    if (success == *error &&
+        update(value, length, found, &new_value, &new_length, arguments,
+               error) &&
+        success == *error) {
+      put_element(database, key, key_length, new_value, new_length,
+                  expires ? &expiry : NULL, error);
+      written = success == *error;
+    }
+    free(value);
+    goto cleanup_0;
+  }
+
+  RecordUpdate record_update = {.database = database,
+                                .key = key,
+                                .key_length = key_length,
+                                .update = update,
+                                .arguments = arguments,
+                                .record_safe_buffer = allocate_record_buffer(),
+                                .expires = false,
+                                .overflow = false,
+                                .replaces_overflow = false};
+  if (NULL == record_update.record_safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  written = database->operations->update(database, key, key_length,
+                                         update_record, &record_update, error);
+  if (NULL != database->value_cache) {
+    value_cache_invalidate(database->value_cache, key, key_length);
+  }
+  if (failure == *error) {
+    if (record_update.overflow) {
+      enum FileErrorStatus free_error;
+      overflow_free_value(database->overflow, &record_update.reference,
+                          &free_error);
+    }
+    written = false;
+  } else if (written) {
+    record_written(database, &record_update.record,
+                   record_update.expires ? &record_update.expiry : NULL,
+                   record_update.replaces_overflow
+                       ? &record_update.old_reference
+                       : NULL,
+                   error);
+  }
+  free_record_buffer(record_update.record_safe_buffer);
+
+cleanup_0:
+  unlock_database(database);
+  return written;
+}
+
+// An expired record reads as a missing key, and is replaced all the same.
+static bool update_record(const Record *current, Record *updated,
+                          void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  RecordUpdate *record_update = arguments;
+  Database *database = record_update->database;
+
+  bool found = NULL != current && !record_has_expired(current);
+  char *value = NULL;
+  uint64_t length = 0;
+  if (found) {
+    record_update->expires = record_expiry(current, &record_update->expiry);
+    value = read_record_value(database, current, &length, error);
+    if (failure == *error) {
+      return false;
+    }
+  }
+
+  const char *new_value;
+  uint64_t new_length;
+  const Timestamp *expiry =
+      record_update->expires ? &record_update->expiry : NULL;
+  bool update = record_update->update(value, length, found, &new_value,
+                                      &new_length, record_update->arguments,
+                                      error) &&
+                success == *error &&
+                check_put(database, record_update->key_length, new_length,
+                          expiry, error);
+  if (update) {
+    record_update->record = make_record(
+        database, record_update->record_safe_buffer, record_update->key,
+        record_update->key_length, new_value, new_length, expiry,
+        &record_update->overflow, &record_update->reference, error);
+  }
+  free(value);
+  if (!update || failure == *error) {
+    return false;
+  }
+
+  if (found) {
+    record_set_first_timestamp(&record_update->record,
+                               record_first_timestamp(current));
+  }
+  if (NULL != current) {
+    record_update->replaces_overflow = record_has_overflow(current);
+    if (record_update->replaces_overflow) {
+      record_update->old_reference = record_overflow_reference(current);
+    }
+  }
+  *updated = record_update->record;
+  return true;
+}
+
+// A missing key reads as an empty value without expiry. The value is owned by
+// the caller, also when the key is missing.
+static bool read_for_update(Database *database, const char *key,
+                            uint32_t key_length, char **value,
+                            uint64_t *length, Timestamp *expiry,
+                            bool *expires, enum FileErrorStatus *error) {
+  *value = NULL;
+  *length = 0;
+  *expires = false;
+
+  Record record;
+  bool found = query_element(database, key, key_length, &record, error);
+  if (failure == *error || !found) {
+    return false;
+  }
+
+  *expires = record_expiry(&record, expiry);
+  *value = read_record_value(database, &record, length, error);
+  destroy_record(&record);
+  return success == *error;
+}
+
+// Decimal digits with an optional sign, nothing else.
+static bool parse_integer(const char *value, uint64_t length,
+                          int64_t *integer) {
+  if (0 == length || isspace((unsigned char)value[0])) {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  long long parsed = strtoll(value, &end, 10);
+  if (0 != errno || end != value + length) {
+    return false;
+  }
+  *integer = parsed;
+  return true;
+}
+
+static bool increment_value(const char *value, uint64_t length, bool found,
+                            const char **new_value, uint64_t *new_length,
+                            void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  Increment *increment = arguments;
+
+  int64_t current = 0;
+  if (found && !parse_integer(value, length, &current)) {
+    fprintf(stderr, "value is not an integer.\n");
+    *error = failure;
+    return false;
+  }
+  int64_t delta = increment->delta;
+  if ((delta > 0 && current > INT64_MAX - delta) ||
+      (delta < 0 && current < INT64_MIN - delta)) {
+    fprintf(stderr, "increment overflows the value.\n");
+    *error = failure;
+    return false;
+  }
+
+  increment->result = current + delta;
+  *new_length = snprintf(increment->digits, sizeof(increment->digits),
+                         "%" PRId64, increment->result);
+  *new_value = increment->digits;
+  return true;
+}
+
+// The appended value is freed by the caller of the update.
+static bool append_value(const char *value, uint64_t length, bool found,
+                         const char **new_value, uint64_t *new_length,
+                         void *arguments, enum FileErrorStatus *error) {
+  (void)found;
+  *error = success;
+  Append *append = arguments;
+
+  if (length + append->suffix_length > MAX_VALUE_LENGTH) {
+    fprintf(stderr, "value is too long.\n");
+    *error = failure;
+    return false;
+  }
+
+  append->length = length + append->suffix_length;
+  *new_length = append->length;
+  *new_value = "";
+  if (0 == append->length) {
+    return true;
+  }
+  append->value = malloc(append->length);
+  if (NULL == append->value) {
+    fprintf(stderr, "cannot allocate value.\n");
+    *error = failure;
+    return false;
+  }
+  if (0 != length) {
+    memcpy(append->value, value, length);
+  }
+  memcpy(append->value + length, append->suffix, append->suffix_length);
+  *new_value = append->value;
+  return true;
+}
+
+static bool compare_and_set_value(const char *value, uint64_t length,
+                                  bool found, const char **new_value,
+                                  uint64_t *new_length, void *arguments,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+  const CompareAndSet *compare_and_set = arguments;
+
+  if (!found || length != compare_and_set->expected_length ||
+      0 != memcmp(value, compare_and_set->expected, length)) {
+    return false;
+  }
+  *new_value = compare_and_set->value;
+  *new_length = compare_and_set->value_length;
+  return true;
+}
+
+static Timestamp current_time(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (Timestamp){.seconds = now.tv_sec, .nanoseconds = now.tv_nsec};
+}
+
+static Timestamp expiry_after(uint64_t ttl_seconds) {
+  Timestamp expiry = current_time();
+  expiry.seconds += ttl_seconds;
+  return expiry;
+}
+
+static void uncache_batch(Database *database, const WriteBatch *write_batch) {
+  if (NULL == database->value_cache) {
+    return;
+  }
+  for (uint64_t i = 0; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    value_cache_invalidate(database->value_cache, entry->key,
+                           entry->key_length);
+  }
+}
+
+// The batched path builds its records in the engine, their own last write
+// is read back and indexed in time order, as a single put does.
+static void index_batch(Database *database, const WriteBatch *write_batch,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  if (NULL == database->time_index) {
+    return;
+  }
+
+  IndexedKeys indexed_keys = {
+      .keys = NULL, .no_keys = 0, .capacity = 0, .failed = false};
+  for (uint64_t i = 0; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    Record record;
+    if (WRITE_BATCH_PUT != entry->type ||
+        !database->operations->get(database, entry->key, entry->key_length,
+                                   &record, error)) {
+      if (failure == *error) {
+        goto cleanup_0;
+      }
+      continue;
+    }
+    collect_record_key(&record, &indexed_keys);
+    destroy_record(&record);
+  }
+  if (indexed_keys.failed) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  if (0 != indexed_keys.no_keys) {
+    qsort(indexed_keys.keys, indexed_keys.no_keys, sizeof(IndexedKey),
+          compare_indexed_keys);
+  }
+  add_indexed_keys(database->time_index, &indexed_keys, error);
+
+cleanup_0:
+  free(indexed_keys.keys);
+}
+
+static bool overflow_in_use(const Database *database,
+                            enum FileErrorStatus *error) {
+  *error = success;
+  return NULL != database->overflow &&
+         0 < overflow_no_used_pages(database->overflow, error);
+}
+
+// The overflow references of the keys of the batch, each once.
+static uint64_t collect_replaced_values(Database *database,
+                                        const WriteBatch *write_batch,
+                                        OverflowReference *references,
+                                        enum FileErrorStatus *error) {
+  uint64_t no_references = 0;
+  if (!overflow_in_use(database, error)) {
+    return 0;
+  }
+
+  for (uint64_t i = 0; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    Record record;
+    if (!query_element(database, entry->key, entry->key_length, &record,
+                       error)) {
+      if (failure == *error) {
+        return 0;
+      }
+      continue;
+    }
+
+    if (record_has_overflow(&record)) {
+      OverflowReference reference = record_overflow_reference(&record);
+      bool seen = false;
+      for (uint64_t j = 0; j < no_references && !seen; ++j) {
+        seen = references[j].first_page == reference.first_page;
+      }
+      if (!seen) {
+        references[no_references++] = reference;
+      }
+    }
+    destroy_record(&record);
+  }
+  return no_references;
 }
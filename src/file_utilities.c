@@ -1,9 +1,10 @@
 #include "../include/file_utilities.h"
 #include "../include/buffer_manager.h"
-#include "../include/data_page.h"
 #include "../include/header_page.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,14 +16,14 @@
 static void lock_page(int file, uint64_t page_id, enum FileErrorStatus *error,
                       char *error_message, short l_type);
 
-static void assert_page_size(uint64_t page_id);
+static void assert_page_offset(uint64_t page_id, uint64_t page_size);
 
 // API implementation
 
-int create_database_file(char *path, uint64_t no_elements,
-                         enum FileErrorStatus *error) {
-  assert(no_elements < MAX_NO_ELEMENTS);
-  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0600);
+// The header page stays write locked until the file is closed, the engine
+// formats the rest of the file before the header is written.
+int create_database_file(char *path, enum FileErrorStatus *error) {
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
 
   *error = success;
   if (-1 == fd) {
@@ -32,48 +33,16 @@ int create_database_file(char *path, uint64_t no_elements,
     return -1;
   }
 
-  uint64_t no_pages_needed =
-      (((no_elements * RECORD_SIZE_ESTIMATE - PAGE_SIZE + 1) / PAGE_SIZE)
-       << 1) +
-      1;
-  SafeBuffer *safe_buffer = allocate_page_buffer();
-  if (NULL == safe_buffer) {
-    *error = failure;
-    return -1;
-  }
-
-  for (uint64_t i = 0; i < no_pages_needed; ++i) {
-    if (0 == i) {
-      write_lock_page(fd, i, error);
-      if (failure == *error) {
-        free_page_buffer(safe_buffer);
-        return -1;
-      }
-      create_header_page(safe_buffer, no_pages_needed);
-      write_page_to_file(fd, safe_buffer, i, true, error);
-      if (failure == *error) {
-        free_page_buffer(safe_buffer);
-        return -1;
-      }
-    } else {
-      data_page_from_data(safe_buffer, i);
-      write_page_to_file(fd, safe_buffer, i, true, error);
-      if (failure == *error) {
-        free_page_buffer(safe_buffer);
-        return -1;
-      }
-    }
-  }
-  unlock_page(fd, 0, error);
+  write_lock_page(fd, 0, error);
   if (failure == *error) {
-    free_page_buffer(safe_buffer);
+    close(fd);
     return -1;
   }
-  free_page_buffer(safe_buffer);
+
   return fd;
 }
 
-int open_database_file(char *path, bool with_write_lock,
+int open_database_file(char *path, bool with_write_lock, uint64_t *page_size,
                        enum FileErrorStatus *error) {
   int fd = open(path, O_RDWR);
   *error = success;
@@ -84,15 +53,12 @@ int open_database_file(char *path, bool with_write_lock,
     *error = failure;
     return -1;
   }
-  if (with_write_lock) {
-    write_lock_page(fd, 0, error);
-  } else {
-    read_lock_page(fd, 0, error);
-  }
+  // write locked once the header is checked, see below
+  read_lock_page(fd, 0, error);
   if (failure == *error) {
     return -1;
   }
-  SafeBuffer *safe_buffer = allocate_page_buffer();
+  SafeBuffer *safe_buffer = allocate_page_buffer(HEADER_PAGE_SIZE);
   if (NULL == safe_buffer) {
     *error = failure;
     unlock_page(fd, 0, error);
@@ -107,12 +73,35 @@ int open_database_file(char *path, bool with_write_lock,
   }
   HeaderPage header_page = open_header_page(safe_buffer);
   uint64_t local_header_version = header_version(&header_page);
-  if (local_header_version != DATABASE_VERSION) {
+  *page_size = header_page_size(&header_page);
+  EngineType engine = header_engine(&header_page);
+  free_page_buffer(safe_buffer);
+  if (local_header_version != DATABASE_VERSION &&
+      local_header_version != DATABASE_VERSION_XXH3 &&
+      local_header_version != DATABASE_VERSION_XXH64) {
+    fprintf(stderr, "unsupported database version.\n");
+    unlock_page(fd, 0, error);
     *error = failure;
+    return -1;
+  }
+  // checked before anything else is read, the journal included
+  if (*page_size < MIN_PAGE_SIZE || *page_size > MAX_PAGE_SIZE ||
+      0 != (*page_size & (*page_size - 1))) {
+    fprintf(stderr, "unsupported page size of %" PRIu64 " bytes.\n",
+            *page_size);
     unlock_page(fd, 0, error);
-    free_page_buffer(safe_buffer);
+    *error = failure;
     return -1;
   }
+  // the file of a sharded database is not written after its creation, its
+  // writers keep the read lock and only write lock the shards they open
+  if (with_write_lock && ENGINE_SHARDED != engine) {
+    unlock_page(fd, 0, error);
+    write_lock_page(fd, 0, error);
+    if (failure == *error) {
+      return -1;
+    }
+  }
 
   return fd;
 }
@@ -120,8 +109,6 @@ int open_database_file(char *path, bool with_write_lock,
 void locked_read_page_into_buffer(int file, uint64_t page_id,
                                   SafeBuffer *safe_buffer,
                                   enum FileErrorStatus *error) {
-  assert_page_size(page_id);
-
   *error = success;
 
   read_lock_page(file, page_id, error);
@@ -139,11 +126,12 @@ void locked_read_page_into_buffer(int file, uint64_t page_id,
 
 void read_page_into_buffer(int file, uint64_t page_id, SafeBuffer *safe_buffer,
                            enum FileErrorStatus *error) {
-  assert_page_size(page_id);
+  size_t page_size = get_buffer_capacity(safe_buffer);
+  assert_page_offset(page_id, page_size);
 
   *error = success;
 
-  uint64_t offset_from_start = (page_id * PAGE_SIZE);
+  uint64_t offset_from_start = (page_id * page_size);
   off_t lseek_offset = lseek(file, offset_from_start, SEEK_SET);
   if (-1 == lseek_offset) {
     *error = failure;
@@ -151,21 +139,19 @@ void read_page_into_buffer(int file, uint64_t page_id, SafeBuffer *safe_buffer,
     return;
   }
 
-  ssize_t bytes_read = read(file, get_buffer(safe_buffer), PAGE_SIZE);
-  if (PAGE_SIZE != bytes_read) {
+  ssize_t bytes_read = read(file, get_buffer(safe_buffer), page_size);
+  if ((ssize_t)page_size != bytes_read) {
     *error = failure;
     fprintf(stderr, "failed to read a page from file.\n");
     return;
   }
 
-  set_buffer_length(safe_buffer, PAGE_SIZE);
+  set_buffer_length(safe_buffer, page_size);
 }
 
 void locked_write_page_to_file(int file, SafeBuffer *safe_buffer,
                                uint64_t page_id, bool append_only,
                                enum FileErrorStatus *error) {
-  assert_page_size(page_id);
-
   *error = success;
 
   write_lock_page(file, page_id, error);
@@ -183,12 +169,13 @@ void locked_write_page_to_file(int file, SafeBuffer *safe_buffer,
 
 void write_page_to_file(int file, SafeBuffer *safe_buffer, uint64_t page_id,
                         bool append_only, enum FileErrorStatus *error) {
-  assert_page_size(page_id);
+  size_t page_size = get_buffer_capacity(safe_buffer);
+  assert_page_offset(page_id, page_size);
 
   *error = success;
 
   if (!append_only) {
-    uint64_t offset_from_start = (page_id * PAGE_SIZE);
+    uint64_t offset_from_start = (page_id * page_size);
     off_t lseek_offset = lseek(file, offset_from_start, SEEK_SET);
     if (-1 == lseek_offset) {
       *error = failure;
@@ -197,7 +184,7 @@ void write_page_to_file(int file, SafeBuffer *safe_buffer, uint64_t page_id,
     }
   }
 
-  size_t bytes_written = write(file, get_buffer(safe_buffer), PAGE_SIZE);
+  size_t bytes_written = write(file, get_buffer(safe_buffer), page_size);
   if (bytes_written != get_buffer_length(safe_buffer)) {
     fprintf(stderr, "failed to write to file.\n");
     *error = failure;
@@ -207,22 +194,16 @@ void write_page_to_file(int file, SafeBuffer *safe_buffer, uint64_t page_id,
 }
 
 void read_lock_page(int file, uint64_t page_id, enum FileErrorStatus *error) {
-  assert_page_size(page_id);
-
   lock_page(file, page_id, error,
             "process interrupted while read locking page.\n", F_RDLCK);
 }
 
 void write_lock_page(int file, uint64_t page_id, enum FileErrorStatus *error) {
-  assert_page_size(page_id);
-
   lock_page(file, page_id, error,
             "process interrupted while write locking page.\n", F_WRLCK);
 }
 
 void unlock_page(int file, uint64_t page_id, enum FileErrorStatus *error) {
-  assert_page_size(page_id);
-
   lock_page(file, page_id, error,
             "process interrupted while write locking page.\n", F_UNLCK);
 }
@@ -242,20 +223,33 @@ void close_database_file(int fd, enum FileErrorStatus *error) {
   *error = success;
 }
 
+bool sync_parent_directory(const char *path) {
+  char buffer[PATH_MAX];
+  snprintf(buffer, sizeof(buffer), "%s", path);
+  int fd = open(dirname(buffer), O_RDONLY);
+  if (-1 == fd) {
+    return false;
+  }
+  bool synced = 0 == fsync(fd);
+  close(fd);
+  return synced;
+}
+
 // Local implementation
 
+// A page is locked through the byte at its page id, which does not depend on
+// the page size, the header page lock is then taken before the size is known.
 static void lock_page(int file, uint64_t page_id, enum FileErrorStatus *error,
                       char *error_message, short l_type) {
-  assert_page_size(page_id);
+  assert(page_id < INT64_MAX);
 
   *error = success;
-  uint64_t offset_from_start = (page_id * PAGE_SIZE);
 
   struct flock lock = {
       .l_type = l_type,
       .l_whence = SEEK_SET,
-      .l_start = offset_from_start,
-      .l_len = PAGE_SIZE,
+      .l_start = page_id,
+      .l_len = 1,
   };
 
   int fcntl_error = fcntl(file, F_SETLKW, &lock);
@@ -265,6 +259,6 @@ static void lock_page(int file, uint64_t page_id, enum FileErrorStatus *error,
   }
 }
 
-static void assert_page_size(uint64_t page_id) {
-  assert(0 == (page_id >> (64 - PAGE_NO_BITS)));
+static void assert_page_offset(uint64_t page_id, uint64_t page_size) {
+  assert(page_id < INT64_MAX / page_size);
 }
@@ -16,23 +16,51 @@
 #define NO_PAGES_SIZE (8)
 #define NO_PAGES_OFFSET (VERSION_OFFSET + VERSION_SIZE)
 
-// page id (8 bytes) | database_version (8 bytes) | no_pages(8 bytes) | reserved
-// (4072 bytes)
+#define ENGINE_SIZE (8)
+#define ENGINE_OFFSET (NO_PAGES_OFFSET + NO_PAGES_SIZE)
+
+#define ROOT_PAGE_SIZE (8)
+#define ROOT_PAGE_OFFSET (ENGINE_OFFSET + ENGINE_SIZE)
+
+#define FIRST_SEGMENT_SIZE (8)
+#define FIRST_SEGMENT_OFFSET (ROOT_PAGE_OFFSET + ROOT_PAGE_SIZE)
+
+#define LAST_SEGMENT_SIZE (8)
+#define LAST_SEGMENT_OFFSET (FIRST_SEGMENT_OFFSET + FIRST_SEGMENT_SIZE)
+
+#define NO_SHARDS_SIZE (8)
+#define NO_SHARDS_OFFSET (LAST_SEGMENT_OFFSET + LAST_SEGMENT_SIZE)
+
+#define PAGE_SIZE_SIZE (8)
+#define PAGE_SIZE_OFFSET (NO_SHARDS_OFFSET + NO_SHARDS_SIZE)
+
+#define PAGE_CODEC_SIZE (8)
+#define PAGE_CODEC_OFFSET (PAGE_SIZE_OFFSET + PAGE_SIZE_SIZE)
+
+// page id (8 bytes) | database_version (8 bytes) | no_pages(8 bytes) | engine
+// (8 bytes) | root page (8 bytes) | first segment (8 bytes) | last segment (8
+// bytes) | no_shards (8 bytes) | page size (8 bytes) | page codec (8 bytes) |
+// reserved (rest of the page)
 
 static void update_page_id(HeaderPage *header_page, size_t free_space);
 static void update_version(HeaderPage *header_page, uint64_t version);
 static void update_no_pages(HeaderPage *header_page, uint64_t no_pages);
+static void update_engine(HeaderPage *header_page, EngineType engine);
 static void assert_header_page(const HeaderPage *header_page);
 
-HeaderPage create_header_page(SafeBuffer *safe_buffer, uint64_t no_pages) {
+HeaderPage create_header_page(SafeBuffer *safe_buffer, uint64_t no_pages,
+                              EngineType engine) {
   assert(safe_buffer);
   uint8_t *buffer = get_buffer(safe_buffer);
-  memset(buffer, 0, get_buffer_capacity(safe_buffer));
-  set_buffer_length(safe_buffer, HEADER_PAGE_SIZE);
+  size_t page_size = get_buffer_capacity(safe_buffer);
+  memset(buffer, 0, page_size);
+  set_buffer_length(safe_buffer, page_size);
   HeaderPage header_page = {.safe_buffer = safe_buffer};
   update_page_id(&header_page, 0);
   update_version(&header_page, DATABASE_VERSION);
   update_no_pages(&header_page, no_pages);
+  update_engine(&header_page, engine);
+  write_data_to_buffer(buffer, PAGE_SIZE_OFFSET, PAGE_SIZE_SIZE, page_size);
   return header_page;
 }
 
@@ -48,6 +76,11 @@ uint64_t header_no_pages(const HeaderPage *header_page) {
                                            NO_PAGES_SIZE);
 }
 
+void header_set_no_pages(HeaderPage *header_page, uint64_t no_pages) {
+  assert_header_page(header_page);
+  update_no_pages(header_page, no_pages);
+}
+
 uint64_t header_page_id(const HeaderPage *header_page) {
   assert_header_page(header_page);
   const uint8_t *buffer = get_buffer(header_page->safe_buffer);
@@ -62,6 +95,88 @@ uint64_t header_version(const HeaderPage *header_page) {
                                            VERSION_SIZE);
 }
 
+EngineType header_engine(const HeaderPage *header_page) {
+  assert_header_page(header_page);
+  const uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  return (EngineType)read_data_from_buffer(buffer, ENGINE_OFFSET, ENGINE_SIZE);
+}
+
+uint64_t header_root_page(const HeaderPage *header_page) {
+  assert_header_page(header_page);
+  const uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  return (uint64_t)read_data_from_buffer(buffer, ROOT_PAGE_OFFSET,
+                                         ROOT_PAGE_SIZE);
+}
+
+void header_set_root_page(HeaderPage *header_page, uint64_t root_page) {
+  assert_header_page(header_page);
+  uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  write_data_to_buffer(buffer, ROOT_PAGE_OFFSET, ROOT_PAGE_SIZE, root_page);
+}
+
+uint64_t header_first_segment(const HeaderPage *header_page) {
+  assert_header_page(header_page);
+  const uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  return (uint64_t)read_data_from_buffer(buffer, FIRST_SEGMENT_OFFSET,
+                                         FIRST_SEGMENT_SIZE);
+}
+
+void header_set_first_segment(HeaderPage *header_page,
+                              uint64_t first_segment) {
+  assert_header_page(header_page);
+  uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  write_data_to_buffer(buffer, FIRST_SEGMENT_OFFSET, FIRST_SEGMENT_SIZE,
+                       first_segment);
+}
+
+uint64_t header_last_segment(const HeaderPage *header_page) {
+  assert_header_page(header_page);
+  const uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  return (uint64_t)read_data_from_buffer(buffer, LAST_SEGMENT_OFFSET,
+                                         LAST_SEGMENT_SIZE);
+}
+
+void header_set_last_segment(HeaderPage *header_page, uint64_t last_segment) {
+  assert_header_page(header_page);
+  uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  write_data_to_buffer(buffer, LAST_SEGMENT_OFFSET, LAST_SEGMENT_SIZE,
+                       last_segment);
+}
+
+uint64_t header_no_shards(const HeaderPage *header_page) {
+  assert_header_page(header_page);
+  const uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  return (uint64_t)read_data_from_buffer(buffer, NO_SHARDS_OFFSET,
+                                         NO_SHARDS_SIZE);
+}
+
+void header_set_no_shards(HeaderPage *header_page, uint64_t no_shards) {
+  assert_header_page(header_page);
+  uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  write_data_to_buffer(buffer, NO_SHARDS_OFFSET, NO_SHARDS_SIZE, no_shards);
+}
+
+uint64_t header_page_size(const HeaderPage *header_page) {
+  assert_header_page(header_page);
+  const uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  uint64_t page_size =
+      read_data_from_buffer(buffer, PAGE_SIZE_OFFSET, PAGE_SIZE_SIZE);
+  return 0 == page_size ? DEFAULT_PAGE_SIZE : page_size;
+}
+
+PageCodec header_page_codec(const HeaderPage *header_page) {
+  assert_header_page(header_page);
+  const uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  return (PageCodec)read_data_from_buffer(buffer, PAGE_CODEC_OFFSET,
+                                          PAGE_CODEC_SIZE);
+}
+
+void header_set_page_codec(HeaderPage *header_page, PageCodec page_codec) {
+  assert_header_page(header_page);
+  uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  write_data_to_buffer(buffer, PAGE_CODEC_OFFSET, PAGE_CODEC_SIZE, page_codec);
+}
+
 const uint8_t *header_page_buffer(HeaderPage *header_page) {
   assert_header_page(header_page);
   uint8_t *buffer = get_buffer(header_page->safe_buffer);
@@ -88,6 +203,11 @@ static void update_no_pages(HeaderPage *header_page, uint64_t no_pages) {
   write_data_to_buffer(buffer, NO_PAGES_OFFSET, NO_PAGES_SIZE, no_pages);
 }
 
+static void update_engine(HeaderPage *header_page, EngineType engine) {
+  uint8_t *buffer = get_buffer(header_page->safe_buffer);
+  write_data_to_buffer(buffer, ENGINE_OFFSET, ENGINE_SIZE, engine);
+}
+
 static void assert_header_page(const HeaderPage *header_page) {
   assert(header_page);
   assert(header_page->safe_buffer);
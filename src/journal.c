@@ -0,0 +1,239 @@
+#include "../include/journal.h"
+#include "../include/buffer_utilities.h"
+#include "../include/constants.h"
+#include "../include/file_utilities.h"
+#include "../include/xxhash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Layout: no_pages | checksum of the entries | entries, an entry being the
+// page id followed by the page as stored in the database file. An empty
+// journal has nothing to replay.
+#define JOURNAL_SUFFIX ".journal"
+#define NO_PAGES_OFFSET (0)
+#define NO_PAGES_SIZE (8)
+#define CHECKSUM_OFFSET (NO_PAGES_OFFSET + NO_PAGES_SIZE)
+#define CHECKSUM_SIZE (8)
+#define JOURNAL_HEADER_SIZE (CHECKSUM_OFFSET + CHECKSUM_SIZE)
+#define PAGE_ID_SIZE (8)
+#define JOURNAL_ENTRY_SIZE(page_size) (PAGE_ID_SIZE + (page_size))
+
+static int open_journal(const char *path, bool create,
+                        enum FileErrorStatus *error);
+static void replay_journal(int journal_fd, int fd, uint64_t page_size,
+                           enum FileErrorStatus *error);
+static bool write_all(int fd, const uint8_t *data, uint64_t length,
+                      off_t offset);
+
+// API implementation
+
+// Pages reach the database file only once the journal holding them is synced,
+// and the journal is emptied once they are synced in turn.
+void journal_commit_pages(const char *path, int fd, uint64_t page_size,
+                          const JournalPage *pages, uint64_t no_pages,
+                          enum FileErrorStatus *error) {
+  *error = success;
+
+  int journal_fd = open_journal(path, true, error);
+  if (failure == *error) {
+    return;
+  }
+
+  uint64_t length =
+      JOURNAL_HEADER_SIZE + no_pages * JOURNAL_ENTRY_SIZE(page_size);
+  uint8_t *journal = malloc(length);
+  if (NULL == journal) {
+    fprintf(stderr, "cannot allocate journal.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < no_pages; ++i) {
+    uint8_t *entry =
+        journal + JOURNAL_HEADER_SIZE + i * JOURNAL_ENTRY_SIZE(page_size);
+    write_data_to_buffer(entry, 0, PAGE_ID_SIZE, pages[i].page_id);
+    memcpy(entry + PAGE_ID_SIZE, pages[i].page, page_size);
+  }
+  write_data_to_buffer(journal, NO_PAGES_OFFSET, NO_PAGES_SIZE, no_pages);
+  write_data_to_buffer(journal, CHECKSUM_OFFSET, CHECKSUM_SIZE,
+                       XXH3_64bits(journal + JOURNAL_HEADER_SIZE,
+                                   length - JOURNAL_HEADER_SIZE));
+
+  if (!write_all(journal_fd, journal, length, 0) ||
+      -1 == fdatasync(journal_fd)) {
+    fprintf(stderr, "failed to write journal.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  for (uint64_t i = 0; i < no_pages; ++i) {
+    if (!write_all(fd, pages[i].page, page_size,
+                   pages[i].page_id * page_size)) {
+      fprintf(stderr, "failed to write a page to file.\n");
+      *error = failure;
+      goto cleanup_1;
+    }
+  }
+  // a journal left behind is replayed once more, the pages are the same
+  if (-1 == fdatasync(fd) || -1 == ftruncate(journal_fd, 0)) {
+    fprintf(stderr, "failed to complete journal.\n");
+    *error = failure;
+  }
+
+cleanup_1:
+  free(journal);
+cleanup_0:
+  close(journal_fd);
+}
+
+void journal_recover(const char *path, int fd, uint64_t page_size,
+                     bool with_write_lock, enum FileErrorStatus *error) {
+  *error = success;
+
+  int journal_fd = open_journal(path, false, error);
+  if (failure == *error || -1 == journal_fd) {
+    return;
+  }
+  if (0 == lseek(journal_fd, 0, SEEK_END)) {
+    goto cleanup_0;
+  }
+
+  if (!with_write_lock) {
+    unlock_page(fd, 0, error);
+    if (success == *error) {
+      write_lock_page(fd, 0, error);
+    }
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+  // another reader may have replayed it while this one waited
+  replay_journal(journal_fd, fd, page_size, error);
+
+  if (!with_write_lock) {
+    enum FileErrorStatus lock_error;
+    read_lock_page(fd, 0, &lock_error);
+    if (failure == lock_error) {
+      *error = failure;
+    }
+  }
+
+cleanup_0:
+  close(journal_fd);
+}
+
+// Local implementation
+
+// Returns -1 without an error when the journal does not exist and is not
+// created. A journal created here has its directory entry synced, it is then
+// kept and only truncated.
+static int open_journal(const char *path, bool create,
+                        enum FileErrorStatus *error) {
+  *error = success;
+
+  char buffer[PATH_MAX];
+  snprintf(buffer, sizeof(buffer), "%s" JOURNAL_SUFFIX, path);
+  int fd = open(buffer, O_RDWR);
+  if (-1 != fd) {
+    return fd;
+  }
+  if (ENOENT != errno) {
+    fprintf(stderr, "cannot open journal.\n");
+    *error = failure;
+    return -1;
+  }
+  if (!create) {
+    return -1;
+  }
+
+  fd = open(buffer, O_RDWR | O_CREAT, 0600);
+  if (-1 == fd || !sync_parent_directory(buffer)) {
+    fprintf(stderr, "cannot create journal.\n");
+    *error = failure;
+    if (-1 != fd) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// A journal failing its checksum was cut short before any page was written in
+// place and is dropped.
+static void replay_journal(int journal_fd, int fd, uint64_t page_size,
+                           enum FileErrorStatus *error) {
+  *error = success;
+
+  off_t length = lseek(journal_fd, 0, SEEK_END);
+  if (length < JOURNAL_HEADER_SIZE) {
+    goto cleanup_0;
+  }
+
+  uint8_t *journal = malloc(length);
+  if (NULL == journal) {
+    fprintf(stderr, "cannot allocate journal.\n");
+    *error = failure;
+    return;
+  }
+  if (length != pread(journal_fd, journal, length, 0)) {
+    fprintf(stderr, "failed to read journal.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  uint64_t no_pages =
+      read_data_from_buffer(journal, NO_PAGES_OFFSET, NO_PAGES_SIZE);
+  uint64_t checksum =
+      read_data_from_buffer(journal, CHECKSUM_OFFSET, CHECKSUM_SIZE);
+  uint64_t expected_length =
+      JOURNAL_HEADER_SIZE + no_pages * JOURNAL_ENTRY_SIZE(page_size);
+  if ((uint64_t)length != expected_length ||
+      checksum != XXH3_64bits(journal + JOURNAL_HEADER_SIZE,
+                              length - JOURNAL_HEADER_SIZE)) {
+    goto cleanup_1;
+  }
+
+  for (uint64_t i = 0; i < no_pages; ++i) {
+    const uint8_t *entry =
+        journal + JOURNAL_HEADER_SIZE + i * JOURNAL_ENTRY_SIZE(page_size);
+    uint64_t page_id = read_data_from_buffer(entry, 0, PAGE_ID_SIZE);
+    if (!write_all(fd, entry + PAGE_ID_SIZE, page_size,
+                   page_id * page_size)) {
+      fprintf(stderr, "failed to replay journal.\n");
+      *error = failure;
+      goto cleanup_1;
+    }
+  }
+  if (-1 == fdatasync(fd)) {
+    fprintf(stderr, "failed to replay journal.\n");
+    *error = failure;
+  }
+
+cleanup_1:
+  free(journal);
+cleanup_0:
+  if (success == *error && -1 == ftruncate(journal_fd, 0)) {
+    fprintf(stderr, "cannot truncate journal.\n");
+    *error = failure;
+  }
+}
+
+static bool write_all(int fd, const uint8_t *data, uint64_t length,
+                      off_t offset) {
+  while (length > 0) {
+    ssize_t written = pwrite(fd, data, length, offset);
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    length -= written;
+    offset += written;
+  }
+  return true;
+}
@@ -0,0 +1,473 @@
+#include "../include/keydir.h"
+#include "../include/buffer_manager.h"
+#include "../include/data_page.h"
+#include "../include/file_utilities.h"
+#include "../include/record.h"
+#include "../include/xxhash.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Pages read per pread while building, large enough to stream the file.
+#define SCAN_CHUNK_PAGES (256)
+#define MIN_CAPACITY (1024)
+#define MAX_SCAN_THREADS (64)
+
+typedef struct {
+  DataPageFile file;
+  uint64_t from_page;
+  uint64_t to_page;
+  KeyDirEntry *entries;
+  uint64_t no_entries;
+  uint64_t capacity;
+  bool failed;
+} ScanTask;
+
+typedef struct {
+  ScanTask *task;
+  uint64_t page_id;
+} CollectArguments;
+
+typedef struct {
+  KeyDir *keydir;
+  uint64_t page_id;
+  bool failed;
+} IndexPageArguments;
+
+static uint64_t key_hash(const char *key, uint32_t key_length);
+static KeyDirEntry make_entry(const char *key, uint32_t key_length,
+                              uint64_t page_id, uint32_t slot);
+static bool entry_has_key(const KeyDirEntry *entry, uint64_t hash,
+                          const char *key, uint32_t key_length);
+static uint64_t table_capacity_for(uint64_t no_entries);
+static bool keydir_put(KeyDir *keydir, const KeyDirEntry *entry);
+static bool keydir_grow(KeyDir *keydir);
+static void insert_into_table(KeyDirEntry *entries, uint8_t *occupied,
+                              uint64_t capacity, const KeyDirEntry *entry,
+                              bool *is_new);
+static void *scan_pages(void *arguments);
+static void collect_entry(const Record *record, uint32_t offset,
+                          void *arguments);
+static void index_entry(const Record *record, uint32_t offset,
+                        void *arguments);
+
+// API implementation
+
+// Splits the data pages into one contiguous range per core, every worker
+// streams its range with large sequential reads and the results are merged
+// into a single table afterwards. The caller must hold the header lock.
+// Empty directory for engines that fill it themselves. The page and slot of
+// an entry are then whatever location the engine stores.
+KeyDir *create_keydir(void) {
+  KeyDir *keydir = calloc(1, sizeof(KeyDir));
+  if (NULL == keydir) {
+    fprintf(stderr, "cannot allocate key directory.\n");
+    return NULL;
+  }
+
+  keydir->capacity = table_capacity_for(0);
+  keydir->entries = malloc(keydir->capacity * sizeof(KeyDirEntry));
+  keydir->occupied = calloc(keydir->capacity, sizeof(uint8_t));
+  if (NULL == keydir->entries || NULL == keydir->occupied) {
+    fprintf(stderr, "cannot allocate key directory.\n");
+    destroy_keydir(keydir);
+    return NULL;
+  }
+  return keydir;
+}
+
+KeyDir *build_keydir(const DataPageFile *file, uint64_t no_pages,
+                     enum FileErrorStatus *error) {
+  *error = success;
+
+  KeyDir *keydir = calloc(1, sizeof(KeyDir));
+  if (NULL == keydir) {
+    *error = failure;
+    fprintf(stderr, "cannot allocate key directory.\n");
+    return NULL;
+  }
+
+  long no_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  uint64_t no_data_pages = no_pages - 1;
+  uint64_t no_threads = no_cores < 1 ? 1 : (uint64_t)no_cores;
+  no_threads = no_threads > MAX_SCAN_THREADS ? MAX_SCAN_THREADS : no_threads;
+  no_threads = no_threads > no_data_pages ? no_data_pages : no_threads;
+  no_threads = no_threads == 0 ? 1 : no_threads;
+
+  posix_fadvise(file->fd, file->slot_size, no_data_pages * file->slot_size,
+                POSIX_FADV_SEQUENTIAL);
+
+  ScanTask tasks[MAX_SCAN_THREADS];
+  pthread_t threads[MAX_SCAN_THREADS];
+  bool started[MAX_SCAN_THREADS] = {false};
+  uint64_t pages_per_thread = (no_data_pages + no_threads - 1) / no_threads;
+  for (uint64_t i = 0; i < no_threads; ++i) {
+    uint64_t from_page = 1 + i * pages_per_thread;
+    uint64_t to_page = from_page + pages_per_thread;
+    tasks[i] = (ScanTask){.file = *file,
+                          .from_page = from_page > no_pages ? no_pages
+                                                            : from_page,
+                          .to_page = to_page > no_pages ? no_pages : to_page};
+    started[i] = 0 == pthread_create(threads + i, NULL, scan_pages, tasks + i);
+    if (!started[i]) {
+      scan_pages(tasks + i);
+    }
+  }
+
+  uint64_t total_entries = 0;
+  for (uint64_t i = 0; i < no_threads; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    if (tasks[i].failed) {
+      *error = failure;
+    }
+    total_entries += tasks[i].no_entries;
+  }
+
+  if (failure == *error) {
+    fprintf(stderr, "failed to scan database while building key directory.\n");
+    goto cleanup_0;
+  }
+
+  keydir->capacity = table_capacity_for(total_entries);
+  keydir->entries = malloc(keydir->capacity * sizeof(KeyDirEntry));
+  keydir->occupied = calloc(keydir->capacity, sizeof(uint8_t));
+  if (NULL == keydir->entries || NULL == keydir->occupied) {
+    *error = failure;
+    fprintf(stderr, "cannot allocate key directory.\n");
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < no_threads; ++i) {
+    for (uint64_t j = 0; j < tasks[i].no_entries; ++j) {
+      bool is_new;
+      insert_into_table(keydir->entries, keydir->occupied, keydir->capacity,
+                        tasks[i].entries + j, &is_new);
+      keydir->no_entries += is_new;
+    }
+  }
+
+cleanup_0:
+  for (uint64_t i = 0; i < no_threads; ++i) {
+    free(tasks[i].entries);
+  }
+  if (failure == *error) {
+    destroy_keydir(keydir);
+    return NULL;
+  }
+  return keydir;
+}
+
+// A hit only says where the key was last written, the record there may have
+// moved since.
+bool keydir_lookup(const KeyDir *keydir, const char *key, uint32_t key_length,
+                   KeyDirEntry *entry) {
+  assert(keydir);
+  assert(key);
+
+  uint64_t hash = key_hash(key, key_length);
+  uint64_t mask = keydir->capacity - 1;
+  for (uint64_t i = hash & mask; keydir->occupied[i]; i = (i + 1) & mask) {
+    if (entry_has_key(keydir->entries + i, hash, key, key_length)) {
+      *entry = keydir->entries[i];
+      return true;
+    }
+  }
+  return false;
+}
+
+// Re-registers every record of a page that was just written. Records move
+// inside a page on deletion, so the whole page is re-indexed.
+bool keydir_index_page(KeyDir *keydir, uint64_t page_id,
+                       const DataPage *data_page) {
+  assert(keydir);
+  IndexPageArguments arguments = {
+      .keydir = keydir, .page_id = page_id, .failed = false};
+  data_page_for_each_entry(data_page, index_entry, &arguments);
+  if (arguments.failed) {
+    fprintf(stderr, "cannot grow key directory.\n");
+  }
+  return !arguments.failed;
+}
+
+bool keydir_set(KeyDir *keydir, const char *key, uint32_t key_length,
+                uint64_t page_id, uint32_t slot) {
+  assert(keydir);
+  assert(key);
+
+  KeyDirEntry entry = make_entry(key, key_length, page_id, slot);
+  if (!keydir_put(keydir, &entry)) {
+    fprintf(stderr, "cannot grow key directory.\n");
+    return false;
+  }
+  return true;
+}
+
+// Backward shift deletion keeps probe sequences intact without tombstones.
+// Only the entry of the key goes, those of keys sharing its hash stay.
+void keydir_remove(KeyDir *keydir, const char *key, uint32_t key_length) {
+  assert(keydir);
+  assert(key);
+
+  uint64_t hash = key_hash(key, key_length);
+  uint64_t mask = keydir->capacity - 1;
+  uint64_t i = hash & mask;
+  while (keydir->occupied[i] &&
+         !entry_has_key(keydir->entries + i, hash, key, key_length)) {
+    i = (i + 1) & mask;
+  }
+  if (!keydir->occupied[i]) {
+    return;
+  }
+
+  keydir->occupied[i] = false;
+  --keydir->no_entries;
+  for (uint64_t j = (i + 1) & mask; keydir->occupied[j]; j = (j + 1) & mask) {
+    uint64_t home = keydir->entries[j].key_hash & mask;
+    bool movable = (j > i) ? (home <= i || home > j) : (home <= i && home > j);
+    if (movable) {
+      keydir->entries[i] = keydir->entries[j];
+      keydir->occupied[i] = true;
+      keydir->occupied[j] = false;
+      i = j;
+    }
+  }
+}
+
+// Resolves a key with a single page read. If the directory has no entry the
+// key does not exist; an entry whose slot no longer holds the key leaves it
+// unresolved so the caller falls back to probing with the engine.
+bool keydir_query_element(const DataPageFile *file, const KeyDir *keydir,
+                          const char *key, uint32_t key_length, Record *record,
+                          bool *resolved, enum FileErrorStatus *error) {
+  *error = success;
+  *resolved = false;
+  bool return_value = false;
+
+  KeyDirEntry entry;
+  if (!keydir_lookup(keydir, key, key_length, &entry)) {
+    *resolved = true;
+    goto cleanup_0;
+  }
+
+  SafeBuffer *safe_buffer = allocate_page_buffer(file->page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  read_lock_page(file->fd, entry.page_id, error);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
+
+  read_data_page(file, entry.page_id, safe_buffer, error);
+  if (failure == *error) {
+    goto cleanup_2;
+  }
+
+  DataPage data_page = create_data_page(safe_buffer);
+  return_value =
+      data_page_entry_at(&data_page, entry.slot, key, key_length, record);
+  *resolved = return_value;
+
+cleanup_2:
+  unlock_page(file->fd, entry.page_id, error);
+cleanup_1:
+  free_page_buffer(safe_buffer);
+cleanup_0:
+  return return_value;
+}
+
+uint64_t keydir_no_entries(const KeyDir *keydir) {
+  assert(keydir);
+  return keydir->no_entries;
+}
+
+void destroy_keydir(KeyDir *keydir) {
+  if (NULL == keydir) {
+    return;
+  }
+  free(keydir->entries);
+  free(keydir->occupied);
+  free(keydir);
+}
+
+// Local implementation
+
+static uint64_t key_hash(const char *key, uint32_t key_length) {
+  return XXH3_64bits(key, key_length);
+}
+
+static KeyDirEntry make_entry(const char *key, uint32_t key_length,
+                              uint64_t page_id, uint32_t slot) {
+  assert(key_length <= MAX_STRING_LENGTH);
+  KeyDirEntry entry = {.key_hash = key_hash(key, key_length),
+                       .page_id = page_id,
+                       .slot = slot,
+                       .key_length = key_length};
+  memcpy(entry.key, key, key_length);
+  return entry;
+}
+
+static bool entry_has_key(const KeyDirEntry *entry, uint64_t hash,
+                          const char *key, uint32_t key_length) {
+  return entry->key_hash == hash && entry->key_length == key_length &&
+         0 == memcmp(entry->key, key, key_length);
+}
+
+static uint64_t table_capacity_for(uint64_t no_entries) {
+  uint64_t capacity = MIN_CAPACITY;
+  while (capacity < (no_entries << 1)) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
+
+static bool keydir_put(KeyDir *keydir, const KeyDirEntry *entry) {
+  if ((keydir->no_entries + 1) << 1 > keydir->capacity) {
+    if (!keydir_grow(keydir)) {
+      return false;
+    }
+  }
+  bool is_new;
+  insert_into_table(keydir->entries, keydir->occupied, keydir->capacity, entry,
+                    &is_new);
+  keydir->no_entries += is_new;
+  return true;
+}
+
+static bool keydir_grow(KeyDir *keydir) {
+  uint64_t capacity = keydir->capacity << 1;
+  KeyDirEntry *entries = malloc(capacity * sizeof(KeyDirEntry));
+  uint8_t *occupied = calloc(capacity, sizeof(uint8_t));
+  if (NULL == entries || NULL == occupied) {
+    free(entries);
+    free(occupied);
+    return false;
+  }
+
+  for (uint64_t i = 0; i < keydir->capacity; ++i) {
+    if (keydir->occupied[i]) {
+      bool is_new;
+      insert_into_table(entries, occupied, capacity, keydir->entries + i,
+                        &is_new);
+    }
+  }
+
+  free(keydir->entries);
+  free(keydir->occupied);
+  keydir->entries = entries;
+  keydir->occupied = occupied;
+  keydir->capacity = capacity;
+  return true;
+}
+
+static void insert_into_table(KeyDirEntry *entries, uint8_t *occupied,
+                              uint64_t capacity, const KeyDirEntry *entry,
+                              bool *is_new) {
+  uint64_t mask = capacity - 1;
+  uint64_t i = entry->key_hash & mask;
+  while (occupied[i] && !entry_has_key(entries + i, entry->key_hash,
+                                       entry->key, entry->key_length)) {
+    i = (i + 1) & mask;
+  }
+  *is_new = !occupied[i];
+  entries[i] = *entry;
+  occupied[i] = true;
+}
+
+// Free pages are told apart by the header of their slot, only the used ones
+// are decoded.
+static void *scan_pages(void *arguments) {
+  ScanTask *task = arguments;
+
+  const DataPageFile *file = &task->file;
+  uint64_t slot_size = file->slot_size;
+  uint8_t *buffer = malloc(SCAN_CHUNK_PAGES * slot_size + file->page_size);
+  if (NULL == buffer) {
+    task->failed = true;
+    return NULL;
+  }
+  uint8_t *page = buffer + SCAN_CHUNK_PAGES * slot_size;
+
+  for (uint64_t page_id = task->from_page; page_id < task->to_page;
+       page_id += SCAN_CHUNK_PAGES) {
+    uint64_t no_pages = task->to_page - page_id;
+    no_pages = no_pages > SCAN_CHUNK_PAGES ? SCAN_CHUNK_PAGES : no_pages;
+    ssize_t bytes_read =
+        pread(file->fd, buffer, no_pages * slot_size, page_id * slot_size);
+    if (bytes_read != (ssize_t)(no_pages * slot_size)) {
+      task->failed = true;
+      break;
+    }
+
+    for (uint64_t i = 0; i < no_pages && !task->failed; ++i) {
+      SafeBuffer safe_buffer = {.buffer = buffer + i * slot_size,
+                                .length = slot_size,
+                                .capacity = slot_size};
+      DataPage data_page = create_data_page(&safe_buffer);
+      if (data_page_is_free_page(&data_page)) {
+        continue;
+      }
+      if (PAGE_CODEC_NONE != file->codec) {
+        if (!decode_data_page(file, buffer + i * slot_size, page)) {
+          task->failed = true;
+          break;
+        }
+        safe_buffer = (SafeBuffer){.buffer = page,
+                                   .length = file->page_size,
+                                   .capacity = file->page_size};
+      }
+      CollectArguments collect_arguments = {.task = task,
+                                            .page_id = page_id + i};
+      data_page_for_each_entry(&data_page, collect_entry, &collect_arguments);
+    }
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+static void collect_entry(const Record *record, uint32_t offset,
+                          void *arguments) {
+  CollectArguments *typed_arguments = arguments;
+  ScanTask *task = typed_arguments->task;
+  if (task->failed) {
+    return;
+  }
+
+  if (task->no_entries == task->capacity) {
+    uint64_t capacity = task->capacity ? task->capacity << 1 : MIN_CAPACITY;
+    KeyDirEntry *entries =
+        realloc(task->entries, capacity * sizeof(KeyDirEntry));
+    if (NULL == entries) {
+      task->failed = true;
+      return;
+    }
+    task->entries = entries;
+    task->capacity = capacity;
+  }
+
+  task->entries[task->no_entries++] =
+      make_entry(record_key(record), record_key_length(record),
+                 typed_arguments->page_id, offset);
+}
+
+static void index_entry(const Record *record, uint32_t offset,
+                        void *arguments) {
+  IndexPageArguments *typed_arguments = arguments;
+  if (typed_arguments->failed) {
+    return;
+  }
+
+  KeyDirEntry entry =
+      make_entry(record_key(record), record_key_length(record),
+                 typed_arguments->page_id, offset);
+  typed_arguments->failed = !keydir_put(typed_arguments->keydir, &entry);
+}
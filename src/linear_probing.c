@@ -0,0 +1,1324 @@
+#include "../include/linear_probing.h"
+#include "../include/buffer_manager.h"
+#include "../include/data_page.h"
+#include "../include/engine.h"
+#include "../include/file_utilities.h"
+#include "../include/keydir.h"
+#include "../include/page_cache.h"
+#include "../include/record.h"
+#include "../include/snapshot.h"
+#include "../include/xxhash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Data pages a load keeps in memory and writes with one call
+#define LOAD_CHUNK_PAGES (256)
+
+typedef enum { FOUND, NOT_FOUND, WILL_NOT_FIND } PredicateResult;
+
+typedef PredicateResult (*DatabasePredicate)(const DataPage *data_page,
+                                             uint64_t index,
+                                             const void *inner_arguments,
+                                             enum FileErrorStatus *error);
+typedef struct {
+  DatabasePredicate predicate;
+  void *inner_arguments;
+} DatabasePredicateClosure;
+
+typedef struct {
+  const DataPageFile *data_pages;
+  const Record *record;
+} SpaceEnough;
+
+typedef struct {
+  const char *key;
+  uint32_t key_length;
+} KeyMatch;
+
+// Record taken out of a cluster by vacuum, distance counts the pages from the
+// start of the cluster to its home page.
+typedef struct {
+  uint8_t buffer[RECORD_SIZE_ESTIMATE];
+  uint32_t length;
+  uint64_t home;
+  uint64_t distance;
+  uint64_t page_id;
+  uint64_t index;
+} VacuumRecord;
+
+typedef struct {
+  const Database *database;
+  uint64_t first_page_id;
+  uint64_t page_id;
+  VacuumRecord *records;
+  uint64_t no_records;
+  uint64_t capacity;
+  uint64_t no_expired;
+  bool failed;
+} VacuumRecords;
+
+// Consecutive data pages filled by a load, from first_page_id on, one after
+// the other in pages.
+typedef struct {
+  uint64_t first_page_id;
+  uint64_t no_pages;
+  uint8_t *pages;
+  SafeBuffer safe_buffers[LOAD_CHUNK_PAGES];
+} LoadChunk;
+
+// The pages fill from the first one to the last and each chunk is written once
+// it is left. The first chunk is written last, records homed near the end of
+// the file may wrap around into it. Compressed pages go through slots on
+// their way to the file.
+struct linear_probing_loader {
+  Database *database;
+  uint8_t *pages;
+  uint8_t *slots;
+  LoadChunk first_chunk;
+  LoadChunk chunk;
+  LoadChunk *current;
+  uint64_t page_id;
+  bool wrapped;
+  bool full;
+};
+
+// Key of a multi-get still being probed, page_id is the next page of its probe
+// sequence.
+typedef struct {
+  uint64_t page_id;
+  uint64_t index;
+  uint64_t no_probes;
+} PendingKey;
+
+static uint64_t hash(const char *key, uint32_t key_length,
+                     const Database *database);
+
+static bool find_element(const Database *database,
+                         DatabasePredicateClosure *closure, uint64_t no_pages,
+                         uint64_t from_index, uint64_t *index,
+                         enum FileErrorStatus *error);
+
+static PredicateResult is_key_match(const DataPage *data_page, uint64_t index,
+                                    const void *inner_arguments,
+                                    enum FileErrorStatus *error);
+
+static PredicateResult is_space_enough(const DataPage *data_page,
+                                       uint64_t index,
+                                       const void *inner_arguments,
+                                       enum FileErrorStatus *error);
+
+static int compare_pending_keys(const void *first, const void *second);
+
+static bool linear_probing_get(Database *database, const char *key,
+                               uint32_t key_length, Record *record,
+                               enum FileErrorStatus *error);
+static void linear_probing_mget(Database *database, const char **keys,
+                                const uint32_t *key_lengths, uint64_t no_keys,
+                                MultiGetCallback callback, void *arguments,
+                                enum FileErrorStatus *error);
+static void linear_probing_put(Database *database, const Record *new_record,
+                               enum FileErrorStatus *error);
+static bool linear_probing_delete(Database *database, const char *key,
+                                  uint32_t key_length, Record *record,
+                                  enum FileErrorStatus *error);
+static bool linear_probing_update(Database *database, const char *key,
+                                  uint32_t key_length, UpdateCallback callback,
+                                  void *arguments,
+                                  enum FileErrorStatus *error);
+static void linear_probing_write_batch(Database *database,
+                                       const WriteBatch *write_batch,
+                                       enum FileErrorStatus *error);
+
+static bool batch_delete(Database *database, PageCache *page_cache,
+                         const char *key, uint32_t key_length, Record *record,
+                         enum FileErrorStatus *error);
+static void batch_put(Database *database, PageCache *page_cache,
+                      const WriteBatchEntry *entry,
+                      enum FileErrorStatus *error);
+static bool linear_probing_vacuum(Database *database, uint64_t *page_id,
+                                  VacuumStats *stats,
+                                  enum FileErrorStatus *error);
+static bool find_page(Database *database, uint64_t from_page_id,
+                      bool free_page, uint64_t *page_id,
+                      enum FileErrorStatus *error);
+static void vacuum_cluster(Database *database, uint64_t first_page_id,
+                           VacuumStats *stats, enum FileErrorStatus *error);
+static bool place_records(Database *database, PageCache *page_cache,
+                          uint64_t first_page_id, uint64_t no_cluster_pages,
+                          VacuumRecords *records, uint64_t *no_moved,
+                          enum FileErrorStatus *error);
+static void collect_vacuum_record(const Record *record, uint32_t offset,
+                                  void *arguments);
+static int compare_vacuum_records(const void *first, const void *second);
+static uint64_t cluster_page_id(const Database *database,
+                                uint64_t first_page_id, uint64_t offset);
+static uint64_t *load_order(const Database *database, const Record *records,
+                            uint64_t no_records, uint64_t *homes,
+                            enum FileErrorStatus *error);
+static void load_record(LinearProbingLoader *loader, const Record *record,
+                        uint64_t home, enum FileErrorStatus *error);
+static void start_load_chunk(Database *database, LoadChunk *chunk,
+                             uint64_t first_page_id);
+static void write_load_chunk(LinearProbingLoader *loader,
+                             const LoadChunk *chunk,
+                             enum FileErrorStatus *error);
+
+// API implementation
+
+const EngineOperations linear_probing_engine = {
+    .name = "linear",
+    .stores_data_pages = true,
+    .create = create_data_pages,
+    .open = NULL,
+    .get = linear_probing_get,
+    .mget = linear_probing_mget,
+    .put = linear_probing_put,
+    .del = linear_probing_delete,
+    .update = linear_probing_update,
+    .write_batch = linear_probing_write_batch,
+    .scan = scan_data_pages,
+    .scan_range = NULL,
+    .stats = data_pages_stats,
+    .vacuum = linear_probing_vacuum,
+    .open_view = NULL,
+    .scan_view = NULL,
+    .close_view = NULL,
+    .close = NULL};
+
+LinearProbingLoader *create_linear_probing_loader(Database *database,
+                                                  enum FileErrorStatus *error) {
+  *error = success;
+
+  const DataPageFile *data_pages = &database->data_pages;
+  bool compressed = PAGE_CODEC_NONE != data_pages->codec;
+  LinearProbingLoader *loader = malloc(sizeof(LinearProbingLoader));
+  uint8_t *pages = malloc(2 * LOAD_CHUNK_PAGES * data_pages->page_size);
+  uint8_t *slots =
+      compressed ? malloc(LOAD_CHUNK_PAGES * data_pages->slot_size) : NULL;
+  if (NULL == loader || NULL == pages || (compressed && NULL == slots)) {
+    fprintf(stderr, "cannot allocate load pages.\n");
+    *error = failure;
+    free(slots);
+    free(pages);
+    free(loader);
+    return NULL;
+  }
+
+  loader->database = database;
+  loader->pages = pages;
+  loader->slots = slots;
+  loader->first_chunk.pages = pages;
+  loader->chunk.pages = pages + LOAD_CHUNK_PAGES * data_pages->page_size;
+  start_load_chunk(database, &loader->first_chunk, 1);
+  loader->current = &loader->first_chunk;
+  loader->page_id = 1;
+  loader->wrapped = false;
+  loader->full = false;
+  return loader;
+}
+
+void linear_probing_loader_add(LinearProbingLoader *loader,
+                               const Record *records, uint64_t no_records,
+                               enum FileErrorStatus *error) {
+  *error = success;
+  if (0 == no_records) {
+    return;
+  }
+
+  uint64_t *homes = malloc(no_records * sizeof(uint64_t));
+  if (NULL == homes) {
+    fprintf(stderr, "cannot allocate load pages.\n");
+    *error = failure;
+    return;
+  }
+  uint64_t *order =
+      load_order(loader->database, records, no_records, homes, error);
+  for (uint64_t i = 0; success == *error && i < no_records; ++i) {
+    load_record(loader, records + order[i], homes[order[i]], error);
+  }
+  free(order);
+  free(homes);
+}
+
+// The pages past the last record are written free.
+void linear_probing_loader_finish(LinearProbingLoader *loader,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+  Database *database = loader->database;
+
+  for (;;) {
+    LoadChunk *current = loader->current;
+    uint64_t next_page_id = current->first_page_id + current->no_pages;
+    if (current != &loader->first_chunk) {
+      write_load_chunk(loader, current, error);
+      if (failure == *error) {
+        goto cleanup_0;
+      }
+    }
+    if (next_page_id == database->no_pages) {
+      break;
+    }
+    loader->current = &loader->chunk;
+    start_load_chunk(database, loader->current, next_page_id);
+  }
+  write_load_chunk(loader, &loader->first_chunk, error);
+
+cleanup_0:
+  destroy_linear_probing_loader(loader);
+}
+
+void destroy_linear_probing_loader(LinearProbingLoader *loader) {
+  if (NULL == loader) {
+    return;
+  }
+  free(loader->slots);
+  free(loader->pages);
+  free(loader);
+}
+
+uint64_t linear_probing_home(const Database *database, const char *key,
+                             uint32_t key_length) {
+  return hash(key, key_length, database);
+}
+
+// Local implementation
+
+static bool linear_probing_get(Database *database, const char *key,
+                               uint32_t key_length, Record *record,
+                               enum FileErrorStatus *error) {
+  *error = success;
+  bool return_value = false;
+  int fd = database->fd;
+
+  uint64_t index = hash(key, key_length, database);
+  KeyMatch key_match = {.key = key, .key_length = key_length};
+  DatabasePredicateClosure closure = {.predicate = is_key_match,
+                                      .inner_arguments = &key_match};
+  bool found =
+      find_element(database, &closure, database->no_pages, index, &index,
+                   error);
+
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  if (!found) {
+    goto cleanup_1;
+  }
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  read_data_page(&database->data_pages, index, safe_buffer, error);
+  if (failure == *error) {
+    goto cleanup_2;
+  }
+
+  DataPage data_page = create_data_page(safe_buffer);
+  data_page_find_entry(&data_page, key, key_length, record);
+  return_value = true;
+
+cleanup_2:
+  free_page_buffer(safe_buffer);
+cleanup_1:
+  unlock_page(fd, index, error);
+cleanup_0:
+  return return_value;
+}
+
+// The keys are sorted by the next page of their probe sequence and every
+// distinct page is read once per step for all the keys waiting on it, keys
+// not resolved move on to the following page for the next step.
+static void linear_probing_mget(Database *database, const char **keys,
+                                const uint32_t *key_lengths, uint64_t no_keys,
+                                MultiGetCallback callback, void *arguments,
+                                enum FileErrorStatus *error) {
+  *error = success;
+
+  PendingKey *pending = malloc(no_keys * sizeof(PendingKey));
+  if (NULL == pending && 0 != no_keys) {
+    fprintf(stderr, "cannot allocate multi-get keys.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+  for (uint64_t i = 0; i < no_keys; ++i) {
+    pending[i] =
+        (PendingKey){.page_id = hash(keys[i], key_lengths[i], database),
+                     .index = i,
+                     .no_probes = 0};
+  }
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  uint64_t no_pending = no_keys;
+  while (0 != no_pending) {
+    qsort(pending, no_pending, sizeof(PendingKey), compare_pending_keys);
+
+    uint64_t no_remaining = 0;
+    uint64_t buffered_page_id = 0;
+    for (uint64_t i = 0; i < no_pending; ++i) {
+      PendingKey *key = pending + i;
+      if (key->page_id != buffered_page_id) {
+        locked_read_data_page(&database->data_pages, key->page_id,
+                              safe_buffer, error);
+        if (failure == *error) {
+          goto cleanup_2;
+        }
+        buffered_page_id = key->page_id;
+      }
+
+      DataPage data_page = create_data_page(safe_buffer);
+      if (data_page_is_free_page(&data_page)) {
+        callback(key->index, NULL, arguments);
+        continue;
+      }
+
+      Record record;
+      if (data_page_find_entry(&data_page, keys[key->index],
+                               key_lengths[key->index], &record)) {
+        callback(key->index, &record, arguments);
+        destroy_record(&record);
+        continue;
+      }
+
+      if (++key->no_probes == database->no_pages - 1) {
+        callback(key->index, NULL, arguments);
+        continue;
+      }
+      key->page_id =
+          (key->page_id == database->no_pages - 1) ? 1 : key->page_id + 1;
+      pending[no_remaining++] = *key;
+    }
+    no_pending = no_remaining;
+  }
+
+cleanup_2:
+  free_page_buffer(safe_buffer);
+cleanup_1:
+  free(pending);
+cleanup_0:
+  return;
+}
+
+static void linear_probing_put(Database *database, const Record *new_record,
+                               enum FileErrorStatus *error) {
+  *error = success;
+  const char *key = record_key(new_record);
+  uint32_t key_length = record_key_length(new_record);
+  int fd = database->fd;
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  Record record = record_copy_into(record_safe_buffer, new_record);
+
+  uint64_t original_index = hash(key, key_length, database);
+  SpaceEnough space_enough = {.data_pages = &database->data_pages,
+                              .record = &record};
+  DatabasePredicateClosure closure = {.predicate = is_space_enough,
+                                      .inner_arguments = &space_enough};
+  uint64_t new_index = original_index;
+  bool found = find_element(database, &closure, database->no_pages,
+                            original_index, &new_index, error);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
+
+  if (!found) {
+    fprintf(stderr, "no room left for the element, database is full.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_2;
+  }
+
+  unlock_page(fd, new_index, error);
+
+  Record deleted_record;
+  bool deleted = linear_probing_delete(database, key, key_length,
+                                       &deleted_record, error);
+  if (failure == *error) {
+    goto cleanup_3;
+  }
+
+  read_data_page(&database->data_pages, new_index, safe_buffer, error);
+  if (failure == *error) {
+    goto cleanup_3;
+  }
+
+  Timestamp first_timestamp;
+  if (deleted) {
+    first_timestamp = record_first_timestamp(&deleted_record);
+    record_set_first_timestamp(&record, first_timestamp);
+    destroy_record(&deleted_record);
+  }
+
+  DataPage data_page = create_data_page(safe_buffer);
+  data_page_insert_entry(&data_page, &record, original_index);
+  snapshot_preserve_page(database, new_index, error);
+  if (failure == *error) {
+    goto cleanup_3;
+  }
+  write_data_page(&database->data_pages, safe_buffer, new_index, error);
+  if (failure == *error) {
+    goto cleanup_3;
+  }
+
+  if (NULL != database->keydir &&
+      !keydir_index_page(database->keydir, new_index, &data_page)) {
+    *error = failure;
+  }
+
+cleanup_3:
+  free_page_buffer(safe_buffer);
+cleanup_2:
+  unlock_page(fd, new_index, error);
+cleanup_1:
+  free_record_buffer(record_safe_buffer);
+cleanup_0:
+  return;
+}
+
+// The page found by the probe is rewritten in place when the new record fits
+// there once the current one is gone, the probes passing it are unchanged.
+// Otherwise, and for a missing key, the record is put as usual.
+static bool linear_probing_update(Database *database, const char *key,
+                                  uint32_t key_length, UpdateCallback callback,
+                                  void *arguments,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+  bool updated = false;
+  int fd = database->fd;
+  enum FileErrorStatus unlock_error = success;
+
+  uint64_t original_index = hash(key, key_length, database);
+  uint64_t index = original_index;
+  KeyMatch key_match = {.key = key, .key_length = key_length};
+  DatabasePredicateClosure closure = {.predicate = is_key_match,
+                                      .inner_arguments = &key_match};
+  bool found =
+      find_element(database, &closure, database->no_pages, index, &index,
+                   error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  Record record;
+  if (!found) {
+    updated = callback(NULL, &record, arguments, error);
+    if (updated && success == *error) {
+      linear_probing_put(database, &record, error);
+    }
+    goto cleanup_0;
+  }
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  read_data_page(&database->data_pages, index, safe_buffer, error);
+  if (failure == *error) {
+    goto cleanup_2;
+  }
+
+  DataPage data_page = create_data_page(safe_buffer);
+  Record current;
+  data_page_delete_entry(&data_page, key, key_length, &current);
+  updated = callback(&current, &record, arguments, error);
+  destroy_record(&current);
+  if (!updated || failure == *error) {
+    goto cleanup_2;
+  }
+
+  if (!data_page_has_room(&database->data_pages, &data_page, &record)) {
+    free_page_buffer(safe_buffer);
+    unlock_page(fd, index, error);
+    if (success == *error) {
+      linear_probing_put(database, &record, error);
+    }
+    goto cleanup_0;
+  }
+
+  data_page_insert_entry(&data_page, &record, original_index);
+  write_lock_page(fd, index, error);
+  if (failure == *error) {
+    goto cleanup_2;
+  }
+  snapshot_preserve_page(database, index, error);
+  if (failure == *error) {
+    goto cleanup_2;
+  }
+  write_data_page(&database->data_pages, safe_buffer, index, error);
+  if (failure == *error) {
+    goto cleanup_2;
+  }
+
+  if (NULL != database->keydir &&
+      !keydir_index_page(database->keydir, index, &data_page)) {
+    *error = failure;
+  }
+
+cleanup_2:
+  free_page_buffer(safe_buffer);
+cleanup_1:
+  // the error of the callback or of the write is kept
+  unlock_page(fd, index, &unlock_error);
+  if (failure == unlock_error) {
+    *error = failure;
+  }
+cleanup_0:
+  return updated;
+}
+
+static bool linear_probing_delete(Database *database, const char *key,
+                                  uint32_t key_length, Record *record,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+  bool return_value = false;
+  int fd = database->fd;
+
+  uint64_t index = hash(key, key_length, database);
+  KeyMatch key_match = {.key = key, .key_length = key_length};
+  DatabasePredicateClosure closure = {.predicate = is_key_match,
+                                      .inner_arguments = &key_match};
+  bool found =
+      find_element(database, &closure, database->no_pages, index, &index,
+                   error);
+
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  if (!found) {
+    goto cleanup_1;
+  }
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  read_data_page(&database->data_pages, index, safe_buffer, error);
+  if (failure == *error) {
+    goto cleanup_2;
+  }
+
+  DataPage data_page = create_data_page(safe_buffer);
+  return_value = data_page_delete_entry(&data_page, key, key_length, record);
+
+  if (return_value) {
+    write_lock_page(fd, index, error);
+    if (failure == *error) {
+      goto cleanup_2;
+    }
+
+    snapshot_preserve_page(database, index, error);
+    if (failure == *error) {
+      goto cleanup_2;
+    }
+    write_data_page(&database->data_pages, safe_buffer, index, error);
+    if (failure == *error) {
+      goto cleanup_2;
+    }
+
+    if (NULL != database->keydir) {
+      keydir_remove(database->keydir, key, key_length);
+      if (!keydir_index_page(database->keydir, index, &data_page)) {
+        *error = failure;
+      }
+    }
+  }
+
+cleanup_2:
+  free_page_buffer(safe_buffer);
+cleanup_1:
+  unlock_page(fd, index, error);
+cleanup_0:
+  return return_value;
+}
+
+// Every entry is applied in memory to the pages it touches, each page being
+// read at most once, then the modified pages are written back together.
+static void linear_probing_write_batch(Database *database,
+                                       const WriteBatch *write_batch,
+                                       enum FileErrorStatus *error) {
+  *error = success;
+  PageCache page_cache = {.pages = NULL, .no_pages = 0};
+
+  for (uint64_t i = 0; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    if (WRITE_BATCH_PUT == entry->type) {
+      batch_put(database, &page_cache, entry, error);
+    } else {
+      Record record;
+      if (batch_delete(database, &page_cache, entry->key, entry->key_length,
+                       &record, error)) {
+        destroy_record(&record);
+      }
+    }
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+  write_cached_pages(database, &page_cache, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  index_cached_pages(database, &page_cache, write_batch, error);
+
+cleanup_0:
+  destroy_page_cache(&page_cache);
+}
+
+// Same probe as linear_probing_delete, on the cached pages.
+static bool batch_delete(Database *database, PageCache *page_cache,
+                         const char *key, uint32_t key_length, Record *record,
+                         enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t page_id = hash(key, key_length, database);
+  for (uint64_t count = 0; count != database->no_pages - 1; ++count) {
+    CachedPage *page = cached_page(database, page_cache, page_id, error);
+    if (failure == *error) {
+      return false;
+    }
+
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    if (data_page_is_free_page(&data_page)) {
+      return false;
+    }
+    if (data_page_delete_entry(&data_page, key, key_length, record)) {
+      page->dirty = true;
+      return true;
+    }
+    page_id = (page_id == database->no_pages - 1) ? 1 : page_id + 1;
+  }
+  return false;
+}
+
+// Same placement as linear_probing_put, on the cached pages.
+static void batch_put(Database *database, PageCache *page_cache,
+                      const WriteBatchEntry *entry,
+                      enum FileErrorStatus *error) {
+  *error = success;
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    return;
+  }
+  Record record = record_from_data(
+      record_safe_buffer, database_record_format(database), entry->key,
+      entry->key_length, entry->value, entry->value_length);
+
+  Record deleted_record;
+  if (batch_delete(database, page_cache, entry->key, entry->key_length,
+                   &deleted_record, error)) {
+    record_set_first_timestamp(&record,
+                               record_first_timestamp(&deleted_record));
+    destroy_record(&deleted_record);
+  }
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  uint64_t original_index = hash(entry->key, entry->key_length, database);
+  uint64_t page_id = original_index;
+  for (uint64_t count = 0; count != database->no_pages - 1; ++count) {
+    CachedPage *page = cached_page(database, page_cache, page_id, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    if (0 == data_page_no_entries(&data_page) ||
+        data_page_has_room(&database->data_pages, &data_page, &record)) {
+      data_page_insert_entry(&data_page, &record, original_index);
+      page->dirty = true;
+      goto cleanup_0;
+    }
+    page_id = (page_id == database->no_pages - 1) ? 1 : page_id + 1;
+  }
+
+  fprintf(stderr, "no room left for the element, database is full.\n");
+  *error = failure;
+
+cleanup_0:
+  free_record_buffer(record_safe_buffer);
+}
+
+// A cluster is a run of used pages between two free pages. The probe of a key
+// stops at the first free page, so the records of a cluster all have their
+// home page inside it and a cluster is rebuilt on its own. Clusters are
+// visited from the free page before them, the one wrapping around the end of
+// the file from the last free page. A file left without free pages by deletes
+// is a single cluster, rebuilt in one step from the page after its first empty
+// page, if any.
+static bool linear_probing_vacuum(Database *database, uint64_t *page_id,
+                                  VacuumStats *stats,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t free_page_id = 0;
+  bool found = find_page(database, 0 == *page_id ? 1 : *page_id, true,
+                         &free_page_id, error);
+  if (failure == *error) {
+    return false;
+  }
+  if (!found) {
+    if (0 == *page_id &&
+        !find_page(database, 1, false, &free_page_id, error)) {
+      free_page_id = database->no_pages - 1;
+    }
+    if (0 == *page_id && success == *error) {
+      vacuum_cluster(database, cluster_page_id(database, free_page_id, 1),
+                     stats, error);
+    }
+    return false;
+  }
+  *page_id = free_page_id + 1;
+
+  vacuum_cluster(database, cluster_page_id(database, free_page_id, 1), stats,
+                 error);
+  return true;
+}
+
+// The first free page from from_page_id on, or the first page without records
+// when free_page is false.
+static bool find_page(Database *database, uint64_t from_page_id,
+                      bool free_page, uint64_t *page_id,
+                      enum FileErrorStatus *error) {
+  *error = success;
+  bool return_value = false;
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    return false;
+  }
+
+  for (uint64_t i = from_page_id; i < database->no_pages; ++i) {
+    locked_read_data_page(&database->data_pages, i, safe_buffer, error);
+    if (failure == *error) {
+      break;
+    }
+    DataPage data_page = create_data_page(safe_buffer);
+    if (free_page ? data_page_is_free_page(&data_page)
+                  : 0 == data_page_no_entries(&data_page)) {
+      *page_id = i;
+      return_value = true;
+      break;
+    }
+  }
+
+  free_page_buffer(safe_buffer);
+  return return_value;
+}
+
+// The records are inserted again in the order of their home pages, each into
+// the first page from its home with room for it, which packs them towards
+// their home pages and leaves the pages at the end of the cluster empty, these
+// are reset to free pages. Expired records are left out. The changed pages are
+// written together as a write batch would.
+static void vacuum_cluster(Database *database, uint64_t first_page_id,
+                           VacuumStats *stats, enum FileErrorStatus *error) {
+  *error = success;
+  PageCache page_cache = {.pages = NULL, .no_pages = 0};
+  VacuumRecords records = {.database = database,
+                           .first_page_id = first_page_id,
+                           .records = NULL,
+                           .no_records = 0,
+                           .capacity = 0,
+                           .no_expired = 0,
+                           .failed = false};
+  uint64_t page_size = database->data_pages.page_size;
+  uint8_t *images = NULL;
+
+  uint64_t no_cluster_pages = 0;
+  for (; no_cluster_pages < database->no_pages - 1; ++no_cluster_pages) {
+    records.page_id =
+        cluster_page_id(database, first_page_id, no_cluster_pages);
+    CachedPage *page =
+        cached_page(database, &page_cache, records.page_id, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    if (data_page_is_free_page(&data_page)) {
+      break;
+    }
+    data_page_for_each_entry(&data_page, collect_vacuum_record, &records);
+    if (records.failed) {
+      *error = failure;
+      goto cleanup_0;
+    }
+  }
+  if (0 == no_cluster_pages) {
+    goto cleanup_0;
+  }
+
+  images = malloc(no_cluster_pages * page_size);
+  if (NULL == images) {
+    fprintf(stderr, "cannot allocate vacuum pages.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+  for (uint64_t i = 0; i < no_cluster_pages; ++i) {
+    CachedPage *page = cached_page(
+        database, &page_cache, cluster_page_id(database, first_page_id, i),
+        error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+    memcpy(images + i * page_size, page->buffer, page_size);
+  }
+
+  if (0 != records.no_records) {
+    qsort(records.records, records.no_records, sizeof(VacuumRecord),
+          compare_vacuum_records);
+  }
+  uint64_t no_moved = 0;
+  if (!place_records(database, &page_cache, first_page_id, no_cluster_pages,
+                     &records, &no_moved, error)) {
+    goto cleanup_0;
+  }
+
+  uint64_t no_written = 0;
+  uint64_t no_freed = 0;
+  for (uint64_t i = 0; i < no_cluster_pages; ++i) {
+    CachedPage *page = cached_page(
+        database, &page_cache, cluster_page_id(database, first_page_id, i),
+        error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+    page->dirty = 0 != memcmp(images + i * page_size, page->buffer, page_size);
+    no_written += page->dirty;
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    no_freed += data_page_is_free_page(&data_page);
+  }
+
+  write_cached_pages(database, &page_cache, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  stats->no_moved_records += no_moved;
+  stats->no_expired_records += records.no_expired;
+  stats->no_written_pages += no_written;
+  stats->no_freed_pages += no_freed;
+
+  for (uint64_t i = 0; NULL != database->keydir && i < page_cache.no_pages;
+       ++i) {
+    CachedPage *page = page_cache.pages[i];
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    if (page->dirty &&
+        !keydir_index_page(database->keydir, page->page_id, &data_page)) {
+      *error = failure;
+      goto cleanup_0;
+    }
+  }
+
+cleanup_0:
+  free(images);
+  free(records.records);
+  destroy_page_cache(&page_cache);
+}
+
+// Fails without an error when a record finds no room before the end of the
+// cluster, the pages are then left as they were. A cluster spanning the whole
+// file has no free page to stop a probe, its records may wrap around to the
+// pages at its start, which all hold records by then.
+static bool place_records(Database *database, PageCache *page_cache,
+                          uint64_t first_page_id, uint64_t no_cluster_pages,
+                          VacuumRecords *records, uint64_t *no_moved,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  bool wraps = database->no_pages - 1 == no_cluster_pages;
+
+  for (uint64_t i = 0; i < no_cluster_pages; ++i) {
+    uint64_t page_id = cluster_page_id(database, first_page_id, i);
+    CachedPage *page = cached_page(database, page_cache, page_id, error);
+    if (failure == *error) {
+      return false;
+    }
+    data_page_from_data(&page->safe_buffer, page_id);
+  }
+
+  for (uint64_t i = 0; i < records->no_records; ++i) {
+    VacuumRecord *vacuum_record = records->records + i;
+    SafeBuffer safe_buffer = {.buffer = vacuum_record->buffer,
+                              .length = vacuum_record->length,
+                              .capacity = RECORD_SIZE_ESTIMATE};
+    Record record = {.safe_buffer = &safe_buffer};
+
+    uint64_t offset = vacuum_record->distance;
+    uint64_t end = wraps ? offset + no_cluster_pages : no_cluster_pages;
+    for (; offset < end; ++offset) {
+      uint64_t page_id = cluster_page_id(database, first_page_id, offset);
+      CachedPage *page = cached_page(database, page_cache, page_id, error);
+      if (failure == *error) {
+        return false;
+      }
+      DataPage data_page = create_data_page(&page->safe_buffer);
+      if (0 == data_page_no_entries(&data_page) ||
+          data_page_has_room(&database->data_pages, &data_page, &record)) {
+        data_page_insert_entry(&data_page, &record, vacuum_record->home);
+        *no_moved += page_id != vacuum_record->page_id;
+        break;
+      }
+    }
+    if (end == offset) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void collect_vacuum_record(const Record *record, uint32_t offset,
+                                  void *arguments) {
+  VacuumRecords *records = arguments;
+  if (records->failed) {
+    return;
+  }
+  // values in overflow pages are left to the reaper, which frees the pages
+  if (record_has_expired(record) && !record_has_overflow(record)) {
+    if (NULL != records->database->keydir) {
+      keydir_remove(records->database->keydir, record_key(record),
+                    record_key_length(record));
+    }
+    ++records->no_expired;
+    return;
+  }
+
+  if (records->no_records == records->capacity) {
+    uint64_t capacity = 0 == records->capacity ? 64 : 2 * records->capacity;
+    VacuumRecord *vacuum_records =
+        realloc(records->records, capacity * sizeof(VacuumRecord));
+    if (NULL == vacuum_records) {
+      fprintf(stderr, "cannot allocate vacuum records.\n");
+      records->failed = true;
+      return;
+    }
+    records->records = vacuum_records;
+    records->capacity = capacity;
+  }
+
+  const Database *database = records->database;
+  uint64_t no_data_pages = database->no_pages - 1;
+  VacuumRecord *vacuum_record = records->records + records->no_records;
+  SafeBuffer safe_buffer = {.buffer = vacuum_record->buffer,
+                            .length = 0,
+                            .capacity = RECORD_SIZE_ESTIMATE};
+  record_copy_into(&safe_buffer, record);
+  vacuum_record->length = get_buffer_length(&safe_buffer);
+  vacuum_record->home =
+      hash(record_key(record), record_key_length(record), database);
+  vacuum_record->distance =
+      (vacuum_record->home + no_data_pages - records->first_page_id) %
+      no_data_pages;
+  vacuum_record->page_id = records->page_id;
+  vacuum_record->index = records->no_records++;
+}
+
+static int compare_vacuum_records(const void *first, const void *second) {
+  const VacuumRecord *first_record = first;
+  const VacuumRecord *second_record = second;
+  if (first_record->distance != second_record->distance) {
+    return first_record->distance < second_record->distance ? -1 : 1;
+  }
+  return first_record->index < second_record->index ? -1 : 1;
+}
+
+static uint64_t cluster_page_id(const Database *database,
+                                uint64_t first_page_id, uint64_t offset) {
+  return (first_page_id - 1 + offset) % (database->no_pages - 1) + 1;
+}
+
+// Counting sort of the records by home page, over the pages between the
+// lowest and the highest home, the order of the records sharing a home is
+// kept.
+static uint64_t *load_order(const Database *database, const Record *records,
+                            uint64_t no_records, uint64_t *homes,
+                            enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t first_home = UINT64_MAX;
+  uint64_t last_home = 0;
+  for (uint64_t i = 0; i < no_records; ++i) {
+    homes[i] = hash(record_key(records + i), record_key_length(records + i),
+                    database);
+    first_home = homes[i] < first_home ? homes[i] : first_home;
+    last_home = homes[i] > last_home ? homes[i] : last_home;
+  }
+
+  uint64_t no_homes = last_home - first_home + 1;
+  uint64_t *order = malloc(no_records * sizeof(uint64_t));
+  uint64_t *starts = calloc(no_homes + 1, sizeof(uint64_t));
+  if (NULL == order || NULL == starts) {
+    fprintf(stderr, "cannot allocate load pages.\n");
+    *error = failure;
+    free(order);
+    order = NULL;
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < no_records; ++i) {
+    ++starts[homes[i] - first_home + 1];
+  }
+  for (uint64_t home = 1; home <= no_homes; ++home) {
+    starts[home] += starts[home - 1];
+  }
+  for (uint64_t i = 0; i < no_records; ++i) {
+    order[starts[homes[i] - first_home]++] = i;
+  }
+
+cleanup_0:
+  free(starts);
+  return order;
+}
+
+// Into the first page from its home with room for it.
+static void load_record(LinearProbingLoader *loader, const Record *record,
+                        uint64_t home, enum FileErrorStatus *error) {
+  *error = success;
+  Database *database = loader->database;
+  LoadChunk *first_chunk = &loader->first_chunk;
+
+  if (!loader->wrapped && loader->page_id < home) {
+    loader->page_id = home;
+  }
+  for (;;) {
+    if (loader->page_id == database->no_pages) {
+      loader->page_id = 1;
+      loader->full = loader->wrapped;
+      loader->wrapped = true;
+    }
+    if (loader->full ||
+        (loader->wrapped && loader->page_id > first_chunk->no_pages)) {
+      fprintf(stderr, "no room left for the element, database is full.\n");
+      *error = failure;
+      return;
+    }
+    while (!loader->wrapped &&
+           loader->page_id >=
+               loader->current->first_page_id + loader->current->no_pages) {
+      uint64_t next_page_id =
+          loader->current->first_page_id + loader->current->no_pages;
+      if (loader->current != first_chunk) {
+        write_load_chunk(loader, loader->current, error);
+        if (failure == *error) {
+          return;
+        }
+      }
+      loader->current = &loader->chunk;
+      start_load_chunk(database, loader->current, next_page_id);
+    }
+
+    LoadChunk *holder = loader->wrapped ? first_chunk : loader->current;
+    DataPage data_page = create_data_page(
+        holder->safe_buffers + (loader->page_id - holder->first_page_id));
+    if (0 == data_page_no_entries(&data_page) ||
+        data_page_has_room(&database->data_pages, &data_page, record)) {
+      data_page_insert_entry(&data_page, record, home);
+      return;
+    }
+    ++loader->page_id;
+  }
+}
+
+static void start_load_chunk(Database *database, LoadChunk *chunk,
+                             uint64_t first_page_id) {
+  uint64_t no_pages = database->no_pages - first_page_id;
+  chunk->first_page_id = first_page_id;
+  chunk->no_pages =
+      no_pages > LOAD_CHUNK_PAGES ? LOAD_CHUNK_PAGES : no_pages;
+  uint64_t page_size = database->data_pages.page_size;
+  for (uint64_t i = 0; i < chunk->no_pages; ++i) {
+    chunk->safe_buffers[i] =
+        (SafeBuffer){.buffer = chunk->pages + i * page_size,
+                     .length = 0,
+                     .capacity = page_size};
+    data_page_from_data(chunk->safe_buffers + i, first_page_id + i);
+  }
+}
+
+static void write_load_chunk(LinearProbingLoader *loader,
+                             const LoadChunk *chunk,
+                             enum FileErrorStatus *error) {
+  *error = success;
+  const DataPageFile *data_pages = &loader->database->data_pages;
+
+  const uint8_t *slots = chunk->pages;
+  if (NULL != loader->slots) {
+    for (uint64_t i = 0; i < chunk->no_pages; ++i) {
+      if (!encode_data_page(data_pages,
+                            chunk->pages + i * data_pages->page_size,
+                            loader->slots + i * data_pages->slot_size)) {
+        *error = failure;
+        return;
+      }
+    }
+    slots = loader->slots;
+  }
+
+  ssize_t length = chunk->no_pages * data_pages->slot_size;
+  if (length != pwrite(data_pages->fd, slots, length,
+                       chunk->first_page_id * data_pages->slot_size)) {
+    fprintf(stderr, "failed to write a page to file.\n");
+    *error = failure;
+  }
+}
+
+// Maps a key to its home data page in [1, no_pages). Current files use XXH3
+// with a multiply-shift range reduction, older files keep XXH64 and modulo.
+static uint64_t hash(const char *key, uint32_t key_length,
+                     const Database *database) {
+  uint64_t no_data_pages = database->no_pages - 1;
+  if (DATABASE_VERSION_XXH64 == database->version) {
+    XXH64_hash_t hash = XXH64(key, key_length, 0);
+    return (hash % no_data_pages) + 1;
+  }
+  XXH64_hash_t hash = XXH3_64bits(key, key_length);
+  return (uint64_t)(((unsigned __int128)hash * no_data_pages) >> 64) + 1;
+}
+
+static int compare_pending_keys(const void *first, const void *second) {
+  const PendingKey *first_key = first;
+  const PendingKey *second_key = second;
+  if (first_key->page_id != second_key->page_id) {
+    return first_key->page_id < second_key->page_id ? -1 : 1;
+  }
+  return first_key->index < second_key->index ? -1 : 1;
+}
+
+static PredicateResult is_key_match(const DataPage *data_page, uint64_t index,
+                             const void *inner_arguments,
+                             enum FileErrorStatus *error) {
+  *error = success;
+  const KeyMatch *typed_inner_arguments = inner_arguments;
+
+  bool is_free_page = data_page_is_free_page(data_page);
+  if (is_free_page) {
+    return WILL_NOT_FIND;
+  }
+
+  // Any used page of the probe sequence may hold the key, so every one of
+  // them is searched rather than trusting the page hash.
+  Record record;
+  bool found = data_page_find_entry(data_page, typed_inner_arguments->key,
+                                    typed_inner_arguments->key_length, &record);
+
+  if (found) {
+    destroy_record(&record);
+  }
+
+  return found ? FOUND : NOT_FOUND;
+}
+
+static PredicateResult is_space_enough(const DataPage *data_page, uint64_t index,
+                                const void *inner_arguments,
+                                enum FileErrorStatus *error) {
+  *error = success;
+  const SpaceEnough *typed_inner_arguments = inner_arguments;
+
+  size_t length = data_page_no_entries(data_page);
+  if (0 == length) {
+    return FOUND;
+  }
+
+  return data_page_has_room(typed_inner_arguments->data_pages, data_page,
+                            typed_inner_arguments->record)
+             ? FOUND
+             : NOT_FOUND;
+}
+
+// A read lock is kept on the found page if found
+static bool find_element(const Database *database,
+                         DatabasePredicateClosure *closure, uint64_t no_pages,
+                         uint64_t from_index, uint64_t *index,
+                         enum FileErrorStatus *error) {
+  *error = success;
+  bool return_value = false;
+  int fd = database->fd;
+
+  SafeBuffer *safe_buffer =
+      allocate_page_buffer(database->data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  uint64_t count = 0;
+  uint64_t i = from_index;
+
+  while (count != no_pages - 1) {
+
+    read_lock_page(fd, i, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    };
+
+    read_data_page(&database->data_pages, i, safe_buffer, error);
+    if (failure == *error) {
+      goto cleanup_2;
+    };
+
+    DataPage data_page = create_data_page(safe_buffer);
+    PredicateResult found =
+        closure->predicate(&data_page, i, closure->inner_arguments, error);
+    if (failure == *error) {
+      goto cleanup_2;
+    }
+
+    if (FOUND == found) {
+      *index = i;
+      return_value = true;
+      goto cleanup_1;
+    }
+
+    if (WILL_NOT_FIND == found) {
+      goto cleanup_2;
+    }
+
+    unlock_page(fd, i, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    };
+
+    i = (i == no_pages - 1) ? 1 : (i + 1) % no_pages;
+    ++count;
+  }
+
+cleanup_2:
+  unlock_page(fd, i, error);
+cleanup_1:
+  free_page_buffer(safe_buffer);
+cleanup_0:
+  return return_value;
+}
@@ -0,0 +1,1199 @@
+#include "../include/log_structured.h"
+#include "../include/buffer_manager.h"
+#include "../include/buffer_utilities.h"
+#include "../include/engine.h"
+#include "../include/keydir.h"
+#include "../include/record.h"
+#include "../include/xxhash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// entry type (1 byte) | record, encoded as in record.c
+//
+// A write batch is framed as ENTRY_BATCH (1 byte) | length of its entries
+// (4 bytes) | XXH3 of its entries (8 bytes) | entries, and only read once
+// written in full.
+//
+// Segments live in <database path>.<segment id>. Segments written by put get
+// even ids, a merge writes its output to the odd id following the last
+// segment it merged, so read in id order the output comes after its inputs
+// and before any newer segment. A crash before the inputs are removed only
+// costs reading them again at open.
+
+#define SEGMENT_SIZE ((uint64_t)4 << 20)
+#define SEGMENT_STRIDE (2)
+#define MERGE_THRESHOLD (4)
+#define MERGE_BUFFER_SIZE ((uint64_t)1 << 20)
+#define MERGE_SUFFIX ".merge"
+
+#define ENTRY_TYPE_SIZE (1)
+#define RECORD_HEADER_SIZE (3)
+#define MAX_ENTRY_SIZE (ENTRY_TYPE_SIZE + RECORD_SIZE_ESTIMATE)
+#define BATCH_LENGTH_SIZE (4)
+#define BATCH_CHECKSUM_SIZE (8)
+#define BATCH_HEADER_SIZE                                                      \
+  (ENTRY_TYPE_SIZE + BATCH_LENGTH_SIZE + BATCH_CHECKSUM_SIZE)
+
+typedef enum { ENTRY_PUT = 1, ENTRY_DELETE, ENTRY_BATCH } EntryType;
+
+typedef struct {
+  uint64_t id;
+  int fd;
+  uint64_t size;
+} Segment;
+
+// The index maps a key to the segment id and offset of its latest put, stored
+// in the page and slot of the key directory entries.
+typedef struct {
+  KeyDir *index;
+  Segment *segments;
+  uint64_t no_segments;
+  pthread_mutex_t mutex;
+  pthread_t merger;
+  bool merging;
+  bool merge_done;
+  Segment *merge_inputs;
+  uint64_t no_merge_inputs;
+  uint64_t merged_first_segment;
+  const char *path;
+} LogState;
+
+typedef struct {
+  char key[MAX_STRING_LENGTH + 1];
+  uint32_t key_length;
+  uint64_t segment_id;
+  uint32_t offset;
+  uint32_t merged_offset;
+  // expired and left out of the merged segment
+  bool dropped;
+} Relocation;
+
+typedef struct {
+  LogState *state;
+  uint64_t segment_id;
+  int fd;
+  uint8_t *buffer;
+  uint64_t length;
+  uint64_t size;
+  Relocation *relocations;
+  uint64_t no_relocations;
+  uint64_t capacity;
+  bool failed;
+} MergeOutput;
+
+typedef struct {
+  LogState *state;
+  uint64_t segment_id;
+  ScanCallback callback;
+  void *arguments;
+  EngineStats *stats;
+  bool has_live_entries;
+  bool failed;
+} SegmentPass;
+
+typedef struct {
+  uint64_t segment_id;
+  uint32_t offset;
+} EntryLocation;
+
+// What a snapshot reads: a descriptor of every segment of the moment it was
+// opened, which keeps a merged away segment readable once unlinked, and the
+// location of every live put, sorted by segment and offset.
+typedef struct {
+  Segment *segments;
+  uint64_t no_segments;
+  EntryLocation *locations;
+  uint64_t no_locations;
+} LogView;
+
+typedef void (*EntryCallback)(EntryType type, const Record *record,
+                              uint32_t offset, void *arguments);
+
+static void log_create(Database *database, uint64_t no_elements,
+                       enum FileErrorStatus *error);
+static void log_open(Database *database, enum FileErrorStatus *error);
+static bool log_get(Database *database, const char *key, uint32_t key_length,
+                    Record *record, enum FileErrorStatus *error);
+static void log_put(Database *database, const Record *new_record,
+                    enum FileErrorStatus *error);
+static bool log_delete(Database *database, const char *key,
+                       uint32_t key_length, Record *record,
+                       enum FileErrorStatus *error);
+static void log_write_batch(Database *database, const WriteBatch *write_batch,
+                            enum FileErrorStatus *error);
+static void log_scan(Database *database, ScanCallback callback,
+                     void *arguments, enum FileErrorStatus *error);
+static void log_stats(Database *database, EngineStats *stats,
+                      enum FileErrorStatus *error);
+static void *log_open_view(Database *database, enum FileErrorStatus *error);
+static void log_scan_view(Database *database, void *view,
+                          ScanCallback callback, void *arguments,
+                          enum FileErrorStatus *error);
+static void log_close_view(Database *database, void *view);
+static void log_close(Database *database, enum FileErrorStatus *error);
+static void segment_path(char *buffer, const char *path, uint64_t id);
+static int open_segment(const char *path, uint64_t id, int flags);
+static void load_segment(Database *database, LogState *state, uint64_t id,
+                         enum FileErrorStatus *error);
+static uint8_t *read_segment(const Segment *segment,
+                             enum FileErrorStatus *error);
+static uint64_t for_each_entry(const uint8_t *buffer, uint64_t size,
+                               EntryCallback callback, void *arguments);
+static uint64_t entry_length(const uint8_t *entry, uint64_t size);
+static uint64_t batch_length(const uint8_t *batch, uint64_t size);
+static void index_entry(EntryType type, const Record *record, uint32_t offset,
+                        void *arguments);
+static bool read_entry(LogState *state, const char *key, uint32_t key_length,
+                       Record *record, enum FileErrorStatus *error);
+static void append_entry(Database *database, LogState *state, EntryType type,
+                         const Record *record, uint64_t *segment_id,
+                         uint32_t *offset, bool *rotated,
+                         enum FileErrorStatus *error);
+static Segment *segment_with_room(Database *database, LogState *state,
+                                  uint64_t length, bool *rotated,
+                                  enum FileErrorStatus *error);
+static void rotate_segment(Database *database, LogState *state,
+                           enum FileErrorStatus *error);
+static Segment *find_segment(LogState *state, uint64_t id);
+static bool is_live(LogState *state, const Record *record, uint64_t segment_id,
+                    uint32_t offset);
+static void maybe_start_merge(Database *database, LogState *state);
+static void finish_merge(Database *database, LogState *state, bool wait,
+                         enum FileErrorStatus *error);
+static void *merge_segments(void *arguments);
+static void copy_live_entry(EntryType type, const Record *record,
+                            uint32_t offset, void *arguments);
+static bool flush_merge_output(MergeOutput *output);
+static void install_merge_output(LogState *state, MergeOutput *output);
+static void scan_live_entry(EntryType type, const Record *record,
+                            uint32_t offset, void *arguments);
+static void count_entry(EntryType type, const Record *record, uint32_t offset,
+                        void *arguments);
+static int compare_locations(const void *first, const void *second);
+
+// API implementation
+
+const EngineOperations log_engine = {.name = "log",
+                                     .stores_data_pages = false,
+                                     .create = log_create,
+                                     .open = log_open,
+                                     .get = log_get,
+                                     .mget = NULL,
+                                     .put = log_put,
+                                     .del = log_delete,
+                                     .update = NULL,
+                                     .write_batch = log_write_batch,
+                                     .scan = log_scan,
+                                     .scan_range = NULL,
+                                     .stats = log_stats,
+                                     .vacuum = NULL,
+                                     .open_view = log_open_view,
+                                     .scan_view = log_scan_view,
+                                     .close_view = log_close_view,
+                                     .close = log_close};
+
+// Local implementation
+
+static void log_create(Database *database, uint64_t no_elements,
+                       enum FileErrorStatus *error) {
+  *error = success;
+
+  int fd = open_segment(database->path, 0, O_RDWR | O_CREAT | O_TRUNC);
+  if (-1 == fd) {
+    fprintf(stderr, "cannot create log segment.\n");
+    *error = failure;
+    return;
+  }
+  close(fd);
+
+  database->no_pages = 1;
+  database->first_segment = 0;
+  database->last_segment = 0;
+}
+
+static void log_open(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+
+  LogState *state = calloc(1, sizeof(LogState));
+  if (NULL == state) {
+    fprintf(stderr, "cannot allocate log state.\n");
+    *error = failure;
+    return;
+  }
+  database->state = state;
+  state->path = database->path;
+  pthread_mutex_init(&state->mutex, NULL);
+
+  state->index = create_keydir();
+  if (NULL == state->index) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (uint64_t id = database->first_segment; id <= database->last_segment;
+       ++id) {
+    load_segment(database, state, id, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+  if (0 == state->no_segments ||
+      database->last_segment != state->segments[state->no_segments - 1].id) {
+    fprintf(stderr, "active log segment is missing.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  maybe_start_merge(database, state);
+  return;
+
+cleanup_0:
+  log_close(database, error);
+  *error = failure;
+}
+
+static bool log_get(Database *database, const char *key, uint32_t key_length,
+                    Record *record, enum FileErrorStatus *error) {
+  LogState *state = database->state;
+
+  pthread_mutex_lock(&state->mutex);
+  bool found = read_entry(state, key, key_length, record, error);
+  pthread_mutex_unlock(&state->mutex);
+  return found;
+}
+
+// One sequential append per write. Only an update reads the previous entry,
+// to carry its first timestamp over.
+static void log_put(Database *database, const Record *new_record,
+                    enum FileErrorStatus *error) {
+  const char *key = record_key(new_record);
+  uint32_t key_length = record_key_length(new_record);
+  LogState *state = database->state;
+
+  finish_merge(database, state, false, error);
+  if (failure == *error) {
+    return;
+  }
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  Record record = record_copy_into(record_safe_buffer, new_record);
+  bool rotated = false;
+
+  pthread_mutex_lock(&state->mutex);
+  Record old_record;
+  bool found = read_entry(state, key, key_length, &old_record, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  if (found) {
+    record_set_first_timestamp(&record, record_first_timestamp(&old_record));
+    destroy_record(&old_record);
+  }
+
+  uint64_t segment_id;
+  uint32_t offset;
+  append_entry(database, state, ENTRY_PUT, &record, &segment_id, &offset,
+               &rotated, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  if (!keydir_set(state->index, key, key_length, segment_id, offset)) {
+    *error = failure;
+  }
+
+cleanup_0:
+  pthread_mutex_unlock(&state->mutex);
+  free_record_buffer(record_safe_buffer);
+  if (success == *error && rotated) {
+    maybe_start_merge(database, state);
+  }
+}
+
+static bool log_delete(Database *database, const char *key,
+                       uint32_t key_length, Record *record,
+                       enum FileErrorStatus *error) {
+  LogState *state = database->state;
+
+  finish_merge(database, state, false, error);
+  if (failure == *error) {
+    return false;
+  }
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    return false;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  bool found = read_entry(state, key, key_length, record, error);
+  if (failure == *error || !found) {
+    goto cleanup_0;
+  }
+
+  Record tombstone =
+      record_from_data(record_safe_buffer, database_record_format(database),
+                       key, key_length, "", 0);
+  uint64_t segment_id;
+  uint32_t offset;
+  bool rotated;
+  append_entry(database, state, ENTRY_DELETE, &tombstone, &segment_id, &offset,
+               &rotated, error);
+  if (failure == *error) {
+    destroy_record(record);
+    found = false;
+    goto cleanup_0;
+  }
+  keydir_remove(state->index, key, key_length);
+
+cleanup_0:
+  pthread_mutex_unlock(&state->mutex);
+  free_record_buffer(record_safe_buffer);
+  return found;
+}
+
+// The batch is appended with a single write, a crash leaves all of it or none
+// of it once the torn end of the segment is cut off at open. The index is
+// updated once the batch is written.
+static void log_write_batch(Database *database, const WriteBatch *write_batch,
+                            enum FileErrorStatus *error) {
+  *error = success;
+  LogState *state = database->state;
+  uint64_t no_entries = write_batch_no_entries(write_batch);
+  if (0 == no_entries) {
+    return;
+  }
+
+  finish_merge(database, state, false, error);
+  if (failure == *error) {
+    return;
+  }
+
+  uint8_t *batch = malloc(BATCH_HEADER_SIZE + no_entries * MAX_ENTRY_SIZE);
+  uint64_t *offsets = malloc(no_entries * sizeof(uint64_t));
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  bool rotated = false;
+  if (NULL == batch || NULL == offsets || NULL == record_safe_buffer) {
+    fprintf(stderr, "cannot allocate write batch.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  uint64_t length = BATCH_HEADER_SIZE;
+  for (uint64_t i = 0; i < no_entries; ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    bool is_put = WRITE_BATCH_PUT == entry->type;
+    Record record = record_from_data(
+        record_safe_buffer, database_record_format(database), entry->key,
+        entry->key_length, is_put ? entry->value : "",
+        is_put ? entry->value_length : 0);
+
+    Record old_record;
+    if (is_put && read_entry(state, entry->key, entry->key_length,
+                             &old_record, error)) {
+      record_set_first_timestamp(&record, record_first_timestamp(&old_record));
+      destroy_record(&old_record);
+    }
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+
+    offsets[i] = length;
+    batch[length] = is_put ? ENTRY_PUT : ENTRY_DELETE;
+    memcpy(batch + length + ENTRY_TYPE_SIZE, record_get_buffer(&record),
+           get_record_length(&record));
+    length += ENTRY_TYPE_SIZE + get_record_length(&record);
+  }
+  if (length > UINT32_MAX) {
+    fprintf(stderr, "write batch is too large.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  batch[0] = ENTRY_BATCH;
+  write_data_to_buffer(batch, ENTRY_TYPE_SIZE, BATCH_LENGTH_SIZE,
+                       length - BATCH_HEADER_SIZE);
+  write_data_to_buffer(
+      batch, ENTRY_TYPE_SIZE + BATCH_LENGTH_SIZE, BATCH_CHECKSUM_SIZE,
+      XXH3_64bits(batch + BATCH_HEADER_SIZE, length - BATCH_HEADER_SIZE));
+
+  Segment *active = segment_with_room(database, state, length, &rotated, error);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
+  if ((ssize_t)length != pwrite(active->fd, batch, length, active->size)) {
+    fprintf(stderr, "failed to append to log segment.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
+
+  for (uint64_t i = 0; i < no_entries; ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    if (WRITE_BATCH_PUT != entry->type) {
+      keydir_remove(state->index, entry->key, entry->key_length);
+    } else if (!keydir_set(state->index, entry->key, entry->key_length,
+                           active->id, active->size + offsets[i])) {
+      *error = failure;
+    }
+  }
+  active->size += length;
+
+cleanup_1:
+  pthread_mutex_unlock(&state->mutex);
+cleanup_0:
+  free_record_buffer(record_safe_buffer);
+  free(offsets);
+  free(batch);
+  if (success == *error && rotated) {
+    maybe_start_merge(database, state);
+  }
+}
+
+static void log_scan(Database *database, ScanCallback callback,
+                     void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  LogState *state = database->state;
+
+  pthread_mutex_lock(&state->mutex);
+  for (uint64_t i = 0; i < state->no_segments; ++i) {
+    uint8_t *buffer = read_segment(state->segments + i, error);
+    if (failure == *error) {
+      break;
+    }
+
+    SegmentPass pass = {.state = state,
+                        .segment_id = state->segments[i].id,
+                        .callback = callback,
+                        .arguments = arguments};
+    for_each_entry(buffer, state->segments[i].size, scan_live_entry, &pass);
+    free(buffer);
+  }
+  pthread_mutex_unlock(&state->mutex);
+}
+
+// Pages are segments here, the free bytes are the ones taken by overwritten
+// and deleted entries that a merge would reclaim.
+static void log_stats(Database *database, EngineStats *stats,
+                      enum FileErrorStatus *error) {
+  *error = success;
+  LogState *state = database->state;
+
+  pthread_mutex_lock(&state->mutex);
+  stats->no_pages = state->no_segments;
+  for (uint64_t i = 0; i < state->no_segments; ++i) {
+    uint8_t *buffer = read_segment(state->segments + i, error);
+    if (failure == *error) {
+      break;
+    }
+
+    SegmentPass pass = {
+        .state = state, .segment_id = state->segments[i].id, .stats = stats};
+    for_each_entry(buffer, state->segments[i].size, count_entry, &pass);
+    stats->no_used_pages += pass.has_live_entries;
+    free(buffer);
+  }
+  pthread_mutex_unlock(&state->mutex);
+}
+
+// Called under the database lock, which keeps the index still while it is
+// copied, the merger is kept out with the mutex of the state.
+static void *log_open_view(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+  LogState *state = database->state;
+
+  LogView *view = calloc(1, sizeof(LogView));
+  if (NULL == view) {
+    fprintf(stderr, "cannot allocate log view.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  view->segments = malloc(state->no_segments * sizeof(Segment));
+  view->locations =
+      malloc((keydir_no_entries(state->index) + 1) * sizeof(EntryLocation));
+  if (NULL == view->segments || NULL == view->locations) {
+    fprintf(stderr, "cannot allocate log view.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < state->no_segments; ++i) {
+    int fd = dup(state->segments[i].fd);
+    if (-1 == fd) {
+      fprintf(stderr, "cannot open log segment: %s.\n", strerror(errno));
+      *error = failure;
+      goto cleanup_0;
+    }
+    view->segments[view->no_segments++] = (Segment){
+        .id = state->segments[i].id, .fd = fd, .size = state->segments[i].size};
+  }
+  for (uint64_t i = 0; i < state->index->capacity; ++i) {
+    if (state->index->occupied[i]) {
+      const KeyDirEntry *entry = state->index->entries + i;
+      view->locations[view->no_locations++] = (EntryLocation){
+          .segment_id = entry->page_id, .offset = entry->slot};
+    }
+  }
+
+cleanup_0:
+  pthread_mutex_unlock(&state->mutex);
+  if (failure == *error) {
+    log_close_view(database, view);
+    return NULL;
+  }
+  qsort(view->locations, view->no_locations, sizeof(EntryLocation),
+        compare_locations);
+  return view;
+}
+
+// Every segment holding a live put is read once, its puts are decoded at
+// their offsets.
+static void log_scan_view(Database *database, void *view,
+                          ScanCallback callback, void *arguments,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  LogView *log_view = view;
+
+  const EntryLocation *location = log_view->locations;
+  const EntryLocation *end = log_view->locations + log_view->no_locations;
+  for (uint64_t i = 0; i < log_view->no_segments && location < end; ++i) {
+    const Segment *segment = log_view->segments + i;
+    if (location->segment_id != segment->id) {
+      continue;
+    }
+
+    uint8_t *buffer = read_segment(segment, error);
+    if (failure == *error) {
+      return;
+    }
+    for (; location < end && location->segment_id == segment->id;
+         ++location) {
+      const uint8_t *entry = buffer + location->offset;
+      if (location->offset >= segment->size ||
+          0 == entry_length(entry, segment->size - location->offset)) {
+        fprintf(stderr, "log index points past a segment.\n");
+        *error = failure;
+        break;
+      }
+
+      SafeBuffer record_view = {.buffer = (uint8_t *)entry + ENTRY_TYPE_SIZE,
+                                .length = entry[ENTRY_TYPE_SIZE],
+                                .capacity = entry[ENTRY_TYPE_SIZE]};
+      Record record = record_from_buffer(&record_view);
+      if (!record_has_expired(&record)) {
+        callback(&record, arguments);
+      }
+    }
+    free(buffer);
+    if (failure == *error) {
+      return;
+    }
+  }
+}
+
+static void log_close_view(Database *database, void *view) {
+  LogView *log_view = view;
+  for (uint64_t i = 0; i < log_view->no_segments; ++i) {
+    close(log_view->segments[i].fd);
+  }
+  free(log_view->segments);
+  free(log_view->locations);
+  free(log_view);
+}
+
+static void log_close(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+  LogState *state = database->state;
+  if (NULL == state) {
+    return;
+  }
+
+  finish_merge(database, state, true, error);
+  for (uint64_t i = 0; i < state->no_segments; ++i) {
+    close(state->segments[i].fd);
+  }
+  destroy_keydir(state->index);
+  pthread_mutex_destroy(&state->mutex);
+  free(state->segments);
+  free(state);
+  database->state = NULL;
+}
+
+static void segment_path(char *buffer, const char *path, uint64_t id) {
+  snprintf(buffer, PATH_MAX, "%s.%" PRIu64, path, id);
+}
+
+static int open_segment(const char *path, uint64_t id, int flags) {
+  char buffer[PATH_MAX];
+  segment_path(buffer, path, id);
+  return open(buffer, flags, 0600);
+}
+
+// Merged away segments may still be listed by the header after a crash, a
+// missing segment is skipped. A torn entry at the end of the active segment is
+// cut off.
+static void load_segment(Database *database, LogState *state, uint64_t id,
+                         enum FileErrorStatus *error) {
+  *error = success;
+
+  int fd = open_segment(database->path, id,
+                        database->writable ? O_RDWR : O_RDONLY);
+  if (-1 == fd) {
+    if (ENOENT != errno) {
+      fprintf(stderr, "cannot open log segment.\n");
+      *error = failure;
+    }
+    return;
+  }
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  Segment segment = {.id = id, .fd = fd, .size = size < 0 ? 0 : size};
+  uint8_t *buffer = read_segment(&segment, error);
+  if (failure == *error) {
+    close(fd);
+    return;
+  }
+
+  SegmentPass pass = {.state = state, .segment_id = id};
+  segment.size = for_each_entry(buffer, segment.size, index_entry, &pass);
+  free(buffer);
+  if (pass.failed) {
+    *error = failure;
+    close(fd);
+    return;
+  }
+
+  if (database->writable && id == database->last_segment &&
+      -1 == ftruncate(fd, segment.size)) {
+    fprintf(stderr, "cannot truncate log segment.\n");
+    *error = failure;
+    close(fd);
+    return;
+  }
+
+  Segment *segments =
+      realloc(state->segments, (state->no_segments + 1) * sizeof(Segment));
+  if (NULL == segments) {
+    fprintf(stderr, "cannot allocate log segment.\n");
+    *error = failure;
+    close(fd);
+    return;
+  }
+  state->segments = segments;
+  state->segments[state->no_segments++] = segment;
+}
+
+static uint8_t *read_segment(const Segment *segment,
+                             enum FileErrorStatus *error) {
+  *error = success;
+
+  uint8_t *buffer = malloc(segment->size + 1);
+  if (NULL == buffer) {
+    fprintf(stderr, "cannot allocate log segment.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  posix_fadvise(segment->fd, 0, segment->size, POSIX_FADV_SEQUENTIAL);
+  uint64_t bytes_read = 0;
+  while (bytes_read < segment->size) {
+    ssize_t result = pread(segment->fd, buffer + bytes_read,
+                           segment->size - bytes_read, bytes_read);
+    if (result <= 0) {
+      fprintf(stderr, "failed to read log segment.\n");
+      *error = failure;
+      free(buffer);
+      return NULL;
+    }
+    bytes_read += result;
+  }
+  return buffer;
+}
+
+// Returns the length of the well formed prefix of the segment.
+static uint64_t for_each_entry(const uint8_t *buffer, uint64_t size,
+                               EntryCallback callback, void *arguments) {
+  uint64_t offset = 0;
+  while (offset < size) {
+    bool is_batch = ENTRY_BATCH == buffer[offset];
+    uint64_t length = is_batch ? batch_length(buffer + offset, size - offset)
+                               : entry_length(buffer + offset, size - offset);
+    if (0 == length) {
+      break;
+    }
+
+    uint64_t end = offset + length;
+    for (offset += is_batch ? BATCH_HEADER_SIZE : 0; offset < end;
+         offset += ENTRY_TYPE_SIZE + buffer[offset + ENTRY_TYPE_SIZE]) {
+      uint32_t record_length = buffer[offset + ENTRY_TYPE_SIZE];
+      SafeBuffer view = {.buffer =
+                             (uint8_t *)buffer + offset + ENTRY_TYPE_SIZE,
+                         .length = record_length,
+                         .capacity = record_length};
+      Record record = record_from_buffer(&view);
+      callback(buffer[offset], &record, offset, arguments);
+    }
+  }
+  return offset;
+}
+
+// 0 for an entry cut short or not an entry at all.
+static uint64_t entry_length(const uint8_t *entry, uint64_t size) {
+  if (size < ENTRY_TYPE_SIZE + RECORD_HEADER_SIZE) {
+    return 0;
+  }
+  uint32_t record_length = entry[ENTRY_TYPE_SIZE];
+  if ((ENTRY_PUT != entry[0] && ENTRY_DELETE != entry[0]) ||
+      record_length < RECORD_HEADER_SIZE ||
+      ENTRY_TYPE_SIZE + record_length > size) {
+    return 0;
+  }
+  return ENTRY_TYPE_SIZE + record_length;
+}
+
+// 0 for a batch cut short, or whose entries do not match their checksum.
+static uint64_t batch_length(const uint8_t *batch, uint64_t size) {
+  if (size < BATCH_HEADER_SIZE) {
+    return 0;
+  }
+  uint64_t length =
+      read_data_from_buffer(batch, ENTRY_TYPE_SIZE, BATCH_LENGTH_SIZE);
+  uint64_t checksum = read_data_from_buffer(
+      batch, ENTRY_TYPE_SIZE + BATCH_LENGTH_SIZE, BATCH_CHECKSUM_SIZE);
+  if (BATCH_HEADER_SIZE + length > size ||
+      checksum != XXH3_64bits(batch + BATCH_HEADER_SIZE, length)) {
+    return 0;
+  }
+
+  const uint8_t *entries = batch + BATCH_HEADER_SIZE;
+  for (uint64_t offset = 0; offset < length;) {
+    uint64_t entry = entry_length(entries + offset, length - offset);
+    if (0 == entry) {
+      return 0;
+    }
+    offset += entry;
+  }
+  return BATCH_HEADER_SIZE + length;
+}
+
+static void index_entry(EntryType type, const Record *record, uint32_t offset,
+                        void *arguments) {
+  SegmentPass *pass = arguments;
+  if (pass->failed) {
+    return;
+  }
+
+  if (ENTRY_PUT == type) {
+    pass->failed =
+        !keydir_set(pass->state->index, record_key(record),
+                    record_key_length(record), pass->segment_id, offset);
+  } else {
+    keydir_remove(pass->state->index, record_key(record),
+                  record_key_length(record));
+  }
+}
+
+// Called with the mutex held.
+static bool read_entry(LogState *state, const char *key, uint32_t key_length,
+                       Record *record, enum FileErrorStatus *error) {
+  *error = success;
+
+  KeyDirEntry entry;
+  if (!keydir_lookup(state->index, key, key_length, &entry)) {
+    return false;
+  }
+
+  Segment *segment = find_segment(state, entry.page_id);
+  if (NULL == segment) {
+    fprintf(stderr, "log index points to a missing segment.\n");
+    *error = failure;
+    return false;
+  }
+
+  uint8_t buffer[MAX_ENTRY_SIZE];
+  ssize_t bytes_read = pread(segment->fd, buffer, MAX_ENTRY_SIZE, entry.slot);
+  if (bytes_read < ENTRY_TYPE_SIZE + RECORD_HEADER_SIZE ||
+      bytes_read < ENTRY_TYPE_SIZE + buffer[ENTRY_TYPE_SIZE]) {
+    fprintf(stderr, "failed to read log entry.\n");
+    *error = failure;
+    return false;
+  }
+
+  SafeBuffer view = {.buffer = buffer + ENTRY_TYPE_SIZE,
+                     .length = buffer[ENTRY_TYPE_SIZE],
+                     .capacity = buffer[ENTRY_TYPE_SIZE]};
+  Record local_record = record_from_buffer(&view);
+  if (!record_has_key(&local_record, key, key_length)) {
+    return false;
+  }
+
+  *record = record_clone(&local_record);
+  return true;
+}
+
+// Called with the mutex held.
+static void append_entry(Database *database, LogState *state, EntryType type,
+                         const Record *record, uint64_t *segment_id,
+                         uint32_t *offset, bool *rotated,
+                         enum FileErrorStatus *error) {
+  *error = success;
+  *rotated = false;
+
+  uint8_t buffer[MAX_ENTRY_SIZE];
+  uint32_t record_length = get_record_length(record);
+  uint32_t length = ENTRY_TYPE_SIZE + record_length;
+  buffer[0] = type;
+  memcpy(buffer + ENTRY_TYPE_SIZE, record_get_buffer(record), record_length);
+
+  Segment *active = segment_with_room(database, state, length, rotated, error);
+  if (failure == *error) {
+    return;
+  }
+
+  ssize_t bytes_written = pwrite(active->fd, buffer, length, active->size);
+  if (length != bytes_written) {
+    fprintf(stderr, "failed to append to log segment.\n");
+    *error = failure;
+    return;
+  }
+
+  *segment_id = active->id;
+  *offset = active->size;
+  active->size += length;
+}
+
+// Called with the mutex held. The active segment, rotated first when the
+// entries would take it past its size.
+static Segment *segment_with_room(Database *database, LogState *state,
+                                  uint64_t length, bool *rotated,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+
+  Segment *active = state->segments + state->no_segments - 1;
+  if (active->size > 0 && active->size + length > SEGMENT_SIZE) {
+    rotate_segment(database, state, error);
+    if (failure == *error) {
+      return NULL;
+    }
+    *rotated = true;
+    active = state->segments + state->no_segments - 1;
+  }
+  return active;
+}
+
+static void rotate_segment(Database *database, LogState *state,
+                           enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t id = state->segments[state->no_segments - 1].id + SEGMENT_STRIDE;
+  Segment *segments =
+      realloc(state->segments, (state->no_segments + 1) * sizeof(Segment));
+  if (NULL == segments) {
+    fprintf(stderr, "cannot allocate log segment.\n");
+    *error = failure;
+    return;
+  }
+  state->segments = segments;
+
+  int fd = open_segment(database->path, id, O_RDWR | O_CREAT | O_TRUNC);
+  if (-1 == fd) {
+    fprintf(stderr, "cannot create log segment.\n");
+    *error = failure;
+    return;
+  }
+
+  state->segments[state->no_segments++] =
+      (Segment){.id = id, .fd = fd, .size = 0};
+  database->last_segment = id;
+  database_write_header(database, error);
+}
+
+static Segment *find_segment(LogState *state, uint64_t id) {
+  for (uint64_t i = state->no_segments; i > 0; --i) {
+    if (state->segments[i - 1].id == id) {
+      return state->segments + i - 1;
+    }
+  }
+  return NULL;
+}
+
+static bool is_live(LogState *state, const Record *record, uint64_t segment_id,
+                    uint32_t offset) {
+  KeyDirEntry entry;
+  return keydir_lookup(state->index, record_key(record),
+                       record_key_length(record), &entry) &&
+         entry.page_id == segment_id && entry.slot == offset;
+}
+
+// The sealed segments are merged once enough of them piled up, as long as
+// the last one is not itself the output of a merge.
+static void maybe_start_merge(Database *database, LogState *state) {
+  if (!database->writable || state->merging) {
+    return;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  uint64_t no_sealed = state->no_segments - 1;
+  bool should_merge =
+      no_sealed >= MERGE_THRESHOLD &&
+      state->segments[no_sealed - 1].id + SEGMENT_STRIDE ==
+          state->segments[no_sealed].id;
+  if (should_merge) {
+    state->merge_inputs = malloc(no_sealed * sizeof(Segment));
+    should_merge = NULL != state->merge_inputs;
+  }
+  if (should_merge) {
+    memcpy(state->merge_inputs, state->segments, no_sealed * sizeof(Segment));
+    state->no_merge_inputs = no_sealed;
+    state->merge_done = false;
+    state->merging =
+        0 == pthread_create(&state->merger, NULL, merge_segments, state);
+    if (!state->merging) {
+      free(state->merge_inputs);
+      state->merge_inputs = NULL;
+    }
+  }
+  pthread_mutex_unlock(&state->mutex);
+}
+
+// The header is only written from the thread driving the database, the
+// merger leaves the new first segment for it. The inputs are removed once the
+// header no longer lists them.
+static void finish_merge(Database *database, LogState *state, bool wait,
+                         enum FileErrorStatus *error) {
+  *error = success;
+  if (!state->merging) {
+    return;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  bool done = state->merge_done;
+  pthread_mutex_unlock(&state->mutex);
+  if (!done && !wait) {
+    return;
+  }
+
+  pthread_join(state->merger, NULL);
+  state->merging = false;
+  free(state->merge_inputs);
+  state->merge_inputs = NULL;
+
+  uint64_t first_segment = database->first_segment;
+  if (state->merged_first_segment <= first_segment) {
+    return;
+  }
+
+  database->first_segment = state->merged_first_segment;
+  database_write_header(database, error);
+  if (failure == *error) {
+    return;
+  }
+
+  for (uint64_t id = first_segment; id < database->first_segment; ++id) {
+    char buffer[PATH_MAX];
+    segment_path(buffer, database->path, id);
+    unlink(buffer);
+  }
+}
+
+static void *merge_segments(void *arguments) {
+  LogState *state = arguments;
+  uint64_t target = state->merge_inputs[state->no_merge_inputs - 1].id + 1;
+
+  char final_path[PATH_MAX];
+  char merge_path[PATH_MAX + sizeof(MERGE_SUFFIX)];
+  segment_path(final_path, state->path, target);
+  snprintf(merge_path, sizeof(merge_path), "%s" MERGE_SUFFIX, final_path);
+
+  MergeOutput output = {.state = state,
+                        .fd = open(merge_path, O_WRONLY | O_CREAT | O_TRUNC,
+                                   0600),
+                        .buffer = malloc(MERGE_BUFFER_SIZE)};
+  output.failed = -1 == output.fd || NULL == output.buffer;
+
+  for (uint64_t i = 0; i < state->no_merge_inputs && !output.failed; ++i) {
+    enum FileErrorStatus error;
+    uint8_t *buffer = read_segment(state->merge_inputs + i, &error);
+    if (failure == error) {
+      output.failed = true;
+      break;
+    }
+
+    output.segment_id = state->merge_inputs[i].id;
+    pthread_mutex_lock(&state->mutex);
+    for_each_entry(buffer, state->merge_inputs[i].size, copy_live_entry,
+                   &output);
+    pthread_mutex_unlock(&state->mutex);
+    free(buffer);
+  }
+
+  if (!output.failed) {
+    output.failed = !flush_merge_output(&output) || -1 == fsync(output.fd) ||
+                    -1 == rename(merge_path, final_path);
+  }
+  if (-1 != output.fd) {
+    close(output.fd);
+  }
+
+  if (output.failed) {
+    fprintf(stderr, "failed to merge log segments.\n");
+    unlink(merge_path);
+    pthread_mutex_lock(&state->mutex);
+  } else {
+    output.fd = open(final_path, O_RDONLY);
+    pthread_mutex_lock(&state->mutex);
+    if (-1 != output.fd) {
+      install_merge_output(state, &output);
+    }
+  }
+  state->merge_done = true;
+  pthread_mutex_unlock(&state->mutex);
+
+  free(output.buffer);
+  free(output.relocations);
+  return NULL;
+}
+
+static void copy_live_entry(EntryType type, const Record *record,
+                            uint32_t offset, void *arguments) {
+  MergeOutput *output = arguments;
+  if (output->failed || ENTRY_DELETE == type ||
+      !is_live(output->state, record, output->segment_id, offset)) {
+    return;
+  }
+
+  // values in overflow pages are left to the reaper, which frees the pages
+  bool dropped = record_has_expired(record) && !record_has_overflow(record);
+  uint32_t length = ENTRY_TYPE_SIZE + get_record_length(record);
+  if (!dropped && output->length + length > MERGE_BUFFER_SIZE &&
+      !flush_merge_output(output)) {
+    output->failed = true;
+    return;
+  }
+
+  if (output->no_relocations == output->capacity) {
+    uint64_t capacity = output->capacity ? output->capacity << 1 : 1024;
+    Relocation *relocations =
+        realloc(output->relocations, capacity * sizeof(Relocation));
+    if (NULL == relocations) {
+      output->failed = true;
+      return;
+    }
+    output->relocations = relocations;
+    output->capacity = capacity;
+  }
+
+  Relocation *relocation = output->relocations + output->no_relocations++;
+  relocation->key_length = record_key_length(record);
+  memcpy(relocation->key, record_key(record), relocation->key_length);
+  relocation->segment_id = output->segment_id;
+  relocation->offset = offset;
+  relocation->merged_offset = output->size + output->length;
+  relocation->dropped = dropped;
+  if (dropped) {
+    return;
+  }
+
+  output->buffer[output->length] = ENTRY_PUT;
+  memcpy(output->buffer + output->length + ENTRY_TYPE_SIZE,
+         record_get_buffer(record), length - ENTRY_TYPE_SIZE);
+  output->length += length;
+}
+
+static bool flush_merge_output(MergeOutput *output) {
+  uint64_t written = 0;
+  while (written < output->length) {
+    ssize_t result = write(output->fd, output->buffer + written,
+                           output->length - written);
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  output->size += output->length;
+  output->length = 0;
+  return true;
+}
+
+// Called with the mutex held. Entries written since the merge started keep
+// their newer location, the expired ones left out are removed. The inputs are
+// the oldest segments, the merged segment takes their place at the front.
+static void install_merge_output(LogState *state, MergeOutput *output) {
+  uint64_t target = state->merge_inputs[state->no_merge_inputs - 1].id + 1;
+  for (uint64_t i = 0; i < output->no_relocations; ++i) {
+    Relocation *relocation = output->relocations + i;
+    KeyDirEntry entry;
+    if (keydir_lookup(state->index, relocation->key, relocation->key_length,
+                      &entry) &&
+        entry.page_id == relocation->segment_id &&
+        entry.slot == relocation->offset) {
+      if (relocation->dropped) {
+        keydir_remove(state->index, relocation->key, relocation->key_length);
+      } else {
+        keydir_set(state->index, relocation->key, relocation->key_length,
+                   target, relocation->merged_offset);
+      }
+    }
+  }
+
+  for (uint64_t i = 0; i < state->no_merge_inputs; ++i) {
+    close(state->segments[i].fd);
+  }
+  state->segments[0] =
+      (Segment){.id = target, .fd = output->fd, .size = output->size};
+  memmove(state->segments + 1, state->segments + state->no_merge_inputs,
+          (state->no_segments - state->no_merge_inputs) * sizeof(Segment));
+  state->no_segments -= state->no_merge_inputs - 1;
+  state->merged_first_segment = target;
+}
+
+static void scan_live_entry(EntryType type, const Record *record,
+                            uint32_t offset, void *arguments) {
+  SegmentPass *pass = arguments;
+  if (ENTRY_PUT == type &&
+      is_live(pass->state, record, pass->segment_id, offset)) {
+    pass->callback(record, pass->arguments);
+  }
+}
+
+static void count_entry(EntryType type, const Record *record, uint32_t offset,
+                        void *arguments) {
+  SegmentPass *pass = arguments;
+  uint32_t length = ENTRY_TYPE_SIZE + get_record_length(record);
+  if (ENTRY_PUT == type &&
+      is_live(pass->state, record, pass->segment_id, offset)) {
+    ++pass->stats->no_records;
+    pass->stats->used_bytes += length;
+    pass->has_live_entries = true;
+  } else {
+    pass->stats->free_bytes += length;
+  }
+}
+
+static int compare_locations(const void *first, const void *second) {
+  const EntryLocation *first_location = first;
+  const EntryLocation *second_location = second;
+  if (first_location->segment_id != second_location->segment_id) {
+    return first_location->segment_id < second_location->segment_id ? -1 : 1;
+  }
+  if (first_location->offset != second_location->offset) {
+    return first_location->offset < second_location->offset ? -1 : 1;
+  }
+  return 0;
+}
@@ -0,0 +1,1316 @@
+#include "../include/lsm.h"
+#include "../include/buffer_manager.h"
+#include "../include/buffer_utilities.h"
+#include "../include/engine.h"
+#include "../include/record.h"
+#include "../include/skiplist.h"
+#include "../include/sorted_run.h"
+#include "../include/xxhash.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Files next to the database file: <path>.wal holds the writes not yet
+// flushed as entry type (1 byte) | record, <path>.manifest lists the runs of
+// every level and <path>.run<id> are the sorted runs.
+//
+// A write batch is logged as WAL_ENTRY_BATCH (1 byte) | length of its entries
+// (4 bytes) | XXH3 of its entries (8 bytes) | entries, and only replayed once
+// written in full.
+//
+// manifest: next run id (8 bytes) | no_runs (8 bytes) | level (8 bytes) | run
+// id (8 bytes) for every run, level 0 newest first
+
+#define MEMTABLE_SIZE ((uint64_t)1 << 20)
+// Overwrites of the same keys grow the log but not the memtable, the log is
+// bounded by flushing anyway.
+#define MAX_WAL_SIZE (2 * MEMTABLE_SIZE)
+#define MAX_LEVELS (7)
+#define L0_COMPACTION_TRIGGER (4)
+#define LEVEL_BASE_SIZE ((uint64_t)10 << 20)
+#define LEVEL_SIZE_MULTIPLIER (10)
+
+#define WAL_SUFFIX ".wal"
+#define MANIFEST_SUFFIX ".manifest"
+#define RUN_SUFFIX ".run"
+#define TMP_SUFFIX ".tmp"
+
+#define ENTRY_TYPE_SIZE (1)
+#define RECORD_HEADER_SIZE (3)
+#define MAX_ENTRY_SIZE (ENTRY_TYPE_SIZE + RECORD_SIZE_ESTIMATE)
+#define WAL_ENTRY_BATCH (3)
+#define BATCH_LENGTH_SIZE (4)
+#define BATCH_CHECKSUM_SIZE (8)
+#define BATCH_HEADER_SIZE                                                      \
+  (ENTRY_TYPE_SIZE + BATCH_LENGTH_SIZE + BATCH_CHECKSUM_SIZE)
+#define MANIFEST_FIELD_SIZE (8)
+
+typedef struct {
+  SortedRun **runs;
+  uint64_t no_runs;
+} Level;
+
+typedef struct {
+  SkipList *memtable;
+  int wal_fd;
+  uint64_t wal_size;
+  Level levels[MAX_LEVELS];
+  uint64_t next_run_id;
+  pthread_mutex_t mutex;
+  pthread_t compactor;
+  bool compacting;
+  bool compaction_done;
+  const char *path;
+} LsmState;
+
+// One input of a merge, either the memtable or a sorted run. Sources are
+// ordered newest first, the newest version of a key wins.
+typedef struct {
+  bool is_memtable;
+  const SkipListNode *node;
+  SortedRunCursor cursor;
+  bool valid;
+  RunEntryType type;
+  Record record;
+  SafeBuffer view;
+} MergeSource;
+
+// What a snapshot reads: a copy of the memtable and the runs of the moment it
+// was opened, newest first.
+typedef struct {
+  SkipList *memtable;
+  SortedRun **runs;
+  uint64_t no_runs;
+} LsmView;
+
+typedef struct {
+  MergeSource *sources;
+  uint64_t no_sources;
+  uint8_t current[RECORD_SIZE_ESTIMATE];
+  SafeBuffer current_buffer;
+} MergeIterator;
+
+static void lsm_create(Database *database, uint64_t no_elements,
+                       enum FileErrorStatus *error);
+static void lsm_open(Database *database, enum FileErrorStatus *error);
+static bool lsm_get(Database *database, const char *key, uint32_t key_length,
+                    Record *record, enum FileErrorStatus *error);
+static void lsm_put(Database *database, const Record *new_record,
+                    enum FileErrorStatus *error);
+static bool lsm_delete(Database *database, const char *key,
+                       uint32_t key_length, Record *record,
+                       enum FileErrorStatus *error);
+static void lsm_write_batch(Database *database, const WriteBatch *write_batch,
+                            enum FileErrorStatus *error);
+static void lsm_scan(Database *database, ScanCallback callback,
+                     void *arguments, enum FileErrorStatus *error);
+static void lsm_scan_range(Database *database, const char *from,
+                           uint32_t from_length, const char *to,
+                           uint32_t to_length, ScanCallback callback,
+                           void *arguments, enum FileErrorStatus *error);
+static void lsm_stats(Database *database, EngineStats *stats,
+                      enum FileErrorStatus *error);
+static void *lsm_open_view(Database *database, enum FileErrorStatus *error);
+static void lsm_scan_view(Database *database, void *view,
+                          ScanCallback callback, void *arguments,
+                          enum FileErrorStatus *error);
+static void lsm_close_view(Database *database, void *view);
+static void lsm_close(Database *database, enum FileErrorStatus *error);
+static SkipList *copy_skiplist(const SkipList *skiplist);
+static void file_path(char *buffer, const char *path, const char *suffix);
+static void run_path(char *buffer, const char *path, uint64_t id);
+static void read_manifest(LsmState *state, enum FileErrorStatus *error);
+static void write_manifest(LsmState *state, enum FileErrorStatus *error);
+static void replay_wal(Database *database, LsmState *state,
+                       enum FileErrorStatus *error);
+static bool replay_batch(LsmState *state, off_t offset, const uint8_t *header,
+                         uint64_t *length, enum FileErrorStatus *error);
+static bool apply_entries(SkipList *memtable, const uint8_t *entries,
+                          uint64_t length);
+static void append_to_wal(LsmState *state, RunEntryType type,
+                          const Record *record, enum FileErrorStatus *error);
+static void apply_write(Database *database, LsmState *state, RunEntryType type,
+                        const Record *record, enum FileErrorStatus *error);
+static void maybe_flush_memtable(Database *database, LsmState *state,
+                                 enum FileErrorStatus *error);
+static void flush_memtable(LsmState *state, enum FileErrorStatus *error);
+static bool add_run(Level *level, SortedRun *run, bool newest);
+static void remove_run(Level *level, const SortedRun *run);
+static uint64_t level_size(const Level *level);
+static int64_t pick_compaction(const LsmState *state);
+static void maybe_start_compaction(Database *database, LsmState *state);
+static void finish_compaction(LsmState *state, bool wait);
+static void *compact_levels(void *arguments);
+static void compact_level(LsmState *state, uint64_t source,
+                          enum FileErrorStatus *error);
+static bool is_expired(const Record *record);
+static MergeIterator *open_merge_iterator(LsmState *state, SkipList *memtable,
+                                          SortedRun **runs, uint64_t no_runs,
+                                          const char *from,
+                                          uint32_t from_length,
+                                          enum FileErrorStatus *error);
+static bool merge_iterator_next(MergeIterator *iterator, RunEntryType *type,
+                                Record *record, enum FileErrorStatus *error);
+static void close_merge_iterator(MergeIterator *iterator);
+static void advance_source(MergeSource *source, enum FileErrorStatus *error);
+static SortedRun **collect_runs(LsmState *state, uint64_t *no_runs);
+
+// API implementation
+
+const EngineOperations lsm_engine = {.name = "lsm",
+                                     .stores_data_pages = false,
+                                     .create = lsm_create,
+                                     .open = lsm_open,
+                                     .get = lsm_get,
+                                     .mget = NULL,
+                                     .put = lsm_put,
+                                     .del = lsm_delete,
+                                     .update = NULL,
+                                     .write_batch = lsm_write_batch,
+                                     .scan = lsm_scan,
+                                     .scan_range = lsm_scan_range,
+                                     .stats = lsm_stats,
+                                     .vacuum = NULL,
+                                     .open_view = lsm_open_view,
+                                     .scan_view = lsm_scan_view,
+                                     .close_view = lsm_close_view,
+                                     .close = lsm_close};
+
+// Local implementation
+
+static void lsm_create(Database *database, uint64_t no_elements,
+                       enum FileErrorStatus *error) {
+  *error = success;
+
+  char buffer[PATH_MAX];
+  file_path(buffer, database->path, WAL_SUFFIX);
+  int fd = open(buffer, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (-1 == fd) {
+    fprintf(stderr, "cannot create write-ahead log.\n");
+    *error = failure;
+    return;
+  }
+  close(fd);
+
+  LsmState state = {.path = database->path};
+  write_manifest(&state, error);
+  database->no_pages = 1;
+}
+
+static void lsm_open(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+
+  LsmState *state = calloc(1, sizeof(LsmState));
+  if (NULL == state) {
+    fprintf(stderr, "cannot allocate lsm state.\n");
+    *error = failure;
+    return;
+  }
+  database->state = state;
+  state->path = database->path;
+  state->wal_fd = -1;
+  pthread_mutex_init(&state->mutex, NULL);
+
+  state->memtable = create_skiplist();
+  if (NULL == state->memtable) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  read_manifest(state, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  replay_wal(database, state, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  maybe_start_compaction(database, state);
+  return;
+
+cleanup_0:
+  lsm_close(database, error);
+  *error = failure;
+}
+
+// The memtable first, then level 0 newest first and the deeper levels, the
+// first version found wins. A run is only read when its key range and Bloom
+// filter admit the key.
+static bool lsm_get(Database *database, const char *key, uint32_t key_length,
+                    Record *record, enum FileErrorStatus *error) {
+  *error = success;
+  LsmState *state = database->state;
+
+  const SkipListNode *node = skiplist_find(state->memtable, key, key_length);
+  if (NULL != node) {
+    if (skiplist_node_is_tombstone(node)) {
+      return false;
+    }
+    SafeBuffer view;
+    Record local_record = skiplist_node_record(node, &view);
+    *record = record_clone(&local_record);
+    return true;
+  }
+
+  bool found = false;
+  uint8_t block[RUN_BLOCK_SIZE];
+  pthread_mutex_lock(&state->mutex);
+  for (uint64_t level = 0; level < MAX_LEVELS; ++level) {
+    for (uint64_t i = 0; i < state->levels[level].no_runs; ++i) {
+      RunEntryType type;
+      SafeBuffer view;
+      Record local_record;
+      if (sorted_run_get(state->levels[level].runs[i], key, key_length, block,
+                         &type, &local_record, &view, error)) {
+        found = RUN_ENTRY_PUT == type;
+        if (found) {
+          *record = record_clone(&local_record);
+        }
+        goto cleanup_0;
+      }
+      if (failure == *error) {
+        goto cleanup_0;
+      }
+    }
+  }
+
+cleanup_0:
+  pthread_mutex_unlock(&state->mutex);
+  return found;
+}
+
+static void lsm_put(Database *database, const Record *new_record,
+                    enum FileErrorStatus *error) {
+  const char *key = record_key(new_record);
+  uint32_t key_length = record_key_length(new_record);
+  LsmState *state = database->state;
+  finish_compaction(state, false);
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    return;
+  }
+
+  Record record = record_copy_into(record_safe_buffer, new_record);
+  Record old_record;
+  bool found = lsm_get(database, key, key_length, &old_record, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  if (found) {
+    record_set_first_timestamp(&record, record_first_timestamp(&old_record));
+    destroy_record(&old_record);
+  }
+
+  apply_write(database, state, RUN_ENTRY_PUT, &record, error);
+
+cleanup_0:
+  free_record_buffer(record_safe_buffer);
+}
+
+// Deletes are tombstones, only dropped by a compaction into the deepest
+// level holding data.
+static bool lsm_delete(Database *database, const char *key,
+                       uint32_t key_length, Record *record,
+                       enum FileErrorStatus *error) {
+  LsmState *state = database->state;
+  finish_compaction(state, false);
+
+  bool found = lsm_get(database, key, key_length, record, error);
+  if (failure == *error || !found) {
+    return false;
+  }
+
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == record_safe_buffer) {
+    *error = failure;
+    destroy_record(record);
+    return false;
+  }
+
+  Record tombstone =
+      record_from_data(record_safe_buffer, database_record_format(database),
+                       key, key_length, "", 0);
+  apply_write(database, state, RUN_ENTRY_DELETE, &tombstone, error);
+  free_record_buffer(record_safe_buffer);
+  if (failure == *error) {
+    destroy_record(record);
+    return false;
+  }
+  return true;
+}
+
+// The batch is logged with a single write and then applied to the memtable,
+// the replay of a log cut short by a crash leaves out a batch written in part.
+static void lsm_write_batch(Database *database, const WriteBatch *write_batch,
+                            enum FileErrorStatus *error) {
+  *error = success;
+  LsmState *state = database->state;
+  uint64_t no_entries = write_batch_no_entries(write_batch);
+  if (0 == no_entries) {
+    return;
+  }
+  finish_compaction(state, false);
+
+  uint8_t *batch = malloc(BATCH_HEADER_SIZE + no_entries * MAX_ENTRY_SIZE);
+  SafeBuffer *record_safe_buffer = allocate_record_buffer();
+  if (NULL == batch || NULL == record_safe_buffer) {
+    fprintf(stderr, "cannot allocate write batch.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  uint64_t length = BATCH_HEADER_SIZE;
+  for (uint64_t i = 0; i < no_entries; ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    bool is_put = WRITE_BATCH_PUT == entry->type;
+    Record record = record_from_data(
+        record_safe_buffer, database_record_format(database), entry->key,
+        entry->key_length, is_put ? entry->value : "",
+        is_put ? entry->value_length : 0);
+
+    Record old_record;
+    if (is_put &&
+        lsm_get(database, entry->key, entry->key_length, &old_record, error)) {
+      record_set_first_timestamp(&record, record_first_timestamp(&old_record));
+      destroy_record(&old_record);
+    }
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+
+    batch[length] = is_put ? RUN_ENTRY_PUT : RUN_ENTRY_DELETE;
+    memcpy(batch + length + ENTRY_TYPE_SIZE, record_get_buffer(&record),
+           get_record_length(&record));
+    length += ENTRY_TYPE_SIZE + get_record_length(&record);
+  }
+  if (length > UINT32_MAX) {
+    fprintf(stderr, "write batch is too large.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  batch[0] = WAL_ENTRY_BATCH;
+  write_data_to_buffer(batch, ENTRY_TYPE_SIZE, BATCH_LENGTH_SIZE,
+                       length - BATCH_HEADER_SIZE);
+  write_data_to_buffer(
+      batch, ENTRY_TYPE_SIZE + BATCH_LENGTH_SIZE, BATCH_CHECKSUM_SIZE,
+      XXH3_64bits(batch + BATCH_HEADER_SIZE, length - BATCH_HEADER_SIZE));
+  if ((ssize_t)length != pwrite(state->wal_fd, batch, length,
+                                state->wal_size)) {
+    fprintf(stderr, "failed to append to write-ahead log.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+  state->wal_size += length;
+
+  if (!apply_entries(state->memtable, batch + BATCH_HEADER_SIZE,
+                     length - BATCH_HEADER_SIZE)) {
+    *error = failure;
+    goto cleanup_0;
+  }
+  maybe_flush_memtable(database, state, error);
+
+cleanup_0:
+  free_record_buffer(record_safe_buffer);
+  free(batch);
+}
+
+static void lsm_scan(Database *database, ScanCallback callback,
+                     void *arguments, enum FileErrorStatus *error) {
+  lsm_scan_range(database, NULL, 0, NULL, 0, callback, arguments, error);
+}
+
+static void lsm_scan_range(Database *database, const char *from,
+                           uint32_t from_length, const char *to,
+                           uint32_t to_length, ScanCallback callback,
+                           void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  LsmState *state = database->state;
+
+  pthread_mutex_lock(&state->mutex);
+  uint64_t no_runs;
+  SortedRun **runs = collect_runs(state, &no_runs);
+  MergeIterator *iterator =
+      NULL == runs ? NULL
+                   : open_merge_iterator(state, state->memtable, runs, no_runs,
+                                         from, from_length, error);
+  if (NULL == iterator) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  RunEntryType type;
+  Record record;
+  while (merge_iterator_next(iterator, &type, &record, error)) {
+    if (NULL != to &&
+        compare_keys(record_key(&record), record_key_length(&record), to,
+                     to_length) > 0) {
+      break;
+    }
+    if (RUN_ENTRY_PUT == type) {
+      callback(&record, arguments);
+    }
+  }
+  close_merge_iterator(iterator);
+
+cleanup_0:
+  free(runs);
+  pthread_mutex_unlock(&state->mutex);
+}
+
+// Pages are run blocks, the free bytes are the ones taken by shadowed
+// versions and tombstones that compaction would reclaim.
+static void lsm_stats(Database *database, EngineStats *stats,
+                      enum FileErrorStatus *error) {
+  *error = success;
+  LsmState *state = database->state;
+
+  pthread_mutex_lock(&state->mutex);
+  uint64_t total_bytes = skiplist_size(state->memtable);
+  for (uint64_t level = 0; level < MAX_LEVELS; ++level) {
+    for (uint64_t i = 0; i < state->levels[level].no_runs; ++i) {
+      SortedRun *run = state->levels[level].runs[i];
+      stats->no_pages += run->no_blocks;
+      total_bytes += sorted_run_size(run);
+    }
+  }
+  stats->no_used_pages = stats->no_pages;
+
+  uint64_t no_runs;
+  SortedRun **runs = collect_runs(state, &no_runs);
+  MergeIterator *iterator =
+      NULL == runs ? NULL
+                   : open_merge_iterator(state, state->memtable, runs, no_runs,
+                                         NULL, 0, error);
+  if (NULL == iterator) {
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  RunEntryType type;
+  Record record;
+  while (merge_iterator_next(iterator, &type, &record, error)) {
+    if (RUN_ENTRY_PUT == type) {
+      ++stats->no_records;
+      stats->used_bytes += get_record_length(&record);
+    }
+  }
+  stats->free_bytes = total_bytes - stats->used_bytes;
+  close_merge_iterator(iterator);
+
+cleanup_0:
+  free(runs);
+  pthread_mutex_unlock(&state->mutex);
+}
+
+// Called under the database lock, which keeps the memtable still while it is
+// copied. The runs stay open while the view reads them, also once compacted.
+static void *lsm_open_view(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+  LsmState *state = database->state;
+
+  LsmView *view = malloc(sizeof(LsmView));
+  if (NULL == view) {
+    fprintf(stderr, "cannot allocate lsm view.\n");
+    *error = failure;
+    return NULL;
+  }
+  view->memtable = copy_skiplist(state->memtable);
+  if (NULL == view->memtable) {
+    *error = failure;
+    free(view);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  view->runs = collect_runs(state, &view->no_runs);
+  for (uint64_t i = 0; NULL != view->runs && i < view->no_runs; ++i) {
+    ++view->runs[i]->no_readers;
+  }
+  pthread_mutex_unlock(&state->mutex);
+  if (NULL == view->runs) {
+    *error = failure;
+    destroy_skiplist(view->memtable);
+    free(view);
+    return NULL;
+  }
+  return view;
+}
+
+static void lsm_scan_view(Database *database, void *view,
+                          ScanCallback callback, void *arguments,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  LsmView *lsm_view = view;
+
+  MergeIterator *iterator =
+      open_merge_iterator(database->state, lsm_view->memtable, lsm_view->runs,
+                          lsm_view->no_runs, NULL, 0, error);
+  if (failure == *error) {
+    return;
+  }
+
+  RunEntryType type;
+  Record record;
+  while (merge_iterator_next(iterator, &type, &record, error)) {
+    if (RUN_ENTRY_PUT == type && !record_has_expired(&record)) {
+      callback(&record, arguments);
+    }
+  }
+  close_merge_iterator(iterator);
+}
+
+static void lsm_close_view(Database *database, void *view) {
+  LsmState *state = database->state;
+  LsmView *lsm_view = view;
+
+  pthread_mutex_lock(&state->mutex);
+  for (uint64_t i = 0; i < lsm_view->no_runs; ++i) {
+    SortedRun *run = lsm_view->runs[i];
+    if (0 == --run->no_readers && run->dropped) {
+      close_sorted_run(run);
+    }
+  }
+  pthread_mutex_unlock(&state->mutex);
+  destroy_skiplist(lsm_view->memtable);
+  free(lsm_view->runs);
+  free(lsm_view);
+}
+
+static void lsm_close(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+  LsmState *state = database->state;
+  if (NULL == state) {
+    return;
+  }
+
+  finish_compaction(state, true);
+  for (uint64_t level = 0; level < MAX_LEVELS; ++level) {
+    for (uint64_t i = 0; i < state->levels[level].no_runs; ++i) {
+      close_sorted_run(state->levels[level].runs[i]);
+    }
+    free(state->levels[level].runs);
+  }
+  if (-1 != state->wal_fd) {
+    close(state->wal_fd);
+  }
+  destroy_skiplist(state->memtable);
+  pthread_mutex_destroy(&state->mutex);
+  free(state);
+  database->state = NULL;
+}
+
+static SkipList *copy_skiplist(const SkipList *skiplist) {
+  SkipList *copy = create_skiplist();
+  for (const SkipListNode *node = skiplist_seek(skiplist, NULL, 0);
+       NULL != copy && NULL != node; node = skiplist_next(node)) {
+    SafeBuffer view;
+    Record record = skiplist_node_record(node, &view);
+    if (!skiplist_put(copy, &record, skiplist_node_is_tombstone(node))) {
+      destroy_skiplist(copy);
+      copy = NULL;
+    }
+  }
+  return copy;
+}
+
+static void file_path(char *buffer, const char *path, const char *suffix) {
+  snprintf(buffer, PATH_MAX, "%s%s", path, suffix);
+}
+
+static void run_path(char *buffer, const char *path, uint64_t id) {
+  snprintf(buffer, PATH_MAX, "%s" RUN_SUFFIX "%" PRIu64, path, id);
+}
+
+static void read_manifest(LsmState *state, enum FileErrorStatus *error) {
+  *error = success;
+
+  char buffer[PATH_MAX];
+  file_path(buffer, state->path, MANIFEST_SUFFIX);
+  FILE *file = fopen(buffer, "rb");
+  if (NULL == file) {
+    fprintf(stderr, "cannot open lsm manifest.\n");
+    *error = failure;
+    return;
+  }
+
+  uint8_t fields[2 * MANIFEST_FIELD_SIZE];
+  if (1 != fread(fields, sizeof(fields), 1, file)) {
+    goto cleanup_0;
+  }
+  state->next_run_id =
+      read_data_from_buffer(fields, 0, MANIFEST_FIELD_SIZE);
+  uint64_t no_runs =
+      read_data_from_buffer(fields, MANIFEST_FIELD_SIZE, MANIFEST_FIELD_SIZE);
+
+  for (uint64_t i = 0; i < no_runs; ++i) {
+    if (1 != fread(fields, sizeof(fields), 1, file)) {
+      goto cleanup_0;
+    }
+    uint64_t level = read_data_from_buffer(fields, 0, MANIFEST_FIELD_SIZE);
+    uint64_t id =
+        read_data_from_buffer(fields, MANIFEST_FIELD_SIZE, MANIFEST_FIELD_SIZE);
+    if (level >= MAX_LEVELS) {
+      goto cleanup_0;
+    }
+
+    run_path(buffer, state->path, id);
+    SortedRun *run = open_sorted_run(buffer, id, error);
+    if (failure == *error) {
+      fclose(file);
+      return;
+    }
+    if (!add_run(state->levels + level, run, false)) {
+      close_sorted_run(run);
+      fclose(file);
+      *error = failure;
+      return;
+    }
+  }
+
+  fclose(file);
+  return;
+
+cleanup_0:
+  fprintf(stderr, "lsm manifest is corrupted.\n");
+  fclose(file);
+  *error = failure;
+}
+
+// Called with the mutex held. The manifest is replaced atomically, the runs
+// it drops are only removed afterwards.
+static void write_manifest(LsmState *state, enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t no_runs = 0;
+  for (uint64_t level = 0; level < MAX_LEVELS; ++level) {
+    no_runs += state->levels[level].no_runs;
+  }
+
+  uint64_t length = 2 * MANIFEST_FIELD_SIZE * (no_runs + 1);
+  uint8_t *manifest = malloc(length);
+  if (NULL == manifest) {
+    fprintf(stderr, "cannot allocate lsm manifest.\n");
+    *error = failure;
+    return;
+  }
+
+  write_data_to_buffer(manifest, 0, MANIFEST_FIELD_SIZE, state->next_run_id);
+  write_data_to_buffer(manifest, MANIFEST_FIELD_SIZE, MANIFEST_FIELD_SIZE,
+                       no_runs);
+  uint64_t offset = 2 * MANIFEST_FIELD_SIZE;
+  for (uint64_t level = 0; level < MAX_LEVELS; ++level) {
+    for (uint64_t i = 0; i < state->levels[level].no_runs; ++i) {
+      write_data_to_buffer(manifest, offset, MANIFEST_FIELD_SIZE, level);
+      write_data_to_buffer(manifest, offset + MANIFEST_FIELD_SIZE,
+                           MANIFEST_FIELD_SIZE,
+                           state->levels[level].runs[i]->id);
+      offset += 2 * MANIFEST_FIELD_SIZE;
+    }
+  }
+
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX + sizeof(TMP_SUFFIX)];
+  file_path(path, state->path, MANIFEST_SUFFIX);
+  snprintf(tmp_path, sizeof(tmp_path), "%s" TMP_SUFFIX, path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (-1 == fd || length != write(fd, manifest, length) || -1 == fsync(fd) ||
+      -1 == rename(tmp_path, path)) {
+    fprintf(stderr, "failed to write lsm manifest.\n");
+    *error = failure;
+    unlink(tmp_path);
+  }
+  if (-1 != fd) {
+    close(fd);
+  }
+  free(manifest);
+}
+
+// A torn entry at the end of the log is cut off.
+static void replay_wal(Database *database, LsmState *state,
+                       enum FileErrorStatus *error) {
+  *error = success;
+
+  char buffer[PATH_MAX];
+  file_path(buffer, state->path, WAL_SUFFIX);
+  state->wal_fd = open(buffer, database->writable ? O_RDWR : O_RDONLY);
+  if (-1 == state->wal_fd) {
+    fprintf(stderr, "cannot open write-ahead log.\n");
+    *error = failure;
+    return;
+  }
+
+  uint8_t entry[MAX_ENTRY_SIZE];
+  off_t size = 0;
+  while (true) {
+    ssize_t bytes_read = pread(state->wal_fd, entry, MAX_ENTRY_SIZE, size);
+    if (bytes_read >= BATCH_HEADER_SIZE && WAL_ENTRY_BATCH == entry[0]) {
+      uint64_t length;
+      if (!replay_batch(state, size, entry, &length, error)) {
+        break;
+      }
+      size += length;
+      continue;
+    }
+    uint32_t record_length =
+        bytes_read > ENTRY_TYPE_SIZE ? entry[ENTRY_TYPE_SIZE] : 0;
+    if (bytes_read < ENTRY_TYPE_SIZE + RECORD_HEADER_SIZE ||
+        record_length < RECORD_HEADER_SIZE ||
+        bytes_read < ENTRY_TYPE_SIZE + record_length ||
+        (RUN_ENTRY_PUT != entry[0] && RUN_ENTRY_DELETE != entry[0])) {
+      break;
+    }
+
+    SafeBuffer view = {.buffer = entry + ENTRY_TYPE_SIZE,
+                       .length = record_length,
+                       .capacity = record_length};
+    Record record = record_from_buffer(&view);
+    if (!skiplist_put(state->memtable, &record,
+                      RUN_ENTRY_DELETE == entry[0])) {
+      *error = failure;
+      return;
+    }
+    size += ENTRY_TYPE_SIZE + record_length;
+  }
+
+  if (failure == *error) {
+    return;
+  }
+
+  state->wal_size = size;
+  if (database->writable && -1 == ftruncate(state->wal_fd, size)) {
+    fprintf(stderr, "cannot truncate write-ahead log.\n");
+    *error = failure;
+  }
+}
+
+// False for a batch cut short or not matching its checksum, which ends the
+// log.
+static bool replay_batch(LsmState *state, off_t offset, const uint8_t *header,
+                         uint64_t *length, enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t entries_length =
+      read_data_from_buffer(header, ENTRY_TYPE_SIZE, BATCH_LENGTH_SIZE);
+  uint64_t checksum = read_data_from_buffer(
+      header, ENTRY_TYPE_SIZE + BATCH_LENGTH_SIZE, BATCH_CHECKSUM_SIZE);
+  // an empty batch is never logged
+  if (0 == entries_length) {
+    return false;
+  }
+
+  uint8_t *entries = malloc(entries_length);
+  if (NULL == entries) {
+    fprintf(stderr, "cannot allocate write batch.\n");
+    *error = failure;
+    return false;
+  }
+
+  bool complete =
+      (ssize_t)entries_length == pread(state->wal_fd, entries, entries_length,
+                                       offset + BATCH_HEADER_SIZE) &&
+      checksum == XXH3_64bits(entries, entries_length);
+  if (complete && !apply_entries(state->memtable, entries, entries_length)) {
+    *error = failure;
+    complete = false;
+  }
+  free(entries);
+  *length = BATCH_HEADER_SIZE + entries_length;
+  return complete;
+}
+
+// The entries of a batch, as written by lsm_write_batch.
+static bool apply_entries(SkipList *memtable, const uint8_t *entries,
+                          uint64_t length) {
+  for (uint64_t offset = 0; offset < length;) {
+    uint32_t record_length = entries[offset + ENTRY_TYPE_SIZE];
+    SafeBuffer view = {.buffer = (uint8_t *)entries + offset + ENTRY_TYPE_SIZE,
+                       .length = record_length,
+                       .capacity = record_length};
+    Record record = record_from_buffer(&view);
+    if (!skiplist_put(memtable, &record,
+                      RUN_ENTRY_DELETE == entries[offset])) {
+      return false;
+    }
+    offset += ENTRY_TYPE_SIZE + record_length;
+  }
+  return true;
+}
+
+static void append_to_wal(LsmState *state, RunEntryType type,
+                          const Record *record, enum FileErrorStatus *error) {
+  *error = success;
+
+  uint8_t entry[MAX_ENTRY_SIZE];
+  uint32_t record_length = get_record_length(record);
+  uint32_t length = ENTRY_TYPE_SIZE + record_length;
+  entry[0] = type;
+  memcpy(entry + ENTRY_TYPE_SIZE, record_get_buffer(record), record_length);
+
+  if (length != pwrite(state->wal_fd, entry, length, state->wal_size)) {
+    fprintf(stderr, "failed to append to write-ahead log.\n");
+    *error = failure;
+    return;
+  }
+  state->wal_size += length;
+}
+
+static void apply_write(Database *database, LsmState *state, RunEntryType type,
+                        const Record *record, enum FileErrorStatus *error) {
+  append_to_wal(state, type, record, error);
+  if (failure == *error) {
+    return;
+  }
+
+  if (!skiplist_put(state->memtable, record, RUN_ENTRY_DELETE == type)) {
+    *error = failure;
+    return;
+  }
+  maybe_flush_memtable(database, state, error);
+}
+
+static void maybe_flush_memtable(Database *database, LsmState *state,
+                                 enum FileErrorStatus *error) {
+  *error = success;
+  if (skiplist_size(state->memtable) >= MEMTABLE_SIZE ||
+      state->wal_size >= MAX_WAL_SIZE) {
+    flush_memtable(state, error);
+    if (success == *error) {
+      maybe_start_compaction(database, state);
+    }
+  }
+}
+
+// The memtable becomes the newest level 0 run and the log is emptied. A crash
+// between the two only replays writes the run already holds.
+static void flush_memtable(LsmState *state, enum FileErrorStatus *error) {
+  *error = success;
+
+  pthread_mutex_lock(&state->mutex);
+  uint64_t id = state->next_run_id++;
+  pthread_mutex_unlock(&state->mutex);
+
+  char buffer[PATH_MAX];
+  run_path(buffer, state->path, id);
+  SortedRunWriter *writer =
+      create_sorted_run_writer(buffer, state->memtable->no_entries, error);
+  if (failure == *error) {
+    return;
+  }
+
+  for (const SkipListNode *node = skiplist_seek(state->memtable, NULL, 0);
+       NULL != node; node = skiplist_next(node)) {
+    SafeBuffer view;
+    Record record = skiplist_node_record(node, &view);
+    sorted_run_writer_add(writer,
+                          skiplist_node_is_tombstone(node) ? RUN_ENTRY_DELETE
+                                                           : RUN_ENTRY_PUT,
+                          &record, error);
+    if (failure == *error) {
+      destroy_sorted_run_writer(writer);
+      return;
+    }
+  }
+
+  SortedRun *run = sorted_run_writer_finish(writer, id, error);
+  if (failure == *error) {
+    return;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  if (!add_run(state->levels, run, true)) {
+    close_sorted_run(run);
+    *error = failure;
+  } else {
+    write_manifest(state, error);
+  }
+  pthread_mutex_unlock(&state->mutex);
+  if (failure == *error) {
+    return;
+  }
+
+  SkipList *memtable = create_skiplist();
+  if (NULL == memtable || -1 == ftruncate(state->wal_fd, 0)) {
+    destroy_skiplist(memtable);
+    *error = failure;
+    return;
+  }
+  destroy_skiplist(state->memtable);
+  state->memtable = memtable;
+  state->wal_size = 0;
+}
+
+static bool add_run(Level *level, SortedRun *run, bool newest) {
+  SortedRun **runs =
+      realloc(level->runs, (level->no_runs + 1) * sizeof(SortedRun *));
+  if (NULL == runs) {
+    fprintf(stderr, "cannot allocate lsm level.\n");
+    return false;
+  }
+
+  level->runs = runs;
+  if (newest) {
+    memmove(level->runs + 1, level->runs, level->no_runs * sizeof(SortedRun *));
+    level->runs[0] = run;
+  } else {
+    level->runs[level->no_runs] = run;
+  }
+  ++level->no_runs;
+  return true;
+}
+
+static void remove_run(Level *level, const SortedRun *run) {
+  for (uint64_t i = 0; i < level->no_runs; ++i) {
+    if (level->runs[i] == run) {
+      memmove(level->runs + i, level->runs + i + 1,
+              (level->no_runs - i - 1) * sizeof(SortedRun *));
+      --level->no_runs;
+      return;
+    }
+  }
+}
+
+static uint64_t level_size(const Level *level) {
+  uint64_t size = 0;
+  for (uint64_t i = 0; i < level->no_runs; ++i) {
+    size += sorted_run_size(level->runs[i]);
+  }
+  return size;
+}
+
+// Level to merge into the next one, -1 when every level is within bounds.
+// Called with the mutex held.
+static int64_t pick_compaction(const LsmState *state) {
+  if (state->levels[0].no_runs >= L0_COMPACTION_TRIGGER) {
+    return 0;
+  }
+
+  uint64_t limit = LEVEL_BASE_SIZE;
+  for (uint64_t level = 1; level < MAX_LEVELS - 1; ++level) {
+    if (level_size(state->levels + level) > limit) {
+      return level;
+    }
+    limit *= LEVEL_SIZE_MULTIPLIER;
+  }
+  return -1;
+}
+
+static void maybe_start_compaction(Database *database, LsmState *state) {
+  if (!database->writable || state->compacting) {
+    return;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  bool needed = -1 != pick_compaction(state);
+  pthread_mutex_unlock(&state->mutex);
+  if (needed) {
+    state->compaction_done = false;
+    state->compacting =
+        0 == pthread_create(&state->compactor, NULL, compact_levels, state);
+  }
+}
+
+static void finish_compaction(LsmState *state, bool wait) {
+  if (!state->compacting) {
+    return;
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  bool done = state->compaction_done;
+  pthread_mutex_unlock(&state->mutex);
+  if (done || wait) {
+    pthread_join(state->compactor, NULL);
+    state->compacting = false;
+  }
+}
+
+static void *compact_levels(void *arguments) {
+  LsmState *state = arguments;
+
+  while (true) {
+    pthread_mutex_lock(&state->mutex);
+    int64_t source = pick_compaction(state);
+    pthread_mutex_unlock(&state->mutex);
+    if (-1 == source) {
+      break;
+    }
+
+    enum FileErrorStatus error;
+    compact_level(state, source, &error);
+    if (failure == error) {
+      fprintf(stderr, "lsm compaction failed.\n");
+      break;
+    }
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  state->compaction_done = true;
+  pthread_mutex_unlock(&state->mutex);
+  return NULL;
+}
+
+// Merges every run of the source level with the run of the next level into a
+// new run of the next level. Runs flushed to level 0 meanwhile are newer than
+// the output and stay in place. Tombstones and expired records shadow older
+// versions until they reach the deepest level holding data, where they go.
+static void compact_level(LsmState *state, uint64_t source,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t target = source + 1;
+
+  pthread_mutex_lock(&state->mutex);
+  uint64_t no_inputs =
+      state->levels[source].no_runs + state->levels[target].no_runs;
+  SortedRun **inputs = malloc(no_inputs * sizeof(SortedRun *));
+  if (NULL == inputs) {
+    pthread_mutex_unlock(&state->mutex);
+    *error = failure;
+    return;
+  }
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < state->levels[source].no_runs; ++i) {
+    inputs[offset++] = state->levels[source].runs[i];
+  }
+  for (uint64_t i = 0; i < state->levels[target].no_runs; ++i) {
+    inputs[offset++] = state->levels[target].runs[i];
+  }
+
+  bool is_last_level = true;
+  uint64_t no_entries = 0;
+  for (uint64_t level = target + 1; level < MAX_LEVELS; ++level) {
+    is_last_level = is_last_level && 0 == state->levels[level].no_runs;
+  }
+  for (uint64_t i = 0; i < no_inputs; ++i) {
+    no_entries += inputs[i]->no_entries;
+  }
+  uint64_t id = state->next_run_id++;
+  pthread_mutex_unlock(&state->mutex);
+
+  char buffer[PATH_MAX];
+  run_path(buffer, state->path, id);
+  SortedRunWriter *writer = create_sorted_run_writer(buffer, no_entries, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  MergeIterator *iterator =
+      open_merge_iterator(state, NULL, inputs, no_inputs, NULL, 0, error);
+  if (failure == *error) {
+    destroy_sorted_run_writer(writer);
+    goto cleanup_0;
+  }
+
+  RunEntryType type;
+  Record record;
+  while (merge_iterator_next(iterator, &type, &record, error)) {
+    if (is_last_level && (RUN_ENTRY_DELETE == type || is_expired(&record))) {
+      continue;
+    }
+    sorted_run_writer_add(writer, type, &record, error);
+    if (failure == *error) {
+      break;
+    }
+  }
+  close_merge_iterator(iterator);
+  if (failure == *error) {
+    destroy_sorted_run_writer(writer);
+    goto cleanup_0;
+  }
+
+  SortedRun *output = NULL;
+  if (0 == sorted_run_writer_no_entries(writer)) {
+    destroy_sorted_run_writer(writer);
+  } else {
+    output = sorted_run_writer_finish(writer, id, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+  pthread_mutex_lock(&state->mutex);
+  for (uint64_t i = 0; i < no_inputs; ++i) {
+    remove_run(state->levels + source, inputs[i]);
+    remove_run(state->levels + target, inputs[i]);
+  }
+  if (NULL != output && !add_run(state->levels + target, output, false)) {
+    close_sorted_run(output);
+    *error = failure;
+  }
+  if (success == *error) {
+    write_manifest(state, error);
+  }
+  // a run still read by a snapshot is closed by the last of them, the open
+  // file stays readable once unlinked
+  for (uint64_t i = 0; i < no_inputs && success == *error; ++i) {
+    run_path(buffer, state->path, inputs[i]->id);
+    unlink(buffer);
+    if (0 == inputs[i]->no_readers) {
+      close_sorted_run(inputs[i]);
+    } else {
+      inputs[i]->dropped = true;
+    }
+  }
+  pthread_mutex_unlock(&state->mutex);
+
+cleanup_0:
+  free(inputs);
+}
+
+// Values in overflow pages are left to the reaper, which frees the pages.
+static bool is_expired(const Record *record) {
+  return record_has_expired(record) && !record_has_overflow(record);
+}
+
+// runs are given newest first, after the memtable when there is one.
+static MergeIterator *open_merge_iterator(LsmState *state, SkipList *memtable,
+                                          SortedRun **runs, uint64_t no_runs,
+                                          const char *from,
+                                          uint32_t from_length,
+                                          enum FileErrorStatus *error) {
+  *error = success;
+
+  MergeIterator *iterator = calloc(1, sizeof(MergeIterator));
+  uint64_t no_sources = no_runs + (NULL != memtable);
+  MergeSource *sources = calloc(no_sources + 1, sizeof(MergeSource));
+  if (NULL == iterator || NULL == sources) {
+    fprintf(stderr, "cannot allocate merge iterator.\n");
+    free(iterator);
+    free(sources);
+    *error = failure;
+    return NULL;
+  }
+  iterator->sources = sources;
+  iterator->current_buffer = (SafeBuffer){.buffer = iterator->current,
+                                          .length = 0,
+                                          .capacity = RECORD_SIZE_ESTIMATE};
+
+  if (NULL != memtable) {
+    MergeSource *source = sources + iterator->no_sources++;
+    source->is_memtable = true;
+    source->node = skiplist_seek(memtable, from, from_length);
+    source->valid = NULL != source->node;
+    if (source->valid) {
+      source->record = skiplist_node_record(source->node, &source->view);
+      source->type = skiplist_node_is_tombstone(source->node)
+                         ? RUN_ENTRY_DELETE
+                         : RUN_ENTRY_PUT;
+    }
+  }
+
+  for (uint64_t i = 0; i < no_runs; ++i) {
+    MergeSource *source = sources + iterator->no_sources++;
+    sorted_run_cursor_open(&source->cursor, runs[i], from, from_length,
+                           error);
+    if (failure == *error) {
+      close_merge_iterator(iterator);
+      return NULL;
+    }
+    source->valid = sorted_run_cursor_next(&source->cursor, &source->type,
+                                           &source->record, error);
+    if (failure == *error) {
+      close_merge_iterator(iterator);
+      return NULL;
+    }
+  }
+  return iterator;
+}
+
+// The record returned is only valid until the following call.
+static bool merge_iterator_next(MergeIterator *iterator, RunEntryType *type,
+                                Record *record, enum FileErrorStatus *error) {
+  *error = success;
+
+  MergeSource *newest = NULL;
+  for (uint64_t i = 0; i < iterator->no_sources; ++i) {
+    MergeSource *source = iterator->sources + i;
+    if (source->valid &&
+        (NULL == newest ||
+         compare_keys(record_key(&source->record),
+                      record_key_length(&source->record),
+                      record_key(&newest->record),
+                      record_key_length(&newest->record)) < 0)) {
+      newest = source;
+    }
+  }
+  if (NULL == newest) {
+    return false;
+  }
+
+  uint32_t length = get_record_length(&newest->record);
+  memcpy(iterator->current, record_get_buffer(&newest->record), length);
+  set_buffer_length(&iterator->current_buffer, length);
+  *record = record_from_buffer(&iterator->current_buffer);
+  *type = newest->type;
+
+  const char *key = record_key(record);
+  uint32_t key_length = record_key_length(record);
+  for (uint64_t i = 0; i < iterator->no_sources; ++i) {
+    MergeSource *source = iterator->sources + i;
+    if (source->valid &&
+        record_has_key(&source->record, key, key_length)) {
+      advance_source(source, error);
+      if (failure == *error) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void close_merge_iterator(MergeIterator *iterator) {
+  for (uint64_t i = 0; i < iterator->no_sources; ++i) {
+    if (!iterator->sources[i].is_memtable) {
+      sorted_run_cursor_close(&iterator->sources[i].cursor);
+    }
+  }
+  free(iterator->sources);
+  free(iterator);
+}
+
+static void advance_source(MergeSource *source, enum FileErrorStatus *error) {
+  *error = success;
+
+  if (!source->is_memtable) {
+    source->valid = sorted_run_cursor_next(&source->cursor, &source->type,
+                                           &source->record, error);
+    return;
+  }
+
+  source->node = skiplist_next(source->node);
+  source->valid = NULL != source->node;
+  if (source->valid) {
+    source->record = skiplist_node_record(source->node, &source->view);
+    source->type = skiplist_node_is_tombstone(source->node) ? RUN_ENTRY_DELETE
+                                                            : RUN_ENTRY_PUT;
+  }
+}
+
+// Every run, newest first. Called with the mutex held.
+static SortedRun **collect_runs(LsmState *state, uint64_t *no_runs) {
+  *no_runs = 0;
+  for (uint64_t level = 0; level < MAX_LEVELS; ++level) {
+    *no_runs += state->levels[level].no_runs;
+  }
+
+  SortedRun **runs = malloc((*no_runs + 1) * sizeof(SortedRun *));
+  if (NULL == runs) {
+    fprintf(stderr, "cannot allocate lsm runs.\n");
+    return NULL;
+  }
+
+  uint64_t offset = 0;
+  for (uint64_t level = 0; level < MAX_LEVELS; ++level) {
+    for (uint64_t i = 0; i < state->levels[level].no_runs; ++i) {
+      runs[offset++] = state->levels[level].runs[i];
+    }
+  }
+  return runs;
+}
@@ -1,31 +1,91 @@
 #include "../include/engine.h"
 #include "../include/file_utilities.h"
+#include "../include/keydir.h"
 #include "../include/parser.h"
+#include "../include/rebuild.h"
 #include "../include/record.h"
+#include "../include/snapshot.h"
+#include "../include/transaction.h"
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+// Values of a multi-get, printed in the order of the keys once the batch is
+// answered in page order.
+typedef struct {
+  const Database *database;
+  char **values;
+  bool failed;
+} MultiGetValues;
+
+// A batch runs its get, set and del lines in the transaction it has open,
+// and keeps the last snapshot it opened until it ends.
+typedef struct {
+  Database *database;
+  Transaction *transaction;
+  Snapshot *snapshot;
+} Batch;
+
+static void print_stats(const Database *database, const EngineStats *stats);
+static void print_record(const Record *record, void *arguments);
+static void print_changed_record(const Record *record, void *arguments);
+static void store_value(uint64_t index, const Record *record,
+                        void *arguments);
+static void run_batch(Database *database, FILE *input,
+                      enum FileErrorStatus *error);
+static void run_batch_line(Batch *batch, const BatchLine *batch_line,
+                           enum FileErrorStatus *error);
+static bool is_transaction_line(const BatchLine *batch_line);
+static void run_transaction_line(Transaction *transaction,
+                                 const BatchLine *batch_line,
+                                 enum FileErrorStatus *error);
 
 int main(int argc, char **argv) {
 
-  if (argc < 4) {
+  if (argc < 3) {
     fprintf(stderr, "wrong number of arguments.\n");
     return 1;
   }
 
   enum FileErrorStatus error;
   Command command = parse_command(argv[1], &error);
+  if (failure == error) {
+    fprintf(stderr, "invalid command.\n");
+    return 1;
+  }
   ParsedValues parsed_values = parse_values(command, argc, argv, &error);
   if (failure == error) {
     fprintf(stderr, "invalid input.\n");
     return 1;
   }
+  // keys carry their length from here on, only argv is NUL terminated
+  uint32_t key_length = NULL == parsed_values.key
+                            ? 0
+                            : strnlen(parsed_values.key, MAX_STRING_LENGTH);
 
   if (COMMAND_CREATE == command) {
-    create_database((char *)parsed_values.path, parsed_values.no_elements,
-                    &error);
+    if (0 == parsed_values.no_shards) {
+      create_database((char *)parsed_values.path, parsed_values.no_elements,
+                      parsed_values.engine, parsed_values.page_size,
+                      parsed_values.page_codec, &error);
+    } else {
+      create_sharded_database(
+          (char *)parsed_values.path, parsed_values.no_elements,
+          parsed_values.engine, parsed_values.no_shards,
+          parsed_values.page_size, parsed_values.page_codec, &error);
+    }
+    if (success == error && parsed_values.time_index) {
+      Database *database =
+          open_database((char *)parsed_values.path, true, &error);
+      if (success == error) {
+        database_create_time_index(database, &error);
+        enum FileErrorStatus close_error;
+        close_database(database, &close_error);
+      }
+    }
     if (success == error) {
       printf("successfully created database.\n");
     } else {
@@ -34,48 +94,114 @@ int main(int argc, char **argv) {
   }
 
   if (COMMAND_GET == command) {
-    int fd = open_database((char *)parsed_values.path, false, &error);
+    Database *database =
+        open_database((char *)parsed_values.path, false, &error);
     if (failure == error) {
       return 1;
     }
 
-    Record record;
-    bool found = query_element(fd, parsed_values.key, &record, &error);
+    char *value;
+    uint64_t length;
+    bool found =
+        query_value(database, parsed_values.key, key_length, &value, &length,
+                    &error);
 
     if (success == error) {
       if (found) {
-        printf("value: %s\n", record_value(&record));
+        printf("value: %s\n", value);
+        free(value);
       } else {
         printf("cannot find element.\n");
       }
     } else {
       printf("error in find element.\n");
     }
-    close_database_file(fd, &error);
+    close_database(database, &error);
   }
 
   if (COMMAND_INSERT == command) {
-    int fd = open_database((char *)parsed_values.path, true, &error);
+    Database *database =
+        open_database((char *)parsed_values.path, true, &error);
     if (failure == error) {
       return 1;
     }
-    insert_element(fd, parsed_values.key, parsed_values.value, &error);
+    insert_element_with_ttl(database, parsed_values.key, key_length,
+                            parsed_values.value,
+                            strnlen(parsed_values.value, MAX_VALUE_LENGTH),
+                            parsed_values.ttl, &error);
     if (success == error) {
       printf("successfully inserted element.\n");
     } else {
       printf("error in insert element.\n");
     }
-    close_database_file(fd, &error);
+    close_database(database, &error);
+  }
+
+  if (COMMAND_INCREMENT == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, true, &error);
+    if (failure == error) {
+      return 1;
+    }
+    int64_t value = increment_element(database, parsed_values.key, key_length,
+                                      parsed_values.delta, &error);
+    if (success == error) {
+      printf("value: %" PRId64 "\n", value);
+    } else {
+      printf("error in increment element.\n");
+    }
+    close_database(database, &error);
+  }
+
+  if (COMMAND_APPEND == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, true, &error);
+    if (failure == error) {
+      return 1;
+    }
+    uint64_t length = append_element(
+        database, parsed_values.key, key_length, parsed_values.value,
+        strnlen(parsed_values.value, MAX_VALUE_LENGTH), &error);
+    if (success == error) {
+      printf("value length: %" PRIu64 "\n", length);
+    } else {
+      printf("error in append element.\n");
+    }
+    close_database(database, &error);
+  }
+
+  if (COMMAND_COMPARE_AND_SET == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, true, &error);
+    if (failure == error) {
+      return 1;
+    }
+    bool swapped = compare_and_set_element(
+        database, parsed_values.key, key_length, parsed_values.expected,
+        strnlen(parsed_values.expected, MAX_VALUE_LENGTH), parsed_values.value,
+        strnlen(parsed_values.value, MAX_VALUE_LENGTH), &error);
+    if (success == error) {
+      if (swapped) {
+        printf("successfully swapped element.\n");
+      } else {
+        printf("value does not match.\n");
+      }
+    } else {
+      printf("error in compare and set element.\n");
+    }
+    close_database(database, &error);
   }
 
   if (COMMAND_DELETE == command) {
-    int fd = open_database((char *)parsed_values.path, true, &error);
+    Database *database =
+        open_database((char *)parsed_values.path, true, &error);
     if (failure == error) {
       return 1;
     }
 
     Record record;
-    bool found = delete_element(fd, parsed_values.key, &record, &error);
+    bool found = delete_element(database, parsed_values.key, key_length,
+                                &record, &error);
     if (success == error) {
       if (found) {
         printf("successfully deleted element.\n");
@@ -85,17 +211,19 @@ int main(int argc, char **argv) {
     } else {
       printf("error in delete element.\n");
     }
-    close_database_file(fd, &error);
+    close_database(database, &error);
   }
 
   if (COMMAND_TIMESTAMP == command) {
-    int fd = open_database((char *)parsed_values.path, false, &error);
+    Database *database =
+        open_database((char *)parsed_values.path, false, &error);
     if (failure == error) {
       return 1;
     }
 
     Record record;
-    bool found = query_element(fd, parsed_values.key, &record, &error);
+    bool found = query_element(database, parsed_values.key, key_length,
+                               &record, &error);
 
     if (success == error) {
       if (found) {
@@ -105,15 +233,444 @@ int main(int argc, char **argv) {
         char second_buffer[100];
         format_timestamp_into_date(&first, first_buffer, sizeof(first_buffer));
         format_timestamp_into_date(&last, second_buffer, sizeof(first_buffer));
-        printf("first ts: %s, last ts: %s\n", first_buffer, second_buffer);
+        Timestamp expiry;
+        if (record_expiry(&record, &expiry)) {
+          char expiry_buffer[100];
+          format_timestamp_into_date(&expiry, expiry_buffer,
+                                     sizeof(expiry_buffer));
+          printf("first ts: %s, last ts: %s, expires: %s\n", first_buffer,
+                 second_buffer, expiry_buffer);
+        } else {
+          printf("first ts: %s, last ts: %s\n", first_buffer, second_buffer);
+        }
       } else {
         printf("cannot find element.\n");
       }
     } else {
       printf("error in find element.\n");
     }
-    close_database_file(fd, &error);
+    close_database(database, &error);
+  }
+
+  if (COMMAND_STATS == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, false, &error);
+    if (failure == error) {
+      return 1;
+    }
+
+    EngineStats stats;
+    database_stats(database, &stats, &error);
+    if (success == error) {
+      print_stats(database, &stats);
+    } else {
+      printf("error in stats.\n");
+    }
+    close_database(database, &error);
+  }
+
+  if (COMMAND_VACUUM == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, true, &error);
+    if (failure == error) {
+      return 1;
+    }
+
+    VacuumStats stats;
+    vacuum_database(database, &stats, &error);
+    if (success == error) {
+      printf("moved records: %" PRIu64 ", expired records: %" PRIu64
+             ", written pages: %" PRIu64 ", freed pages: %" PRIu64 "\n",
+             stats.no_moved_records, stats.no_expired_records,
+             stats.no_written_pages, stats.no_freed_pages);
+    } else {
+      printf("error in vacuum.\n");
+    }
+    close_database(database, &error);
+  }
+
+  if (COMMAND_REBUILD == command) {
+    RebuildStats stats;
+    rebuild_database((char *)parsed_values.path,
+                     (char *)parsed_values.destination,
+                     parsed_values.load_factor, &stats, &error);
+    if (success == error) {
+      printf("rebuilt database, records: %" PRIu64 ", pages: %" PRIu64 "\n",
+             stats.no_records, stats.no_pages);
+    } else {
+      printf("error in rebuild.\n");
+    }
+  }
+
+  if (COMMAND_SCAN == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, false, &error);
+    if (failure == error) {
+      return 1;
+    }
+
+    scan_range_elements(database, parsed_values.key, key_length,
+                        parsed_values.end_key,
+                        strnlen(parsed_values.end_key, MAX_STRING_LENGTH),
+                        print_record, database, &error);
+    if (failure == error) {
+      printf("error in scan.\n");
+    }
+    close_database(database, &error);
+  }
+
+  if (COMMAND_CHANGED_SINCE == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, false, &error);
+    if (failure == error) {
+      return 1;
+    }
+
+    Timestamp since = {.seconds = parsed_values.since, .nanoseconds = 0};
+    scan_changed_since(database, &since, print_changed_record, NULL, &error);
+    if (failure == error) {
+      printf("error in changed since.\n");
+    }
+    close_database(database, &error);
+  }
+
+  if (COMMAND_MGET == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, false, &error);
+    if (failure == error) {
+      return 1;
+    }
+
+    MultiGetValues values = {
+        .database = database,
+        .values = calloc(parsed_values.no_keys, sizeof(char *)),
+        .failed = false};
+    uint32_t *key_lengths = malloc(parsed_values.no_keys * sizeof(uint32_t));
+    if (NULL == values.values || NULL == key_lengths) {
+      fprintf(stderr, "cannot allocate values.\n");
+      error = failure;
+    } else {
+      for (uint64_t i = 0; i < parsed_values.no_keys; ++i) {
+        key_lengths[i] = strnlen(parsed_values.keys[i], MAX_STRING_LENGTH);
+      }
+      query_elements(database, parsed_values.keys, key_lengths,
+                     parsed_values.no_keys, store_value, &values, &error);
+    }
+
+    if (success == error && !values.failed) {
+      for (uint64_t i = 0; i < parsed_values.no_keys; ++i) {
+        if (NULL != values.values[i]) {
+          printf("key: %s, value: %s\n", parsed_values.keys[i],
+                 values.values[i]);
+        } else {
+          printf("key: %s, cannot find element.\n", parsed_values.keys[i]);
+        }
+      }
+    } else {
+      printf("error in find elements.\n");
+    }
+    for (uint64_t i = 0; NULL != values.values && i < parsed_values.no_keys;
+         ++i) {
+      free(values.values[i]);
+    }
+    free(values.values);
+    free(key_lengths);
+    close_database(database, &error);
+  }
+
+  if (COMMAND_BATCH == command) {
+    Database *database =
+        open_database((char *)parsed_values.path, true, &error);
+    if (failure == error) {
+      return 1;
+    }
+
+    if (parsed_values.keydir) {
+      database_attach_keydir(database, &error);
+    }
+    if (success == error && 0 != parsed_values.cache_capacity) {
+      database_attach_value_cache(database, parsed_values.cache_capacity,
+                                  &error);
+    }
+    if (success == error && parsed_values.reaper) {
+      database_start_reaper(database, &error);
+    }
+    if (success == error) {
+      run_batch(database, stdin, &error);
+    } else {
+      printf("error in batch.\n");
+    }
+    close_database(database, &error);
   }
 
   return 0;
 }
+
+// The lines are applied one after the other with the database open once,
+// the batch stopping at the first line failing. A transaction left open by
+// the input is aborted, and the snapshot closed.
+static void run_batch(Database *database, FILE *input,
+                      enum FileErrorStatus *error) {
+  *error = success;
+
+  Batch batch = {.database = database, .transaction = NULL, .snapshot = NULL};
+  char *line = NULL;
+  size_t capacity = 0;
+  while (success == *error && -1 != getline(&line, &capacity, input)) {
+    BatchLine batch_line = parse_batch_line(line, error);
+    if (failure == *error) {
+      printf("invalid batch line.\n");
+      break;
+    }
+    if (NULL != batch.transaction && is_transaction_line(&batch_line)) {
+      run_transaction_line(batch.transaction, &batch_line, error);
+    } else {
+      run_batch_line(&batch, &batch_line, error);
+    }
+  }
+  if (NULL != batch.transaction) {
+    abort_transaction(batch.transaction);
+  }
+  if (NULL != batch.snapshot) {
+    close_snapshot(batch.snapshot);
+  }
+  free(line);
+}
+
+static void run_batch_line(Batch *batch, const BatchLine *batch_line,
+                           enum FileErrorStatus *error) {
+  Database *database = batch->database;
+  uint32_t key_length = NULL == batch_line->key
+                            ? 0
+                            : strnlen(batch_line->key, MAX_STRING_LENGTH);
+
+  switch (batch_line->operation) {
+  case BATCH_GET: {
+    char *value;
+    uint64_t length;
+    bool found = query_value(database, batch_line->key, key_length, &value,
+                             &length, error);
+    if (failure == *error) {
+      printf("error in find element.\n");
+    } else if (found) {
+      printf("value: %s\n", value);
+      free(value);
+    } else {
+      printf("cannot find element.\n");
+    }
+    break;
+  }
+  case BATCH_SET:
+    insert_element_with_ttl(database, batch_line->key, key_length,
+                            batch_line->value,
+                            strnlen(batch_line->value, MAX_VALUE_LENGTH),
+                            batch_line->ttl, error);
+    if (success == *error) {
+      printf("successfully inserted element.\n");
+    } else {
+      printf("error in insert element.\n");
+    }
+    break;
+  case BATCH_DELETE: {
+    Record record;
+    bool found =
+        delete_element(database, batch_line->key, key_length, &record, error);
+    if (failure == *error) {
+      printf("error in delete element.\n");
+    } else if (found) {
+      printf("successfully deleted element.\n");
+      destroy_record(&record);
+    } else {
+      printf("cannot find element.\n");
+    }
+    break;
+  }
+  case BATCH_SCAN:
+    if (0 == batch_line->no_threads) {
+      scan_elements(database, print_record, database, error);
+    } else {
+      parallel_scan_elements(database, batch_line->no_threads, print_record,
+                             database, error);
+    }
+    if (failure == *error) {
+      printf("error in scan.\n");
+    }
+    break;
+  case BATCH_SLEEP:
+    sleep(batch_line->seconds);
+    break;
+  case BATCH_STATS: {
+    EngineStats stats;
+    database_stats(database, &stats, error);
+    if (success == *error) {
+      print_stats(database, &stats);
+    } else {
+      printf("error in stats.\n");
+    }
+    break;
+  }
+  case BATCH_BEGIN:
+    if (NULL == batch->transaction) {
+      batch->transaction = begin_transaction(database, error);
+    } else {
+      fprintf(stderr, "a transaction is already open.\n");
+      *error = failure;
+    }
+    if (failure == *error) {
+      printf("error in begin transaction.\n");
+    }
+    break;
+  case BATCH_COMMIT:
+  case BATCH_ABORT:
+    if (NULL == batch->transaction) {
+      fprintf(stderr, "no transaction is open.\n");
+      *error = failure;
+      printf("error in transaction.\n");
+      break;
+    }
+    if (BATCH_ABORT == batch_line->operation) {
+      abort_transaction(batch->transaction);
+      printf("aborted transaction.\n");
+    } else {
+      commit_transaction(batch->transaction, error);
+      if (success == *error) {
+        printf("successfully committed transaction.\n");
+      } else {
+        printf("error in commit transaction.\n");
+      }
+    }
+    batch->transaction = NULL;
+    break;
+  case BATCH_SNAPSHOT:
+    if (NULL != batch->snapshot) {
+      close_snapshot(batch->snapshot);
+    }
+    batch->snapshot = open_snapshot(database, error);
+    if (failure == *error) {
+      printf("error in open snapshot.\n");
+    }
+    break;
+  case BATCH_SNAPSHOT_SCAN:
+    if (NULL == batch->snapshot) {
+      fprintf(stderr, "no snapshot is open.\n");
+      *error = failure;
+    } else {
+      snapshot_scan(batch->snapshot, print_record, database, error);
+    }
+    if (failure == *error) {
+      printf("error in scan.\n");
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static bool is_transaction_line(const BatchLine *batch_line) {
+  return BATCH_GET == batch_line->operation ||
+         BATCH_SET == batch_line->operation ||
+         BATCH_DELETE == batch_line->operation;
+}
+
+// The writes of a transaction are buffered until it commits and its reads
+// see them, a set with a ttl does not fit its write batch.
+static void run_transaction_line(Transaction *transaction,
+                                 const BatchLine *batch_line,
+                                 enum FileErrorStatus *error) {
+  *error = success;
+  uint32_t key_length = strnlen(batch_line->key, MAX_STRING_LENGTH);
+  char *value;
+  uint64_t length;
+  bool found = BATCH_SET != batch_line->operation &&
+               transaction_get(transaction, batch_line->key, key_length,
+                               &value, &length, error);
+  if (failure == *error) {
+    printf("error in find element.\n");
+    return;
+  }
+
+  switch (batch_line->operation) {
+  case BATCH_GET:
+    if (found) {
+      printf("value: %s\n", value);
+    } else {
+      printf("cannot find element.\n");
+    }
+    break;
+  case BATCH_SET:
+    if (0 != batch_line->ttl ||
+        !transaction_put(transaction, batch_line->key, key_length,
+                         batch_line->value,
+                         strnlen(batch_line->value, MAX_VALUE_LENGTH))) {
+      *error = failure;
+      printf("error in insert element.\n");
+    } else {
+      printf("successfully inserted element.\n");
+    }
+    break;
+  case BATCH_DELETE:
+    if (!found) {
+      printf("cannot find element.\n");
+    } else if (!transaction_delete(transaction, batch_line->key,
+                                   key_length)) {
+      *error = failure;
+      printf("error in delete element.\n");
+    } else {
+      printf("successfully deleted element.\n");
+    }
+    break;
+  default:
+    break;
+  }
+  if (found) {
+    free(value);
+  }
+}
+
+// The stats of a batch also count the entries of the key directory it opened
+// the database with.
+static void print_stats(const Database *database, const EngineStats *stats) {
+  printf("engine: %s, pages: %" PRIu64 ", used pages: %" PRIu64
+         ", records: %" PRIu64 ", used bytes: %" PRIu64
+         ", free bytes: %" PRIu64,
+         database_engine_name(database), stats->no_pages,
+         stats->no_used_pages, stats->no_records, stats->used_bytes,
+         stats->free_bytes);
+  if (NULL != database->keydir) {
+    printf(", keydir entries: %" PRIu64, keydir_no_entries(database->keydir));
+  }
+  printf("\n");
+}
+
+static void print_record(const Record *record, void *arguments) {
+  enum FileErrorStatus error;
+  uint64_t length;
+  char *value = read_record_value(arguments, record, &length, &error);
+  if (success == error) {
+    printf("key: %.*s, value: %s\n", (int)record_key_length(record),
+           record_key(record), value);
+    free(value);
+  }
+}
+
+static void print_changed_record(const Record *record, void *arguments) {
+  Timestamp last = record_last_timestamp(record);
+  char buffer[100];
+  format_timestamp_into_date(&last, buffer, sizeof(buffer));
+  printf("key: %.*s, last ts: %s\n", (int)record_key_length(record),
+         record_key(record), buffer);
+}
+
+static void store_value(uint64_t index, const Record *record,
+                        void *arguments) {
+  MultiGetValues *values = arguments;
+  if (NULL == record) {
+    return;
+  }
+
+  enum FileErrorStatus error;
+  uint64_t length;
+  values->values[index] =
+      read_record_value(values->database, record, &length, &error);
+  values->failed = values->failed || failure == error;
+}
@@ -0,0 +1,372 @@
+#include "../include/overflow.h"
+#include "../include/buffer_utilities.h"
+#include "../include/constants.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// header page: magic (8 bytes) | no_pages (8 bytes) | first free page (8
+// bytes) | next chain id (8 bytes) | no_used_pages (8 bytes)
+//
+// overflow page: chain id (8 bytes) | next page (8 bytes) | used (2 bytes) |
+// data (page size - 18 bytes), free pages are chained through next page with
+// chain id 0. The data of a 64 KiB page still fits the 2 bytes of used.
+
+#define OVERFLOW_SUFFIX ".overflow"
+#define OVERFLOW_MAGIC (0x574F4C465245564FULL)
+
+#define FIELD_SIZE (8)
+#define MAGIC_OFFSET (0)
+#define NO_PAGES_OFFSET (MAGIC_OFFSET + FIELD_SIZE)
+#define FREE_PAGE_OFFSET (NO_PAGES_OFFSET + FIELD_SIZE)
+#define CHAIN_ID_COUNTER_OFFSET (FREE_PAGE_OFFSET + FIELD_SIZE)
+#define NO_USED_PAGES_OFFSET (CHAIN_ID_COUNTER_OFFSET + FIELD_SIZE)
+
+#define CHAIN_ID_OFFSET (0)
+#define NEXT_PAGE_OFFSET (CHAIN_ID_OFFSET + FIELD_SIZE)
+#define USED_SIZE (2)
+#define USED_OFFSET (NEXT_PAGE_OFFSET + FIELD_SIZE)
+#define DATA_OFFSET (USED_OFFSET + USED_SIZE)
+#define PAGE_DATA_SIZE(page_size) ((page_size) - DATA_OFFSET)
+
+typedef struct {
+  uint64_t no_pages;
+  uint64_t free_page;
+  uint64_t next_chain_id;
+  uint64_t no_used_pages;
+} OverflowHeader;
+
+static void read_header(const OverflowFile *overflow_file,
+                        OverflowHeader *header, enum FileErrorStatus *error);
+static void write_header(OverflowFile *overflow_file,
+                         const OverflowHeader *header,
+                         enum FileErrorStatus *error);
+static uint8_t *allocate_page(const OverflowFile *overflow_file,
+                              enum FileErrorStatus *error);
+static void read_page(const OverflowFile *overflow_file, uint64_t page_id,
+                      uint8_t *page, enum FileErrorStatus *error);
+static void write_page(OverflowFile *overflow_file, uint64_t page_id,
+                       const uint8_t *page, enum FileErrorStatus *error);
+static uint64_t no_chain_pages(uint64_t length, uint64_t page_size);
+
+// API implementation
+
+void overflow_file_path(char *buffer, const char *path) {
+  snprintf(buffer, PATH_MAX, "%s" OVERFLOW_SUFFIX, path);
+}
+
+OverflowFile *open_overflow_file(const char *path, uint64_t page_size,
+                                 bool writable, bool create,
+                                 enum FileErrorStatus *error) {
+  *error = success;
+
+  char buffer[PATH_MAX];
+  overflow_file_path(buffer, path);
+  int flags = writable ? O_RDWR : O_RDONLY;
+  int fd = open(buffer, create ? flags | O_CREAT : flags, 0600);
+  if (-1 == fd) {
+    if (ENOENT != errno || create) {
+      fprintf(stderr, "cannot open overflow file.\n");
+      *error = failure;
+    }
+    return NULL;
+  }
+
+  OverflowFile *overflow_file = malloc(sizeof(OverflowFile));
+  if (NULL == overflow_file) {
+    fprintf(stderr, "cannot allocate overflow file.\n");
+    *error = failure;
+    close(fd);
+    return NULL;
+  }
+  overflow_file->fd = fd;
+  overflow_file->page_size = page_size;
+
+  if (create && 0 == lseek(fd, 0, SEEK_END)) {
+    OverflowHeader header = {
+        .no_pages = 1, .free_page = 0, .next_chain_id = 1, .no_used_pages = 0};
+    write_header(overflow_file, &header, error);
+    if (failure == *error) {
+      close_overflow_file(overflow_file);
+      return NULL;
+    }
+  }
+  return overflow_file;
+}
+
+uint64_t overflow_no_used_pages(const OverflowFile *overflow_file,
+                                enum FileErrorStatus *error) {
+  OverflowHeader header = {0};
+  read_header(overflow_file, &header, error);
+  return failure == *error ? 0 : header.no_used_pages;
+}
+
+// Free pages are reused before the file grows.
+void overflow_write_value(OverflowFile *overflow_file, const char *value,
+                          uint64_t length, OverflowReference *reference,
+                          enum FileErrorStatus *error) {
+  *error = success;
+
+  OverflowHeader header;
+  read_header(overflow_file, &header, error);
+  if (failure == *error) {
+    return;
+  }
+
+  uint64_t page_size = overflow_file->page_size;
+  uint64_t no_pages = no_chain_pages(length, page_size);
+  uint64_t *page_ids = malloc(no_pages * sizeof(uint64_t));
+  if (NULL == page_ids) {
+    fprintf(stderr, "cannot allocate overflow pages.\n");
+    *error = failure;
+    return;
+  }
+
+  uint8_t *page = allocate_page(overflow_file, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  for (uint64_t i = 0; i < no_pages; ++i) {
+    if (0 == header.free_page) {
+      page_ids[i] = header.no_pages++;
+      continue;
+    }
+    page_ids[i] = header.free_page;
+    read_page(overflow_file, header.free_page, page, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+    header.free_page =
+        read_data_from_buffer(page, NEXT_PAGE_OFFSET, FIELD_SIZE);
+  }
+
+  uint64_t chain_id = header.next_chain_id++;
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < no_pages; ++i) {
+    uint64_t used = length - offset;
+    used = used > PAGE_DATA_SIZE(page_size) ? PAGE_DATA_SIZE(page_size) : used;
+    memset(page, 0, page_size);
+    write_data_to_buffer(page, CHAIN_ID_OFFSET, FIELD_SIZE, chain_id);
+    write_data_to_buffer(page, NEXT_PAGE_OFFSET, FIELD_SIZE,
+                         i + 1 < no_pages ? page_ids[i + 1] : 0);
+    write_data_to_buffer(page, USED_OFFSET, USED_SIZE, used);
+    memcpy(page + DATA_OFFSET, value + offset, used);
+    write_page(overflow_file, page_ids[i], page, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+    offset += used;
+  }
+
+  header.no_used_pages += no_pages;
+  write_header(overflow_file, &header, error);
+  if (success == *error) {
+    *reference = (OverflowReference){
+        .length = length, .first_page = page_ids[0], .chain_id = chain_id};
+  }
+
+cleanup_1:
+  free(page);
+cleanup_0:
+  free(page_ids);
+}
+
+char *overflow_read_value(const OverflowFile *overflow_file,
+                          const OverflowReference *reference,
+                          enum FileErrorStatus *error) {
+  *error = success;
+
+  char *value = malloc(reference->length + 1);
+  if (NULL == value) {
+    fprintf(stderr, "cannot allocate overflow value.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  uint8_t *page = allocate_page(overflow_file, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  uint64_t page_id = reference->first_page;
+  uint64_t offset = 0;
+  while (offset < reference->length) {
+    read_page(overflow_file, page_id, page, error);
+    if (failure == *error) {
+      goto cleanup_1;
+    }
+
+    uint64_t used = read_data_from_buffer(page, USED_OFFSET, USED_SIZE);
+    if (reference->chain_id !=
+            read_data_from_buffer(page, CHAIN_ID_OFFSET, FIELD_SIZE) ||
+        used > PAGE_DATA_SIZE(overflow_file->page_size) ||
+        offset + used > reference->length || 0 == used) {
+      fprintf(stderr, "overflow value changed while reading.\n");
+      *error = failure;
+      goto cleanup_1;
+    }
+    memcpy(value + offset, page + DATA_OFFSET, used);
+    offset += used;
+    page_id = read_data_from_buffer(page, NEXT_PAGE_OFFSET, FIELD_SIZE);
+  }
+
+  free(page);
+  value[reference->length] = '\0';
+  return value;
+
+cleanup_1:
+  free(page);
+cleanup_0:
+  free(value);
+  return NULL;
+}
+
+void overflow_free_value(OverflowFile *overflow_file,
+                         const OverflowReference *reference,
+                         enum FileErrorStatus *error) {
+  *error = success;
+
+  OverflowHeader header;
+  read_header(overflow_file, &header, error);
+  if (failure == *error) {
+    return;
+  }
+
+  uint8_t *page = allocate_page(overflow_file, error);
+  if (failure == *error) {
+    return;
+  }
+  uint64_t page_id = reference->first_page;
+  uint64_t no_pages =
+      no_chain_pages(reference->length, overflow_file->page_size);
+  for (uint64_t i = 0; i < no_pages && 0 != page_id; ++i) {
+    read_page(overflow_file, page_id, page, error);
+    if (failure == *error) {
+      break;
+    }
+    if (reference->chain_id !=
+        read_data_from_buffer(page, CHAIN_ID_OFFSET, FIELD_SIZE)) {
+      fprintf(stderr, "overflow chain is corrupted.\n");
+      *error = failure;
+      break;
+    }
+
+    uint64_t next_page =
+        read_data_from_buffer(page, NEXT_PAGE_OFFSET, FIELD_SIZE);
+    memset(page, 0, overflow_file->page_size);
+    write_data_to_buffer(page, NEXT_PAGE_OFFSET, FIELD_SIZE, header.free_page);
+    write_page(overflow_file, page_id, page, error);
+    if (failure == *error) {
+      break;
+    }
+    header.free_page = page_id;
+    --header.no_used_pages;
+    page_id = next_page;
+  }
+
+  free(page);
+
+  enum FileErrorStatus header_error;
+  write_header(overflow_file, &header, &header_error);
+  if (failure == header_error) {
+    *error = failure;
+  }
+}
+
+void close_overflow_file(OverflowFile *overflow_file) {
+  if (NULL == overflow_file) {
+    return;
+  }
+  close(overflow_file->fd);
+  free(overflow_file);
+}
+
+// Local implementation
+
+static void read_header(const OverflowFile *overflow_file,
+                        OverflowHeader *header, enum FileErrorStatus *error) {
+  uint8_t *page = allocate_page(overflow_file, error);
+  if (failure == *error) {
+    return;
+  }
+  read_page(overflow_file, 0, page, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  if (OVERFLOW_MAGIC != read_data_from_buffer(page, MAGIC_OFFSET, FIELD_SIZE)) {
+    fprintf(stderr, "overflow file is corrupted.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+  header->no_pages = read_data_from_buffer(page, NO_PAGES_OFFSET, FIELD_SIZE);
+  header->free_page = read_data_from_buffer(page, FREE_PAGE_OFFSET, FIELD_SIZE);
+  header->next_chain_id =
+      read_data_from_buffer(page, CHAIN_ID_COUNTER_OFFSET, FIELD_SIZE);
+  header->no_used_pages =
+      read_data_from_buffer(page, NO_USED_PAGES_OFFSET, FIELD_SIZE);
+
+cleanup_0:
+  free(page);
+}
+
+static void write_header(OverflowFile *overflow_file,
+                         const OverflowHeader *header,
+                         enum FileErrorStatus *error) {
+  uint8_t *page = allocate_page(overflow_file, error);
+  if (failure == *error) {
+    return;
+  }
+  memset(page, 0, overflow_file->page_size);
+  write_data_to_buffer(page, MAGIC_OFFSET, FIELD_SIZE, OVERFLOW_MAGIC);
+  write_data_to_buffer(page, NO_PAGES_OFFSET, FIELD_SIZE, header->no_pages);
+  write_data_to_buffer(page, FREE_PAGE_OFFSET, FIELD_SIZE, header->free_page);
+  write_data_to_buffer(page, CHAIN_ID_COUNTER_OFFSET, FIELD_SIZE,
+                       header->next_chain_id);
+  write_data_to_buffer(page, NO_USED_PAGES_OFFSET, FIELD_SIZE,
+                       header->no_used_pages);
+  write_page(overflow_file, 0, page, error);
+  free(page);
+}
+
+static uint8_t *allocate_page(const OverflowFile *overflow_file,
+                              enum FileErrorStatus *error) {
+  *error = success;
+  uint8_t *page = malloc(overflow_file->page_size);
+  if (NULL == page) {
+    fprintf(stderr, "cannot allocate overflow page.\n");
+    *error = failure;
+  }
+  return page;
+}
+
+static void read_page(const OverflowFile *overflow_file, uint64_t page_id,
+                      uint8_t *page, enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t page_size = overflow_file->page_size;
+  if ((ssize_t)page_size !=
+      pread(overflow_file->fd, page, page_size, page_id * page_size)) {
+    fprintf(stderr, "failed to read an overflow page.\n");
+    *error = failure;
+  }
+}
+
+static void write_page(OverflowFile *overflow_file, uint64_t page_id,
+                       const uint8_t *page, enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t page_size = overflow_file->page_size;
+  if ((ssize_t)page_size !=
+      pwrite(overflow_file->fd, page, page_size, page_id * page_size)) {
+    fprintf(stderr, "failed to write an overflow page.\n");
+    *error = failure;
+  }
+}
+
+static uint64_t no_chain_pages(uint64_t length, uint64_t page_size) {
+  uint64_t no_pages =
+      (length + PAGE_DATA_SIZE(page_size) - 1) / PAGE_DATA_SIZE(page_size);
+  return 0 == no_pages ? 1 : no_pages;
+}
@@ -0,0 +1,240 @@
+#include "../include/page_cache.h"
+#include "../include/data_page.h"
+#include "../include/file_utilities.h"
+#include "../include/journal.h"
+#include "../include/keydir.h"
+#include "../include/snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static CachedPage *add_page(Database *database, PageCache *page_cache,
+                            uint64_t page_id, bool read,
+                            enum FileErrorStatus *error);
+static void journal_cached_pages(Database *database, PageCache *page_cache,
+                                 uint64_t no_dirty,
+                                 enum FileErrorStatus *error);
+static bool is_data_page(const Database *database, uint64_t page_id);
+
+// API implementation
+
+CachedPage *cached_page(Database *database, PageCache *page_cache,
+                        uint64_t page_id, enum FileErrorStatus *error) {
+  return add_page(database, page_cache, page_id, true, error);
+}
+
+CachedPage *new_cached_page(Database *database, PageCache *page_cache,
+                            uint64_t page_id, enum FileErrorStatus *error) {
+  return add_page(database, page_cache, page_id, false, error);
+}
+
+// All the write locks are held until every page is written, so a reader
+// never sees a page of the batch before the batch is written in full.
+void write_cached_pages(Database *database, PageCache *page_cache,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  int fd = database->fd;
+
+  uint64_t no_locked = 0;
+  for (; no_locked < page_cache->no_pages; ++no_locked) {
+    CachedPage *page = page_cache->pages[no_locked];
+    if (!page->dirty || 0 == page->page_id) {
+      continue;
+    }
+    write_lock_page(fd, page->page_id, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+  uint64_t no_dirty = 0;
+  for (uint64_t i = 0; i < page_cache->no_pages; ++i) {
+    CachedPage *page = page_cache->pages[i];
+    if (!page->dirty) {
+      continue;
+    }
+    if (0 != page->page_id) {
+      snapshot_preserve_page(database, page->page_id, error);
+      if (failure == *error) {
+        goto cleanup_0;
+      }
+    }
+    ++no_dirty;
+  }
+  if (no_dirty > 1) {
+    journal_cached_pages(database, page_cache, no_dirty, error);
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < page_cache->no_pages; ++i) {
+    CachedPage *page = page_cache->pages[i];
+    if (!page->dirty) {
+      continue;
+    }
+    if (is_data_page(database, page->page_id)) {
+      write_data_page(&database->data_pages, &page->safe_buffer,
+                      page->page_id, error);
+    } else {
+      write_page_to_file(fd, &page->safe_buffer, page->page_id, false, error);
+    }
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+cleanup_0:
+  for (uint64_t i = 0; i < no_locked; ++i) {
+    CachedPage *page = page_cache->pages[i];
+    if (page->dirty && 0 != page->page_id) {
+      enum FileErrorStatus unlock_error;
+      unlock_page(fd, page->page_id, &unlock_error);
+    }
+  }
+}
+
+void index_cached_pages(Database *database, const PageCache *page_cache,
+                        const WriteBatch *write_batch,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  if (NULL == database->keydir) {
+    return;
+  }
+
+  for (uint64_t i = 0; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    keydir_remove(database->keydir, entry->key, entry->key_length);
+  }
+  for (uint64_t i = 0; i < page_cache->no_pages; ++i) {
+    CachedPage *page = page_cache->pages[i];
+    DataPage data_page = create_data_page(&page->safe_buffer);
+    if (page->dirty &&
+        !keydir_index_page(database->keydir, page->page_id, &data_page)) {
+      *error = failure;
+      return;
+    }
+  }
+}
+
+void destroy_page_cache(PageCache *page_cache) {
+  for (uint64_t i = 0; i < page_cache->no_pages; ++i) {
+    free(page_cache->pages[i]);
+  }
+  free(page_cache->pages);
+}
+
+// Local implementation
+
+static CachedPage *add_page(Database *database, PageCache *page_cache,
+                            uint64_t page_id, bool read,
+                            enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t low = 0;
+  uint64_t high = page_cache->no_pages;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    if (page_cache->pages[middle]->page_id < page_id) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low < page_cache->no_pages &&
+      page_cache->pages[low]->page_id == page_id) {
+    return page_cache->pages[low];
+  }
+
+  CachedPage **pages = realloc(page_cache->pages, (page_cache->no_pages + 1) *
+                                                      sizeof(CachedPage *));
+  if (NULL == pages) {
+    fprintf(stderr, "cannot allocate write batch pages.\n");
+    *error = failure;
+    return NULL;
+  }
+  page_cache->pages = pages;
+
+  uint64_t page_size = is_data_page(database, page_id)
+                           ? database->data_pages.page_size
+                           : database->page_size;
+  CachedPage *page = malloc(sizeof(CachedPage) + page_size);
+  if (NULL == page) {
+    fprintf(stderr, "cannot allocate write batch pages.\n");
+    *error = failure;
+    return NULL;
+  }
+  page->page_id = page_id;
+  page->dirty = !read;
+  page->safe_buffer = (SafeBuffer){
+      .buffer = page->buffer, .length = 0, .capacity = page_size};
+
+  // The header page stays locked while the database is open.
+  if (read && 0 == page_id) {
+    read_page_into_buffer(database->fd, page_id, &page->safe_buffer, error);
+  } else if (read && is_data_page(database, page_id)) {
+    locked_read_data_page(&database->data_pages, page_id, &page->safe_buffer,
+                          error);
+  } else if (read) {
+    locked_read_page_into_buffer(database->fd, page_id, &page->safe_buffer,
+                                 error);
+  } else {
+    memset(page->buffer, 0, page_size);
+    page->safe_buffer.length = page_size;
+  }
+  if (failure == *error) {
+    free(page);
+    return NULL;
+  }
+
+  memmove(page_cache->pages + low + 1, page_cache->pages + low,
+          (page_cache->no_pages - low) * sizeof(CachedPage *));
+  page_cache->pages[low] = page;
+  ++page_cache->no_pages;
+  return page;
+}
+
+// The dirty pages go through the journal so that a crash leaves all of them or
+// none. Compressed data pages are journaled as the slots they are written to.
+static void journal_cached_pages(Database *database, PageCache *page_cache,
+                                 uint64_t no_dirty,
+                                 enum FileErrorStatus *error) {
+  *error = success;
+  const DataPageFile *file = &database->data_pages;
+  bool compressed = PAGE_CODEC_NONE != file->codec;
+
+  JournalPage *pages = malloc(no_dirty * sizeof(JournalPage));
+  uint8_t *slots = compressed ? malloc(no_dirty * file->slot_size) : NULL;
+  if (NULL == pages || (compressed && NULL == slots)) {
+    fprintf(stderr, "cannot allocate write batch pages.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  uint64_t no_pages = 0;
+  for (uint64_t i = 0; i < page_cache->no_pages; ++i) {
+    CachedPage *page = page_cache->pages[i];
+    if (!page->dirty) {
+      continue;
+    }
+    pages[no_pages].page_id = page->page_id;
+    pages[no_pages].page = page->buffer;
+    if (compressed && is_data_page(database, page->page_id)) {
+      uint8_t *slot = slots + no_pages * file->slot_size;
+      if (!encode_data_page(file, page->buffer, slot)) {
+        *error = failure;
+        goto cleanup_0;
+      }
+      pages[no_pages].page = slot;
+    }
+    ++no_pages;
+  }
+  journal_commit_pages(database->path, database->fd, database->page_size,
+                       pages, no_pages, error);
+
+cleanup_0:
+  free(slots);
+  free(pages);
+}
+
+static bool is_data_page(const Database *database, uint64_t page_id) {
+  return database->operations->stores_data_pages && 0 != page_id;
+}
@@ -0,0 +1,213 @@
+#include "../include/page_codec.h"
+#include "../include/buffer_utilities.h"
+#include <assert.h>
+#include <string.h>
+
+// LZ77 in the LZ4 block layout, a sequence being token (1 byte) | literal
+// length extension | literals | match offset (2 bytes) | match length
+// extension. The token holds the literal length in its high nibble and the
+// match length minus MIN_MATCH in its low one, a nibble of 15 continuing in
+// extension bytes added up until one below 255. The last sequence only has
+// literals. Pages are small enough for every offset to fit 2 bytes.
+
+#define MIN_MATCH (4)
+#define NIBBLE_BITS (4)
+#define NIBBLE_MASK (0x0F)
+#define EXTENSION_BYTE (255)
+#define OFFSET_SIZE (2)
+#define HASH_BITS (12)
+#define HASH_MULTIPLIER (2654435761U)
+#define MAX_OFFSET (0xFFFF)
+// Token and length bytes of the last sequence, with room to spare
+#define BOUND_SLACK (16)
+
+static uint32_t lz_compress(const uint8_t *input, uint32_t length,
+                            uint8_t *output, uint32_t capacity);
+static bool lz_decompress(const uint8_t *input, uint32_t input_length,
+                          uint8_t *output, uint32_t length);
+static bool write_length(uint8_t *output, uint32_t capacity,
+                         uint32_t *offset, uint32_t length);
+static bool read_length(const uint8_t *input, uint32_t input_length,
+                        uint32_t *offset, uint32_t *length);
+static uint32_t sequence_hash(const uint8_t *input);
+
+// API implementation
+
+// Every 255 literals take a length extension byte, a match never takes more
+// bytes than it stands for.
+uint32_t page_codec_bound(PageCodec codec, uint32_t length) {
+  assert(PAGE_CODEC_LZ == codec);
+  return length + length / EXTENSION_BYTE + BOUND_SLACK;
+}
+
+uint32_t page_codec_compress(PageCodec codec, const uint8_t *input,
+                             uint32_t length, uint8_t *output,
+                             uint32_t capacity) {
+  assert(PAGE_CODEC_LZ == codec);
+  return lz_compress(input, length, output, capacity);
+}
+
+bool page_codec_decompress(PageCodec codec, const uint8_t *input,
+                           uint32_t input_length, uint8_t *output,
+                           uint32_t length) {
+  if (PAGE_CODEC_LZ != codec) {
+    return false;
+  }
+  return lz_decompress(input, input_length, output, length);
+}
+
+// Local implementation
+
+// Greedy, a match is only looked up at the last position sharing the hash of
+// its first four bytes.
+static uint32_t lz_compress(const uint8_t *input, uint32_t length,
+                            uint8_t *output, uint32_t capacity) {
+  assert(length <= MAX_OFFSET);
+  uint16_t positions[1 << HASH_BITS] = {0};
+  uint32_t offset = 0;
+  uint32_t anchor = 0;
+  uint32_t position = 0;
+
+  while (position + MIN_MATCH <= length) {
+    uint32_t hash = sequence_hash(input + position);
+    // positions are stored plus one, zero marking an empty slot
+    uint32_t candidate = positions[hash];
+    positions[hash] = position + 1;
+    if (0 == candidate ||
+        0 != memcmp(input + candidate - 1, input + position, MIN_MATCH)) {
+      ++position;
+      continue;
+    }
+    --candidate;
+
+    uint32_t match_length = MIN_MATCH;
+    while (position + match_length < length &&
+           input[candidate + match_length] == input[position + match_length]) {
+      ++match_length;
+    }
+
+    uint32_t literal_length = position - anchor;
+    if (offset >= capacity) {
+      return 0;
+    }
+    uint32_t token = offset++;
+    output[token] =
+        (literal_length < NIBBLE_MASK ? literal_length : NIBBLE_MASK)
+            << NIBBLE_BITS |
+        (match_length - MIN_MATCH < NIBBLE_MASK ? match_length - MIN_MATCH
+                                                : NIBBLE_MASK);
+    if (!write_length(output, capacity, &offset, literal_length) ||
+        offset + literal_length + OFFSET_SIZE > capacity) {
+      return 0;
+    }
+    memcpy(output + offset, input + anchor, literal_length);
+    offset += literal_length;
+    write_data_to_buffer(output, offset, OFFSET_SIZE, position - candidate);
+    offset += OFFSET_SIZE;
+    if (!write_length(output, capacity, &offset, match_length - MIN_MATCH)) {
+      return 0;
+    }
+
+    position += match_length;
+    anchor = position;
+  }
+
+  uint32_t literal_length = length - anchor;
+  if (offset >= capacity) {
+    return 0;
+  }
+  output[offset++] =
+      (literal_length < NIBBLE_MASK ? literal_length : NIBBLE_MASK)
+      << NIBBLE_BITS;
+  if (!write_length(output, capacity, &offset, literal_length) ||
+      offset + literal_length > capacity) {
+    return 0;
+  }
+  memcpy(output + offset, input + anchor, literal_length);
+  return offset + literal_length;
+}
+
+// Every length and offset is checked, a corrupt page never writes past the
+// output.
+static bool lz_decompress(const uint8_t *input, uint32_t input_length,
+                          uint8_t *output, uint32_t length) {
+  uint32_t offset = 0;
+  uint32_t position = 0;
+
+  while (offset < input_length) {
+    uint8_t token = input[offset++];
+    uint32_t literal_length = token >> NIBBLE_BITS;
+    if (!read_length(input, input_length, &offset, &literal_length) ||
+        literal_length > input_length - offset ||
+        literal_length > length - position) {
+      return false;
+    }
+    memcpy(output + position, input + offset, literal_length);
+    offset += literal_length;
+    position += literal_length;
+    if (offset == input_length) {
+      break;
+    }
+
+    if (OFFSET_SIZE > input_length - offset) {
+      return false;
+    }
+    uint32_t match_offset =
+        read_data_from_buffer(input, offset, OFFSET_SIZE);
+    offset += OFFSET_SIZE;
+    uint32_t match_length = token & NIBBLE_MASK;
+    if (!read_length(input, input_length, &offset, &match_length)) {
+      return false;
+    }
+    match_length += MIN_MATCH;
+    if (0 == match_offset || match_offset > position ||
+        match_length > length - position) {
+      return false;
+    }
+    // byte by byte, a match may overlap the bytes it produces
+    for (uint32_t i = 0; i < match_length; ++i, ++position) {
+      output[position] = output[position - match_offset];
+    }
+  }
+  return position == length;
+}
+
+static bool write_length(uint8_t *output, uint32_t capacity,
+                         uint32_t *offset, uint32_t length) {
+  if (length < NIBBLE_MASK) {
+    return true;
+  }
+  for (length -= NIBBLE_MASK; length >= EXTENSION_BYTE;
+       length -= EXTENSION_BYTE) {
+    if (*offset >= capacity) {
+      return false;
+    }
+    output[(*offset)++] = EXTENSION_BYTE;
+  }
+  if (*offset >= capacity) {
+    return false;
+  }
+  output[(*offset)++] = length;
+  return true;
+}
+
+static bool read_length(const uint8_t *input, uint32_t input_length,
+                        uint32_t *offset, uint32_t *length) {
+  if (NIBBLE_MASK != *length) {
+    return true;
+  }
+  uint8_t byte;
+  do {
+    if (*offset >= input_length) {
+      return false;
+    }
+    byte = input[(*offset)++];
+    *length += byte;
+  } while (EXTENSION_BYTE == byte);
+  return true;
+}
+
+static uint32_t sequence_hash(const uint8_t *input) {
+  uint32_t sequence = read_data_from_buffer(input, 0, MIN_MATCH);
+  return (sequence * HASH_MULTIPLIER) >> (32 - HASH_BITS);
+}
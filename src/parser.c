@@ -1,27 +1,66 @@
 #include "../include/parser.h"
 #include "../include/constants.h"
+#include "../include/rebuild.h"
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_COMMAND_STRING_LENGTH (10)
+#define MAX_COMMAND_STRING_LENGTH (16)
+#define TIME_INDEX_OPTION "--time-index"
+#define PAGE_SIZE_OPTION "--page-size="
+#define COMPRESS_OPTION "--compress"
+#define KEYDIR_OPTION "--keydir"
+#define REAPER_OPTION "--reaper"
+#define CACHE_OPTION "--cache="
+#define BATCH_SEPARATORS " \t\r\n"
 
 typedef struct command_data {
-  char string[10];
+  char string[MAX_COMMAND_STRING_LENGTH];
   uint8_t command_len;
 } CommandData;
 
 // Order based on enum
-CommandData command_data[5] = {{.string = "get", .command_len = 4},
-                               {.string = "create", .command_len = 4},
-                               {.string = "set", .command_len = 5},
-                               {.string = "ts", .command_len = 4},
-                               {.string = "del", .command_len = 4}};
+CommandData command_data[COMMAND_LENGTH] = {
+    {.string = "get", .command_len = 4},
+    {.string = "create", .command_len = 4},
+    {.string = "set", .command_len = 5},
+    {.string = "ts", .command_len = 4},
+    {.string = "del", .command_len = 4},
+    {.string = "stats", .command_len = 3},
+    {.string = "scan", .command_len = 5},
+    {.string = "mget", .command_len = 4},
+    {.string = "incr", .command_len = 4},
+    {.string = "append", .command_len = 5},
+    {.string = "cas", .command_len = 6},
+    {.string = "changed-since", .command_len = 4},
+    {.string = "vacuum", .command_len = 3},
+    {.string = "rebuild", .command_len = 4},
+    {.string = "batch", .command_len = 3}};
 
-static bool check_string_size(const char *string);
-static bool check_strings(int command_length, char **strings);
+// Order based on enum, the number of words includes the operation
+CommandData batch_data[BATCH_LENGTH] = {
+    {.string = "get", .command_len = 2},
+    {.string = "set", .command_len = 3},
+    {.string = "del", .command_len = 2},
+    {.string = "stats", .command_len = 1},
+    {.string = "scan", .command_len = 1},
+    {.string = "sleep", .command_len = 2},
+    {.string = "begin", .command_len = 1},
+    {.string = "commit", .command_len = 1},
+    {.string = "abort", .command_len = 1},
+    {.string = "snapshot", .command_len = 1},
+    {.string = "snapshot-scan", .command_len = 1}};
+
+// Order based on enum
+const char *engine_names[ENGINE_LENGTH] = {"linear", "cuckoo", "btree",
+                                            "log",    "lsm",    "sharded"};
+
+static bool check_string_size(const char *string, uint64_t max_length);
+static EngineType parse_engine(const char *engine, enum FileErrorStatus *error);
+static bool check_strings(Command command, int command_length, char **strings);
+static bool parse_positive(const char *string, uint64_t *number);
 
 Command parse_command(const char *command, enum FileErrorStatus *error) {
   *error = success;
@@ -52,8 +91,71 @@ ParsedValues parse_values(Command command, int argc, char **argv,
   parsed_values.command = command;
   parsed_values.path = argv[2];
   parsed_values.key = argv[3];
+  parsed_values.time_index = false;
+  parsed_values.page_size = DEFAULT_PAGE_SIZE;
+  parsed_values.page_codec = PAGE_CODEC_NONE;
+  parsed_values.ttl = 0;
+  parsed_values.delta = 1;
+  parsed_values.load_factor = DEFAULT_LOAD_FACTOR;
+  parsed_values.keydir = false;
+  parsed_values.reaper = false;
+  parsed_values.cache_capacity = 0;
 
-  if (argc != command_data[command].command_len || !check_strings(argc, argv)) {
+  // create may end with the time index, page size and compression options,
+  // batch with the options of the open database, parsed before the
+  // positional arguments
+  while ((COMMAND_CREATE == command || COMMAND_BATCH == command) &&
+         argc > 3) {
+    const char *option = argv[argc - 1];
+    if (COMMAND_BATCH == command) {
+      if (0 == strncmp(option, KEYDIR_OPTION, sizeof(KEYDIR_OPTION))) {
+        parsed_values.keydir = true;
+      } else if (0 == strncmp(option, REAPER_OPTION, sizeof(REAPER_OPTION))) {
+        parsed_values.reaper = true;
+      } else if (0 == strncmp(option, CACHE_OPTION,
+                              sizeof(CACHE_OPTION) - 1)) {
+        if (!parse_positive(option + sizeof(CACHE_OPTION) - 1,
+                            &parsed_values.cache_capacity)) {
+          *error = failure;
+          return parsed_values;
+        }
+      } else {
+        break;
+      }
+    } else if (0 == strncmp(option, TIME_INDEX_OPTION,
+                            sizeof(TIME_INDEX_OPTION))) {
+      parsed_values.time_index = true;
+    } else if (0 == strncmp(option, COMPRESS_OPTION,
+                            sizeof(COMPRESS_OPTION))) {
+      parsed_values.page_codec = PAGE_CODEC_LZ;
+    } else if (0 == strncmp(option, PAGE_SIZE_OPTION,
+                            sizeof(PAGE_SIZE_OPTION) - 1)) {
+      const char *size = option + sizeof(PAGE_SIZE_OPTION) - 1;
+      char *end;
+      parsed_values.page_size = strtoull(size, &end, 10);
+      if (size[0] < '0' || size[0] > '9' || '\0' != *end) {
+        *error = failure;
+        return parsed_values;
+      }
+    } else {
+      break;
+    }
+    --argc;
+  }
+
+  // create optionally takes the engine and then the number of shards as last
+  // arguments, set a ttl in seconds, incr a delta, rebuild a load factor,
+  // mget any number of keys
+  bool has_optional_argument =
+      (COMMAND_CREATE == command &&
+       (argc == command_data[command].command_len + 1 ||
+        argc == command_data[command].command_len + 2)) ||
+      ((COMMAND_INSERT == command || COMMAND_INCREMENT == command ||
+        COMMAND_REBUILD == command) &&
+       argc == command_data[command].command_len + 1) ||
+      (COMMAND_MGET == command && argc > command_data[command].command_len);
+  if ((argc != command_data[command].command_len && !has_optional_argument) ||
+      !check_strings(command, argc, argv)) {
     *error = failure;
     return parsed_values;
   }
@@ -61,6 +163,56 @@ ParsedValues parse_values(Command command, int argc, char **argv,
   switch (command) {
   case COMMAND_INSERT:
     parsed_values.value = argv[4];
+    if (has_optional_argument &&
+        !parse_positive(argv[5], &parsed_values.ttl)) {
+      *error = failure;
+      return parsed_values;
+    }
+    break;
+  case COMMAND_SCAN:
+    parsed_values.end_key = argv[4];
+    break;
+  case COMMAND_INCREMENT:
+    if (has_optional_argument) {
+      char *end;
+      parsed_values.delta = strtoll(argv[4], &end, 10);
+      if ('\0' != *end) {
+        *error = failure;
+        return parsed_values;
+      }
+    }
+    break;
+  case COMMAND_APPEND:
+    parsed_values.value = argv[4];
+    break;
+  case COMMAND_CHANGED_SINCE: {
+    char *end;
+    parsed_values.since = strtoull(argv[3], &end, 10);
+    if ('\0' != *end) {
+      *error = failure;
+      return parsed_values;
+    }
+    break;
+  }
+  case COMMAND_REBUILD:
+    parsed_values.destination = argv[3];
+    if (has_optional_argument) {
+      char *end;
+      parsed_values.load_factor = strtod(argv[4], &end);
+      if ('\0' != *end || !(parsed_values.load_factor > 0) ||
+          parsed_values.load_factor > 1) {
+        *error = failure;
+        return parsed_values;
+      }
+    }
+    break;
+  case COMMAND_COMPARE_AND_SET:
+    parsed_values.expected = argv[4];
+    parsed_values.value = argv[5];
+    break;
+  case COMMAND_MGET:
+    parsed_values.keys = (const char **)argv + 3;
+    parsed_values.no_keys = argc - 3;
     break;
   case COMMAND_CREATE: {
     char *end;
@@ -69,6 +221,17 @@ ParsedValues parse_values(Command command, int argc, char **argv,
       *error = failure;
       return parsed_values;
     }
+    parsed_values.engine = has_optional_argument
+                               ? parse_engine(argv[4], error)
+                               : ENGINE_LINEAR_PROBING;
+    parsed_values.no_shards = 0;
+    if (argc == command_data[command].command_len + 2) {
+      parsed_values.no_shards = strtoull(argv[5], &end, 10);
+      if ('\0' != *end || parsed_values.no_shards == 0) {
+        *error = failure;
+        return parsed_values;
+      }
+    }
     break;
   default:
     break;
@@ -77,14 +240,129 @@ ParsedValues parse_values(Command command, int argc, char **argv,
   return parsed_values;
 }
 
-static bool check_string_size(const char *string) {
-  size_t length = strnlen(string, MAX_STRING_LENGTH);
-  return length > 0 && length <= MAX_STRING_LENGTH;
+BatchLine parse_batch_line(char *line, enum FileErrorStatus *error) {
+  *error = success;
+
+  BatchLine batch_line = {.key = NULL,
+                          .value = NULL,
+                          .ttl = 0,
+                          .no_threads = 0,
+                          .seconds = 0,
+                          .operation = BATCH_LENGTH};
+  char *words[4];
+  uint32_t no_words = 0;
+  char *state;
+  for (char *word = strtok_r(line, BATCH_SEPARATORS, &state);
+       NULL != word; word = strtok_r(NULL, BATCH_SEPARATORS, &state)) {
+    if (no_words == sizeof(words) / sizeof(words[0])) {
+      *error = failure;
+      return batch_line;
+    }
+    words[no_words++] = word;
+  }
+  if (0 == no_words) {
+    *error = failure;
+    return batch_line;
+  }
+
+  for (uint32_t i = 0; i < BATCH_LENGTH; ++i) {
+    if (0 == strncmp(batch_data[i].string, words[0],
+                     MAX_COMMAND_STRING_LENGTH)) {
+      batch_line.operation = (BatchOperation)i;
+    }
+  }
+  if (BATCH_LENGTH == batch_line.operation) {
+    *error = failure;
+    return batch_line;
+  }
+
+  // set takes an optional ttl and scan a number of threads
+  uint32_t no_expected_words = batch_data[batch_line.operation].command_len;
+  bool has_optional_word =
+      (BATCH_SET == batch_line.operation ||
+       BATCH_SCAN == batch_line.operation) &&
+      no_words == no_expected_words + 1;
+  if (no_words != no_expected_words && !has_optional_word) {
+    *error = failure;
+    return batch_line;
+  }
+
+  bool has_key = BATCH_GET == batch_line.operation ||
+                 BATCH_SET == batch_line.operation ||
+                 BATCH_DELETE == batch_line.operation;
+  if (has_key) {
+    if (!check_string_size(words[1], MAX_STRING_LENGTH)) {
+      *error = failure;
+      return batch_line;
+    }
+    batch_line.key = words[1];
+  }
+
+  switch (batch_line.operation) {
+  case BATCH_SET:
+    if (!check_string_size(words[2], MAX_VALUE_LENGTH) ||
+        (has_optional_word && !parse_positive(words[3], &batch_line.ttl))) {
+      *error = failure;
+      return batch_line;
+    }
+    batch_line.value = words[2];
+    break;
+  case BATCH_SCAN:
+    if (has_optional_word &&
+        !parse_positive(words[1], &batch_line.no_threads)) {
+      *error = failure;
+      return batch_line;
+    }
+    break;
+  case BATCH_SLEEP:
+    if (!parse_positive(words[1], &batch_line.seconds)) {
+      *error = failure;
+      return batch_line;
+    }
+    break;
+  default:
+    break;
+  }
+  return batch_line;
+}
+
+static EngineType parse_engine(const char *engine,
+                               enum FileErrorStatus *error) {
+  // sharded is selected with the number of shards, over another engine
+  for (uint32_t i = 0; i < ENGINE_LENGTH; ++i) {
+    if (ENGINE_SHARDED != i &&
+        0 == strncmp(engine_names[i], engine, MAX_COMMAND_STRING_LENGTH)) {
+      return (EngineType)i;
+    }
+  }
+  fprintf(stderr, "unknown engine.\n");
+  *error = failure;
+  return ENGINE_LENGTH;
+}
+
+// strtoull takes a sign and leading spaces, a ttl, a number of threads or of
+// seconds is digits only
+static bool parse_positive(const char *string, uint64_t *number) {
+  char *end;
+  *number = strtoull(string, &end, 10);
+  return string[0] >= '0' && string[0] <= '9' && '\0' == *end && *number > 0;
+}
+
+static bool check_string_size(const char *string, uint64_t max_length) {
+  size_t length = strnlen(string, max_length + 1);
+  return length > 0 && length <= max_length;
 }
 
-static bool check_strings(int command_length, char **strings) {
+// The values of set, append and cas may be longer than a record holds, they
+// then go to overflow pages.
+static bool check_strings(Command command, int command_length,
+                          char **strings) {
   for (uint64_t i = 2; i < command_length; ++i) {
-    if (!check_string_size(strings[i])) {
+    bool is_value =
+        ((COMMAND_INSERT == command || COMMAND_APPEND == command) && 4 == i) ||
+        (COMMAND_COMPARE_AND_SET == command && i >= 4);
+    uint64_t max_length = is_value ? MAX_VALUE_LENGTH : MAX_STRING_LENGTH;
+    if (!check_string_size(strings[i], max_length)) {
       fprintf(stderr, "invalid input string length.\n");
       return false;
     }
@@ -0,0 +1,194 @@
+#include "../include/reaper.h"
+#include "../include/constants.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// 512 slots of 100 milliseconds turn the wheel in about 51 seconds, an entry
+// further away stays in its slot and is skipped until its turn.
+#define TICK_MILLISECONDS (100)
+#define NO_SLOTS (512)
+#define MILLISECONDS_PER_SECOND (1000)
+#define NANOSECONDS_PER_MILLISECOND (1000000)
+
+typedef struct wheel_entry {
+  struct wheel_entry *next;
+  uint64_t tick;
+  uint32_t key_length;
+  char key[MAX_STRING_LENGTH];
+} WheelEntry;
+
+// tick is the last tick processed, the wheel is guarded by the mutex.
+struct reaper {
+  WheelEntry *slots[NO_SLOTS];
+  uint64_t tick;
+  ReapCallback callback;
+  void *arguments;
+  pthread_mutex_t mutex;
+  pthread_cond_t stop_condition;
+  bool stopping;
+  pthread_t thread;
+};
+
+static uint64_t tick_of(uint64_t milliseconds);
+static uint64_t current_tick(void);
+static WheelEntry *take_due(Reaper *reaper, uint64_t tick);
+static void *run_reaper(void *arguments);
+
+// API implementation
+
+Reaper *create_reaper(ReapCallback callback, void *arguments,
+                      enum FileErrorStatus *error) {
+  *error = success;
+
+  Reaper *reaper = calloc(1, sizeof(Reaper));
+  if (NULL == reaper) {
+    fprintf(stderr, "cannot allocate reaper.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  reaper->callback = callback;
+  reaper->arguments = arguments;
+  reaper->tick = current_tick();
+  pthread_mutex_init(&reaper->mutex, NULL);
+  pthread_cond_init(&reaper->stop_condition, NULL);
+  if (0 != pthread_create(&reaper->thread, NULL, run_reaper, reaper)) {
+    fprintf(stderr, "cannot start reaper thread.\n");
+    pthread_cond_destroy(&reaper->stop_condition);
+    pthread_mutex_destroy(&reaper->mutex);
+    free(reaper);
+    *error = failure;
+    return NULL;
+  }
+  return reaper;
+}
+
+// A key already past its expiry is reaped on the next tick.
+void reaper_schedule(Reaper *reaper, const char *key, uint32_t key_length,
+                     const Timestamp *expiry, enum FileErrorStatus *error) {
+  *error = success;
+  assert(reaper);
+  assert(key_length <= MAX_STRING_LENGTH);
+
+  WheelEntry *entry = malloc(sizeof(WheelEntry));
+  if (NULL == entry) {
+    fprintf(stderr, "cannot allocate reaper entry.\n");
+    *error = failure;
+    return;
+  }
+  entry->tick = tick_of(expiry->seconds * MILLISECONDS_PER_SECOND +
+                        expiry->nanoseconds / NANOSECONDS_PER_MILLISECOND);
+  entry->key_length = key_length;
+  memcpy(entry->key, key, key_length);
+
+  pthread_mutex_lock(&reaper->mutex);
+  if (entry->tick <= reaper->tick) {
+    entry->tick = reaper->tick + 1;
+  }
+  WheelEntry **slot = reaper->slots + entry->tick % NO_SLOTS;
+  entry->next = *slot;
+  *slot = entry;
+  pthread_mutex_unlock(&reaper->mutex);
+}
+
+void destroy_reaper(Reaper *reaper) {
+  if (NULL == reaper) {
+    return;
+  }
+
+  pthread_mutex_lock(&reaper->mutex);
+  reaper->stopping = true;
+  pthread_cond_signal(&reaper->stop_condition);
+  pthread_mutex_unlock(&reaper->mutex);
+  pthread_join(reaper->thread, NULL);
+
+  for (uint32_t i = 0; i < NO_SLOTS; ++i) {
+    while (NULL != reaper->slots[i]) {
+      WheelEntry *next = reaper->slots[i]->next;
+      free(reaper->slots[i]);
+      reaper->slots[i] = next;
+    }
+  }
+  pthread_cond_destroy(&reaper->stop_condition);
+  pthread_mutex_destroy(&reaper->mutex);
+  free(reaper);
+}
+
+// Local implementation
+
+// First tick starting at or after the given time.
+static uint64_t tick_of(uint64_t milliseconds) {
+  return (milliseconds + TICK_MILLISECONDS - 1) / TICK_MILLISECONDS;
+}
+
+static uint64_t current_tick(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return ((uint64_t)now.tv_sec * MILLISECONDS_PER_SECOND +
+          now.tv_nsec / NANOSECONDS_PER_MILLISECOND) /
+         TICK_MILLISECONDS;
+}
+
+// Unlinks the entries due by tick from the slots of the ticks elapsed, every
+// slot at most once when the thread fell a whole turn behind.
+static WheelEntry *take_due(Reaper *reaper, uint64_t tick) {
+  if (tick <= reaper->tick) {
+    return NULL;
+  }
+
+  WheelEntry *due = NULL;
+  uint64_t no_ticks = tick - reaper->tick;
+  no_ticks = no_ticks > NO_SLOTS ? NO_SLOTS : no_ticks;
+  for (uint64_t i = 1; i <= no_ticks; ++i) {
+    WheelEntry **link = reaper->slots + (reaper->tick + i) % NO_SLOTS;
+    while (NULL != *link) {
+      WheelEntry *entry = *link;
+      if (entry->tick > tick) {
+        link = &entry->next;
+        continue;
+      }
+      *link = entry->next;
+      entry->next = due;
+      due = entry;
+    }
+  }
+  reaper->tick = tick;
+  return due;
+}
+
+// Sleeps until the next tick, the callback runs without the wheel lock so it
+// may schedule keys itself.
+static void *run_reaper(void *arguments) {
+  Reaper *reaper = arguments;
+
+  pthread_mutex_lock(&reaper->mutex);
+  while (!reaper->stopping) {
+    uint64_t wake_up = (reaper->tick + 1) * TICK_MILLISECONDS;
+    struct timespec deadline = {
+        .tv_sec = wake_up / MILLISECONDS_PER_SECOND,
+        .tv_nsec = wake_up % MILLISECONDS_PER_SECOND *
+                   NANOSECONDS_PER_MILLISECOND};
+    pthread_cond_timedwait(&reaper->stop_condition, &reaper->mutex,
+                           &deadline);
+    if (reaper->stopping) {
+      break;
+    }
+
+    WheelEntry *due = take_due(reaper, current_tick());
+    pthread_mutex_unlock(&reaper->mutex);
+    while (NULL != due) {
+      WheelEntry *next = due->next;
+      reaper->callback(due->key, due->key_length, reaper->arguments);
+      free(due);
+      due = next;
+    }
+    pthread_mutex_lock(&reaper->mutex);
+  }
+  pthread_mutex_unlock(&reaper->mutex);
+  return NULL;
+}
@@ -0,0 +1,464 @@
+#include "../include/rebuild.h"
+#include "../include/buffer_utilities.h"
+#include "../include/data_page.h"
+#include "../include/engine.h"
+#include "../include/file_utilities.h"
+#include "../include/linear_probing.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REBUILD_SUFFIX ".rebuild"
+#define SPILL_SUFFIX ".spill"
+// Bytes of the overflow file copied per read
+#define COPY_CHUNK_SIZE (1 << 20)
+// Home pages of the records given to the loader at once
+#define BUCKET_PAGES (256)
+// spill file entry: record length (4 bytes) | record
+#define SPILL_LENGTH_SIZE (4)
+
+// Room the records take in empty data pages. Compressed pages are filled with
+// the records in scan order, a page left for the next one counting in full.
+typedef struct {
+  const DataPageFile *data_pages;
+  DataPage data_page;
+  uint64_t page_space;
+  uint64_t space;
+} RebuildSpace;
+
+// The records of the source grouped by stretches of BUCKET_PAGES home pages
+// of the new file in the spill file, each stretch from starts on. ends counts
+// the bytes of a stretch and then the ones written.
+typedef struct {
+  const Database *destination;
+  int fd;
+  uint64_t no_buckets;
+  uint64_t *starts;
+  uint64_t *ends;
+  uint64_t *no_records;
+  bool failed;
+} RebuildBuckets;
+
+static void measure_record(const Record *record, void *arguments);
+static void count_record(const Record *record, void *arguments);
+static void spill_record(const Record *record, void *arguments);
+static uint64_t record_bucket(const RebuildBuckets *buckets,
+                              const Record *record);
+static uint64_t no_data_pages(Database *source, double load_factor,
+                              enum FileErrorStatus *error);
+static uint64_t write_database(char *path, Database *source,
+                               uint64_t no_pages, enum FileErrorStatus *error);
+static void spill_records(Database *source, RebuildBuckets *buckets,
+                          enum FileErrorStatus *error);
+static void load_buckets(LinearProbingLoader *loader,
+                         const RebuildBuckets *buckets,
+                         enum FileErrorStatus *error);
+static void copy_overflow_file(const char *source_path,
+                               const char *destination_path, bool *copied,
+                               enum FileErrorStatus *error);
+
+// API implementation
+
+// The source is scanned three times instead of being held in memory: to size
+// the new file, to size the stretches of the spill file and to fill them. The
+// loader then takes one stretch at a time.
+void rebuild_database(char *source_path, char *destination_path,
+                      double load_factor, RebuildStats *stats,
+                      enum FileErrorStatus *error) {
+  *error = success;
+  assert(load_factor > 0 && load_factor <= 1);
+
+  if (0 == access(destination_path, F_OK)) {
+    fprintf(stderr, "destination database already exists.\n");
+    *error = failure;
+    return;
+  }
+
+  Database *source = open_database(source_path, false, error);
+  if (failure == *error) {
+    return;
+  }
+  if (ENGINE_SHARDED == source->engine) {
+    fprintf(stderr, "rebuild is not supported by the sharded engine.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  uint64_t no_pages = no_data_pages(source, load_factor, error) + 1;
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  char rebuild_path[PATH_MAX];
+  snprintf(rebuild_path, sizeof(rebuild_path), "%s" REBUILD_SUFFIX,
+           destination_path);
+  char rebuild_overflow_path[PATH_MAX];
+  overflow_file_path(rebuild_overflow_path, rebuild_path);
+  // left behind by a rebuild cut short
+  unlink(rebuild_path);
+  unlink(rebuild_overflow_path);
+
+  uint64_t no_records = write_database(rebuild_path, source, no_pages, error);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
+  bool copied = false;
+  copy_overflow_file(source_path, rebuild_path, &copied, error);
+  if (failure == *error) {
+    goto cleanup_1;
+  }
+
+  // the overflow file first, the database is only there once complete
+  char overflow_path[PATH_MAX];
+  overflow_file_path(overflow_path, destination_path);
+  if (!copied) {
+    unlink(overflow_path);
+  }
+  if ((copied && -1 == rename(rebuild_overflow_path, overflow_path)) ||
+      -1 == rename(rebuild_path, destination_path) ||
+      !sync_parent_directory(destination_path)) {
+    fprintf(stderr, "cannot rename rebuilt database.\n");
+    *error = failure;
+    goto cleanup_1;
+  }
+  stats->no_records = no_records;
+  stats->no_pages = no_pages;
+
+  if (NULL != source->time_index) {
+    Database *destination = open_database(destination_path, true, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+    database_create_time_index(destination, error);
+    enum FileErrorStatus close_error;
+    close_database(destination, &close_error);
+  }
+  goto cleanup_0;
+
+cleanup_1:
+  unlink(rebuild_path);
+  unlink(rebuild_overflow_path);
+cleanup_0:;
+  enum FileErrorStatus close_error;
+  close_database(source, &close_error);
+}
+
+// Local implementation
+
+static void measure_record(const Record *record, void *arguments) {
+  RebuildSpace *space = arguments;
+  if (PAGE_CODEC_NONE == space->data_pages->codec) {
+    space->space += data_page_entry_size(&space->data_page, record);
+    return;
+  }
+
+  if (!data_page_has_room(space->data_pages, &space->data_page, record)) {
+    space->space += space->page_space;
+    data_page_from_data(space->data_page.safe_buffer, 1);
+  }
+  data_page_insert_entry(&space->data_page, record, 1);
+}
+
+static void count_record(const Record *record, void *arguments) {
+  RebuildBuckets *buckets = arguments;
+  buckets->ends[record_bucket(buckets, record)] +=
+      SPILL_LENGTH_SIZE + get_record_length(record);
+}
+
+// A record expired since the stretches were sized leaves room unused, the
+// room of a stretch is never exceeded.
+static void spill_record(const Record *record, void *arguments) {
+  RebuildBuckets *buckets = arguments;
+  if (buckets->failed) {
+    return;
+  }
+
+  uint64_t bucket = record_bucket(buckets, record);
+  uint32_t length = get_record_length(record);
+  uint64_t end = bucket + 1 == buckets->no_buckets
+                     ? UINT64_MAX
+                     : buckets->starts[bucket + 1];
+  uint8_t entry[SPILL_LENGTH_SIZE + RECORD_SIZE_ESTIMATE];
+  write_data_to_buffer(entry, 0, SPILL_LENGTH_SIZE, length);
+  memcpy(entry + SPILL_LENGTH_SIZE, record_get_buffer(record), length);
+  if (buckets->ends[bucket] + SPILL_LENGTH_SIZE + length > end ||
+      (ssize_t)(SPILL_LENGTH_SIZE + length) !=
+          pwrite(buckets->fd, entry, SPILL_LENGTH_SIZE + length,
+                 buckets->ends[bucket])) {
+    fprintf(stderr, "failed to write rebuild records.\n");
+    buckets->failed = true;
+    return;
+  }
+  buckets->ends[bucket] += SPILL_LENGTH_SIZE + length;
+  ++buckets->no_records[bucket];
+}
+
+static uint64_t record_bucket(const RebuildBuckets *buckets,
+                              const Record *record) {
+  return (linear_probing_home(buckets->destination, record_key(record),
+                              record_key_length(record)) -
+          1) /
+         BUCKET_PAGES;
+}
+
+// Sized by the room the records take in empty data pages, at least two pages
+// as for a new database. The pages have the codec of the source.
+static uint64_t no_data_pages(Database *source, double load_factor,
+                              enum FileErrorStatus *error) {
+  *error = success;
+
+  DataPageFile data_pages =
+      data_page_file(-1, source->page_size, source->data_pages.codec);
+  SafeBuffer *safe_buffer = allocate_page_buffer(data_pages.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    return 0;
+  }
+  RebuildSpace space = {.data_pages = &data_pages,
+                        .data_page = data_page_from_data(safe_buffer, 1),
+                        .space = 0};
+  uint64_t page_space = data_page_free_space(&space.data_page);
+  space.page_space = page_space;
+  scan_elements(source, measure_record, &space, error);
+  if (PAGE_CODEC_NONE != data_pages.codec) {
+    space.space += data_page_used_space(&space.data_page);
+  }
+  free_page_buffer(safe_buffer);
+  if (failure == *error) {
+    return 0;
+  }
+
+  double pages = space.space / (load_factor * page_space);
+  uint64_t no_pages = pages;
+  no_pages += no_pages < pages;
+  return no_pages < 2 ? 2 : no_pages;
+}
+
+// Same header as a new linear probing database, with the version, the page
+// size and the page codec of the source. Returns the number of records
+// written.
+static uint64_t write_database(char *path, Database *source,
+                               uint64_t no_pages, enum FileErrorStatus *error) {
+  *error = success;
+  uint64_t no_records = 0;
+
+  Database database = {.path = path,
+                       .writable = true,
+                       .no_pages = no_pages,
+                       .page_size = source->page_size,
+                       .version = DATABASE_VERSION,
+                       .engine = ENGINE_LINEAR_PROBING,
+                       .operations = &linear_probing_engine};
+  database.fd = create_database_file(path, error);
+  if (failure == *error) {
+    return 0;
+  }
+  database.data_pages = data_page_file(database.fd, database.page_size,
+                                       source->data_pages.codec);
+
+  // the spill file is gone once closed, also after a crash
+  char spill_path[PATH_MAX + sizeof(SPILL_SUFFIX)];
+  snprintf(spill_path, sizeof(spill_path), "%s" SPILL_SUFFIX, path);
+  uint64_t no_buckets = (no_pages - 1 + BUCKET_PAGES - 1) / BUCKET_PAGES;
+  RebuildBuckets buckets = {
+      .destination = &database,
+      .fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC, 0600),
+      .no_buckets = no_buckets,
+      .starts = calloc(no_buckets, sizeof(uint64_t)),
+      .ends = calloc(no_buckets, sizeof(uint64_t)),
+      .no_records = calloc(no_buckets, sizeof(uint64_t)),
+      .failed = false};
+  unlink(spill_path);
+  if (-1 == buckets.fd || NULL == buckets.starts || NULL == buckets.ends ||
+      NULL == buckets.no_records) {
+    fprintf(stderr, "cannot allocate rebuild records.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  spill_records(source, &buckets, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  LinearProbingLoader *loader = create_linear_probing_loader(&database, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  load_buckets(loader, &buckets, error);
+  if (failure == *error) {
+    destroy_linear_probing_loader(loader);
+    goto cleanup_0;
+  }
+  linear_probing_loader_finish(loader, error);
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+  for (uint64_t i = 0; i < no_buckets; ++i) {
+    no_records += buckets.no_records[i];
+  }
+
+  SafeBuffer *safe_buffer = allocate_page_buffer(database.page_size);
+  if (NULL == safe_buffer) {
+    *error = failure;
+    goto cleanup_0;
+  }
+  HeaderPage header_page =
+      create_header_page(safe_buffer, database.no_pages, ENGINE_LINEAR_PROBING);
+  header_set_page_codec(&header_page, database.data_pages.codec);
+  write_page_to_file(database.fd, safe_buffer, 0, false, error);
+  free_page_buffer(safe_buffer);
+  if (success == *error && -1 == fdatasync(database.fd)) {
+    fprintf(stderr, "failed to sync rebuilt database.\n");
+    *error = failure;
+  }
+
+cleanup_0:
+  free(buckets.no_records);
+  free(buckets.ends);
+  free(buckets.starts);
+  if (-1 != buckets.fd) {
+    close(buckets.fd);
+  }
+  enum FileErrorStatus close_error;
+  close_database_file(database.fd, &close_error);
+  return no_records;
+}
+
+// Sizes the stretches with one scan and fills them with another.
+static void spill_records(Database *source, RebuildBuckets *buckets,
+                          enum FileErrorStatus *error) {
+  *error = success;
+
+  scan_elements(source, count_record, buckets, error);
+  if (failure == *error) {
+    return;
+  }
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < buckets->no_buckets; ++i) {
+    buckets->starts[i] = offset;
+    offset += buckets->ends[i];
+    buckets->ends[i] = buckets->starts[i];
+  }
+
+  scan_elements(source, spill_record, buckets, error);
+  if (buckets->failed) {
+    *error = failure;
+  }
+}
+
+// Stretches are read back in order of their home pages, one at a time.
+static void load_buckets(LinearProbingLoader *loader,
+                         const RebuildBuckets *buckets,
+                         enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t max_length = 0;
+  uint64_t max_records = 0;
+  for (uint64_t i = 0; i < buckets->no_buckets; ++i) {
+    uint64_t length = buckets->ends[i] - buckets->starts[i];
+    max_length = length > max_length ? length : max_length;
+    max_records = buckets->no_records[i] > max_records
+                      ? buckets->no_records[i]
+                      : max_records;
+  }
+  if (0 == max_records) {
+    return;
+  }
+
+  uint8_t *bytes = malloc(max_length);
+  Record *records = malloc(max_records * sizeof(Record));
+  SafeBuffer *safe_buffers = malloc(max_records * sizeof(SafeBuffer));
+  if (NULL == bytes || NULL == records || NULL == safe_buffers) {
+    fprintf(stderr, "cannot allocate rebuild records.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < buckets->no_buckets && success == *error; ++i) {
+    uint64_t length = buckets->ends[i] - buckets->starts[i];
+    if (0 == buckets->no_records[i]) {
+      continue;
+    }
+    if ((ssize_t)length !=
+        pread(buckets->fd, bytes, length, buckets->starts[i])) {
+      fprintf(stderr, "failed to read rebuild records.\n");
+      *error = failure;
+      break;
+    }
+    uint64_t offset = 0;
+    for (uint64_t j = 0; j < buckets->no_records[i]; ++j) {
+      uint32_t record_length =
+          read_data_from_buffer(bytes, offset, SPILL_LENGTH_SIZE);
+      offset += SPILL_LENGTH_SIZE;
+      safe_buffers[j] = (SafeBuffer){.buffer = bytes + offset,
+                                     .length = record_length,
+                                     .capacity = record_length};
+      records[j] = (Record){.safe_buffer = safe_buffers + j};
+      offset += record_length;
+    }
+    linear_probing_loader_add(loader, records, buckets->no_records[i], error);
+  }
+
+cleanup_0:
+  free(safe_buffers);
+  free(records);
+  free(bytes);
+}
+
+// copied is left false when the source has no overflow file.
+static void copy_overflow_file(const char *source_path,
+                               const char *destination_path, bool *copied,
+                               enum FileErrorStatus *error) {
+  *error = success;
+  *copied = false;
+
+  char buffer[PATH_MAX];
+  overflow_file_path(buffer, source_path);
+  int source_fd = open(buffer, O_RDONLY);
+  if (-1 == source_fd) {
+    if (ENOENT != errno) {
+      fprintf(stderr, "cannot open overflow file.\n");
+      *error = failure;
+    }
+    return;
+  }
+  overflow_file_path(buffer, destination_path);
+  int destination_fd = open(buffer, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  uint8_t *chunk = malloc(COPY_CHUNK_SIZE);
+  if (-1 == destination_fd || NULL == chunk) {
+    fprintf(stderr, "cannot create rebuilt overflow file.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (;;) {
+    ssize_t bytes_read = read(source_fd, chunk, COPY_CHUNK_SIZE);
+    if (0 == bytes_read) {
+      break;
+    }
+    if (bytes_read < 0 ||
+        bytes_read != write(destination_fd, chunk, bytes_read)) {
+      fprintf(stderr, "failed to copy overflow file.\n");
+      *error = failure;
+      goto cleanup_0;
+    }
+  }
+  if (-1 == fsync(destination_fd)) {
+    fprintf(stderr, "failed to sync rebuilt overflow file.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+  *copied = true;
+
+cleanup_0:
+  free(chunk);
+  if (-1 != destination_fd) {
+    close(destination_fd);
+  }
+  close(source_fd);
+}
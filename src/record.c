@@ -11,6 +11,31 @@
 // value length (1 byte) | value (value length + 1 bytes) | timestamp first
 // seconds (8 bytes) | timestamp first nanoseconds (8 bytes) | Timestamp last
 // seconds (8 bytes) | Timestamp last nanoseconds (8 bytes)
+//
+// Keys and values are length prefixed and may hold any byte, the terminator
+// following them only lets string keys and values be read in place.
+//
+// A value kept in overflow pages has OVERFLOW_FLAG set in its value length and
+// stores an empty string followed by value length (8 bytes) | first page (8
+// bytes) | chain id (8 bytes) in place of the value.
+//
+// Compact records drop the terminators and the fixed-width fields:
+//
+// total_length (1 byte) | flags (1 byte) | key length (varint) | key | value
+// length (varint) | value | timestamp first seconds (varint) | timestamp first
+// nanoseconds (varint) | timestamp last - first in nanoseconds (zigzag varint)
+//
+// The flags always have COMPACT_FLAG set, which the high byte of the length of
+// a fixed record never has, so both formats can share a page. An overflow
+// value sets COMPACT_OVERFLOW_FLAG and stores value length | first page |
+// chain id as varints in place of the value. A record set to expire sets
+// COMPACT_EXPIRES_FLAG and ends with the expiry in milliseconds since the
+// epoch (varint).
+//
+// Inside a data page, a compact record may leave out the first bytes of its
+// key, which the page keeps once for all its records. It then sets
+// COMPACT_SHARED_PREFIX_FLAG and stores shared length (varint) | suffix length
+// (varint) | suffix in place of the key, the rest of the record unchanged.
 
 #define BYTE_SIZE (8)
 
@@ -22,38 +47,78 @@
 #define KEY_OFFSET (KEY_LENGTH_OFFSET + KEY_LENGTH_SIZE)
 
 #define VALUE_LENGTH_SIZE (1)
+#define OVERFLOW_FLAG (0x80)
+#define VALUE_LENGTH_MASK (0x7F)
+#define OVERFLOW_FIELD_SIZE (8)
+#define OVERFLOW_REFERENCE_SIZE (3 * OVERFLOW_FIELD_SIZE)
 #define STRING_TERMINATOR_SIZE (1)
 
 #define TIMESTAMP_SECONDS_SIZE (8)
 #define TIMESTAMP_NANOSECONDS_SIZE (8)
 
+#define FLAGS_OFFSET (LENGTH_OFFSET + 1)
+#define COMPACT_FLAG (0x80)
+#define COMPACT_OVERFLOW_FLAG (0x40)
+#define COMPACT_SHARED_PREFIX_FLAG (0x20)
+#define COMPACT_EXPIRES_FLAG (0x10)
+#define COMPACT_KEY_LENGTH_OFFSET (FLAGS_OFFSET + 1)
+#define MAX_VARINT_SIZE (10)
+#define NANOSECONDS_VARINT_SIZE (5)
+// Milliseconds since the epoch take 7 bytes until the year 19000.
+#define EXPIRY_VARINT_SIZE (7)
+#define MAX_COMPACT_TIMESTAMPS_SIZE                                            \
+  (2 * MAX_VARINT_SIZE + NANOSECONDS_VARINT_SIZE + EXPIRY_VARINT_SIZE)
+#define NANOSECONDS_PER_SECOND (1000000000LL)
+#define NANOSECONDS_PER_MILLISECOND (1000000LL)
+#define MILLISECONDS_PER_SECOND (1000LL)
+
 static void update_timestamp_helper(Record *record, const Timestamp *timestamp,
                                     uint32_t offset);
 static void update_first_timestamp(Record *record, const Timestamp *timestamp);
 static void update_last_timestamp(Record *record, const Timestamp *timestamp);
-static void insert_key(Record *record, const char *key);
+static void insert_key(Record *record, const char *key, uint32_t key_length);
 static void clean_record(Record *record);
 static Timestamp get_timestamp();
 static uint32_t value_offset(const Record *record);
+static uint32_t value_length(const Record *record);
 static uint32_t timestamp_first_offset(const Record *record);
 static uint32_t timestamp_last_offset(const Record *record);
 static void update_length(Record *record, uint16_t length);
 static uint64_t get_most_significant_three_digits(uint64_t nanoseconds);
+static bool is_compact(const Record *record);
+static void encode_compact(Record *record, const char *key,
+                           uint32_t key_length, const uint8_t *value,
+                           uint32_t value_length, bool has_overflow,
+                           const Timestamp *first, const Timestamp *last,
+                           const Timestamp *expiry);
+static Timestamp read_compact_timestamp(const Record *record, bool last);
+static uint32_t compact_expiry_offset(const Record *record);
+static const Timestamp *kept_expiry(const Record *record, Timestamp *expiry);
+static uint32_t key_suffix_offset(const uint8_t *entry, uint32_t *shared,
+                                  uint32_t *suffix_length);
 
 const Record record_from_buffer(SafeBuffer *safe_buffer) {
   return (const Record){.safe_buffer = safe_buffer};
 }
 
-Record record_from_data(SafeBuffer *safe_buffer, const char *key,
-                        const char *value) {
+Record record_from_data(SafeBuffer *safe_buffer, RecordFormat format,
+                        const char *key, uint32_t key_length,
+                        const char *value, uint32_t value_length) {
   assert(get_buffer_capacity(safe_buffer) >= RECORD_SIZE_ESTIMATE);
   assert(key);
   assert(value);
+  assert(key_length <= MAX_STRING_LENGTH);
+  assert(value_length <= MAX_STRING_LENGTH);
   Record record = {.safe_buffer = safe_buffer};
   Timestamp timestamp = get_timestamp();
   clean_record(&record);
-  insert_key(&record, key);
-  record_update_data(&record, value, &timestamp);
+  if (RECORD_FORMAT_COMPACT == format) {
+    encode_compact(&record, key, key_length, (const uint8_t *)value,
+                   value_length, false, &timestamp, &timestamp, NULL);
+    return record;
+  }
+  insert_key(&record, key, key_length);
+  record_update_data(&record, value, value_length, &timestamp);
   update_length(&record, timestamp_last_offset(&record) +
                              TIMESTAMP_SECONDS_SIZE +
                              TIMESTAMP_NANOSECONDS_SIZE + 1);
@@ -61,15 +126,115 @@ Record record_from_data(SafeBuffer *safe_buffer, const char *key,
   return record;
 }
 
-void record_update_data(Record *record, const char *value,
+Record record_from_overflow(SafeBuffer *safe_buffer, RecordFormat format,
+                            const char *key, uint32_t key_length,
+                            const OverflowReference *reference) {
+  assert(get_buffer_capacity(safe_buffer) >= RECORD_SIZE_ESTIMATE);
+  assert(reference);
+  Record record = record_from_data(safe_buffer, format, key, key_length, "", 0);
+  Timestamp first_timestamp = record_first_timestamp(&record);
+  Timestamp last_timestamp = record_last_timestamp(&record);
+
+  if (RECORD_FORMAT_COMPACT == format) {
+    uint8_t fields[3 * MAX_VARINT_SIZE];
+    uint32_t length = write_varint_to_buffer(fields, 0, reference->length);
+    length += write_varint_to_buffer(fields, length, reference->first_page);
+    length += write_varint_to_buffer(fields, length, reference->chain_id);
+    encode_compact(&record, key, key_length, fields, length, true,
+                   &first_timestamp, &last_timestamp, NULL);
+    return record;
+  }
+
+  uint8_t *buffer = get_buffer(safe_buffer);
+  uint32_t offset = value_offset(&record);
+  buffer[offset - 1] = OVERFLOW_FLAG | (STRING_TERMINATOR_SIZE +
+                                        OVERFLOW_REFERENCE_SIZE - 1);
+  offset += STRING_TERMINATOR_SIZE;
+  write_data_to_buffer(buffer, offset, OVERFLOW_FIELD_SIZE, reference->length);
+  write_data_to_buffer(buffer, offset + OVERFLOW_FIELD_SIZE,
+                       OVERFLOW_FIELD_SIZE, reference->first_page);
+  write_data_to_buffer(buffer, offset + 2 * OVERFLOW_FIELD_SIZE,
+                       OVERFLOW_FIELD_SIZE, reference->chain_id);
+
+  update_first_timestamp(&record, &first_timestamp);
+  update_last_timestamp(&record, &last_timestamp);
+  update_length(&record, timestamp_last_offset(&record) +
+                             TIMESTAMP_SECONDS_SIZE +
+                             TIMESTAMP_NANOSECONDS_SIZE + 1);
+  return record;
+}
+
+// Whether key and value fit a record, longer values go to overflow pages.
+bool record_fits_inline(RecordFormat format, uint32_t key_length,
+                        uint64_t value_length) {
+  if (RECORD_FORMAT_COMPACT == format) {
+    uint64_t length = COMPACT_KEY_LENGTH_OFFSET + varint_size(key_length) +
+                      key_length + varint_size(value_length) + value_length +
+                      MAX_COMPACT_TIMESTAMPS_SIZE;
+    return value_length <= MAX_STRING_LENGTH && length <= RECORD_SIZE_ESTIMATE;
+  }
+  uint64_t length = KEY_OFFSET + key_length +
+                    STRING_TERMINATOR_SIZE + VALUE_LENGTH_SIZE + value_length +
+                    STRING_TERMINATOR_SIZE + 2 * TIMESTAMP_SECONDS_SIZE +
+                    2 * TIMESTAMP_NANOSECONDS_SIZE + 1;
+  return value_length <= MAX_STRING_LENGTH && length <= RECORD_SIZE_ESTIMATE;
+}
+
+bool record_has_overflow(const Record *record) {
+  assert(record);
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  if (is_compact(record)) {
+    return 0 != (buffer[FLAGS_OFFSET] & COMPACT_OVERFLOW_FLAG);
+  }
+  return 0 != (buffer[value_offset(record) - 1] & OVERFLOW_FLAG);
+}
+
+OverflowReference record_overflow_reference(const Record *record) {
+  assert(record_has_overflow(record));
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  if (is_compact(record)) {
+    uint32_t offset = value_offset(record);
+    OverflowReference reference;
+    reference.length = read_varint_from_buffer(buffer, &offset);
+    reference.first_page = read_varint_from_buffer(buffer, &offset);
+    reference.chain_id = read_varint_from_buffer(buffer, &offset);
+    return reference;
+  }
+  uint32_t offset = value_offset(record) + STRING_TERMINATOR_SIZE;
+  return (OverflowReference){
+      .length = read_data_from_buffer(buffer, offset, OVERFLOW_FIELD_SIZE),
+      .first_page = read_data_from_buffer(buffer, offset + OVERFLOW_FIELD_SIZE,
+                                          OVERFLOW_FIELD_SIZE),
+      .chain_id = read_data_from_buffer(
+          buffer, offset + 2 * OVERFLOW_FIELD_SIZE, OVERFLOW_FIELD_SIZE)};
+}
+
+Record record_copy_into(SafeBuffer *safe_buffer, const Record *record) {
+  assert(record);
+  assert(get_buffer_capacity(safe_buffer) >= RECORD_SIZE_ESTIMATE);
+  uint32_t length = get_record_length(record);
+  memcpy(get_buffer(safe_buffer), record_get_buffer(record), length);
+  set_buffer_length(safe_buffer, length);
+  return (Record){.safe_buffer = safe_buffer};
+}
+
+void record_update_data(Record *record, const char *value, uint32_t length,
                         const Timestamp *timestamp) {
   assert(record);
   assert(value);
   assert(timestamp);
+  assert(length <= MAX_STRING_LENGTH);
+  if (is_compact(record)) {
+    Timestamp first = record_first_timestamp(record);
+    Timestamp expiry;
+    encode_compact(record, record_key(record), record_key_length(record),
+                   (const uint8_t *)value, length, false, &first, timestamp,
+                   kept_expiry(record, &expiry));
+    return;
+  }
   uint8_t *buffer = get_buffer(record->safe_buffer);
-  uint32_t length = strnlen(value, MAX_STRING_LENGTH);
   uint32_t value_length_offset = value_offset(record) - 1;
-  uint32_t value_old_length = buffer[value_length_offset];
+  uint32_t value_old_length = value_length(record);
   buffer[value_length_offset] = length;
   memcpy(buffer + value_length_offset + 1, value, length);
   update_last_timestamp(record, timestamp);
@@ -80,17 +245,49 @@ void record_update_data(Record *record, const char *value,
 const char *record_key(const Record *record) {
   assert(record);
   uint8_t *buffer = get_buffer(record->safe_buffer);
+  if (is_compact(record)) {
+    uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+    read_varint_from_buffer(buffer, &offset);
+    return (char *)buffer + offset;
+  }
   return (char *)buffer + KEY_LENGTH_OFFSET + KEY_LENGTH_SIZE;
 }
 
+uint32_t record_key_length(const Record *record) {
+  assert(record);
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  if (is_compact(record)) {
+    uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+    return read_varint_from_buffer(buffer, &offset);
+  }
+  return buffer[KEY_LENGTH_OFFSET];
+}
+
+// Compares the lengths first, so most mismatches never touch the key bytes.
+bool record_has_key(const Record *record, const char *key,
+                    uint32_t key_length) {
+  assert(record);
+  return record_key_length(record) == key_length &&
+         0 == memcmp(record_key(record), key, key_length);
+}
+
 const char *record_value(const Record *record) {
   assert(record);
   uint8_t *buffer = get_buffer(record->safe_buffer);
   return (char *)buffer + value_offset(record);
 }
 
+// Length of the value stored in the record, 0 for overflow records.
+uint32_t record_value_length(const Record *record) {
+  assert(record);
+  return record_has_overflow(record) ? 0 : value_length(record);
+}
+
 Timestamp record_first_timestamp(const Record *record) {
   assert(record);
+  if (is_compact(record)) {
+    return read_compact_timestamp(record, false);
+  }
   uint8_t *buffer = get_buffer(record->safe_buffer);
   uint32_t offset = timestamp_first_offset(record);
   uint64_t seconds = read_data_from_buffer(buffer, offset, sizeof(uint64_t));
@@ -101,6 +298,9 @@ Timestamp record_first_timestamp(const Record *record) {
 
 Timestamp record_last_timestamp(const Record *record) {
   assert(record);
+  if (is_compact(record)) {
+    return read_compact_timestamp(record, true);
+  }
   uint8_t *buffer = get_buffer(record->safe_buffer);
   uint32_t offset = timestamp_last_offset(record);
   uint64_t seconds = read_data_from_buffer(buffer, offset, sizeof(uint64_t));
@@ -131,9 +331,139 @@ Record record_clone(Record *record) {
 }
 
 void record_set_first_timestamp(Record *record, Timestamp timestamp) {
+  if (is_compact(record)) {
+    Timestamp last = record_last_timestamp(record);
+    Timestamp expiry;
+    encode_compact(record, record_key(record), record_key_length(record),
+                   (const uint8_t *)record_value(record),
+                   value_length(record), record_has_overflow(record),
+                   &timestamp, &last, kept_expiry(record, &expiry));
+    return;
+  }
   update_first_timestamp(record, &timestamp);
 }
 
+// Only compact records expire.
+void record_set_expiry(Record *record, const Timestamp *expiry) {
+  assert(record);
+  assert(is_compact(record));
+  Timestamp first = record_first_timestamp(record);
+  Timestamp last = record_last_timestamp(record);
+  encode_compact(record, record_key(record), record_key_length(record),
+                 (const uint8_t *)record_value(record), value_length(record),
+                 record_has_overflow(record), &first, &last, expiry);
+}
+
+bool record_expiry(const Record *record, Timestamp *expiry) {
+  assert(record);
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  if (!is_compact(record) ||
+      0 == (buffer[FLAGS_OFFSET] & COMPACT_EXPIRES_FLAG)) {
+    return false;
+  }
+
+  uint32_t offset = compact_expiry_offset(record);
+  uint64_t milliseconds = read_varint_from_buffer(buffer, &offset);
+  *expiry = (Timestamp){
+      .seconds = milliseconds / MILLISECONDS_PER_SECOND,
+      .nanoseconds =
+          milliseconds % MILLISECONDS_PER_SECOND * NANOSECONDS_PER_MILLISECOND};
+  return true;
+}
+
+// The clock is only read for records with an expiry.
+bool record_has_expired(const Record *record) {
+  Timestamp expiry;
+  if (!record_expiry(record, &expiry)) {
+    return false;
+  }
+  Timestamp now = get_timestamp();
+  return now.seconds > expiry.seconds ||
+         (now.seconds == expiry.seconds &&
+          now.nanoseconds >= expiry.nanoseconds);
+}
+
+// Byte order, a key sorting before every key it is a prefix of, the same
+// order strcmp gives keys without NUL bytes.
+int compare_keys(const char *key, uint32_t key_length, const char *other_key,
+                 uint32_t other_key_length) {
+  uint32_t length =
+      key_length < other_key_length ? key_length : other_key_length;
+  int cmp = memcmp(key, other_key, length);
+  if (0 != cmp) {
+    return cmp;
+  }
+  return (key_length > other_key_length) - (key_length < other_key_length);
+}
+
+uint32_t record_encode_shared_prefix(const Record *record, uint32_t shared,
+                                     uint8_t *entry) {
+  assert(record);
+  assert(entry);
+  if (!is_compact(record)) {
+    return 0;
+  }
+
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  uint32_t key_length = record_key_length(record);
+  assert(shared <= key_length);
+  uint32_t rest_offset = record_key(record) - (char *)buffer + key_length;
+  uint32_t rest_length = get_record_length(record) - rest_offset;
+
+  entry[FLAGS_OFFSET] = buffer[FLAGS_OFFSET] | COMPACT_SHARED_PREFIX_FLAG;
+  uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+  offset += write_varint_to_buffer(entry, offset, shared);
+  offset += write_varint_to_buffer(entry, offset, key_length - shared);
+  if (offset + key_length - shared + rest_length >=
+      get_record_length(record)) {
+    return 0;
+  }
+  memcpy(entry + offset, record_key(record) + shared, key_length - shared);
+  offset += key_length - shared;
+  memcpy(entry + offset, buffer + rest_offset, rest_length);
+  offset += rest_length;
+  entry[LENGTH_OFFSET] = offset;
+  return offset;
+}
+
+bool record_entry_has_shared_prefix(const uint8_t *entry) {
+  assert(entry);
+  return 0 != (entry[FLAGS_OFFSET] & COMPACT_FLAG) &&
+         0 != (entry[FLAGS_OFFSET] & COMPACT_SHARED_PREFIX_FLAG);
+}
+
+const char *record_entry_key_suffix(const uint8_t *entry, uint32_t *shared,
+                                    uint32_t *suffix_length) {
+  assert(record_entry_has_shared_prefix(entry));
+  return (const char *)entry + key_suffix_offset(entry, shared, suffix_length);
+}
+
+Record record_expand_shared_prefix(SafeBuffer *safe_buffer,
+                                   const uint8_t *entry, const char *prefix) {
+  assert(get_buffer_capacity(safe_buffer) >= RECORD_SIZE_ESTIMATE);
+  assert(record_entry_has_shared_prefix(entry));
+  uint32_t shared, suffix_length;
+  uint32_t suffix_offset = key_suffix_offset(entry, &shared, &suffix_length);
+  uint32_t rest_offset = suffix_offset + suffix_length;
+  uint32_t rest_length = entry[LENGTH_OFFSET] - rest_offset;
+
+  uint8_t *buffer = get_buffer(safe_buffer);
+  buffer[FLAGS_OFFSET] = entry[FLAGS_OFFSET] & ~COMPACT_SHARED_PREFIX_FLAG;
+  uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+  offset += write_varint_to_buffer(buffer, offset, shared + suffix_length);
+  memcpy(buffer + offset, prefix, shared);
+  offset += shared;
+  memcpy(buffer + offset, entry + suffix_offset, suffix_length);
+  offset += suffix_length;
+  memcpy(buffer + offset, entry + rest_offset, rest_length);
+  offset += rest_length;
+
+  assert(offset <= RECORD_SIZE_ESTIMATE);
+  buffer[LENGTH_OFFSET] = offset;
+  set_buffer_length(safe_buffer, offset);
+  return (Record){.safe_buffer = safe_buffer};
+}
+
 void format_timestamp_into_date(const Timestamp *timestamp, char *date_buffer,
                                 size_t len_date_buffer) {
   char buffer[100];
@@ -156,11 +486,11 @@ static Timestamp get_timestamp() {
   return (Timestamp){.seconds = ts.tv_sec, .nanoseconds = ts.tv_nsec};
 }
 
-static void insert_key(Record *record, const char *key) {
+static void insert_key(Record *record, const char *key, uint32_t key_length) {
+  assert(key_length <= MAX_STRING_LENGTH);
   uint8_t *buffer = get_buffer(record->safe_buffer);
-  uint32_t length = strnlen(key, MAX_STRING_LENGTH);
-  buffer[KEY_LENGTH_OFFSET] = length;
-  memcpy(buffer + KEY_OFFSET, key, length);
+  buffer[KEY_LENGTH_OFFSET] = key_length;
+  memcpy(buffer + KEY_OFFSET, key, key_length);
 }
 
 static void clean_record(Record *record) {
@@ -170,14 +500,28 @@ static void clean_record(Record *record) {
 
 static uint32_t value_offset(const Record *record) {
   uint8_t *buffer = get_buffer(record->safe_buffer);
+  if (is_compact(record)) {
+    uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+    offset += read_varint_from_buffer(buffer, &offset);
+    read_varint_from_buffer(buffer, &offset);
+    return offset;
+  }
   return KEY_LENGTH_OFFSET + KEY_LENGTH_SIZE + buffer[KEY_LENGTH_OFFSET] +
          STRING_TERMINATOR_SIZE + 1;
 }
 
-static uint32_t timestamp_first_offset(const Record *record) {
+static uint32_t value_length(const Record *record) {
   uint8_t *buffer = get_buffer(record->safe_buffer);
-  uint32_t offset = value_offset(record);
-  return buffer[offset - 1] + offset + STRING_TERMINATOR_SIZE;
+  if (is_compact(record)) {
+    uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+    offset += read_varint_from_buffer(buffer, &offset);
+    return read_varint_from_buffer(buffer, &offset);
+  }
+  return buffer[value_offset(record) - 1] & VALUE_LENGTH_MASK;
+}
+
+static uint32_t timestamp_first_offset(const Record *record) {
+  return value_offset(record) + value_length(record) + STRING_TERMINATOR_SIZE;
 }
 
 static uint32_t timestamp_last_offset(const Record *record) {
@@ -208,3 +552,95 @@ static void update_timestamp_helper(Record *record, const Timestamp *timestamp,
   write_data_to_buffer(buffer, offset + TIMESTAMP_SECONDS_SIZE,
                        sizeof(uint64_t), timestamp->nanoseconds);
 }
+
+static bool is_compact(const Record *record) {
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  return 0 != (buffer[FLAGS_OFFSET] & COMPACT_FLAG);
+}
+
+// Also rewrites a record in place, key and value may then point inside it as
+// long as they keep their offsets.
+static void encode_compact(Record *record, const char *key,
+                           uint32_t key_length, const uint8_t *value,
+                           uint32_t value_length, bool has_overflow,
+                           const Timestamp *first, const Timestamp *last,
+                           const Timestamp *expiry) {
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  buffer[FLAGS_OFFSET] = COMPACT_FLAG |
+                         (has_overflow ? COMPACT_OVERFLOW_FLAG : 0) |
+                         (NULL != expiry ? COMPACT_EXPIRES_FLAG : 0);
+  uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+  offset += write_varint_to_buffer(buffer, offset, key_length);
+  memmove(buffer + offset, key, key_length);
+  offset += key_length;
+  offset += write_varint_to_buffer(buffer, offset, value_length);
+  memmove(buffer + offset, value, value_length);
+  offset += value_length;
+
+  int64_t delta =
+      ((int64_t)last->seconds - (int64_t)first->seconds) *
+          NANOSECONDS_PER_SECOND +
+      ((int64_t)last->nanoseconds - (int64_t)first->nanoseconds);
+  offset += write_varint_to_buffer(buffer, offset, first->seconds);
+  offset += write_varint_to_buffer(buffer, offset, first->nanoseconds);
+  offset += write_varint_to_buffer(buffer, offset,
+                                   ((uint64_t)delta << 1) ^ (delta >> 63));
+  if (NULL != expiry) {
+    offset += write_varint_to_buffer(
+        buffer, offset,
+        expiry->seconds * MILLISECONDS_PER_SECOND +
+            expiry->nanoseconds / NANOSECONDS_PER_MILLISECOND);
+  }
+
+  assert(offset <= RECORD_SIZE_ESTIMATE);
+  buffer[LENGTH_OFFSET] = offset;
+  set_buffer_length(record->safe_buffer, offset);
+}
+
+static Timestamp read_compact_timestamp(const Record *record, bool last) {
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  uint32_t offset = value_offset(record) + value_length(record);
+  Timestamp timestamp;
+  timestamp.seconds = read_varint_from_buffer(buffer, &offset);
+  timestamp.nanoseconds = read_varint_from_buffer(buffer, &offset);
+  if (!last) {
+    return timestamp;
+  }
+
+  uint64_t zigzag = read_varint_from_buffer(buffer, &offset);
+  int64_t delta = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+  int64_t nanoseconds =
+      (int64_t)timestamp.nanoseconds + delta % NANOSECONDS_PER_SECOND;
+  int64_t seconds =
+      (int64_t)timestamp.seconds + delta / NANOSECONDS_PER_SECOND;
+  if (nanoseconds < 0) {
+    nanoseconds += NANOSECONDS_PER_SECOND;
+    --seconds;
+  } else if (nanoseconds >= NANOSECONDS_PER_SECOND) {
+    nanoseconds -= NANOSECONDS_PER_SECOND;
+    ++seconds;
+  }
+  return (Timestamp){.seconds = seconds, .nanoseconds = nanoseconds};
+}
+
+static uint32_t key_suffix_offset(const uint8_t *entry, uint32_t *shared,
+                                  uint32_t *suffix_length) {
+  uint32_t offset = COMPACT_KEY_LENGTH_OFFSET;
+  *shared = read_varint_from_buffer(entry, &offset);
+  *suffix_length = read_varint_from_buffer(entry, &offset);
+  return offset;
+}
+
+static uint32_t compact_expiry_offset(const Record *record) {
+  uint8_t *buffer = get_buffer(record->safe_buffer);
+  uint32_t offset = value_offset(record) + value_length(record);
+  for (uint32_t i = 0; i < 3; ++i) {
+    read_varint_from_buffer(buffer, &offset);
+  }
+  return offset;
+}
+
+// The expiry of a record about to be encoded again, NULL when it has none.
+static const Timestamp *kept_expiry(const Record *record, Timestamp *expiry) {
+  return record_expiry(record, expiry) ? expiry : NULL;
+}
@@ -0,0 +1,469 @@
+#include "../include/sharded.h"
+#include "../include/engine.h"
+#include "../include/write_batch.h"
+#include "../include/xxhash.h"
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Seeded so the shard of a key does not bias its home page inside the shard,
+// which the hash engines take from the high bits of the unseeded hash.
+#define SHARD_SEED (0x5348415244ULL)
+#define SHARD_SUFFIX ".shard"
+
+// A shard is opened by the first operation needing it, under the open mutex,
+// and kept open until the sharded database is closed.
+typedef struct {
+  Database **shards;
+  uint64_t no_shards;
+  const char *path;
+  bool writable;
+  pthread_mutex_t open_mutex;
+  pthread_mutex_t callback_mutex;
+} ShardedState;
+
+// Share of an operation run against one shard. The callbacks of the caller
+// are serialized with the callback mutex. The shards an operation does not
+// touch are left unused, and not opened when they are not yet.
+typedef struct {
+  ShardedState *state;
+  Database *shard;
+  bool used;
+  const char **keys;
+  uint32_t *key_lengths;
+  uint64_t *indices;
+  uint64_t no_keys;
+  const char *from;
+  uint32_t from_length;
+  const char *to;
+  uint32_t to_length;
+  ScanCallback scan_callback;
+  MultiGetCallback multi_get_callback;
+  void *arguments;
+  EngineStats stats;
+  enum FileErrorStatus error;
+} ShardTask;
+
+typedef void *(*ShardWorker)(void *arguments);
+
+static void sharded_create(Database *database, uint64_t no_elements,
+                           enum FileErrorStatus *error);
+static void sharded_open(Database *database, enum FileErrorStatus *error);
+static void sharded_mget(Database *database, const char **keys,
+                         const uint32_t *key_lengths, uint64_t no_keys,
+                         MultiGetCallback callback,
+                         void *arguments, enum FileErrorStatus *error);
+static void sharded_write_batch(Database *database,
+                                const WriteBatch *write_batch,
+                                enum FileErrorStatus *error);
+static void sharded_scan(Database *database, ScanCallback callback,
+                         void *arguments, enum FileErrorStatus *error);
+static void sharded_scan_range(Database *database, const char *from,
+                               uint32_t from_length, const char *to,
+                               uint32_t to_length, ScanCallback callback,
+                               void *arguments, enum FileErrorStatus *error);
+static void sharded_stats(Database *database, EngineStats *stats,
+                          enum FileErrorStatus *error);
+static bool sharded_vacuum(Database *database, uint64_t *page_id,
+                           VacuumStats *stats, enum FileErrorStatus *error);
+static void sharded_close(Database *database, enum FileErrorStatus *error);
+static uint64_t shard_index(const char *key, uint32_t key_length,
+                            uint64_t no_shards);
+static ShardTask *create_shard_tasks(ShardedState *state,
+                                     enum FileErrorStatus *error);
+static void open_task_shards(const Database *database, ShardTask *tasks,
+                             enum FileErrorStatus *error);
+static void run_on_shards(ShardTask *tasks, uint64_t no_shards,
+                          ShardWorker worker, enum FileErrorStatus *error);
+static void *multi_get_worker(void *arguments);
+static void *scan_worker(void *arguments);
+static void *stats_worker(void *arguments);
+static void serialized_multi_get_callback(uint64_t index, const Record *record,
+                                          void *arguments);
+static void serialized_scan_callback(const Record *record, void *arguments);
+
+// API implementation
+
+const EngineOperations sharded_engine = {.name = "sharded",
+                                         .stores_data_pages = false,
+                                         .create = sharded_create,
+                                         .open = sharded_open,
+                                         .get = NULL,
+                                         .mget = sharded_mget,
+                                         .put = NULL,
+                                         .del = NULL,
+                                         .update = NULL,
+                                         .write_batch = sharded_write_batch,
+                                         .scan = sharded_scan,
+                                         .scan_range = sharded_scan_range,
+                                         .stats = sharded_stats,
+                                         .vacuum = sharded_vacuum,
+                                         .open_view = NULL,
+                                         .scan_view = NULL,
+                                         .close_view = NULL,
+                                         .close = sharded_close};
+
+void sharded_shard_path(char *buffer, const char *path, uint64_t shard) {
+  snprintf(buffer, PATH_MAX, "%s" SHARD_SUFFIX "%" PRIu64, path, shard);
+}
+
+Database *sharded_key_shard(const Database *database, const char *key,
+                            uint32_t key_length, enum FileErrorStatus *error) {
+  const ShardedState *state = database->state;
+  return sharded_shard(database, shard_index(key, key_length, state->no_shards),
+                       error);
+}
+
+// Held while opening, a second descriptor of the shard in this process would
+// drop its locks when closed.
+Database *sharded_shard(const Database *database, uint64_t shard,
+                        enum FileErrorStatus *error) {
+  *error = success;
+  ShardedState *state = database->state;
+  assert(shard < state->no_shards);
+
+  pthread_mutex_lock(&state->open_mutex);
+  if (NULL == state->shards[shard]) {
+    char buffer[PATH_MAX];
+    sharded_shard_path(buffer, state->path, shard);
+    state->shards[shard] = open_database(buffer, state->writable, error);
+  }
+  Database *opened = state->shards[shard];
+  pthread_mutex_unlock(&state->open_mutex);
+  return opened;
+}
+
+// Local implementation
+
+// The shard files are created by create_sharded_database, the database file
+// itself has no data pages.
+static void sharded_create(Database *database, uint64_t no_elements,
+                           enum FileErrorStatus *error) {
+  *error = success;
+  database->no_pages = 1;
+}
+
+// No shard is opened yet, a process only locks the shards it uses.
+static void sharded_open(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+
+  if (0 == database->no_shards || database->no_shards > MAX_SHARDS) {
+    fprintf(stderr, "invalid number of shards.\n");
+    *error = failure;
+    return;
+  }
+
+  ShardedState *state = calloc(1, sizeof(ShardedState));
+  Database **shards = calloc(database->no_shards, sizeof(Database *));
+  if (NULL == state || NULL == shards) {
+    fprintf(stderr, "cannot allocate shards.\n");
+    free(state);
+    free(shards);
+    *error = failure;
+    return;
+  }
+  state->shards = shards;
+  state->no_shards = database->no_shards;
+  state->path = database->path;
+  state->writable = database->writable;
+  pthread_mutex_init(&state->open_mutex, NULL);
+  pthread_mutex_init(&state->callback_mutex, NULL);
+  database->state = state;
+}
+
+// The keys are split per shard and every shard answers its share of the batch
+// on a thread of its own.
+static void sharded_mget(Database *database, const char **keys,
+                         const uint32_t *key_lengths, uint64_t no_keys,
+                         MultiGetCallback callback,
+                         void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  ShardedState *state = database->state;
+
+  ShardTask *tasks = create_shard_tasks(state, error);
+  const char **shard_keys = malloc(no_keys * sizeof(const char *));
+  uint32_t *shard_key_lengths = malloc(no_keys * sizeof(uint32_t));
+  uint64_t *indices = malloc(no_keys * sizeof(uint64_t));
+  if (failure == *error ||
+      (0 != no_keys && (NULL == shard_keys || NULL == shard_key_lengths ||
+                        NULL == indices))) {
+    fprintf(stderr, "cannot allocate multi-get shards.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  for (uint64_t i = 0; i < no_keys; ++i) {
+    ++tasks[shard_index(keys[i], key_lengths[i], state->no_shards)].no_keys;
+  }
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < state->no_shards; ++i) {
+    tasks[i].keys = shard_keys + offset;
+    tasks[i].key_lengths = shard_key_lengths + offset;
+    tasks[i].indices = indices + offset;
+    tasks[i].multi_get_callback = callback;
+    tasks[i].arguments = arguments;
+    offset += tasks[i].no_keys;
+    tasks[i].no_keys = 0;
+  }
+  for (uint64_t i = 0; i < no_keys; ++i) {
+    ShardTask *task =
+        tasks + shard_index(keys[i], key_lengths[i], state->no_shards);
+    task->keys[task->no_keys] = keys[i];
+    task->key_lengths[task->no_keys] = key_lengths[i];
+    task->indices[task->no_keys++] = i;
+  }
+  for (uint64_t i = 0; i < state->no_shards; ++i) {
+    tasks[i].used = 0 != tasks[i].no_keys;
+  }
+
+  open_task_shards(database, tasks, error);
+  if (success == *error) {
+    run_on_shards(tasks, state->no_shards, multi_get_worker, error);
+  }
+
+cleanup_0:
+  free(indices);
+  free(shard_key_lengths);
+  free(shard_keys);
+  free(tasks);
+}
+
+// A batch is only atomic within a shard, one spanning several shards is
+// rejected.
+static void sharded_write_batch(Database *database,
+                                const WriteBatch *write_batch,
+                                enum FileErrorStatus *error) {
+  *error = success;
+  ShardedState *state = database->state;
+
+  const WriteBatchEntry *first = write_batch_entry(write_batch, 0);
+  uint64_t shard_id =
+      shard_index(first->key, first->key_length, state->no_shards);
+  for (uint64_t i = 1; i < write_batch_no_entries(write_batch); ++i) {
+    const WriteBatchEntry *entry = write_batch_entry(write_batch, i);
+    if (shard_index(entry->key, entry->key_length, state->no_shards) !=
+        shard_id) {
+      fprintf(stderr, "write batches spanning several shards are not "
+                      "atomic.\n");
+      *error = failure;
+      return;
+    }
+  }
+
+  Database *shard = sharded_shard(database, shard_id, error);
+  if (success == *error) {
+    commit_write_batch(shard, write_batch, error);
+  }
+}
+
+static void sharded_scan(Database *database, ScanCallback callback,
+                         void *arguments, enum FileErrorStatus *error) {
+  sharded_scan_range(database, NULL, 0, NULL, 0, callback, arguments, error);
+}
+
+// Every shard is scanned on a thread of its own, the records come in key
+// order within a shard only.
+static void sharded_scan_range(Database *database, const char *from,
+                               uint32_t from_length, const char *to,
+                               uint32_t to_length, ScanCallback callback,
+                               void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+  ShardedState *state = database->state;
+
+  ShardTask *tasks = create_shard_tasks(state, error);
+  if (failure == *error) {
+    return;
+  }
+
+  for (uint64_t i = 0; i < state->no_shards; ++i) {
+    tasks[i].from = from;
+    tasks[i].from_length = from_length;
+    tasks[i].to = to;
+    tasks[i].to_length = to_length;
+    tasks[i].scan_callback = callback;
+    tasks[i].arguments = arguments;
+  }
+  open_task_shards(database, tasks, error);
+  if (success == *error) {
+    run_on_shards(tasks, state->no_shards, scan_worker, error);
+  }
+  free(tasks);
+}
+
+static void sharded_stats(Database *database, EngineStats *stats,
+                          enum FileErrorStatus *error) {
+  *error = success;
+  ShardedState *state = database->state;
+
+  ShardTask *tasks = create_shard_tasks(state, error);
+  if (failure == *error) {
+    return;
+  }
+
+  open_task_shards(database, tasks, error);
+  if (success == *error) {
+    run_on_shards(tasks, state->no_shards, stats_worker, error);
+  }
+  for (uint64_t i = 0; i < state->no_shards; ++i) {
+    stats->no_pages += tasks[i].stats.no_pages;
+    stats->no_used_pages += tasks[i].stats.no_used_pages;
+    stats->no_records += tasks[i].stats.no_records;
+    stats->used_bytes += tasks[i].stats.used_bytes;
+    stats->free_bytes += tasks[i].stats.free_bytes;
+  }
+  free(tasks);
+}
+
+// A step vacuums the shard numbered *page_id, the shard taking its own lock
+// for each stretch of its pages.
+static bool sharded_vacuum(Database *database, uint64_t *page_id,
+                           VacuumStats *stats, enum FileErrorStatus *error) {
+  *error = success;
+  ShardedState *state = database->state;
+  if (*page_id >= state->no_shards) {
+    return false;
+  }
+
+  Database *shard = sharded_shard(database, *page_id, error);
+  if (failure == *error) {
+    return false;
+  }
+  VacuumStats shard_stats;
+  vacuum_database(shard, &shard_stats, error);
+  stats->no_moved_records += shard_stats.no_moved_records;
+  stats->no_expired_records += shard_stats.no_expired_records;
+  stats->no_written_pages += shard_stats.no_written_pages;
+  stats->no_freed_pages += shard_stats.no_freed_pages;
+  return ++*page_id < state->no_shards;
+}
+
+static void sharded_close(Database *database, enum FileErrorStatus *error) {
+  *error = success;
+  ShardedState *state = database->state;
+  if (NULL == state) {
+    return;
+  }
+
+  for (uint64_t i = 0; i < state->no_shards; ++i) {
+    if (NULL != state->shards[i]) {
+      enum FileErrorStatus close_error;
+      close_database(state->shards[i], &close_error);
+      if (failure == close_error) {
+        *error = failure;
+      }
+    }
+  }
+  pthread_mutex_destroy(&state->open_mutex);
+  pthread_mutex_destroy(&state->callback_mutex);
+  free(state->shards);
+  free(state);
+  database->state = NULL;
+}
+
+static uint64_t shard_index(const char *key, uint32_t key_length,
+                            uint64_t no_shards) {
+  uint64_t hash = XXH3_64bits_withSeed(key, key_length, SHARD_SEED);
+  return (uint64_t)(((unsigned __int128)hash * no_shards) >> 64);
+}
+
+static ShardTask *create_shard_tasks(ShardedState *state,
+                                     enum FileErrorStatus *error) {
+  *error = success;
+
+  ShardTask *tasks = calloc(state->no_shards, sizeof(ShardTask));
+  if (NULL == tasks) {
+    fprintf(stderr, "cannot allocate shard tasks.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  for (uint64_t i = 0; i < state->no_shards; ++i) {
+    tasks[i].state = state;
+    tasks[i].used = true;
+    tasks[i].error = success;
+  }
+  return tasks;
+}
+
+static void open_task_shards(const Database *database, ShardTask *tasks,
+                             enum FileErrorStatus *error) {
+  *error = success;
+  const ShardedState *state = database->state;
+  for (uint64_t i = 0; i < state->no_shards && success == *error; ++i) {
+    if (tasks[i].used) {
+      tasks[i].shard = sharded_shard(database, i, error);
+    }
+  }
+}
+
+// One thread per shard, a shard whose thread cannot be started runs on the
+// calling thread.
+static void run_on_shards(ShardTask *tasks, uint64_t no_shards,
+                          ShardWorker worker, enum FileErrorStatus *error) {
+  *error = success;
+
+  pthread_t threads[MAX_SHARDS];
+  bool started[MAX_SHARDS] = {false};
+  for (uint64_t i = 0; i < no_shards; ++i) {
+    if (!tasks[i].used) {
+      continue;
+    }
+    started[i] = 0 == pthread_create(threads + i, NULL, worker, tasks + i);
+    if (!started[i]) {
+      worker(tasks + i);
+    }
+  }
+
+  for (uint64_t i = 0; i < no_shards; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    if (failure == tasks[i].error) {
+      *error = failure;
+    }
+  }
+}
+
+static void *multi_get_worker(void *arguments) {
+  ShardTask *task = arguments;
+  query_elements(task->shard, task->keys, task->key_lengths, task->no_keys,
+                 serialized_multi_get_callback, task, &task->error);
+  return NULL;
+}
+
+static void *scan_worker(void *arguments) {
+  ShardTask *task = arguments;
+  if (NULL == task->from) {
+    scan_elements(task->shard, serialized_scan_callback, task, &task->error);
+  } else {
+    scan_range_elements(task->shard, task->from, task->from_length, task->to,
+                        task->to_length, serialized_scan_callback, task,
+                        &task->error);
+  }
+  return NULL;
+}
+
+static void *stats_worker(void *arguments) {
+  ShardTask *task = arguments;
+  database_stats(task->shard, &task->stats, &task->error);
+  return NULL;
+}
+
+static void serialized_multi_get_callback(uint64_t index, const Record *record,
+                                          void *arguments) {
+  ShardTask *task = arguments;
+  pthread_mutex_lock(&task->state->callback_mutex);
+  task->multi_get_callback(task->indices[index], record, task->arguments);
+  pthread_mutex_unlock(&task->state->callback_mutex);
+}
+
+static void serialized_scan_callback(const Record *record, void *arguments) {
+  ShardTask *task = arguments;
+  pthread_mutex_lock(&task->state->callback_mutex);
+  task->scan_callback(record, task->arguments);
+  pthread_mutex_unlock(&task->state->callback_mutex);
+}
@@ -0,0 +1,232 @@
+#include "../include/skiplist.h"
+#include "../include/constants.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every level holds a quarter of the nodes of the level below.
+#define MAX_HEIGHT (12)
+#define BRANCHING (4)
+
+struct skiplist_node {
+  uint8_t *record;
+  uint32_t length;
+  bool tombstone;
+  uint32_t height;
+  SkipListNode *next[];
+};
+
+static SkipListNode *create_node(const Record *record, bool tombstone,
+                                 uint32_t height);
+static bool set_node_record(SkipListNode *node, const Record *record,
+                            bool tombstone);
+static int compare_node_key(const SkipListNode *node, const char *key,
+                            uint32_t key_length);
+static uint32_t random_height(SkipList *skiplist);
+static const SkipListNode *find_greater_or_equal(const SkipList *skiplist,
+                                                 const char *key,
+                                                 uint32_t key_length,
+                                                 SkipListNode **previous);
+
+// API implementation
+
+SkipList *create_skiplist(void) {
+  SkipList *skiplist = calloc(1, sizeof(SkipList));
+  if (NULL == skiplist) {
+    fprintf(stderr, "cannot allocate memtable.\n");
+    return NULL;
+  }
+
+  skiplist->head = calloc(1, sizeof(SkipListNode) +
+                                 MAX_HEIGHT * sizeof(SkipListNode *));
+  if (NULL == skiplist->head) {
+    fprintf(stderr, "cannot allocate memtable.\n");
+    free(skiplist);
+    return NULL;
+  }
+  skiplist->head->height = MAX_HEIGHT;
+  skiplist->height = 1;
+  skiplist->random_state = 0x9E3779B97F4A7C15ULL;
+  return skiplist;
+}
+
+// Replaces the record of an existing key in place.
+bool skiplist_put(SkipList *skiplist, const Record *record, bool tombstone) {
+  assert(skiplist);
+  assert(record);
+
+  SkipListNode *previous[MAX_HEIGHT];
+  const char *key = record_key(record);
+  uint32_t key_length = record_key_length(record);
+  SkipListNode *node = (SkipListNode *)find_greater_or_equal(
+      skiplist, key, key_length, previous);
+  if (NULL != node && 0 == compare_node_key(node, key, key_length)) {
+    uint32_t old_length = node->length;
+    if (!set_node_record(node, record, tombstone)) {
+      return false;
+    }
+    skiplist->size = skiplist->size - old_length + node->length;
+    return true;
+  }
+
+  uint32_t height = random_height(skiplist);
+  if (height > skiplist->height) {
+    for (uint32_t level = skiplist->height; level < height; ++level) {
+      previous[level] = skiplist->head;
+    }
+    skiplist->height = height;
+  }
+
+  node = create_node(record, tombstone, height);
+  if (NULL == node) {
+    return false;
+  }
+
+  for (uint32_t level = 0; level < height; ++level) {
+    node->next[level] = previous[level]->next[level];
+    previous[level]->next[level] = node;
+  }
+  ++skiplist->no_entries;
+  skiplist->size += node->length;
+  return true;
+}
+
+const SkipListNode *skiplist_find(const SkipList *skiplist, const char *key,
+                                  uint32_t key_length) {
+  assert(skiplist);
+  assert(key);
+
+  const SkipListNode *node =
+      find_greater_or_equal(skiplist, key, key_length, NULL);
+  if (NULL != node && 0 == compare_node_key(node, key, key_length)) {
+    return node;
+  }
+  return NULL;
+}
+
+// First node whose key is not smaller than from, the first node when from is
+// NULL.
+const SkipListNode *skiplist_seek(const SkipList *skiplist, const char *from,
+                                  uint32_t from_length) {
+  assert(skiplist);
+  if (NULL == from) {
+    return skiplist->head->next[0];
+  }
+  return find_greater_or_equal(skiplist, from, from_length, NULL);
+}
+
+const SkipListNode *skiplist_next(const SkipListNode *node) {
+  assert(node);
+  return node->next[0];
+}
+
+Record skiplist_node_record(const SkipListNode *node, SafeBuffer *view) {
+  assert(node);
+  *view = (SafeBuffer){
+      .buffer = node->record, .length = node->length, .capacity = node->length};
+  return record_from_buffer(view);
+}
+
+bool skiplist_node_is_tombstone(const SkipListNode *node) {
+  assert(node);
+  return node->tombstone;
+}
+
+uint64_t skiplist_size(const SkipList *skiplist) {
+  assert(skiplist);
+  return skiplist->size;
+}
+
+void destroy_skiplist(SkipList *skiplist) {
+  if (NULL == skiplist) {
+    return;
+  }
+
+  SkipListNode *node = skiplist->head->next[0];
+  while (NULL != node) {
+    SkipListNode *next = node->next[0];
+    free(node->record);
+    free(node);
+    node = next;
+  }
+  free(skiplist->head);
+  free(skiplist);
+}
+
+// Local implementation
+
+static SkipListNode *create_node(const Record *record, bool tombstone,
+                                 uint32_t height) {
+  SkipListNode *node =
+      calloc(1, sizeof(SkipListNode) + height * sizeof(SkipListNode *));
+  if (NULL == node) {
+    fprintf(stderr, "cannot allocate memtable entry.\n");
+    return NULL;
+  }
+
+  node->height = height;
+  if (!set_node_record(node, record, tombstone)) {
+    free(node);
+    return NULL;
+  }
+  return node;
+}
+
+static bool set_node_record(SkipListNode *node, const Record *record,
+                            bool tombstone) {
+  uint32_t length = get_record_length(record);
+  uint8_t *buffer = realloc(node->record, length);
+  if (NULL == buffer) {
+    fprintf(stderr, "cannot allocate memtable entry.\n");
+    return false;
+  }
+
+  memcpy(buffer, record_get_buffer(record), length);
+  node->record = buffer;
+  node->length = length;
+  node->tombstone = tombstone;
+  return true;
+}
+
+static int compare_node_key(const SkipListNode *node, const char *key,
+                            uint32_t key_length) {
+  SafeBuffer view;
+  Record record = skiplist_node_record(node, &view);
+  return compare_keys(record_key(&record), record_key_length(&record), key,
+                      key_length);
+}
+
+static uint32_t random_height(SkipList *skiplist) {
+  uint32_t height = 1;
+  while (height < MAX_HEIGHT) {
+    uint64_t x = skiplist->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    skiplist->random_state = x;
+    if (0 != x % BRANCHING) {
+      break;
+    }
+    ++height;
+  }
+  return height;
+}
+
+static const SkipListNode *find_greater_or_equal(const SkipList *skiplist,
+                                                 const char *key,
+                                                 uint32_t key_length,
+                                                 SkipListNode **previous) {
+  SkipListNode *node = skiplist->head;
+  for (uint32_t level = skiplist->height; level > 0; --level) {
+    SkipListNode *next = node->next[level - 1];
+    while (NULL != next && compare_node_key(next, key, key_length) < 0) {
+      node = next;
+      next = node->next[level - 1];
+    }
+    if (NULL != previous) {
+      previous[level - 1] = node;
+    }
+  }
+  return node->next[0];
+}
@@ -0,0 +1,349 @@
+#include "../include/snapshot.h"
+#include "../include/btree.h"
+#include "../include/data_page_cursor.h"
+#include "../include/sharded.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Shared by the open snapshots of a database, freed with the last of them.
+struct snapshot_registry {
+  Snapshot *snapshots;
+  OverflowReference *deferred_frees;
+  uint64_t no_deferred_frees;
+};
+
+// pages holds the kept image of every page changed since the snapshot was
+// opened, indexed by page id up to the no_pages of the moment, view the
+// records of the engines keeping them and shards the snapshot of each shard.
+struct snapshot {
+  Database *database;
+  uint64_t sequence;
+  uint64_t no_pages;
+  uint64_t root_page;
+  uint8_t **pages;
+  void *view;
+  Snapshot **shards;
+  uint64_t no_shards;
+  Snapshot *next;
+};
+
+static Snapshot *open_locked_snapshot(Database *database,
+                                      enum FileErrorStatus *error);
+static Snapshot *open_sharded_snapshot(Database *database,
+                                       enum FileErrorStatus *error);
+static void scan_pages(Snapshot *snapshot, ScanCallback callback,
+                       void *arguments, enum FileErrorStatus *error);
+static void free_deferred_overflow(Database *database);
+
+// API implementation
+
+Snapshot *open_snapshot(Database *database, enum FileErrorStatus *error) {
+  if (ENGINE_SHARDED == database->engine) {
+    return open_sharded_snapshot(database, error);
+  }
+
+  pthread_mutex_lock(&database->mutex);
+  Snapshot *snapshot = open_locked_snapshot(database, error);
+  pthread_mutex_unlock(&database->mutex);
+  return snapshot;
+}
+
+uint64_t snapshot_sequence(const Snapshot *snapshot) {
+  assert(snapshot);
+  return snapshot->sequence;
+}
+
+void snapshot_scan(Snapshot *snapshot, ScanCallback callback, void *arguments,
+                   enum FileErrorStatus *error) {
+  assert(snapshot);
+  *error = success;
+
+  for (uint64_t i = 0; i < snapshot->no_shards && success == *error; ++i) {
+    snapshot_scan(snapshot->shards[i], callback, arguments, error);
+  }
+  if (NULL != snapshot->view) {
+    snapshot->database->operations->scan_view(
+        snapshot->database, snapshot->view, callback, arguments, error);
+  }
+  if (NULL != snapshot->pages) {
+    scan_pages(snapshot, callback, arguments, error);
+  }
+}
+
+void close_snapshot(Snapshot *snapshot) {
+  assert(snapshot);
+  Database *database = snapshot->database;
+  if (NULL != snapshot->shards) {
+    for (uint64_t i = 0; i < snapshot->no_shards; ++i) {
+      close_snapshot(snapshot->shards[i]);
+    }
+    free(snapshot->shards);
+    free(snapshot);
+    return;
+  }
+
+  pthread_mutex_lock(&database->mutex);
+  Snapshot **link = &database->snapshots->snapshots;
+  while (*link != snapshot) {
+    link = &(*link)->next;
+  }
+  *link = snapshot->next;
+  if (NULL == database->snapshots->snapshots) {
+    free_deferred_overflow(database);
+    free(database->snapshots);
+    database->snapshots = NULL;
+  }
+  pthread_mutex_unlock(&database->mutex);
+
+  if (NULL != snapshot->view) {
+    database->operations->close_view(database, snapshot->view);
+  }
+  for (uint64_t i = 0; NULL != snapshot->pages && i < snapshot->no_pages;
+       ++i) {
+    free(snapshot->pages[i]);
+  }
+  free(snapshot->pages);
+  free(snapshot);
+}
+
+// The page is read from the file once for all the snapshots missing it. A
+// page appended after a snapshot was opened is not part of it.
+void snapshot_preserve_page(const Database *database, uint64_t page_id,
+                            enum FileErrorStatus *error) {
+  *error = success;
+  if (NULL == database->snapshots) {
+    return;
+  }
+
+  uint64_t page_size = database->page_size;
+  uint8_t *image = NULL;
+  for (Snapshot *snapshot = database->snapshots->snapshots; NULL != snapshot;
+       snapshot = snapshot->next) {
+    if (NULL == snapshot->pages || page_id >= snapshot->no_pages ||
+        NULL != snapshot->pages[page_id]) {
+      continue;
+    }
+    snapshot->pages[page_id] = malloc(page_size);
+    if (NULL == snapshot->pages[page_id]) {
+      fprintf(stderr, "cannot allocate snapshot page.\n");
+      *error = failure;
+      return;
+    }
+    if (NULL == image) {
+      image = snapshot->pages[page_id];
+      if ((ssize_t)page_size !=
+          pread(database->fd, image, page_size, page_id * page_size)) {
+        fprintf(stderr, "failed to read a page for a snapshot.\n");
+        *error = failure;
+        free(image);
+        snapshot->pages[page_id] = NULL;
+        return;
+      }
+    } else {
+      memcpy(snapshot->pages[page_id], image, page_size);
+    }
+  }
+}
+
+bool snapshot_defer_overflow_free(Database *database,
+                                  const OverflowReference *reference,
+                                  enum FileErrorStatus *error) {
+  *error = success;
+  struct snapshot_registry *registry = database->snapshots;
+  if (NULL == registry) {
+    return false;
+  }
+
+  OverflowReference *deferred_frees =
+      realloc(registry->deferred_frees,
+              (registry->no_deferred_frees + 1) * sizeof(OverflowReference));
+  if (NULL == deferred_frees) {
+    fprintf(stderr, "cannot allocate snapshot.\n");
+    *error = failure;
+    return true;
+  }
+  registry->deferred_frees = deferred_frees;
+  registry->deferred_frees[registry->no_deferred_frees++] = *reference;
+  return true;
+}
+
+// The pages not kept are read under the database lock, a writer keeps a page
+// before changing it under the same lock.
+void snapshot_read_pages(Snapshot *snapshot, uint64_t page_id,
+                         uint64_t no_pages, uint8_t *buffer,
+                         enum FileErrorStatus *error) {
+  *error = success;
+  Database *database = snapshot->database;
+  uint64_t page_size = database->page_size;
+
+  pthread_mutex_lock(&database->mutex);
+  ssize_t bytes_read =
+      pread(database->fd, buffer, no_pages * page_size, page_id * page_size);
+  if (bytes_read != (ssize_t)(no_pages * page_size)) {
+    fprintf(stderr, "failed to read pages while scanning.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+  for (uint64_t i = 0; i < no_pages; ++i) {
+    if (NULL != snapshot->pages[page_id + i]) {
+      memcpy(buffer + i * page_size, snapshot->pages[page_id + i], page_size);
+    }
+  }
+
+cleanup_0:
+  pthread_mutex_unlock(&database->mutex);
+}
+
+// Local implementation
+
+// Called with the database lock held.
+static Snapshot *open_locked_snapshot(Database *database,
+                                      enum FileErrorStatus *error) {
+  *error = success;
+
+  Snapshot *snapshot = calloc(1, sizeof(Snapshot));
+  if (NULL == snapshot) {
+    fprintf(stderr, "cannot allocate snapshot.\n");
+    *error = failure;
+    return NULL;
+  }
+  snapshot->database = database;
+  snapshot->no_pages = database->no_pages;
+  snapshot->root_page = database->root_page;
+
+  // The engines without a view write their pages in place.
+  if (NULL != database->operations->open_view) {
+    snapshot->view = database->operations->open_view(database, error);
+  } else {
+    snapshot->pages = calloc(database->no_pages, sizeof(uint8_t *));
+    if (NULL == snapshot->pages) {
+      fprintf(stderr, "cannot allocate snapshot.\n");
+      *error = failure;
+    }
+  }
+  if (failure == *error) {
+    goto cleanup_0;
+  }
+
+  if (NULL == database->snapshots) {
+    database->snapshots = calloc(1, sizeof(struct snapshot_registry));
+    if (NULL == database->snapshots) {
+      fprintf(stderr, "cannot allocate snapshot.\n");
+      *error = failure;
+      goto cleanup_1;
+    }
+  }
+  snapshot->sequence = database->commit_sequence;
+  snapshot->next = database->snapshots->snapshots;
+  database->snapshots->snapshots = snapshot;
+  return snapshot;
+
+cleanup_1:
+  if (NULL != snapshot->view) {
+    database->operations->close_view(database, snapshot->view);
+  }
+cleanup_0:
+  free(snapshot->pages);
+  free(snapshot);
+  return NULL;
+}
+
+// Every shard is locked while the snapshots of the shards are opened, so they
+// are all taken at the same moment. The sequence is the sum of theirs.
+static Snapshot *open_sharded_snapshot(Database *database,
+                                       enum FileErrorStatus *error) {
+  *error = success;
+
+  Database *shards[MAX_SHARDS];
+  for (uint64_t i = 0; i < database->no_shards; ++i) {
+    shards[i] = sharded_shard(database, i, error);
+    if (failure == *error) {
+      return NULL;
+    }
+  }
+
+  Snapshot *snapshot = calloc(1, sizeof(Snapshot));
+  if (NULL == snapshot) {
+    fprintf(stderr, "cannot allocate snapshot.\n");
+    *error = failure;
+    return NULL;
+  }
+  snapshot->database = database;
+  snapshot->shards = calloc(database->no_shards, sizeof(Snapshot *));
+  if (NULL == snapshot->shards) {
+    fprintf(stderr, "cannot allocate snapshot.\n");
+    *error = failure;
+    free(snapshot);
+    return NULL;
+  }
+
+  for (uint64_t i = 0; i < database->no_shards; ++i) {
+    pthread_mutex_lock(&shards[i]->mutex);
+  }
+  for (uint64_t i = 0; i < database->no_shards && success == *error; ++i) {
+    Snapshot *shard_snapshot = open_locked_snapshot(shards[i], error);
+    if (NULL != shard_snapshot) {
+      snapshot->shards[snapshot->no_shards++] = shard_snapshot;
+      snapshot->sequence += shard_snapshot->sequence;
+    }
+  }
+  for (uint64_t i = 0; i < database->no_shards; ++i) {
+    pthread_mutex_unlock(&shards[i]->mutex);
+  }
+
+  if (failure == *error) {
+    close_snapshot(snapshot);
+    return NULL;
+  }
+  return snapshot;
+}
+
+// The data page engines are read in page order, the btree along its leaves.
+static void scan_pages(Snapshot *snapshot, ScanCallback callback,
+                       void *arguments, enum FileErrorStatus *error) {
+  Record record;
+  if (!snapshot->database->operations->stores_data_pages) {
+    BTreeCursor cursor;
+    btree_snapshot_cursor_open(snapshot->database, snapshot,
+                               snapshot->root_page, &cursor, error);
+    if (failure == *error) {
+      return;
+    }
+    while (btree_cursor_next(&cursor, &record, error)) {
+      if (!record_has_expired(&record)) {
+        callback(&record, arguments);
+      }
+    }
+    btree_cursor_close(&cursor);
+    return;
+  }
+
+  DataPageCursor cursor;
+  data_page_cursor_open(&cursor, snapshot->database, 1, snapshot->no_pages,
+                        error);
+  if (failure == *error) {
+    return;
+  }
+  cursor.snapshot = snapshot;
+
+  while (data_page_cursor_next(&cursor, &record, error)) {
+    if (!record_has_expired(&record)) {
+      callback(&record, arguments);
+    }
+  }
+  data_page_cursor_close(&cursor);
+}
+
+static void free_deferred_overflow(Database *database) {
+  struct snapshot_registry *registry = database->snapshots;
+  for (uint64_t i = 0; i < registry->no_deferred_frees; ++i) {
+    enum FileErrorStatus free_error;
+    overflow_free_value(database->overflow, registry->deferred_frees + i,
+                        &free_error);
+  }
+  free(registry->deferred_frees);
+}
@@ -0,0 +1,524 @@
+#include "../include/sorted_run.h"
+#include "../include/buffer_utilities.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// data blocks (4096 bytes each) | block index | bloom filter | footer
+//
+// block: no_entries (2 bytes) | used space (2 bytes) | entries, an entry is
+// entry type (1 byte) | record, encoded as in record.c
+// block index: key length (1 byte) | key (key length + 1 bytes) for the first
+// key of every block
+// footer: magic (8 bytes) | no_blocks (8 bytes) | no_entries (8 bytes) | index
+// offset (8 bytes) | bloom offset (8 bytes) | bloom bits (8 bytes) | last key
+// length (1 byte) | last key (101 bytes)
+
+#define RUN_MAGIC (0x4B5644424C534D31ULL)
+
+#define BLOCK_NO_ENTRIES_SIZE (2)
+#define BLOCK_NO_ENTRIES_OFFSET (0)
+#define BLOCK_USED_SIZE (2)
+#define BLOCK_USED_OFFSET (BLOCK_NO_ENTRIES_OFFSET + BLOCK_NO_ENTRIES_SIZE)
+#define BLOCK_DATA_OFFSET (BLOCK_USED_OFFSET + BLOCK_USED_SIZE)
+
+#define ENTRY_TYPE_SIZE (1)
+#define KEY_LENGTH_SIZE (1)
+#define STRING_TERMINATOR_SIZE (1)
+#define INDEX_ENTRY_SIZE                                                       \
+  (KEY_LENGTH_SIZE + MAX_STRING_LENGTH + STRING_TERMINATOR_SIZE)
+
+#define FIELD_SIZE (8)
+#define MAGIC_OFFSET (0)
+#define NO_BLOCKS_OFFSET (MAGIC_OFFSET + FIELD_SIZE)
+#define NO_ENTRIES_OFFSET (NO_BLOCKS_OFFSET + FIELD_SIZE)
+#define INDEX_OFFSET_OFFSET (NO_ENTRIES_OFFSET + FIELD_SIZE)
+#define BLOOM_OFFSET_OFFSET (INDEX_OFFSET_OFFSET + FIELD_SIZE)
+#define BLOOM_BITS_OFFSET (BLOOM_OFFSET_OFFSET + FIELD_SIZE)
+#define LAST_KEY_OFFSET (BLOOM_BITS_OFFSET + FIELD_SIZE)
+#define FOOTER_SIZE (LAST_KEY_OFFSET + INDEX_ENTRY_SIZE)
+
+#define TMP_SUFFIX ".tmp"
+
+struct sorted_run_writer {
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX + sizeof(TMP_SUFFIX)];
+  int fd;
+  uint8_t block[RUN_BLOCK_SIZE];
+  uint64_t no_blocks;
+  uint64_t no_entries;
+  uint8_t *index;
+  uint64_t index_length;
+  uint64_t index_capacity;
+  BloomFilter bloom_filter;
+  char last_key[MAX_STRING_LENGTH + 1];
+  uint32_t last_key_length;
+};
+
+static bool write_all(int fd, const uint8_t *buffer, uint64_t length);
+static bool read_all(int fd, uint8_t *buffer, uint64_t length,
+                     uint64_t offset);
+static void flush_block(SortedRunWriter *writer, enum FileErrorStatus *error);
+static bool append_index_key(SortedRunWriter *writer, const char *key,
+                             uint32_t key_length);
+static uint32_t write_index_key(uint8_t *buffer, const char *key,
+                                uint32_t key_length);
+static uint32_t read_index_key(const uint8_t *buffer, char *key,
+                               uint32_t *key_length);
+static uint32_t block_used(const uint8_t *block);
+static Record block_entry_at(const uint8_t *block, uint32_t offset,
+                             RunEntryType *type, SafeBuffer *view);
+static uint64_t find_block(const SortedRun *run, const char *key,
+                           uint32_t key_length);
+static void read_block(const SortedRun *run, uint64_t block_id,
+                       uint8_t *block, enum FileErrorStatus *error);
+
+// API implementation
+
+// The run is written to a temporary file and only renamed into place once
+// complete. no_entries sizes the Bloom filter and may be an upper bound.
+SortedRunWriter *create_sorted_run_writer(const char *path,
+                                          uint64_t no_entries,
+                                          enum FileErrorStatus *error) {
+  *error = success;
+
+  SortedRunWriter *writer = calloc(1, sizeof(SortedRunWriter));
+  if (NULL == writer) {
+    fprintf(stderr, "cannot allocate sorted run writer.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  snprintf(writer->path, sizeof(writer->path), "%s", path);
+  snprintf(writer->tmp_path, sizeof(writer->tmp_path), "%s" TMP_SUFFIX, path);
+  writer->bloom_filter = create_bloom_filter(no_entries);
+  writer->fd = open(writer->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (-1 == writer->fd || NULL == writer->bloom_filter.bits) {
+    fprintf(stderr, "cannot create sorted run.\n");
+    *error = failure;
+    destroy_sorted_run_writer(writer);
+    return NULL;
+  }
+
+  write_data_to_buffer(writer->block, BLOCK_USED_OFFSET, BLOCK_USED_SIZE,
+                       BLOCK_DATA_OFFSET);
+  return writer;
+}
+
+// Entries must be added in strictly increasing key order.
+void sorted_run_writer_add(SortedRunWriter *writer, RunEntryType type,
+                           const Record *record, enum FileErrorStatus *error) {
+  *error = success;
+
+  uint32_t record_length = get_record_length(record);
+  uint32_t length = ENTRY_TYPE_SIZE + record_length;
+  uint32_t used = block_used(writer->block);
+  if (used + length > RUN_BLOCK_SIZE) {
+    flush_block(writer, error);
+    if (failure == *error) {
+      return;
+    }
+    used = BLOCK_DATA_OFFSET;
+  }
+
+  const char *key = record_key(record);
+  uint32_t key_length = record_key_length(record);
+  uint32_t no_entries = read_data_from_buffer(
+      writer->block, BLOCK_NO_ENTRIES_OFFSET, BLOCK_NO_ENTRIES_SIZE);
+  if (0 == no_entries && !append_index_key(writer, key, key_length)) {
+    *error = failure;
+    return;
+  }
+
+  writer->block[used] = type;
+  memcpy(writer->block + used + ENTRY_TYPE_SIZE, record_get_buffer(record),
+         record_length);
+  write_data_to_buffer(writer->block, BLOCK_USED_OFFSET, BLOCK_USED_SIZE,
+                       used + length);
+  write_data_to_buffer(writer->block, BLOCK_NO_ENTRIES_OFFSET,
+                       BLOCK_NO_ENTRIES_SIZE, no_entries + 1);
+
+  bloom_filter_add(&writer->bloom_filter, key, key_length);
+  memcpy(writer->last_key, key, key_length);
+  writer->last_key_length = key_length;
+  ++writer->no_entries;
+}
+
+uint64_t sorted_run_writer_no_entries(const SortedRunWriter *writer) {
+  return writer->no_entries;
+}
+
+// Consumes the writer, also on failure.
+SortedRun *sorted_run_writer_finish(SortedRunWriter *writer, uint64_t id,
+                                    enum FileErrorStatus *error) {
+  *error = success;
+  SortedRun *run = NULL;
+
+  if (block_used(writer->block) > BLOCK_DATA_OFFSET) {
+    flush_block(writer, error);
+    if (failure == *error) {
+      goto cleanup_0;
+    }
+  }
+
+  uint64_t index_offset = writer->no_blocks * RUN_BLOCK_SIZE;
+  uint64_t bloom_offset = index_offset + writer->index_length;
+  uint8_t footer[FOOTER_SIZE] = {0};
+  write_data_to_buffer(footer, MAGIC_OFFSET, FIELD_SIZE, RUN_MAGIC);
+  write_data_to_buffer(footer, NO_BLOCKS_OFFSET, FIELD_SIZE, writer->no_blocks);
+  write_data_to_buffer(footer, NO_ENTRIES_OFFSET, FIELD_SIZE,
+                       writer->no_entries);
+  write_data_to_buffer(footer, INDEX_OFFSET_OFFSET, FIELD_SIZE, index_offset);
+  write_data_to_buffer(footer, BLOOM_OFFSET_OFFSET, FIELD_SIZE, bloom_offset);
+  write_data_to_buffer(footer, BLOOM_BITS_OFFSET, FIELD_SIZE,
+                       writer->bloom_filter.no_bits);
+  write_index_key(footer + LAST_KEY_OFFSET, writer->last_key,
+                  writer->last_key_length);
+
+  if (!write_all(writer->fd, writer->index, writer->index_length) ||
+      !write_all(writer->fd, writer->bloom_filter.bits,
+                 bloom_filter_size(&writer->bloom_filter)) ||
+      !write_all(writer->fd, footer, FOOTER_SIZE) || -1 == fsync(writer->fd) ||
+      -1 == rename(writer->tmp_path, writer->path)) {
+    fprintf(stderr, "failed to write sorted run.\n");
+    *error = failure;
+    goto cleanup_0;
+  }
+
+  run = open_sorted_run(writer->path, id, error);
+
+cleanup_0:
+  destroy_sorted_run_writer(writer);
+  return run;
+}
+
+void destroy_sorted_run_writer(SortedRunWriter *writer) {
+  if (NULL == writer) {
+    return;
+  }
+  if (-1 != writer->fd) {
+    close(writer->fd);
+  }
+  unlink(writer->tmp_path);
+  destroy_bloom_filter(&writer->bloom_filter);
+  free(writer->index);
+  free(writer);
+}
+
+SortedRun *open_sorted_run(const char *path, uint64_t id,
+                           enum FileErrorStatus *error) {
+  *error = success;
+
+  SortedRun *run = calloc(1, sizeof(SortedRun));
+  if (NULL == run) {
+    fprintf(stderr, "cannot allocate sorted run.\n");
+    *error = failure;
+    return NULL;
+  }
+  run->id = id;
+
+  run->fd = open(path, O_RDONLY);
+  if (-1 == run->fd) {
+    fprintf(stderr, "cannot open sorted run.\n");
+    *error = failure;
+    free(run);
+    return NULL;
+  }
+
+  uint8_t footer[FOOTER_SIZE];
+  off_t size = lseek(run->fd, 0, SEEK_END);
+  if (size < FOOTER_SIZE ||
+      !read_all(run->fd, footer, FOOTER_SIZE, size - FOOTER_SIZE) ||
+      RUN_MAGIC != read_data_from_buffer(footer, MAGIC_OFFSET, FIELD_SIZE)) {
+    goto cleanup_0;
+  }
+
+  run->no_blocks = read_data_from_buffer(footer, NO_BLOCKS_OFFSET, FIELD_SIZE);
+  run->no_entries =
+      read_data_from_buffer(footer, NO_ENTRIES_OFFSET, FIELD_SIZE);
+  uint64_t index_offset =
+      read_data_from_buffer(footer, INDEX_OFFSET_OFFSET, FIELD_SIZE);
+  uint64_t bloom_offset =
+      read_data_from_buffer(footer, BLOOM_OFFSET_OFFSET, FIELD_SIZE);
+  uint64_t bloom_bits =
+      read_data_from_buffer(footer, BLOOM_BITS_OFFSET, FIELD_SIZE);
+  read_index_key(footer + LAST_KEY_OFFSET, run->last_key,
+                 &run->last_key_length);
+  if (bloom_offset < index_offset ||
+      bloom_offset + bloom_bits / BYTE_SIZE + FOOTER_SIZE != (uint64_t)size) {
+    goto cleanup_0;
+  }
+
+  uint64_t index_length = bloom_offset - index_offset;
+  uint8_t *index = malloc(index_length + 1);
+  uint8_t *bits = malloc(bloom_bits / BYTE_SIZE);
+  run->first_keys = malloc((run->no_blocks + 1) * INDEX_ENTRY_SIZE);
+  run->first_key_lengths = malloc((run->no_blocks + 1) * sizeof(uint32_t));
+  run->bloom_filter = bloom_filter_from_data(bits, bloom_bits);
+  if (NULL == index || NULL == bits || NULL == run->first_keys ||
+      NULL == run->first_key_lengths ||
+      !read_all(run->fd, index, index_length, index_offset) ||
+      !read_all(run->fd, bits, bloom_bits / BYTE_SIZE, bloom_offset)) {
+    free(index);
+    goto cleanup_0;
+  }
+
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < run->no_blocks; ++i) {
+    if (offset >= index_length) {
+      free(index);
+      goto cleanup_0;
+    }
+    offset += read_index_key(index + offset, run->first_keys[i],
+                             run->first_key_lengths + i);
+  }
+  free(index);
+  return run;
+
+cleanup_0:
+  fprintf(stderr, "sorted run is corrupted.\n");
+  *error = failure;
+  close_sorted_run(run);
+  return NULL;
+}
+
+uint64_t sorted_run_size(const SortedRun *run) {
+  return run->no_blocks * RUN_BLOCK_SIZE;
+}
+
+// block must hold RUN_BLOCK_SIZE bytes, the record found points into it.
+bool sorted_run_get(const SortedRun *run, const char *key,
+                    uint32_t key_length, uint8_t *block, RunEntryType *type,
+                    Record *record, SafeBuffer *view,
+                    enum FileErrorStatus *error) {
+  *error = success;
+
+  if (0 == run->no_blocks ||
+      compare_keys(key, key_length, run->first_keys[0],
+                   run->first_key_lengths[0]) < 0 ||
+      compare_keys(key, key_length, run->last_key, run->last_key_length) > 0 ||
+      !bloom_filter_may_contain(&run->bloom_filter, key, key_length)) {
+    return false;
+  }
+
+  read_block(run, find_block(run, key, key_length), block, error);
+  if (failure == *error) {
+    return false;
+  }
+
+  uint32_t used = block_used(block);
+  uint32_t offset = BLOCK_DATA_OFFSET;
+  while (offset < used) {
+    *record = block_entry_at(block, offset, type, view);
+    int cmp = compare_keys(record_key(record), record_key_length(record), key,
+                           key_length);
+    if (0 == cmp) {
+      return true;
+    }
+    if (cmp > 0) {
+      break;
+    }
+    offset += ENTRY_TYPE_SIZE + get_record_length(record);
+  }
+  return false;
+}
+
+void close_sorted_run(SortedRun *run) {
+  if (NULL == run) {
+    return;
+  }
+  if (-1 != run->fd) {
+    close(run->fd);
+  }
+  destroy_bloom_filter(&run->bloom_filter);
+  free(run->first_keys);
+  free(run->first_key_lengths);
+  free(run);
+}
+
+// Positions the cursor on the first entry not smaller than from, the first
+// entry of the run when from is NULL.
+void sorted_run_cursor_open(SortedRunCursor *cursor, const SortedRun *run,
+                            const char *from, uint32_t from_length,
+                            enum FileErrorStatus *error) {
+  *error = success;
+  *cursor = (SortedRunCursor){.run = run, .offset = BLOCK_DATA_OFFSET};
+
+  cursor->block = malloc(RUN_BLOCK_SIZE);
+  if (NULL == cursor->block) {
+    fprintf(stderr, "cannot allocate sorted run block.\n");
+    *error = failure;
+    return;
+  }
+
+  if (0 == run->no_blocks) {
+    write_data_to_buffer(cursor->block, BLOCK_USED_OFFSET, BLOCK_USED_SIZE,
+                         BLOCK_DATA_OFFSET);
+    return;
+  }
+
+  cursor->block_id = NULL == from ? 0 : find_block(run, from, from_length);
+  read_block(run, cursor->block_id, cursor->block, error);
+  if (failure == *error || NULL == from) {
+    return;
+  }
+
+  uint32_t used = block_used(cursor->block);
+  while (cursor->offset < used) {
+    RunEntryType type;
+    SafeBuffer view;
+    Record record = block_entry_at(cursor->block, cursor->offset, &type, &view);
+    if (compare_keys(record_key(&record), record_key_length(&record), from,
+                     from_length) >= 0) {
+      break;
+    }
+    cursor->offset += ENTRY_TYPE_SIZE + get_record_length(&record);
+  }
+}
+
+bool sorted_run_cursor_next(SortedRunCursor *cursor, RunEntryType *type,
+                            Record *record, enum FileErrorStatus *error) {
+  *error = success;
+
+  while (cursor->offset >= block_used(cursor->block)) {
+    if (cursor->block_id + 1 >= cursor->run->no_blocks) {
+      return false;
+    }
+    read_block(cursor->run, ++cursor->block_id, cursor->block, error);
+    if (failure == *error) {
+      return false;
+    }
+    cursor->offset = BLOCK_DATA_OFFSET;
+  }
+
+  *record = block_entry_at(cursor->block, cursor->offset, type, &cursor->view);
+  cursor->offset += ENTRY_TYPE_SIZE + get_record_length(record);
+  return true;
+}
+
+void sorted_run_cursor_close(SortedRunCursor *cursor) {
+  free(cursor->block);
+  cursor->block = NULL;
+}
+
+// Local implementation
+
+static bool write_all(int fd, const uint8_t *buffer, uint64_t length) {
+  uint64_t written = 0;
+  while (written < length) {
+    ssize_t result = write(fd, buffer + written, length - written);
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+static bool read_all(int fd, uint8_t *buffer, uint64_t length,
+                     uint64_t offset) {
+  uint64_t bytes_read = 0;
+  while (bytes_read < length) {
+    ssize_t result =
+        pread(fd, buffer + bytes_read, length - bytes_read, offset + bytes_read);
+    if (result <= 0) {
+      return false;
+    }
+    bytes_read += result;
+  }
+  return true;
+}
+
+static void flush_block(SortedRunWriter *writer, enum FileErrorStatus *error) {
+  *error = success;
+
+  if (!write_all(writer->fd, writer->block, RUN_BLOCK_SIZE)) {
+    fprintf(stderr, "failed to write sorted run.\n");
+    *error = failure;
+    return;
+  }
+
+  ++writer->no_blocks;
+  memset(writer->block, 0, RUN_BLOCK_SIZE);
+  write_data_to_buffer(writer->block, BLOCK_USED_OFFSET, BLOCK_USED_SIZE,
+                       BLOCK_DATA_OFFSET);
+}
+
+static bool append_index_key(SortedRunWriter *writer, const char *key,
+                             uint32_t key_length) {
+  if (writer->index_length + INDEX_ENTRY_SIZE > writer->index_capacity) {
+    uint64_t capacity =
+        writer->index_capacity ? writer->index_capacity << 1 : RUN_BLOCK_SIZE;
+    uint8_t *index = realloc(writer->index, capacity);
+    if (NULL == index) {
+      fprintf(stderr, "cannot allocate sorted run index.\n");
+      return false;
+    }
+    writer->index = index;
+    writer->index_capacity = capacity;
+  }
+
+  writer->index_length +=
+      write_index_key(writer->index + writer->index_length, key, key_length);
+  return true;
+}
+
+static uint32_t write_index_key(uint8_t *buffer, const char *key,
+                                uint32_t key_length) {
+  buffer[0] = key_length;
+  memcpy(buffer + KEY_LENGTH_SIZE, key, key_length);
+  buffer[KEY_LENGTH_SIZE + key_length] = '\0';
+  return KEY_LENGTH_SIZE + key_length + STRING_TERMINATOR_SIZE;
+}
+
+static uint32_t read_index_key(const uint8_t *buffer, char *key,
+                               uint32_t *key_length) {
+  *key_length = buffer[0] > MAX_STRING_LENGTH ? MAX_STRING_LENGTH : buffer[0];
+  memcpy(key, buffer + KEY_LENGTH_SIZE, *key_length);
+  key[*key_length] = '\0';
+  return KEY_LENGTH_SIZE + buffer[0] + STRING_TERMINATOR_SIZE;
+}
+
+static uint32_t block_used(const uint8_t *block) {
+  return (uint32_t)read_data_from_buffer(block, BLOCK_USED_OFFSET,
+                                         BLOCK_USED_SIZE);
+}
+
+static Record block_entry_at(const uint8_t *block, uint32_t offset,
+                             RunEntryType *type, SafeBuffer *view) {
+  *type = block[offset];
+  uint32_t record_length = block[offset + ENTRY_TYPE_SIZE];
+  *view = (SafeBuffer){.buffer = (uint8_t *)block + offset + ENTRY_TYPE_SIZE,
+                       .length = record_length,
+                       .capacity = record_length};
+  return record_from_buffer(view);
+}
+
+// Last block whose first key is not greater than key.
+static uint64_t find_block(const SortedRun *run, const char *key,
+                           uint32_t key_length) {
+  uint64_t low = 0;
+  uint64_t high = run->no_blocks;
+  while (high - low > 1) {
+    uint64_t middle = low + (high - low) / 2;
+    if (compare_keys(run->first_keys[middle], run->first_key_lengths[middle],
+                     key, key_length) <= 0) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static void read_block(const SortedRun *run, uint64_t block_id,
+                       uint8_t *block, enum FileErrorStatus *error) {
+  *error = success;
+  if (!read_all(run->fd, block, RUN_BLOCK_SIZE, block_id * RUN_BLOCK_SIZE)) {
+    fprintf(stderr, "failed to read sorted run block.\n");
+    *error = failure;
+  }
+}
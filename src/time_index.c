@@ -0,0 +1,225 @@
+#include "../include/time_index.h"
+#include "../include/buffer_utilities.h"
+#include "../include/constants.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// entry: time in nanoseconds since the epoch (8 bytes) | key length (1 byte)
+// | key (100 bytes), a key shorter than that padded with zeros
+
+#define TIME_INDEX_SUFFIX ".mtime"
+#define REPLACEMENT_SUFFIX ".new"
+#define NANOSECONDS_PER_SECOND (1000000000ULL)
+#define TIME_OFFSET (0)
+#define TIME_SIZE (8)
+#define KEY_LENGTH_OFFSET (TIME_OFFSET + TIME_SIZE)
+#define KEY_LENGTH_SIZE (1)
+#define KEY_OFFSET (KEY_LENGTH_OFFSET + KEY_LENGTH_SIZE)
+#define ENTRY_SIZE (KEY_OFFSET + MAX_STRING_LENGTH)
+// Entries read per pread once the first one is found
+#define CHUNK_ENTRIES (256)
+
+static TimeIndex *open_time_index_file(const char *file_path, int flags,
+                                       enum FileErrorStatus *error);
+static uint64_t to_nanoseconds(const Timestamp *timestamp);
+static Timestamp from_nanoseconds(uint64_t nanoseconds);
+static bool read_entry_time(const TimeIndex *time_index, uint64_t index,
+                            uint64_t *nanoseconds);
+
+// API implementation
+
+TimeIndex *open_time_index(const char *path, bool writable, bool create,
+                           enum FileErrorStatus *error) {
+  *error = success;
+
+  char buffer[PATH_MAX];
+  snprintf(buffer, sizeof(buffer), "%s" TIME_INDEX_SUFFIX, path);
+  int flags = writable ? O_RDWR : O_RDONLY;
+  return open_time_index_file(buffer, create ? flags | O_CREAT : flags, error);
+}
+
+TimeIndex *create_time_index_replacement(const char *path,
+                                         enum FileErrorStatus *error) {
+  *error = success;
+
+  char buffer[PATH_MAX];
+  snprintf(buffer, sizeof(buffer), "%s" TIME_INDEX_SUFFIX REPLACEMENT_SUFFIX,
+           path);
+  TimeIndex *replacement =
+      open_time_index_file(buffer, O_RDWR | O_CREAT | O_TRUNC, error);
+  if (NULL == replacement) {
+    *error = failure;
+  }
+  return replacement;
+}
+
+void replace_time_index(TimeIndex *time_index, TimeIndex *replacement,
+                        const char *path, enum FileErrorStatus *error) {
+  *error = success;
+
+  char replacement_path[PATH_MAX];
+  snprintf(replacement_path, sizeof(replacement_path),
+           "%s" TIME_INDEX_SUFFIX REPLACEMENT_SUFFIX, path);
+  char index_path[PATH_MAX];
+  snprintf(index_path, sizeof(index_path), "%s" TIME_INDEX_SUFFIX, path);
+  if (-1 == fsync(replacement->fd) ||
+      -1 == rename(replacement_path, index_path)) {
+    fprintf(stderr, "cannot replace time index.\n");
+    *error = failure;
+    unlink(replacement_path);
+    close_time_index(replacement);
+    return;
+  }
+
+  close(time_index->fd);
+  *time_index = *replacement;
+  free(replacement);
+}
+
+void time_index_add(TimeIndex *time_index, const char *key,
+                    uint32_t key_length, const Timestamp *timestamp,
+                    enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t nanoseconds = to_nanoseconds(timestamp);
+  if (nanoseconds < time_index->last_nanoseconds) {
+    nanoseconds = time_index->last_nanoseconds;
+  }
+
+  uint8_t entry[ENTRY_SIZE] = {0};
+  write_data_to_buffer(entry, TIME_OFFSET, TIME_SIZE, nanoseconds);
+  write_data_to_buffer(entry, KEY_LENGTH_OFFSET, KEY_LENGTH_SIZE, key_length);
+  memcpy(entry + KEY_OFFSET, key, key_length);
+  if (ENTRY_SIZE != pwrite(time_index->fd, entry, ENTRY_SIZE,
+                           time_index->no_entries * ENTRY_SIZE)) {
+    fprintf(stderr, "failed to write time index.\n");
+    *error = failure;
+    return;
+  }
+  ++time_index->no_entries;
+  time_index->last_nanoseconds = nanoseconds;
+}
+
+void time_index_find_since(const TimeIndex *time_index,
+                           const Timestamp *since, TimeIndexCallback callback,
+                           void *arguments, enum FileErrorStatus *error) {
+  *error = success;
+
+  uint64_t since_nanoseconds = to_nanoseconds(since);
+  uint64_t low = 0;
+  uint64_t high = time_index->no_entries;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    uint64_t nanoseconds;
+    if (!read_entry_time(time_index, middle, &nanoseconds)) {
+      *error = failure;
+      return;
+    }
+    if (nanoseconds < since_nanoseconds) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  uint8_t *chunk = malloc(CHUNK_ENTRIES * ENTRY_SIZE);
+  if (NULL == chunk) {
+    fprintf(stderr, "cannot allocate time index.\n");
+    *error = failure;
+    return;
+  }
+  for (uint64_t index = low; index < time_index->no_entries;
+       index += CHUNK_ENTRIES) {
+    uint64_t no_entries = time_index->no_entries - index;
+    no_entries = no_entries > CHUNK_ENTRIES ? CHUNK_ENTRIES : no_entries;
+    ssize_t length = no_entries * ENTRY_SIZE;
+    if (length != pread(time_index->fd, chunk, length, index * ENTRY_SIZE)) {
+      fprintf(stderr, "failed to read time index.\n");
+      *error = failure;
+      break;
+    }
+    for (uint64_t i = 0; i < no_entries; ++i) {
+      const uint8_t *entry = chunk + i * ENTRY_SIZE;
+      uint32_t key_length =
+          read_data_from_buffer(entry, KEY_LENGTH_OFFSET, KEY_LENGTH_SIZE);
+      Timestamp timestamp = from_nanoseconds(
+          read_data_from_buffer(entry, TIME_OFFSET, TIME_SIZE));
+      callback((const char *)entry + KEY_OFFSET, key_length, &timestamp,
+               arguments);
+    }
+  }
+  free(chunk);
+}
+
+uint64_t time_index_no_entries(const TimeIndex *time_index) {
+  return time_index->no_entries;
+}
+
+void close_time_index(TimeIndex *time_index) {
+  if (NULL == time_index) {
+    return;
+  }
+  close(time_index->fd);
+  free(time_index);
+}
+
+// Local implementation
+
+static TimeIndex *open_time_index_file(const char *file_path, int flags,
+                                       enum FileErrorStatus *error) {
+  int fd = open(file_path, flags, 0600);
+  if (-1 == fd) {
+    if (ENOENT != errno || 0 != (flags & O_CREAT)) {
+      fprintf(stderr, "cannot open time index.\n");
+      *error = failure;
+    }
+    return NULL;
+  }
+
+  TimeIndex *time_index = malloc(sizeof(TimeIndex));
+  if (NULL == time_index) {
+    fprintf(stderr, "cannot allocate time index.\n");
+    *error = failure;
+    close(fd);
+    return NULL;
+  }
+  time_index->fd = fd;
+  // a torn last entry is overwritten by the next one
+  time_index->no_entries = lseek(fd, 0, SEEK_END) / ENTRY_SIZE;
+  time_index->last_nanoseconds = 0;
+  if (0 != time_index->no_entries &&
+      !read_entry_time(time_index, time_index->no_entries - 1,
+                       &time_index->last_nanoseconds)) {
+    *error = failure;
+    close_time_index(time_index);
+    return NULL;
+  }
+  return time_index;
+}
+
+static uint64_t to_nanoseconds(const Timestamp *timestamp) {
+  return timestamp->seconds * NANOSECONDS_PER_SECOND + timestamp->nanoseconds;
+}
+
+static Timestamp from_nanoseconds(uint64_t nanoseconds) {
+  Timestamp timestamp = {.seconds = nanoseconds / NANOSECONDS_PER_SECOND,
+                         .nanoseconds = nanoseconds % NANOSECONDS_PER_SECOND};
+  return timestamp;
+}
+
+static bool read_entry_time(const TimeIndex *time_index, uint64_t index,
+                            uint64_t *nanoseconds) {
+  uint8_t field[TIME_SIZE];
+  if (TIME_SIZE !=
+      pread(time_index->fd, field, TIME_SIZE, index * ENTRY_SIZE)) {
+    fprintf(stderr, "failed to read time index.\n");
+    return false;
+  }
+  *nanoseconds = read_data_from_buffer(field, TIME_OFFSET, TIME_SIZE);
+  return true;
+}
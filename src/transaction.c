@@ -0,0 +1,122 @@
+#include "../include/transaction.h"
+#include "../include/write_batch.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct transaction {
+  Database *database;
+  WriteBatch *write_batch;
+};
+
+static const WriteBatchEntry *last_write(const Transaction *transaction,
+                                         const char *key,
+                                         uint32_t key_length);
+static void end_transaction(Transaction *transaction);
+
+// API implementation
+
+Transaction *begin_transaction(Database *database,
+                               enum FileErrorStatus *error) {
+  *error = success;
+
+  if (!database->writable) {
+    fprintf(stderr, "transactions need a writable database.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  Transaction *transaction = malloc(sizeof(Transaction));
+  if (NULL == transaction) {
+    fprintf(stderr, "cannot allocate transaction.\n");
+    *error = failure;
+    return NULL;
+  }
+  transaction->database = database;
+  transaction->write_batch = create_write_batch();
+  if (NULL == transaction->write_batch) {
+    free(transaction);
+    *error = failure;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&database->mutex);
+  return transaction;
+}
+
+bool transaction_get(Transaction *transaction, const char *key,
+                     uint32_t key_length, char **value, uint64_t *length,
+                     enum FileErrorStatus *error) {
+  assert(transaction);
+  *error = success;
+
+  const WriteBatchEntry *entry = last_write(transaction, key, key_length);
+  if (NULL == entry) {
+    return query_value(transaction->database, key, key_length, value, length,
+                       error);
+  }
+  if (WRITE_BATCH_DELETE == entry->type) {
+    return false;
+  }
+
+  *value = malloc(entry->value_length + 1);
+  if (NULL == *value) {
+    fprintf(stderr, "cannot allocate value.\n");
+    *error = failure;
+    return false;
+  }
+  memcpy(*value, entry->value, entry->value_length + 1);
+  *length = entry->value_length;
+  return true;
+}
+
+bool transaction_put(Transaction *transaction, const char *key,
+                     uint32_t key_length, const char *value,
+                     uint32_t value_length) {
+  assert(transaction);
+  return write_batch_put(transaction->write_batch, key, key_length, value,
+                         value_length);
+}
+
+bool transaction_delete(Transaction *transaction, const char *key,
+                        uint32_t key_length) {
+  assert(transaction);
+  return write_batch_delete(transaction->write_batch, key, key_length);
+}
+
+void commit_transaction(Transaction *transaction,
+                        enum FileErrorStatus *error) {
+  assert(transaction);
+  commit_write_batch(transaction->database, transaction->write_batch, error);
+  end_transaction(transaction);
+}
+
+void abort_transaction(Transaction *transaction) {
+  assert(transaction);
+  end_transaction(transaction);
+}
+
+// Local implementation
+
+static const WriteBatchEntry *last_write(const Transaction *transaction,
+                                         const char *key,
+                                         uint32_t key_length) {
+  for (uint64_t i = write_batch_no_entries(transaction->write_batch); i > 0;
+       --i) {
+    const WriteBatchEntry *entry =
+        write_batch_entry(transaction->write_batch, i - 1);
+    if (entry->key_length == key_length &&
+        0 == memcmp(entry->key, key, key_length)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void end_transaction(Transaction *transaction) {
+  pthread_mutex_unlock(&transaction->database->mutex);
+  destroy_write_batch(transaction->write_batch);
+  free(transaction);
+}
@@ -0,0 +1,219 @@
+#include "../include/value_cache.h"
+#include "../include/buffer_manager.h"
+#include "../include/constants.h"
+#include "../include/xxhash.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_SHARDS (16)
+#define SHARD_BITS (4)
+#define NO_ENTRY (UINT32_MAX)
+
+// next chains the entries of a bucket.
+typedef struct {
+  uint8_t record[RECORD_SIZE_ESTIMATE];
+  uint32_t length;
+  uint64_t hash;
+  uint32_t next;
+  bool used;
+  bool referenced;
+} CachedValue;
+
+// buckets hold the first entry of their chain, the hand the next entry the
+// clock looks at.
+typedef struct {
+  pthread_mutex_t mutex;
+  CachedValue *entries;
+  uint32_t *buckets;
+  uint32_t capacity;
+  uint32_t no_buckets;
+  uint32_t hand;
+} CacheShard;
+
+struct value_cache {
+  CacheShard shards[NO_SHARDS];
+};
+
+static CacheShard *shard_of(ValueCache *value_cache, uint64_t hash);
+static uint32_t *find_link(CacheShard *shard, uint64_t hash, const char *key,
+                           uint32_t key_length);
+static uint32_t evict_entry(CacheShard *shard);
+static void unlink_entry(CacheShard *shard, uint32_t index);
+
+// API implementation
+
+ValueCache *create_value_cache(uint64_t capacity,
+                               enum FileErrorStatus *error) {
+  *error = success;
+
+  ValueCache *value_cache = calloc(1, sizeof(ValueCache));
+  if (NULL == value_cache) {
+    fprintf(stderr, "cannot allocate value cache.\n");
+    *error = failure;
+    return NULL;
+  }
+
+  uint64_t shard_capacity = (capacity + NO_SHARDS - 1) / NO_SHARDS;
+  uint32_t no_buckets = 1;
+  while (no_buckets < shard_capacity) {
+    no_buckets <<= 1;
+  }
+  for (uint32_t i = 0; i < NO_SHARDS; ++i) {
+    CacheShard *shard = value_cache->shards + i;
+    pthread_mutex_init(&shard->mutex, NULL);
+    shard->capacity = shard_capacity;
+    shard->no_buckets = no_buckets;
+    shard->entries = calloc(shard_capacity, sizeof(CachedValue));
+    shard->buckets = malloc(no_buckets * sizeof(uint32_t));
+    if (NULL == shard->entries || NULL == shard->buckets) {
+      fprintf(stderr, "cannot allocate value cache.\n");
+      *error = failure;
+      destroy_value_cache(value_cache);
+      return NULL;
+    }
+    memset(shard->buckets, 0xFF, no_buckets * sizeof(uint32_t));
+  }
+  return value_cache;
+}
+
+bool value_cache_get(ValueCache *value_cache, const char *key,
+                     uint32_t key_length, Record *record) {
+  uint64_t hash = XXH3_64bits(key, key_length);
+  CacheShard *shard = shard_of(value_cache, hash);
+  bool found = false;
+
+  pthread_mutex_lock(&shard->mutex);
+  uint32_t *link = find_link(shard, hash, key, key_length);
+  if (NO_ENTRY == *link) {
+    goto cleanup_0;
+  }
+  SafeBuffer *safe_buffer = allocate_record_buffer();
+  if (NULL == safe_buffer) {
+    goto cleanup_0;
+  }
+  CachedValue *entry = shard->entries + *link;
+  SafeBuffer cached = {.buffer = entry->record,
+                       .length = entry->length,
+                       .capacity = RECORD_SIZE_ESTIMATE};
+  *record = record_copy_into(safe_buffer, &(Record){.safe_buffer = &cached});
+  entry->referenced = true;
+  found = true;
+
+cleanup_0:
+  pthread_mutex_unlock(&shard->mutex);
+  return found;
+}
+
+// A key already cached has its record replaced, a new one takes a free entry
+// or the one the clock evicts.
+void value_cache_put(ValueCache *value_cache, const Record *record) {
+  uint32_t length = get_record_length(record);
+  if (length > RECORD_SIZE_ESTIMATE) {
+    return;
+  }
+  const char *key = record_key(record);
+  uint32_t key_length = record_key_length(record);
+  uint64_t hash = XXH3_64bits(key, key_length);
+  CacheShard *shard = shard_of(value_cache, hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  uint32_t *link = find_link(shard, hash, key, key_length);
+  uint32_t index = *link;
+  if (NO_ENTRY == index) {
+    index = evict_entry(shard);
+    CachedValue *entry = shard->entries + index;
+    uint32_t *bucket = shard->buckets + (hash & (shard->no_buckets - 1));
+    entry->hash = hash;
+    entry->next = *bucket;
+    entry->used = true;
+    entry->referenced = false;
+    *bucket = index;
+  }
+  CachedValue *entry = shard->entries + index;
+  memcpy(entry->record, record_get_buffer(record), length);
+  entry->length = length;
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void value_cache_invalidate(ValueCache *value_cache, const char *key,
+                            uint32_t key_length) {
+  uint64_t hash = XXH3_64bits(key, key_length);
+  CacheShard *shard = shard_of(value_cache, hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  uint32_t *link = find_link(shard, hash, key, key_length);
+  uint32_t index = *link;
+  if (NO_ENTRY != index) {
+    *link = shard->entries[index].next;
+    shard->entries[index].used = false;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void destroy_value_cache(ValueCache *value_cache) {
+  if (NULL == value_cache) {
+    return;
+  }
+  for (uint32_t i = 0; i < NO_SHARDS; ++i) {
+    pthread_mutex_destroy(&value_cache->shards[i].mutex);
+    free(value_cache->shards[i].entries);
+    free(value_cache->shards[i].buckets);
+  }
+  free(value_cache);
+}
+
+// Local implementation
+
+// The high bits pick the shard, the low ones the bucket.
+static CacheShard *shard_of(ValueCache *value_cache, uint64_t hash) {
+  return value_cache->shards + (hash >> (64 - SHARD_BITS));
+}
+
+// Returns the link pointing to the entry of the key, or to NO_ENTRY at the
+// end of its chain when the key is not cached.
+static uint32_t *find_link(CacheShard *shard, uint64_t hash, const char *key,
+                           uint32_t key_length) {
+  uint32_t *link = shard->buckets + (hash & (shard->no_buckets - 1));
+  while (NO_ENTRY != *link) {
+    CachedValue *entry = shard->entries + *link;
+    SafeBuffer cached = {.buffer = entry->record,
+                         .length = entry->length,
+                         .capacity = RECORD_SIZE_ESTIMATE};
+    if (entry->hash == hash &&
+        record_has_key(&(Record){.safe_buffer = &cached}, key, key_length)) {
+      break;
+    }
+    link = &entry->next;
+  }
+  return link;
+}
+
+// Two turns of the hand at most, the first one clearing every bit.
+static uint32_t evict_entry(CacheShard *shard) {
+  for (;;) {
+    uint32_t index = shard->hand;
+    shard->hand = (shard->hand + 1) % shard->capacity;
+    CachedValue *entry = shard->entries + index;
+    if (!entry->used) {
+      return index;
+    }
+    if (entry->referenced) {
+      entry->referenced = false;
+      continue;
+    }
+    unlink_entry(shard, index);
+    return index;
+  }
+}
+
+static void unlink_entry(CacheShard *shard, uint32_t index) {
+  CachedValue *entry = shard->entries + index;
+  uint32_t *link = shard->buckets + (entry->hash & (shard->no_buckets - 1));
+  while (*link != index) {
+    link = &shard->entries[*link].next;
+  }
+  *link = entry->next;
+  entry->used = false;
+}
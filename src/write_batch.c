@@ -0,0 +1,117 @@
+#include "../include/write_batch.h"
+#include "../include/record.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY (16)
+
+static WriteBatchEntry *append_entry(WriteBatch *write_batch);
+
+// API implementation
+
+WriteBatch *create_write_batch(void) {
+  WriteBatch *write_batch = calloc(1, sizeof(WriteBatch));
+  if (NULL == write_batch) {
+    fprintf(stderr, "cannot allocate write batch.\n");
+  }
+  return write_batch;
+}
+
+bool write_batch_put(WriteBatch *write_batch, const char *key,
+                     uint32_t key_length, const char *value,
+                     uint32_t value_length) {
+  assert(key);
+  assert(value);
+
+  // a batch is built before its database is known, entries must fit the
+  // larger fixed records
+  if (key_length > MAX_STRING_LENGTH ||
+      !record_fits_inline(RECORD_FORMAT_FIXED, key_length, value_length)) {
+    fprintf(stderr, "write batch entry is too long.\n");
+    return false;
+  }
+
+  WriteBatchEntry *entry = append_entry(write_batch);
+  if (NULL == entry) {
+    return false;
+  }
+  entry->type = WRITE_BATCH_PUT;
+  entry->key_length = key_length;
+  entry->value_length = value_length;
+  memcpy(entry->key, key, key_length);
+  entry->key[key_length] = '\0';
+  memcpy(entry->value, value, value_length);
+  entry->value[value_length] = '\0';
+  return true;
+}
+
+bool write_batch_delete(WriteBatch *write_batch, const char *key,
+                        uint32_t key_length) {
+  assert(key);
+
+  if (key_length > MAX_STRING_LENGTH) {
+    fprintf(stderr, "write batch entry is too long.\n");
+    return false;
+  }
+
+  WriteBatchEntry *entry = append_entry(write_batch);
+  if (NULL == entry) {
+    return false;
+  }
+  entry->type = WRITE_BATCH_DELETE;
+  entry->key_length = key_length;
+  memcpy(entry->key, key, key_length);
+  entry->key[key_length] = '\0';
+  return true;
+}
+
+uint64_t write_batch_no_entries(const WriteBatch *write_batch) {
+  assert(write_batch);
+  return write_batch->no_entries;
+}
+
+const WriteBatchEntry *write_batch_entry(const WriteBatch *write_batch,
+                                         uint64_t index) {
+  assert(write_batch);
+  assert(index < write_batch->no_entries);
+  return write_batch->entries + index;
+}
+
+void clear_write_batch(WriteBatch *write_batch) {
+  assert(write_batch);
+  write_batch->no_entries = 0;
+}
+
+void destroy_write_batch(WriteBatch *write_batch) {
+  if (NULL == write_batch) {
+    return;
+  }
+  free(write_batch->entries);
+  free(write_batch);
+}
+
+// Local implementation
+
+static WriteBatchEntry *append_entry(WriteBatch *write_batch) {
+  assert(write_batch);
+
+  if (write_batch->no_entries == write_batch->capacity) {
+    uint64_t capacity = 0 == write_batch->capacity
+                            ? INITIAL_CAPACITY
+                            : 2 * write_batch->capacity;
+    WriteBatchEntry *entries =
+        realloc(write_batch->entries, capacity * sizeof(WriteBatchEntry));
+    if (NULL == entries) {
+      fprintf(stderr, "cannot grow write batch.\n");
+      return NULL;
+    }
+    write_batch->entries = entries;
+    write_batch->capacity = capacity;
+  }
+
+  WriteBatchEntry *entry = write_batch->entries + write_batch->no_entries++;
+  memset(entry, 0, sizeof(WriteBatchEntry));
+  return entry;
+}
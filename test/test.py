@@ -10,9 +10,9 @@ def check_query_db(database_path, key, value, found):
     assert len(key) > 0 and len(key) <= 100
     output = subprocess.check_output(["./kvdb", "get", database_path, key])
     if found:
-        return output == str("value: " + value + "\n")
+        assert output == ("value: " + value + "\n").encode()
     else:
-        return output == str("element not found.\n")
+        assert output == b"cannot find element.\n"
 
 
 def query_db_and_check(database_path):
@@ -73,7 +73,8 @@ def main(argv):
 
     except:
         print(map)
-    
+        raise
+
 
 
 if __name__ == "__main__":
@@ -0,0 +1,475 @@
+import os
+import random
+import string
+import subprocess
+import sys
+import tempfile
+import time
+
+# Runs the same checks against every engine, and against sharded databases,
+# through the command line. Run from the repository root after make, the
+# first failed check of an engine is printed and the exit status is 1.
+
+ENGINES = [
+    ("linear", None),
+    ("cuckoo", None),
+    ("btree", None),
+    ("log", None),
+    ("lsm", None),
+    ("linear", 4),
+    ("lsm", 4),
+]
+
+
+def kvdb(*arguments):
+    return subprocess.run(["./kvdb", *arguments], stdout=subprocess.PIPE,
+                          stderr=subprocess.DEVNULL, text=True).stdout
+
+
+# Runs the lines in one process, the database being opened once.
+def batch(path, lines, *options):
+    return subprocess.run(["./kvdb", "batch", path, *options],
+                          input="".join(line + "\n" for line in lines),
+                          stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                          text=True).stdout
+
+
+def random_string(length):
+    return ''.join(random.choices(string.ascii_letters + string.digits,
+                                  k=length))
+
+
+def expect(output, expected, what):
+    if output != expected:
+        raise AssertionError(what + ": expected " + repr(expected) +
+                             ", got " + repr(output))
+
+
+def create(directory, engine, no_shards, *options):
+    path = os.path.join(directory,
+                        engine + "-" + str(no_shards or 0) + "".join(options))
+    arguments = ["create", path, "2000", engine]
+    if no_shards:
+        arguments.append(str(no_shards))
+    expect(kvdb(*arguments, *options), "successfully created database.\n",
+           "create")
+    return path
+
+
+def check_get(path, key, value):
+    expected = ("value: " + value + "\n" if value is not None
+                else "cannot find element.\n")
+    expect(kvdb("get", path, key), expected, "get " + key)
+
+
+# Random sets, replaces and deletes checked against a dictionary, values
+# past 100 bytes going to overflow pages.
+def check_random_operations(path, no_operations):
+    model = {}
+    for i in range(no_operations):
+        operation = random.choices(["set", "replace", "del", "get"],
+                                   weights=[3, 1, 1, 1])[0]
+        if operation == "set" or not model:
+            key = random_string(random.randint(1, 100))
+            value = random_string(random.choice([1, 20, 100, 300]))
+            model[key] = value
+            expect(kvdb("set", path, key, value),
+                   "successfully inserted element.\n", "set")
+        elif operation == "replace":
+            key = random.choice(list(model))
+            model[key] = random_string(random.choice([1, 20, 100, 300]))
+            expect(kvdb("set", path, key, model[key]),
+                   "successfully inserted element.\n", "replace")
+        elif operation == "del":
+            key = random.choice(list(model))
+            del model[key]
+            expect(kvdb("del", path, key), "successfully deleted element.\n",
+                   "del")
+            expect(kvdb("del", path, key), "cannot find element.\n",
+                   "del missing")
+        check_get(path, key, model.get(key))
+
+    for key, value in model.items():
+        check_get(path, key, value)
+    check_get(path, "never-written", None)
+    return model
+
+
+def check_stats(path, model):
+    records = kvdb("stats", path).split(", records: ")[1].split(",")[0]
+    expect(int(records), len(model), "stats records")
+
+
+def check_scan(path, model):
+    lines = kvdb("scan", path, "0", "~").splitlines()
+    expected = sorted("key: " + key + ", value: " + value
+                      for key, value in model.items())
+    expect(sorted(lines), expected, "scan")
+
+
+# Split across any number of threads, a scan returns every record of a serial
+# scan once.
+def check_parallel_scan(path, model):
+    serial = sorted(batch(path, ["scan"]).splitlines())
+    expect(serial, sorted("key: " + key + ", value: " + value
+                          for key, value in model.items()), "serial scan")
+    for no_threads in ["1", "3", "8", "1000"]:
+        expect(sorted(batch(path, ["scan " + no_threads]).splitlines()),
+               serial, "parallel scan on " + no_threads + " threads")
+
+
+def check_mget(path, model):
+    keys = random.sample(list(model), min(5, len(model))) + ["never-written"]
+    expected = ''.join(
+        "key: " + key + ", value: " + model[key] + "\n" if key in model else
+        "key: " + key + ", cannot find element.\n" for key in keys)
+    expect(kvdb("mget", path, *keys), expected, "mget")
+
+
+# The keys written after a given second come out most recent first, a key
+# written again at its last write and a deleted key not at all, also after
+# vacuum rewrote the time index with one entry per record.
+def check_changed_since(path, model):
+    since = int(time.time()) + 1
+    time.sleep(since - time.time())
+    for key in ["changed0", "changed1", "changed2", "changed3", "changed0"]:
+        model[key] = "value"
+        expect(kvdb("set", path, key, "value"),
+               "successfully inserted element.\n", "set")
+    del model["changed3"]
+    expect(kvdb("del", path, "changed3"), "successfully deleted element.\n",
+           "del")
+
+    def changed():
+        return [line.split(",")[0][len("key: "):] for line in
+                kvdb("changed-since", path, str(since)).splitlines()]
+
+    expected = ["changed0", "changed2", "changed1"]
+    expect(changed(), expected, "changed-since")
+    kvdb("vacuum", path)
+    expect(changed(), expected, "changed-since after vacuum")
+    if os.path.exists(path + ".mtime"):
+        expect(os.path.getsize(path + ".mtime"), 109 * len(model),
+               "time index size after vacuum")
+
+
+# incr, append and cas read and write one key, a missing key reading as 0 or
+# empty, values growing past 100 bytes into overflow pages.
+def check_read_modify_write(path, model):
+    expect(kvdb("incr", path, "counter", "1"), "value: 1\n", "incr missing")
+    expect(kvdb("incr", path, "counter", "-6"), "value: -5\n", "incr")
+    model["counter"] = "-5"
+    key = random.choice([key for key, value in model.items()
+                         if not value.lstrip("-").isdigit()])
+    expect(kvdb("incr", path, key, "1"), "error in increment element.\n",
+           "incr not an integer")
+    check_get(path, key, model[key])
+
+    model["appended"] = ""
+    for length in [1, 20, 100, 300]:
+        suffix = random_string(length)
+        model["appended"] += suffix
+        expect(kvdb("append", path, "appended", suffix),
+               "value length: " + str(len(model["appended"])) + "\n",
+               "append")
+        check_get(path, "appended", model["appended"])
+
+    expect(kvdb("cas", path, "never-written", "value", "value"),
+           "value does not match.\n", "cas missing")
+    expect(kvdb("cas", path, key, model[key] + "x", "value"),
+           "value does not match.\n", "cas mismatch")
+    check_get(path, key, model[key])
+    expect(kvdb("cas", path, key, model[key], "swapped"),
+           "successfully swapped element.\n", "cas")
+    model[key] = "swapped"
+    check_get(path, key, "swapped")
+    check_get(path, "never-written", None)
+
+
+# Expired keys are left out of get and scan, vacuum drops them from the pages
+# of a linear database, get opening it read only leaves them there.
+def check_ttl(path, model):
+    for ttl in ["5abc", "-1", "0"]:
+        expect(kvdb("set", path, "expiring", "value", ttl), "", "ttl " + ttl)
+    for i in range(10):
+        expect(kvdb("set", path, "expiring" + str(i), "value", "1"),
+               "successfully inserted element.\n", "set with ttl")
+    check_get(path, "expiring0", "value")
+    expect(kvdb("append", path, "expiring1", "-appended"),
+           "value length: 14\n", "append with ttl")
+    check_get(path, "expiring1", "value-appended")
+    time.sleep(1.1)
+    for i in range(10):
+        check_get(path, "expiring" + str(i), None)
+    check_scan(path, model)
+    vacuum = kvdb("vacuum", path)
+    if vacuum.startswith("moved records") and "linear" in path:
+        expired = vacuum.split("expired records: ")[1].split(",")[0]
+        expect(int(expired), 10, "vacuum expired records")
+
+
+# The key directory built by a scan of the pages at open answers the gets of
+# a batch and holds an entry per record, kept current by its sets and deletes,
+# and again once reopened.
+def check_keydir(path, model):
+    def keydir_entries(output):
+        stats = output.splitlines()[-1]
+        records = stats.split(", records: ")[1].split(",")[0]
+        expect(stats.split(", keydir entries: ")[1], records, "keydir entries")
+        return output[:-len(stats) - 1]
+
+    lines, expected = [], []
+    for i in range(100):
+        key = random.choice(list(model))
+        operation = random.choice(["get", "set", "del"])
+        if operation == "set":
+            model[key] = random_string(random.choice([1, 20, 100, 300]))
+            lines.append("set " + key + " " + model[key])
+            expected.append("successfully inserted element.\n")
+        elif operation == "del" and len(model) > 1:
+            del model[key]
+            lines.append("del " + key)
+            expected.append("successfully deleted element.\n")
+        lines.append("get " + key)
+        expected.append("value: " + model[key] + "\n" if key in model
+                        else "cannot find element.\n")
+    expect(keydir_entries(batch(path, lines + ["stats"], "--keydir")),
+           "".join(expected), "keydir batch")
+    expect(keydir_entries(batch(path, ["get " + key for key in model] +
+                                ["get never-written", "stats"], "--keydir")),
+           "".join("value: " + value + "\n" for value in model.values()) +
+           "cannot find element.\n", "keydir after reopen")
+    check_scan(path, model)
+    check_stats(path, model)
+
+
+# Expired keys stay in the pages until read, unless the reaper of a batch
+# removes them: those set to expire before it started and those set since.
+def check_reaper(path, model):
+    def records(output):
+        return int(output.split(", records: ")[1].split(",")[0])
+
+    for i in range(5):
+        expect(kvdb("set", path, "reaped" + str(i), "value", "1"),
+               "successfully inserted element.\n", "set with ttl")
+    time.sleep(1.1)
+    expect(records(kvdb("stats", path)), len(model) + 5,
+           "stats before reaping")
+    lines = ["set reaped" + str(i) + " value 1" for i in range(5, 10)]
+    expect(records(batch(path, lines + ["sleep 2", "stats"], "--reaper")),
+           len(model), "stats after reaping")
+    check_stats(path, model)
+
+
+# A transaction reads its own writes and applies them all at commit, none of
+# them when aborted or stopped by a line failing. The commit of a sharded
+# transaction spreading over several shards is refused as a whole.
+def check_transactions(path, model, no_shards):
+    key = random.choice(list(model))
+    expect(batch(path, ["begin", "set moved value", "get moved", "del " + key,
+                        "get " + key, "del never-written", "abort"]),
+           "successfully inserted element.\nvalue: value\n"
+           "successfully deleted element.\ncannot find element.\n"
+           "cannot find element.\naborted transaction.\n",
+           "aborted transaction")
+    check_get(path, "moved", None)
+    check_get(path, key, model[key])
+    expect(batch(path, ["begin", "set moved value",
+                        "set too-long " + random_string(101), "commit"]),
+           "successfully inserted element.\nerror in insert element.\n",
+           "failed transaction")
+    check_get(path, "moved", None)
+
+    balances = ["balance" + str(i) for i in range(10)]
+    lines = (["set " + balance + " 10" for balance in balances] + ["begin"] +
+             ["get " + balance for balance in balances] +
+             ["set balance0 100"] +
+             ["set " + balance + " 0" for balance in balances[1:]] +
+             ["commit"])
+    expected = ("successfully inserted element.\n" * 10 + "value: 10\n" * 10 +
+                "successfully inserted element.\n" * 10 +
+                ("error in commit transaction.\n" if no_shards else
+                 "successfully committed transaction.\n"))
+    expect(batch(path, lines), expected, "transfer")
+    for balance in balances:
+        model[balance] = "10" if no_shards else "0"
+    model["balance0"] = "10" if no_shards else "100"
+    for balance in balances:
+        check_get(path, balance, model[balance])
+    check_scan(path, model)
+
+
+# A snapshot holds the records of the moment it was opened, values in overflow
+# pages included, while the batch replaces, deletes and adds keys, also in a
+# transaction, and a snapshot opened after them holds the new records.
+def check_snapshot(path, model):
+    def records(model):
+        return sorted("key: " + key + ", value: " + value
+                      for key, value in model.items())
+
+    before = records(model)
+    lines = ["snapshot"]
+    for key in random.sample(list(model), len(model) // 2):
+        if random.random() < 0.5:
+            del model[key]
+            lines.append("del " + key)
+        else:
+            model[key] = random_string(random.choice([1, 20, 100, 300]))
+            lines.append("set " + key + " " + model[key])
+    for i in range(20):
+        model["snapshot" + str(i)] = random_string(random.choice([20, 300]))
+        lines.append("set snapshot" + str(i) + " " + model["snapshot" + str(i)])
+    model["snapshot0"] = "committed"
+    lines += ["begin", "set snapshot0 committed", "commit"]
+    output = batch(path, lines + ["snapshot-scan", "scan", "snapshot",
+                                  "snapshot-scan"]).splitlines()
+    output = [line for line in output if line.startswith("key: ")]
+    expect(sorted(output[:len(before)]), before, "snapshot before writes")
+    expect(sorted(output[len(before):len(before) + len(model)]),
+           records(model), "scan after writes")
+    expect(sorted(output[len(before) + len(model):]), records(model),
+           "snapshot after writes")
+    check_scan(path, model)
+
+
+# The gets of a batch answered by a value cache, of a few entries or of all
+# the keys, see every set and delete of the batch before them.
+def check_value_cache(path, model):
+    for capacity in ["4", "1000"]:
+        keys = random.sample(list(model), 10)
+        lines, expected = [], []
+        for i in range(200):
+            key = random.choice(keys)
+            operation = random.choice(["get", "get", "set", "del"])
+            if operation == "set":
+                model[key] = random_string(random.choice([1, 20, 100, 300]))
+                lines.append("set " + key + " " + model[key])
+                expected.append("successfully inserted element.\n")
+            elif operation == "del":
+                lines.append("del " + key)
+                expected.append("successfully deleted element.\n"
+                                if model.pop(key, None) is not None
+                                else "cannot find element.\n")
+            lines.append("get " + key)
+            expected.append("value: " + model[key] + "\n" if key in model
+                            else "cannot find element.\n")
+        expect(batch(path, lines, "--cache=" + capacity), "".join(expected),
+               "value cache of " + capacity)
+    check_scan(path, model)
+
+
+# A rebuild holds the same records in a new linear database, which refuses to
+# be written over.
+def check_rebuild(path, model):
+    rebuilt = path + "-rebuilt"
+    output = kvdb("rebuild", path, rebuilt, "0.5")
+    expect(output.split(", pages")[0],
+           "rebuilt database, records: " + str(len(model)), "rebuild")
+    check_stats(rebuilt, model)
+    check_scan(rebuilt, model)
+    expect(kvdb("rebuild", path, rebuilt), "error in rebuild.\n",
+           "rebuild over a database")
+
+
+def run_engine(directory, engine, no_shards):
+    path = create(directory, engine, no_shards)
+    model = check_random_operations(path, 150)
+    check_stats(path, model)
+    check_scan(path, model)
+    check_mget(path, model)
+    check_parallel_scan(path, model)
+    check_read_modify_write(path, model)
+    check_stats(path, model)
+    check_scan(path, model)
+    check_changed_since(path, model)
+    if engine in ["linear", "cuckoo"] and not no_shards:
+        check_keydir(path, model)
+    else:
+        expect(batch(path, ["get never-written"], "--keydir"),
+               "error in batch.\n", "keydir " + engine)
+    if not no_shards:
+        check_rebuild(path, model)
+    check_reaper(path, model)
+    check_transactions(path, model, no_shards)
+    check_snapshot(path, model)
+    check_value_cache(path, model)
+    check_ttl(path, model)
+
+    path = create(directory, engine, no_shards, "--time-index")
+    model = check_random_operations(path, 50)
+    check_changed_since(path, model)
+    check_scan(path, model)
+
+    # pages of 64 KiB, kept by a rebuild, sizes other than a power of two
+    # from 4 to 64 KiB are refused
+    path = create(directory, engine, no_shards, "--page-size=65536")
+    model = check_random_operations(path, 50)
+    check_stats(path, model)
+    check_scan(path, model)
+    if not no_shards:
+        check_rebuild(path, model)
+        expect(os.path.getsize(path + "-rebuilt") % 65536, 0,
+               "rebuilt page size")
+    for page_size in ["5000", "2048", "131072"]:
+        expect(kvdb("create", path + "-" + page_size, "2000", engine,
+                    "--page-size=" + page_size),
+               "error in create database.\n", "page size " + page_size)
+
+    if engine in ["linear", "cuckoo"]:
+        check_compression(directory, engine, no_shards)
+    else:
+        expect(kvdb("create", path + "-compressed", "2000", engine,
+                    "--compress"),
+               "error in create database.\n", "compress " + engine)
+
+
+# Compressed data pages hold the same records as plain ones, and a rebuild
+# of redundant values packs them into fewer pages than a plain rebuild.
+def check_compression(directory, engine, no_shards):
+    path = create(directory, engine, no_shards, "--compress")
+    model = check_random_operations(path, 150)
+    check_stats(path, model)
+    check_scan(path, model)
+    check_read_modify_write(path, model)
+    check_scan(path, model)
+    check_parallel_scan(path, model)
+    expect(kvdb("create", path + "-large", "2000", engine, "--compress",
+                "--page-size=32768"),
+           "error in create database.\n", "compress page size")
+    if no_shards:
+        return
+
+    model = {"key" + str(i): '{"id": ' + str(i) + ', "name": "user"}'
+             for i in range(300)}
+    sizes = []
+    for options in [["--compress"], []]:
+        redundant = path + "-redundant" + "".join(options)
+        expect(kvdb("create", redundant, "2000", engine, *options),
+               "successfully created database.\n", "create")
+        for key, value in model.items():
+            expect(kvdb("set", redundant, key, value),
+                   "successfully inserted element.\n", "set")
+        check_rebuild(redundant, model)
+        sizes.append(os.path.getsize(redundant + "-rebuilt"))
+    if sizes[0] >= sizes[1]:
+        raise AssertionError("compressed rebuild size: " + str(sizes))
+
+
+def main(argv):
+    random.seed(int(argv[1]) if len(argv) > 1 else 0)
+    failed = False
+    with tempfile.TemporaryDirectory() as directory:
+        for engine, no_shards in ENGINES:
+            name = engine + (" with " + str(no_shards) + " shards"
+                             if no_shards else "")
+            try:
+                run_engine(directory, engine, no_shards)
+                print(name + ": ok")
+            except AssertionError as error:
+                print(name + ": " + str(error))
+                failed = True
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))